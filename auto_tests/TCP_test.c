@@ -403,6 +403,8 @@ START_TEST(test_client)
     do_TCP_connection(conn);
     ck_assert_msg(conn->status == TCP_CLIENT_CONFIRMED, "Wrong status. Expected: %u, is: %u", TCP_CLIENT_CONFIRMED,
                   conn->status);
+    /* The handshake took two sleeps to be answered. */
+    ck_assert_msg(conn->rtt >= 90, "Wrong round trip time %u ms.", conn->rtt);
     c_sleep(500);
     do_TCP_connection(conn);
     ck_assert_msg(conn->status == TCP_CLIENT_CONFIRMED, "Wrong status. Expected: %u, is: %u", TCP_CLIENT_CONFIRMED,
@@ -474,6 +476,628 @@ START_TEST(test_client)
 }
 END_TEST
 
+START_TEST(test_client_precompute)
+{
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_public_key, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+    ck_assert_msg(tcp_s->num_listening_socks == NUM_PORTS, "Failed to bind to all ports");
+    Precompute_Pool *pool = new_precompute_pool(2, 16);
+    ck_assert_msg(pool != NULL, "Failed to create precompute pool");
+    tcp_s->precompute_pool = pool;
+
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.port = htons(ports[rand() % NUM_PORTS]);
+    ip_port_tcp_s.ip.family = AF_INET6;
+    ip_port_tcp_s.ip.ip6.in6_addr = in6addr_loopback;
+
+#define NUM_PRECOMPUTE_CLIENTS 8
+    TCP_Client_Connection *conns[NUM_PRECOMPUTE_CLIENTS];
+    uint32_t i, j;
+
+    for (i = 0; i < NUM_PRECOMPUTE_CLIENTS; ++i) {
+        uint8_t f_public_key[crypto_box_PUBLICKEYBYTES];
+        uint8_t f_secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(f_public_key, f_secret_key);
+        conns[i] = new_TCP_connection(ip_port_tcp_s, self_public_key, f_public_key, f_secret_key, 0);
+        ck_assert_msg(conns[i] != NULL, "Failed to create TCP client");
+    }
+
+    for (j = 0; j < 40; ++j) {
+        c_sleep(50);
+        do_precompute_pool(pool);
+        do_TCP_server(tcp_s);
+
+        for (i = 0; i < NUM_PRECOMPUTE_CLIENTS; ++i) {
+            do_TCP_connection(conns[i]);
+        }
+    }
+
+    for (i = 0; i < NUM_PRECOMPUTE_CLIENTS; ++i) {
+        ck_assert_msg(conns[i]->status == TCP_CLIENT_CONFIRMED, "Wrong status. Expected: %u, is: %u", TCP_CLIENT_CONFIRMED,
+                      conns[i]->status);
+        kill_TCP_connection(conns[i]);
+    }
+
+    ck_assert_msg(tcp_s->num_accepted_connections == NUM_PRECOMPUTE_CLIENTS, "Not all connections were accepted");
+    kill_TCP_server(tcp_s);
+    kill_precompute_pool(pool);
+}
+END_TEST
+
+#define NUM_FLUSH_ROUNDS 20
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Read and throw away everything waiting on sock. */
+static void drain_sock(sock_t sock)
+{
+    uint8_t data[4096];
+
+    while (recv(sock, data, sizeof(data), MSG_DONTWAIT) > 0);
+}
+
+START_TEST(test_queue_flush)
+{
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_public_key, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+
+    /* Any packet confirms a connection. */
+    uint8_t ping_packet[1 + sizeof(uint64_t)] = {4, 8, 6, 9, 67};
+    struct sec_TCP_con *con2 = new_TCP_con(tcp_s);
+    write_packet_TCP_secure_connection(con2, ping_packet, sizeof(ping_packet));
+
+    uint8_t oob_packet[1 + crypto_box_PUBLICKEYBYTES + TCP_MAX_OOB_DATA_LENGTH];
+    oob_packet[0] = TCP_PACKET_OOB_SEND;
+    memset(oob_packet + 1 + crypto_box_PUBLICKEYBYTES, 7, TCP_MAX_OOB_DATA_LENGTH);
+
+    uint64_t latency[NUM_FLUSH_ROUNDS];
+    uint32_t i, j;
+
+    for (i = 0; i < NUM_FLUSH_ROUNDS; ++i) {
+        struct sec_TCP_con *con1 = new_TCP_con(tcp_s);
+        write_packet_TCP_secure_connection(con1, ping_packet, sizeof(ping_packet));
+        c_sleep(50);
+        do_TCP_server(tcp_s);
+
+        int index = get_TCP_connection_index(tcp_s, con1->public_key);
+        ck_assert_msg(index != -1, "Connection not accepted");
+        TCP_Secure_Connection *conn = &tcp_s->accepted_connection_array[index];
+
+        /* A small send buffer so that it fills up quickly. */
+        int size = 4096;
+        setsockopt(conn->sock, SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(size));
+
+        /* Fill the buffers between the relay and con1 while con1 pings the relay. Once
+         * they are full a pong can't be dropped so it waits in the queue. */
+        memcpy(oob_packet + 1, con1->public_key, crypto_box_PUBLICKEYBYTES);
+
+        for (j = 0; j < 10000 && conn->send_queue.length == 0; ++j) {
+            write_packet_TCP_secure_connection(con2, oob_packet, sizeof(oob_packet));
+            write_packet_TCP_secure_connection(con1, ping_packet, sizeof(ping_packet));
+            do_TCP_server(tcp_s);
+        }
+
+        ck_assert_msg(conn->send_queue.length != 0, "Relay never had to queue data");
+
+        /* Relayed packets stop being queued at the high water mark. */
+        for (j = 0; j < 64; ++j) {
+            write_packet_TCP_secure_connection(con2, oob_packet, sizeof(oob_packet));
+        }
+
+        c_sleep(10);
+        do_TCP_server(tcp_s);
+        ck_assert_msg(conn->send_queue.length <= TCP_SEND_QUEUE_HIGH_WATER, "Queue grew to %u bytes",
+                      conn->send_queue.length);
+
+        /* con1 reads everything, the queued data should follow right away. */
+        uint64_t start = current_time_monotonic();
+
+        while (conn->send_queue.length != 0 && current_time_monotonic() - start < 5000) {
+            drain_sock(con1->sock);
+            c_sleep(1);
+            do_TCP_server(tcp_s);
+        }
+
+        ck_assert_msg(conn->send_queue.length == 0, "Queued data was never sent");
+        latency[i] = current_time_monotonic() - start;
+        kill_TCP_con(con1);
+    }
+
+    qsort(latency, NUM_FLUSH_ROUNDS, sizeof(uint64_t), cmp_u64);
+    printf("queued data flushed after p50 %llu ms, p90 %llu ms, max %llu ms\n",
+           (unsigned long long)latency[NUM_FLUSH_ROUNDS / 2], (unsigned long long)latency[NUM_FLUSH_ROUNDS * 9 / 10],
+           (unsigned long long)latency[NUM_FLUSH_ROUNDS - 1]);
+    ck_assert_msg(latency[NUM_FLUSH_ROUNDS / 2] < 200, "Queued data waited %llu ms",
+                  (unsigned long long)latency[NUM_FLUSH_ROUNDS / 2]);
+
+    kill_TCP_server(tcp_s);
+    kill_TCP_con(con2);
+}
+END_TEST
+
+#define NUM_IDLE_CLIENTS 512
+#define NUM_IDLE_RUNS 2000
+
+START_TEST(test_idle_clients)
+{
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_public_key, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.port = htons(ports[rand() % NUM_PORTS]);
+    ip_port_tcp_s.ip.family = AF_INET6;
+    ip_port_tcp_s.ip.ip6.in6_addr = in6addr_loopback;
+
+    TCP_Client_Connection **conns = calloc(NUM_IDLE_CLIENTS, sizeof(TCP_Client_Connection *));
+    ck_assert_msg(conns != NULL, "calloc failed");
+    uint32_t i, j;
+
+    for (i = 0; i < NUM_IDLE_CLIENTS; ++i) {
+        uint8_t f_public_key[crypto_box_PUBLICKEYBYTES];
+        uint8_t f_secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(f_public_key, f_secret_key);
+        conns[i] = new_TCP_connection(ip_port_tcp_s, self_public_key, f_public_key, f_secret_key, 0);
+        ck_assert_msg(conns[i] != NULL, "Failed to create TCP client");
+
+        /* Keep the listen backlog short. */
+        if (i % 32 == 31) {
+            do_TCP_server(tcp_s);
+
+            for (j = 0; j <= i; ++j) {
+                do_TCP_connection(conns[j]);
+            }
+        }
+    }
+
+    for (j = 0; j < 100 && tcp_s->num_accepted_connections != NUM_IDLE_CLIENTS; ++j) {
+        c_sleep(50);
+        do_TCP_server(tcp_s);
+
+        for (i = 0; i < NUM_IDLE_CLIENTS; ++i) {
+            do_TCP_connection(conns[i]);
+        }
+    }
+
+    ck_assert_msg(tcp_s->num_accepted_connections == NUM_IDLE_CLIENTS, "Only %u of %u connections were accepted",
+                  tcp_s->num_accepted_connections, NUM_IDLE_CLIENTS);
+
+    /* The clients stay quiet, see what the relay costs with nothing to do. */
+    uint64_t start = current_time_monotonic();
+    clock_t cpu_start = clock();
+
+    for (i = 0; i < NUM_IDLE_RUNS; ++i) {
+        do_TCP_server(tcp_s);
+
+        if (i % 100 == 99)
+            c_sleep(100);
+    }
+
+    double cpu_us = (double)(clock() - cpu_start) * 1000000 / CLOCKS_PER_SEC / NUM_IDLE_RUNS;
+    printf("%u idle connections: %.2f us of cpu per do_TCP_server() run (%.2f per 10000 connections) over %llu ms\n",
+           NUM_IDLE_CLIENTS, cpu_us, cpu_us * 10000 / NUM_IDLE_CLIENTS,
+           (unsigned long long)(current_time_monotonic() - start));
+    ck_assert_msg(tcp_s->num_accepted_connections == NUM_IDLE_CLIENTS, "Idle connections were dropped");
+
+    for (i = 0; i < NUM_IDLE_CLIENTS; ++i) {
+        kill_TCP_connection(conns[i]);
+    }
+
+    free(conns);
+    kill_TCP_server(tcp_s);
+}
+END_TEST
+
+#define NUM_WORKER_CLIENTS 8
+
+typedef struct {
+    uint32_t num;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    TCP_Client_Connection *conn;
+    uint8_t connection_id[NUM_WORKER_CLIENTS];
+    uint8_t status[NUM_WORKER_CLIENTS];
+    uint32_t data_received[NUM_WORKER_CLIENTS];
+    uint32_t oob_received[NUM_WORKER_CLIENTS];
+} Worker_Client;
+
+static Worker_Client worker_clients[NUM_WORKER_CLIENTS];
+
+static int worker_client_num(const uint8_t *public_key)
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_WORKER_CLIENTS; ++i) {
+        if (memcmp(worker_clients[i].public_key, public_key, crypto_box_PUBLICKEYBYTES) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static int worker_response_callback(void *object, uint8_t connection_id, const uint8_t *public_key)
+{
+    Worker_Client *client = object;
+    int peer = worker_client_num(public_key);
+
+    if (peer == -1 || set_tcp_connection_number(client->conn, connection_id, peer) != 0)
+        return 1;
+
+    client->connection_id[peer] = connection_id;
+    return 0;
+}
+
+static int worker_status_callback(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    Worker_Client *client = object;
+
+    if (number >= NUM_WORKER_CLIENTS || client->connection_id[number] != connection_id)
+        return 1;
+
+    client->status[number] = status;
+    return 0;
+}
+
+static int worker_data_callback(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data,
+                                uint16_t length)
+{
+    Worker_Client *client = object;
+
+    if (number >= NUM_WORKER_CLIENTS || length != 2 || data[0] != number || data[1] != client->num)
+        return 1;
+
+    ++client->data_received[number];
+    return 0;
+}
+
+static int worker_oob_data_callback(void *object, const uint8_t *public_key, const uint8_t *data, uint16_t length)
+{
+    Worker_Client *client = object;
+    int peer = worker_client_num(public_key);
+
+    if (peer == -1 || length != 2 || data[0] != peer || data[1] != client->num)
+        return 1;
+
+    ++client->oob_received[peer];
+    return 0;
+}
+
+static void do_worker_clients(TCP_Server *tcp_s)
+{
+    uint32_t i;
+
+    c_sleep(20);
+    do_TCP_server(tcp_s);
+
+    for (i = 0; i < NUM_WORKER_CLIENTS; ++i) {
+        if (worker_clients[i].conn)
+            do_TCP_connection(worker_clients[i].conn);
+    }
+}
+
+START_TEST(test_client_workers)
+{
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_public_key, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+
+#ifndef TCP_SERVER_USE_EPOLL
+    ck_assert_msg(TCP_server_start_workers(tcp_s, 4) == -1, "Workers need epoll");
+    kill_TCP_server(tcp_s);
+    return;
+#endif
+
+    ck_assert_msg(TCP_server_start_workers(tcp_s, 4) == 0, "Failed to start workers");
+    ck_assert_msg(TCP_server_start_workers(tcp_s, 4) == -1, "Started workers twice");
+
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.port = htons(ports[rand() % NUM_PORTS]);
+    ip_port_tcp_s.ip.family = AF_INET6;
+    ip_port_tcp_s.ip.ip6.in6_addr = in6addr_loopback;
+
+    memset(worker_clients, 0, sizeof(worker_clients));
+    uint32_t i, j, k;
+
+    for (i = 0; i < NUM_WORKER_CLIENTS; ++i) {
+        Worker_Client *client = &worker_clients[i];
+        uint8_t f_secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(client->public_key, f_secret_key);
+        client->num = i;
+        client->conn = new_TCP_connection(ip_port_tcp_s, self_public_key, client->public_key, f_secret_key, 0);
+        ck_assert_msg(client->conn != NULL, "Failed to create TCP client");
+        routing_response_handler(client->conn, worker_response_callback, client);
+        routing_status_handler(client->conn, worker_status_callback, client);
+        routing_data_handler(client->conn, worker_data_callback, client);
+        oob_data_handler(client->conn, worker_oob_data_callback, client);
+    }
+
+    for (j = 0; j < 100; ++j) {
+        do_worker_clients(tcp_s);
+
+        for (i = 0; i < NUM_WORKER_CLIENTS && worker_clients[i].conn->status == TCP_CLIENT_CONFIRMED; ++i);
+
+        if (i == NUM_WORKER_CLIENTS)
+            break;
+    }
+
+    ck_assert_msg(i == NUM_WORKER_CLIENTS, "Not all clients connected");
+
+    /* Every client routes to every other one, they end up on different workers. */
+    for (i = 0; i < NUM_WORKER_CLIENTS; ++i) {
+        for (k = 0; k < NUM_WORKER_CLIENTS; ++k) {
+            if (k != i)
+                ck_assert_msg(send_routing_request(worker_clients[i].conn, worker_clients[k].public_key) == 1,
+                              "Failed to send routing request");
+        }
+    }
+
+    _Bool online = 0;
+
+    for (j = 0; j < 100 && !online; ++j) {
+        do_worker_clients(tcp_s);
+        online = 1;
+
+        for (i = 0; i < NUM_WORKER_CLIENTS; ++i) {
+            for (k = 0; k < NUM_WORKER_CLIENTS; ++k) {
+                if (k != i && worker_clients[i].status[k] != 2)
+                    online = 0;
+            }
+        }
+    }
+
+    ck_assert_msg(online, "Not all clients were linked");
+
+    for (i = 0; i < NUM_WORKER_CLIENTS; ++i) {
+        for (k = 0; k < NUM_WORKER_CLIENTS; ++k) {
+            if (k == i)
+                continue;
+
+            uint8_t data[2] = {i, k};
+            ck_assert_msg(send_data(worker_clients[i].conn, worker_clients[i].connection_id[k], data, 2) == 1,
+                          "Failed to send data");
+            ck_assert_msg(send_oob_packet(worker_clients[i].conn, worker_clients[k].public_key, data, 2) == 1,
+                          "Failed to send oob packet");
+        }
+    }
+
+    _Bool received = 0;
+
+    for (j = 0; j < 100 && !received; ++j) {
+        do_worker_clients(tcp_s);
+        received = 1;
+
+        for (i = 0; i < NUM_WORKER_CLIENTS; ++i) {
+            for (k = 0; k < NUM_WORKER_CLIENTS; ++k) {
+                if (k != i && (worker_clients[i].data_received[k] != 1 || worker_clients[i].oob_received[k] != 1))
+                    received = 0;
+            }
+        }
+    }
+
+    ck_assert_msg(received, "Not all data and oob packets were relayed exactly once");
+
+    kill_TCP_connection(worker_clients[0].conn);
+    worker_clients[0].conn = NULL;
+
+    _Bool offline = 0;
+
+    for (j = 0; j < 100 && !offline; ++j) {
+        do_worker_clients(tcp_s);
+        offline = 1;
+
+        for (i = 1; i < NUM_WORKER_CLIENTS; ++i) {
+            if (worker_clients[i].status[0] != 1)
+                offline = 0;
+        }
+    }
+
+    ck_assert_msg(offline, "Disconnect of a client was not relayed to all others");
+
+    for (i = 1; i < NUM_WORKER_CLIENTS; ++i) {
+        kill_TCP_connection(worker_clients[i].conn);
+    }
+
+    kill_TCP_server(tcp_s);
+}
+END_TEST
+
+#define NUM_ROUTING_CLIENTS 64
+/* Keys each client asks for that never connect, so the tables of the relay fill up. */
+#define NUM_ROUTING_OFFLINE 128
+#define NUM_ROUTING_REQUESTS (NUM_ROUTING_CLIENTS - 1 + NUM_ROUTING_OFFLINE)
+
+typedef struct {
+    TCP_Client_Connection *conn;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint32_t requests;
+    uint32_t responses; /* Refused requests get none. */
+    uint32_t online;
+    uint32_t offline;
+} Routing_Client;
+
+static Routing_Client routing_clients[NUM_ROUTING_CLIENTS];
+
+static int routing_response_callback(void *object, uint8_t connection_id, const uint8_t *public_key)
+{
+    Routing_Client *client = object;
+    ++client->responses;
+    return 0;
+}
+
+static int routing_status_callback(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    Routing_Client *client = object;
+
+    if (status == 2) {
+        ++client->online;
+    } else if (status == 1) {
+        ++client->offline;
+    }
+
+    return 0;
+}
+
+START_TEST(test_client_routing)
+{
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_public_key, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.port = htons(ports[rand() % NUM_PORTS]);
+    ip_port_tcp_s.ip.family = AF_INET6;
+    ip_port_tcp_s.ip.ip6.in6_addr = in6addr_loopback;
+
+    uint32_t i, j;
+    memset(routing_clients, 0, sizeof(routing_clients));
+
+    for (i = 0; i < NUM_ROUTING_CLIENTS; ++i) {
+        Routing_Client *client = &routing_clients[i];
+        uint8_t f_secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(client->public_key, f_secret_key);
+        client->conn = new_TCP_connection(ip_port_tcp_s, self_public_key, client->public_key, f_secret_key, 0);
+        ck_assert_msg(client->conn != NULL, "Failed to create TCP client");
+        routing_response_handler(client->conn, routing_response_callback, client);
+        routing_status_handler(client->conn, routing_status_callback, client);
+
+        if (i % 32 == 31) {
+            do_TCP_server(tcp_s);
+
+            for (j = 0; j <= i; ++j) {
+                do_TCP_connection(routing_clients[j].conn);
+            }
+        }
+    }
+
+    for (j = 0; j < 100 && tcp_s->num_accepted_connections != NUM_ROUTING_CLIENTS; ++j) {
+        c_sleep(50);
+        do_TCP_server(tcp_s);
+
+        for (i = 0; i < NUM_ROUTING_CLIENTS; ++i) {
+            do_TCP_connection(routing_clients[i].conn);
+        }
+    }
+
+    ck_assert_msg(tcp_s->num_accepted_connections == NUM_ROUTING_CLIENTS, "Only %u of %u connections were accepted",
+                  tcp_s->num_accepted_connections, NUM_ROUTING_CLIENTS);
+
+    /* Every client asks for every other client, mixed with keys that never connect. */
+    uint64_t start = current_time_monotonic();
+    clock_t cpu_start = clock();
+    _Bool done = 0;
+
+    for (j = 0; j < 2000 && !done; ++j) {
+        done = 1;
+
+        for (i = 0; i < NUM_ROUTING_CLIENTS; ++i) {
+            Routing_Client *client = &routing_clients[i];
+
+            while (client->requests < NUM_ROUTING_REQUESTS) {
+                uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+
+                if (client->requests % 3 == 0 && client->requests / 3 < NUM_ROUTING_CLIENTS - 1) {
+                    memcpy(public_key, routing_clients[(i + 1 + client->requests / 3) % NUM_ROUTING_CLIENTS].public_key,
+                           crypto_box_PUBLICKEYBYTES);
+                } else {
+                    randombytes(public_key, crypto_box_PUBLICKEYBYTES);
+                }
+
+                if (send_routing_request(client->conn, public_key) != 1)
+                    break;
+
+                ++client->requests;
+            }
+
+            do_TCP_connection(client->conn);
+
+            if (client->responses != NUM_ROUTING_REQUESTS || client->online != NUM_ROUTING_CLIENTS - 1)
+                done = 0;
+        }
+
+        do_TCP_server(tcp_s);
+        c_sleep(1);
+    }
+
+    double cpu_ms = (double)(clock() - cpu_start) * 1000 / CLOCKS_PER_SEC;
+    printf("%u clients made %u routing requests in %llu ms (%.2f ms of cpu)\n", NUM_ROUTING_CLIENTS,
+           NUM_ROUTING_CLIENTS * NUM_ROUTING_REQUESTS, (unsigned long long)(current_time_monotonic() - start), cpu_ms);
+
+    for (i = 0; i < NUM_ROUTING_CLIENTS; ++i) {
+        Routing_Client *client = &routing_clients[i];
+        ck_assert_msg(client->responses == NUM_ROUTING_REQUESTS, "Client %u got %u of %u routing responses", i,
+                      client->responses, NUM_ROUTING_REQUESTS);
+        ck_assert_msg(client->online == NUM_ROUTING_CLIENTS - 1, "Client %u saw %u of %u clients online", i,
+                      client->online, NUM_ROUTING_CLIENTS - 1);
+    }
+
+    /* Asking again for a key reuses the connection it already has. */
+    Routing_Client *client = &routing_clients[0];
+    ck_assert_msg(send_routing_request(client->conn, routing_clients[1].public_key) == 1, "Routing request failed");
+
+    for (j = 0; j < 10; ++j) {
+        do_TCP_server(tcp_s);
+        c_sleep(1);
+        do_TCP_connection(client->conn);
+    }
+
+    int index = get_TCP_connection_index(tcp_s, client->public_key);
+    ck_assert_msg(index != -1, "Connection not found by key");
+    uint32_t num_used = 0;
+
+    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        num_used += (tcp_s->accepted_connection_array[index].connections[i].status != 0);
+    }
+
+    ck_assert_msg(num_used == NUM_ROUTING_REQUESTS, "Connection uses %u slots instead of %u", num_used,
+                  NUM_ROUTING_REQUESTS);
+
+    /* Killing a client tells all the others it went offline, and frees its key. */
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    memcpy(public_key, client->public_key, crypto_box_PUBLICKEYBYTES);
+    kill_TCP_connection(client->conn);
+    uint32_t num_offline = 0;
+
+    for (j = 0; j < 200 && num_offline != NUM_ROUTING_CLIENTS - 1; ++j) {
+        do_TCP_server(tcp_s);
+        c_sleep(5);
+
+        for (num_offline = 0, i = 1; i < NUM_ROUTING_CLIENTS; ++i) {
+            do_TCP_connection(routing_clients[i].conn);
+            num_offline += routing_clients[i].offline;
+        }
+    }
+
+    ck_assert_msg(get_TCP_connection_index(tcp_s, public_key) == -1, "Closed connection still found by key");
+    ck_assert_msg(num_offline == NUM_ROUTING_CLIENTS - 1, "Only %u of %u clients saw the closed one go offline",
+                  num_offline, NUM_ROUTING_CLIENTS - 1);
+
+    for (i = 1; i < NUM_ROUTING_CLIENTS; ++i) {
+        kill_TCP_connection(routing_clients[i].conn);
+    }
+
+    kill_TCP_server(tcp_s);
+}
+END_TEST
+
 START_TEST(test_client_invalid)
 {
     unix_time_update();
@@ -514,6 +1138,11 @@ Suite *TCP_suite(void)
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(some, 10);
     DEFTESTCASE_SLOW(client, 10);
+    DEFTESTCASE_SLOW(client_precompute, 10);
+    DEFTESTCASE_SLOW(queue_flush, 30);
+    DEFTESTCASE_SLOW(idle_clients, 60);
+    DEFTESTCASE_SLOW(client_workers, 30);
+    DEFTESTCASE_SLOW(client_routing, 30);
     DEFTESTCASE_SLOW(client_invalid, 15);
     return s;
 }
@@ -12,6 +12,13 @@
 
 #include "helpers.h"
 
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
 void rand_bytes(uint8_t *b, size_t blen)
 {
     size_t i;
@@ -272,6 +279,80 @@ START_TEST(test_large_data_symmetric)
 }
 END_TEST
 
+#define NUM_PRECOMPUTE_JOBS 64
+
+static uint8_t precompute_public_keys[NUM_PRECOMPUTE_JOBS][crypto_box_PUBLICKEYBYTES];
+static uint32_t precompute_done_count;
+
+static void precompute_test_work(Precompute_Job *job)
+{
+    job->data[0] ^= 0xFF;
+}
+
+static void precompute_test_done(void *object, Precompute_Job *job)
+{
+    const uint8_t *secret_key = object;
+    uint8_t k[crypto_box_BEFORENMBYTES];
+
+    ck_assert_msg(job->number == precompute_done_count, "jobs not handed back in order");
+    ck_assert_msg(job->result == 0, "job failed");
+    ck_assert_msg(job->length == 1 && job->data[0] == (uint8_t)~job->number, "work function was not run");
+    ck_assert_msg(memcmp(job->public_key, precompute_public_keys[job->number], crypto_box_PUBLICKEYBYTES) == 0,
+                  "wrong public key");
+
+    encrypt_precompute(job->public_key, secret_key, k);
+    ck_assert_msg(memcmp(k, job->shared_key, sizeof(k)) == 0, "wrong shared key");
+    ++precompute_done_count;
+}
+
+START_TEST(test_precompute_pool)
+{
+    uint8_t pk[crypto_box_PUBLICKEYBYTES], sk[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(pk, sk);
+
+    Precompute_Pool *pool = new_precompute_pool(4, NUM_PRECOMPUTE_JOBS);
+    ck_assert_msg(pool != NULL, "failed to create pool");
+
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    uint32_t i;
+
+    for (i = 0; i < NUM_PRECOMPUTE_JOBS; ++i) {
+        uint8_t temp_sk[crypto_box_SECRETKEYBYTES];
+        uint8_t data = i;
+        crypto_box_keypair(precompute_public_keys[i], temp_sk);
+        ck_assert_msg(precompute_pool_add(pool, precompute_public_keys[i], sk, &precompute_test_work, &precompute_test_done,
+                                          sk, ip_port, i, 0, &data, 1) == 0, "failed to add job %u", i);
+    }
+
+    /* Queue is full, new jobs must be dropped. */
+    ck_assert_msg(precompute_pool_add(pool, pk, sk, NULL, &precompute_test_done, sk, ip_port, 0, 0, NULL, 0) == -1,
+                  "job added to full queue");
+    ck_assert_msg(pool->num_dropped == 1, "dropped job not counted");
+
+    for (i = 0; i < 1000 && precompute_done_count != NUM_PRECOMPUTE_JOBS; ++i) {
+        do_precompute_pool(pool);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(precompute_done_count == NUM_PRECOMPUTE_JOBS, "only %u jobs done", precompute_done_count);
+    ck_assert_msg(precompute_pool_pending(pool) == 0, "jobs still pending");
+
+    /* Cancelled jobs must never call back. */
+    ck_assert_msg(precompute_pool_add(pool, pk, sk, NULL, &precompute_test_done, sk, ip_port, 0, 0, NULL, 0) == 0,
+                  "failed to add job");
+    precompute_pool_cancel(pool, sk);
+
+    for (i = 0; i < 1000 && precompute_pool_pending(pool) != 0; ++i) {
+        do_precompute_pool(pool);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(precompute_done_count == NUM_PRECOMPUTE_JOBS, "cancelled job called back");
+    kill_precompute_pool(pool);
+}
+END_TEST
+
 Suite *crypto_suite(void)
 {
     Suite *s = suite_create("Crypto");
@@ -281,6 +362,7 @@ Suite *crypto_suite(void)
     DEFTESTCASE_SLOW(endtoend, 15); /* waiting up to 15 seconds */
     DEFTESTCASE(large_data);
     DEFTESTCASE(large_data_symmetric);
+    DEFTESTCASE(precompute_pool);
 
     return s;
 }
@@ -10,6 +10,13 @@
 
 #include "helpers.h"
 
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
 #define swap(x,y) do \
    { unsigned char swap_temp[sizeof(x) == sizeof(y) ? (signed)sizeof(x) : -1]; \
      memcpy(swap_temp,&y,sizeof(x)); \
@@ -364,12 +371,305 @@ START_TEST(test_addto_lists_ipv6)
 }
 END_TEST
 
+START_TEST(test_node_stats)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(ip, TOX_PORT_DEFAULT);
+    ck_assert_msg(net != 0, "Failed to create Networking_Core");
+    DHT *dht = new_DHT(net);
+    ck_assert_msg(dht != 0, "Failed to create DHT");
+
+    uint8_t client_id[CLIENT_ID_SIZE];
+    randombytes(client_id, sizeof(client_id));
+    ck_assert_msg(DHT_node_cost(dht, client_id) == NODE_STATS_DEFAULT_RTT, "Unknown node has wrong cost");
+
+    DHT_node_request_sent(dht, client_id);
+    DHT_node_response(dht, client_id, current_time_monotonic() - 100);
+    uint32_t cost = DHT_node_cost(dht, client_id);
+    ck_assert_msg(cost >= 100 && cost < 150, "Wrong cost %u for node with 100ms rtt", cost);
+    ck_assert_msg(!DHT_node_unreliable(dht, client_id), "Node that answered is unreliable");
+
+    uint32_t i;
+
+    for (i = 0; i < NODE_STATS_WINDOW; ++i) {
+        DHT_node_request_sent(dht, client_id);
+    }
+
+    ck_assert_msg(DHT_node_unreliable(dht, client_id), "Node that doesn't answer isn't unreliable");
+    ck_assert_msg(DHT_node_cost(dht, client_id) > cost + 50 * NODE_STATS_LOSS_COST, "Lost requests don't cost");
+
+    /* Fill the close list with good nodes, an unreliable one gets replaced by any node. */
+    IP_Port ip_port = {ip, TOX_PORT_DEFAULT};
+    uint8_t unreliable_id[CLIENT_ID_SIZE];
+
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        randombytes(unreliable_id, sizeof(unreliable_id));
+        ip_port.port += 1;
+        addto_lists(dht, ip_port, unreliable_id);
+    }
+
+    ck_assert_msg(client_in_list(dht->close_clientlist, LCLIENT_LIST, unreliable_id) >= 0, "Client id is not in the list");
+
+    for (i = 0; i < NODE_STATS_WINDOW; ++i) {
+        DHT_node_request_sent(dht, unreliable_id);
+    }
+
+    memcpy(client_id, dht->self_public_key, CLIENT_ID_SIZE);
+    client_id[0] ^= 0x80; /* as far from us as possible. */
+    ip_port.port += 1;
+    addto_lists(dht, ip_port, client_id);
+    ck_assert_msg(client_in_list(dht->close_clientlist, LCLIENT_LIST, client_id) >= 0, "Far node didn't replace unreliable one");
+    ck_assert_msg(client_in_list(dht->close_clientlist, LCLIENT_LIST, unreliable_id) == -1, "Unreliable node not replaced");
+
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+#define NUM_DHT_NODES 16
+#define DHT_NODES_PORT 34500
+#define ONLINE_CLOSE_NODES 8
+
+static uint32_t good_close_nodes(const DHT *dht)
+{
+    uint32_t i, num = 0;
+
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        if (!is_timeout(dht->close_clientlist[i].assoc4.timestamp, BAD_NODE_TIMEOUT) ||
+                !is_timeout(dht->close_clientlist[i].assoc6.timestamp, BAD_NODE_TIMEOUT))
+            ++num;
+    }
+
+    return num;
+}
+
+static void do_dhts(DHT **dhts, uint32_t num)
+{
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        networking_poll(dhts[i]->net);
+        do_DHT(dhts[i]);
+    }
+}
+
+/* return the time in ms it took dhts[0] to have ONLINE_CLOSE_NODES good close nodes. */
+static uint64_t time_to_online(DHT **dhts, uint32_t num)
+{
+    uint64_t start = current_time_monotonic();
+
+    while (good_close_nodes(dhts[0]) < ONLINE_CLOSE_NODES) {
+        ck_assert_msg(current_time_monotonic() - start < 60000, "DHT didn't come online");
+        do_dhts(dhts, num);
+        c_sleep(50);
+    }
+
+    return current_time_monotonic() - start;
+}
+
+static DHT *new_dht_node(uint16_t port)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(ip, port);
+    ck_assert_msg(net != 0, "Failed to create Networking_Core");
+    DHT *dht = new_DHT(net);
+    ck_assert_msg(dht != 0, "Failed to create DHT");
+    return dht;
+}
+
+static void kill_dht_node(DHT *dht)
+{
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+
+START_TEST(test_node_cache_warm_start)
+{
+    DHT *dhts[NUM_DHT_NODES];
+    uint32_t i;
+
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+
+    for (i = 0; i < NUM_DHT_NODES; ++i) {
+        dhts[i] = new_dht_node(DHT_NODES_PORT + i);
+
+        if (i > 0) {
+            IP_Port ip_port = {ip, dhts[i - 1]->net->port};
+            DHT_bootstrap(dhts[i], ip_port, dhts[i - 1]->self_public_key);
+        }
+    }
+
+    Node_Cache *node_cache = new_node_cache();
+    ck_assert_msg(node_cache != 0, "Failed to create Node_Cache");
+    dhts[0]->node_cache = node_cache;
+    time_to_online(dhts, NUM_DHT_NODES);
+
+    uint32_t size = node_cache_flush_size(node_cache);
+    ck_assert_msg(size >= ONLINE_CLOSE_NODES * NODE_CACHE_RECORD_SIZE, "Too few nodes in the cache");
+    uint8_t *data = malloc(size);
+    ck_assert_msg(node_cache_flush(node_cache, data, size) == size, "node_cache_flush failed");
+    ck_assert_msg(node_cache_flush_size(node_cache) == 0, "Nodes still dirty after flush");
+
+    /* Restart the first node with the cache. */
+    kill_dht_node(dhts[0]);
+    kill_node_cache(node_cache);
+
+    node_cache = new_node_cache();
+    ck_assert_msg(node_cache_load(node_cache, data, size) == (int)(size / NODE_CACHE_RECORD_SIZE),
+                  "node_cache_load failed");
+    /* Incomplete records at the end are ignored. */
+    ck_assert_msg(node_cache_load(node_cache, data, NODE_CACHE_RECORD_SIZE + 7) == 1, "node_cache_load failed");
+    free(data);
+
+    dhts[0] = new_dht_node(DHT_NODES_PORT);
+    dhts[0]->node_cache = node_cache;
+    uint64_t warm_time = time_to_online(dhts, NUM_DHT_NODES);
+    kill_dht_node(dhts[0]);
+    kill_node_cache(node_cache);
+
+    /* Restart it again without the cache. */
+    dhts[0] = new_dht_node(DHT_NODES_PORT);
+    IP_Port ip_port = {ip, dhts[NUM_DHT_NODES - 1]->net->port};
+    DHT_bootstrap(dhts[0], ip_port, dhts[NUM_DHT_NODES - 1]->self_public_key);
+    uint64_t cold_time = time_to_online(dhts, NUM_DHT_NODES);
+
+    printf("Time to %u close nodes: %llums with the node cache, %llums bootstrapping from one node\n",
+           ONLINE_CLOSE_NODES, (unsigned long long)warm_time, (unsigned long long)cold_time);
+
+    for (i = 0; i < NUM_DHT_NODES; ++i) {
+        kill_dht_node(dhts[i]);
+    }
+}
+END_TEST
+
+/* A simulated NAT that gives every new destination a new port, either the next
+ * ones in sequence (some taken by other hosts behind it) or random ones of its
+ * range.
+ */
+typedef struct {
+    _Bool random;
+    uint16_t next_port;
+    uint16_t step;
+    uint16_t low, high;
+} Sim_NAT;
+
+static uint16_t sim_nat_map(Sim_NAT *nat)
+{
+    if (nat->random)
+        return nat->low + rand() % (nat->high - nat->low + 1);
+
+    uint16_t port = nat->next_port;
+    nat->next_port += nat->step * (1 + (rand() % 4 == 0 ? rand() % 3 : 0));
+    return port;
+}
+
+/* return the number of guesses needed to find the port the NAT gives to the
+ * mapping towards us, after it gave a port to each of the close nodes.
+ * return 0 if it wasn't found in max_guesses.
+ */
+static uint32_t sim_punch(Sim_NAT *nat, uint32_t max_guesses)
+{
+    uint16_t port_list[MAX_FRIEND_CLIENTS];
+    uint32_t i;
+
+    for (i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
+        port_list[i] = sim_nat_map(nat);
+    }
+
+    uint16_t port = sim_nat_map(nat);
+    uint16_t guesses[PUNCH_PORTS_PER_SECOND * PUNCH_INTERVAL];
+    uint32_t index = 0;
+
+    while (index < max_guesses) {
+        uint16_t num = NAT_predict_ports(guesses, sizeof(guesses) / sizeof(uint16_t), port_list, MAX_FRIEND_CLIENTS, index);
+        ck_assert_msg(num != 0, "No guesses");
+
+        for (i = 0; i < num && index + i < max_guesses; ++i) {
+            if (guesses[i] == port)
+                return index + i + 1;
+        }
+
+        index += num;
+    }
+
+    return 0;
+}
+
+START_TEST(test_NAT_predict_ports)
+{
+    /* One round of punching. */
+    uint32_t round = PUNCH_PORTS_PER_SECOND * PUNCH_INTERVAL;
+    uint16_t same[MAX_FRIEND_CLIENTS], guesses[4];
+    uint32_t i, j, found;
+
+    for (i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
+        same[i] = 33445;
+    }
+
+    ck_assert_msg(NAT_predict_ports(guesses, 4, same, MAX_FRIEND_CLIENTS, 0) == 1 && guesses[0] == 33445,
+                  "Port keeping NAT must only get its port tried");
+
+    uint16_t steps[] = {1, 2, 7};
+
+    for (j = 0; j < sizeof(steps) / sizeof(uint16_t); ++j) {
+        for (found = 0, i = 0; i < 100; ++i) {
+            Sim_NAT nat = {0, 20000 + rand() % 40000, steps[j]};
+            found += sim_punch(&nat, round) != 0;
+        }
+
+        printf("NAT giving out ports by %u: %u%% found in a round\n", steps[j], found);
+        ck_assert_msg(found == 100, "Port of a NAT giving out ports by %u not found in a round", steps[j]);
+    }
+
+    /* Every port around the ones seen gets tried. */
+    uint16_t port_list[MAX_FRIEND_CLIENTS] = {40310, 40020, 40750, 40101, 40999, 40532, 40020, 40666};
+    uint16_t many[PUNCH_PORTS_PER_SECOND * PUNCH_INTERVAL];
+    uint8_t tried[65536] = {0};
+    uint32_t index = 0;
+
+    while (index < 2 * 2 * 1000 + 2) {
+        uint16_t num = NAT_predict_ports(many, sizeof(many) / sizeof(uint16_t), port_list, MAX_FRIEND_CLIENTS, index);
+
+        for (i = 0; i < num; ++i) {
+            tried[many[i]] = 1;
+        }
+
+        index += num;
+    }
+
+    for (i = 40020 - 489; i <= 40999 + 489; ++i) {
+        ck_assert_msg(tried[i], "Port %u was never tried", i);
+    }
+
+    uint32_t found_scan = 0;
+
+    for (found = 0, i = 0; i < 100; ++i) {
+        Sim_NAT nat = {1, 0, 0, 40000, 40999};
+        found += sim_punch(&nat, round * MAX_NORMAL_PUNCHING_TRIES) != 0;
+        found_scan += sim_punch(&nat, 2 * 2 * 1000 + 2) != 0;
+    }
+
+    printf("NAT giving out random ports of 1000: %u%% found in %u rounds, %u%% after trying all around the ports seen\n",
+           found, MAX_NORMAL_PUNCHING_TRIES, found_scan);
+    ck_assert_msg(found >= 20, "Only %u%% of the ports of a random NAT found", found);
+    ck_assert_msg(found_scan >= 90, "Only %u%% of the ports of a random NAT found after a scan", found_scan);
+}
+END_TEST
+
 Suite *dht_suite(void)
 {
     Suite *s = suite_create("DHT");
 
     DEFTESTCASE(addto_lists_ipv4);
     DEFTESTCASE(addto_lists_ipv6);
+    DEFTESTCASE(node_stats);
+    DEFTESTCASE(NAT_predict_ports);
+    DEFTESTCASE_SLOW(node_cache_warm_start, 120);
     return s;
 }
 
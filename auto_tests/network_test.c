@@ -10,6 +10,9 @@
 #include <time.h>
 
 #include "../toxcore/network.h"
+#include "../toxcore/list.h"
+#include "../toxcore/ping_array.h"
+#include "../toxcore/util.h"
 
 #include "helpers.h"
 
@@ -134,12 +137,141 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+static void random_ip_port(IP_Port *ip_port)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+    ip_port->ip.family = AF_INET;
+    ip_port->ip.ip4.uint32 = rand();
+    ip_port->port = rand();
+}
+
+#define NUM_LIST_IP_PORTS 512
+#define NUM_FLOOD_PACKETS 1000000
+
+START_TEST(test_bs_list_filter)
+{
+    BS_LIST list;
+    IP_Port ip_ports[NUM_LIST_IP_PORTS];
+    uint32_t i;
+
+    ck_assert_msg(bs_list_init(&list, sizeof(IP_Port), 8), "bs_list_init failed");
+
+    for (i = 0; i < NUM_LIST_IP_PORTS; ++i) {
+        random_ip_port(&ip_ports[i]);
+        ip_ports[i].port = i; /* make them unique. */
+        ck_assert_msg(bs_list_add(&list, &ip_ports[i], i), "bs_list_add failed");
+    }
+
+    /* Remove every other one, the filter must still find all the others. */
+    for (i = 0; i < NUM_LIST_IP_PORTS; i += 2) {
+        ck_assert_msg(bs_list_remove(&list, &ip_ports[i], i), "bs_list_remove failed");
+    }
+
+    for (i = 0; i < NUM_LIST_IP_PORTS; ++i) {
+        int id = bs_list_find(&list, &ip_ports[i]);
+
+        if (i % 2)
+            ck_assert_msg(id == i, "bs_list_find returned %i instead of %u", id, i);
+        else
+            ck_assert_msg(id == -1, "removed element still found");
+    }
+
+    /* Flood of packets from random sources. */
+    IP_Port source;
+    uint32_t found = 0;
+    clock_t start = clock();
+
+    for (i = 0; i < NUM_FLOOD_PACKETS; ++i) {
+        random_ip_port(&source);
+
+        if (bs_list_find(&list, &source) != -1)
+            ++found;
+    }
+
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%u random source lookups in a list of %u took %f seconds\n", NUM_FLOOD_PACKETS, list.n, secs);
+    ck_assert_msg(found == 0, "%u random sources found in list", found);
+
+    for (i = 1; i < NUM_LIST_IP_PORTS; i += 2) {
+        ck_assert_msg(bs_list_remove(&list, &ip_ports[i], i), "bs_list_remove failed");
+    }
+
+    for (i = 0; i < BS_LIST_FILTER_SIZE; ++i) {
+        ck_assert_msg(list.filter[i] == 0, "filter not empty after removing everything");
+    }
+
+    bs_list_free(&list);
+}
+END_TEST
+
+#define PING_ARRAY_BENCH_SIZE 65536
+#define NUM_PING_ARRAY_OPS 1000000
+
+START_TEST(test_ping_array)
+{
+    Ping_Array array;
+    uint8_t data[64], data2[64];
+    uint32_t i;
+
+    ck_assert_msg(ping_array_init(&array, 1000, 10, sizeof(data)) == -1, "Size that isn't a power of 2 accepted");
+    ck_assert_msg(ping_array_init(&array, 16, 10, sizeof(data)) == 0, "ping_array_init failed");
+
+    ck_assert_msg(ping_array_add(&array, data, sizeof(data) + 1) == 0, "Data that is too big accepted");
+
+    memset(data, 7, sizeof(data));
+    uint64_t ping_id = ping_array_add(&array, data, sizeof(data));
+    ck_assert_msg(ping_id != 0, "ping_array_add failed");
+    ck_assert_msg(ping_array_check(data2, sizeof(data2) - 1, &array, ping_id) == -1, "Data copied into too small buffer");
+    ck_assert_msg(ping_array_check(data2, sizeof(data2), &array, ping_id + 16) == -1, "Wrong ping_id accepted");
+    ck_assert_msg(ping_array_check(data2, sizeof(data2), &array, ping_id) == sizeof(data), "ping_array_check failed");
+    ck_assert_msg(memcmp(data, data2, sizeof(data)) == 0, "Wrong data");
+    ck_assert_msg(ping_array_check(data2, sizeof(data2), &array, ping_id) == -1, "ping_id accepted twice");
+
+    /* Entries are overwritten once the ring wraps around. */
+    ping_id = ping_array_add(&array, data, 8);
+
+    for (i = 0; i < 16; ++i) {
+        ping_array_add(&array, data, 8);
+    }
+
+    ck_assert_msg(ping_array_check(data2, sizeof(data2), &array, ping_id) == -1, "Overwritten entry accepted");
+    ping_array_free_all(&array);
+
+    /* Benchmark, every request gets an answer after PING_ARRAY_BENCH_SIZE / 2 others were sent. */
+    ck_assert_msg(ping_array_init(&array, PING_ARRAY_BENCH_SIZE, 10, sizeof(data)) == 0, "ping_array_init failed");
+    uint64_t *ping_ids = calloc(PING_ARRAY_BENCH_SIZE / 2, sizeof(uint64_t));
+    uint32_t found = 0;
+    unix_time_update();
+    clock_t start = clock();
+
+    for (i = 0; i < NUM_PING_ARRAY_OPS; ++i) {
+        uint32_t slot = i % (PING_ARRAY_BENCH_SIZE / 2);
+
+        if (i >= PING_ARRAY_BENCH_SIZE / 2 && ping_array_check(data2, sizeof(data2), &array, ping_ids[slot]) == sizeof(data))
+            ++found;
+
+        ping_ids[slot] = ping_array_add(&array, data, sizeof(data));
+    }
+
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%u ping array adds and checks with %u entries took %f seconds\n", NUM_PING_ARRAY_OPS, PING_ARRAY_BENCH_SIZE,
+           secs);
+    ck_assert_msg(found == NUM_PING_ARRAY_OPS - PING_ARRAY_BENCH_SIZE / 2, "Only %u entries found", found);
+    ck_assert_msg(secs < NUM_PING_ARRAY_OPS / 100000.0, "Less than 100k ops/s");
+
+    free(ping_ids);
+    ping_array_free_all(&array);
+}
+END_TEST
+
 Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(bs_list_filter);
+    DEFTESTCASE(ping_array);
 
     return s;
 }
@@ -195,14 +195,13 @@ START_TEST(test_basic)
 
     randombytes(sb_data, sizeof(sb_data));
     memcpy(&s, sb_data, sizeof(uint64_t));
-    memcpy(onion2_a->entries[1].public_key, onion2->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-    onion2_a->entries[1].time = unix_time();
+    uint8_t zero_ret[ONION_RETURN_3] = {0};
+    onion_announce_add_entry(onion2_a, on1, onion2->dht->self_public_key, onion2->dht->self_public_key, zero_ret);
     networking_registerhandler(onion1->net, NET_PACKET_ONION_DATA_RESPONSE, &handle_test_4, onion1);
     send_announce_request(onion1->net, &path, nodes[3], onion1->dht->self_public_key, onion1->dht->self_secret_key,
                           test_3_ping_id, onion1->dht->self_public_key, onion1->dht->self_public_key, s);
 
-    while (memcmp(onion2_a->entries[ONION_ANNOUNCE_MAX_ENTRIES - 2].public_key, onion1->dht->self_public_key,
-                  crypto_box_PUBLICKEYBYTES) != 0) {
+    while (onion_announce_find_entry(onion2_a, onion1->dht->self_public_key) == -1) {
         do_onion(onion1);
         do_onion(onion2);
         c_sleep(50);
@@ -272,10 +271,12 @@ Onions *new_onions(uint16_t port)
     ip_init(&ip, 1);
     ip.ip6.uint8[15] = 1;
     Onions *on = malloc(sizeof(Onions));
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
     DHT *dht = new_DHT(new_networking(ip, port));
     on->onion = new_onion(dht);
     on->onion_a = new_onion_announce(dht);
-    on->onion_c = new_onion_client(new_net_crypto(dht, 0));
+    on->onion_c = new_onion_client(new_net_crypto(dht, &proxy_info));
 
     if (on->onion && on->onion_a && on->onion_c)
         return on;
@@ -294,7 +295,9 @@ void kill_onions(Onions *on)
 {
     Networking_Core *net = on->onion->dht->net;
     DHT *dht = on->onion->dht;
+    Net_Crypto *c = on->onion_c->c;
     kill_onion_client(on->onion_c);
+    kill_net_crypto(c);
     kill_onion_announce(on->onion_a);
     kill_onion(on->onion);
     kill_DHT(dht);
@@ -386,11 +389,490 @@ START_TEST(test_announce)
 }
 END_TEST
 
+#define NUM_STORE_ENTRIES 256
+#define NUM_STORE_KEYS 1024
+#define NUM_STORE_BENCH_ENTRIES 8192
+#define NUM_STORE_BENCH_OPS 1000000
+
+START_TEST(test_announce_store)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+    DHT *dht = new_DHT(new_networking(ip, 34580));
+    ck_assert_msg(dht != NULL, "DHT failed initializing.");
+    ck_assert_msg(new_onion_announce_ex(dht, 0) == NULL, "Store of size 0 created.");
+    Onion_Announce *onion_a = new_onion_announce_ex(dht, NUM_STORE_ENTRIES);
+    ck_assert_msg(onion_a != NULL, "Onion_Announce failed initializing.");
+
+    static uint8_t keys[NUM_STORE_KEYS][crypto_box_PUBLICKEYBYTES];
+    uint8_t ret[ONION_RETURN_3] = {0};
+    IP_Port ip_port = {ip, 1};
+    uint32_t i, j;
+
+    for (i = 0; i < NUM_STORE_KEYS; ++i) {
+        randombytes(keys[i], crypto_box_PUBLICKEYBYTES);
+        onion_announce_add_entry(onion_a, ip_port, keys[i], keys[i], ret);
+    }
+
+    /* Only the closest keys to ours are kept. */
+    uint32_t num_found = 0;
+
+    for (i = 0; i < NUM_STORE_KEYS; ++i) {
+        uint32_t num_closer = 0;
+
+        for (j = 0; j < NUM_STORE_KEYS; ++j) {
+            if (id_closest(dht->self_public_key, keys[j], keys[i]) == 1)
+                ++num_closer;
+        }
+
+        int index = onion_announce_find_entry(onion_a, keys[i]);
+
+        if (num_closer < NUM_STORE_ENTRIES) {
+            ck_assert_msg(index != -1, "Close key %u not stored.", i);
+            ck_assert_msg(id_equal(onion_a->entries[index].data_public_key, keys[i]), "Wrong entry found.");
+            ++num_found;
+        } else {
+            ck_assert_msg(index == -1, "Far key %u stored.", i);
+        }
+    }
+
+    ck_assert_msg(num_found == NUM_STORE_ENTRIES, "Found %u entries.", num_found);
+
+    /* Refreshing an entry keeps it in place. */
+    int index = onion_announce_find_entry(onion_a, keys[0]);
+
+    if (index != -1) {
+        ck_assert_msg(onion_announce_add_entry(onion_a, ip_port, keys[0], keys[1], ret) == index, "Entry moved.");
+        ck_assert_msg(id_equal(onion_a->entries[index].data_public_key, keys[1]), "Entry not refreshed.");
+    }
+
+    /* Entries that timed out are reused for new keys, even far ones. */
+    for (i = 0; i < NUM_STORE_ENTRIES; ++i) {
+        onion_a->entries[i].time = unix_time() - ONION_ANNOUNCE_TIMEOUT - 1;
+    }
+
+    uint8_t far_key[crypto_box_PUBLICKEYBYTES];
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        far_key[i] = dht->self_public_key[i] ^ 0xFF;
+    }
+
+    ck_assert_msg(onion_announce_find_entry(onion_a, keys[0]) == -1, "Timed out entry found.");
+    ck_assert_msg(onion_announce_add_entry(onion_a, ip_port, far_key, far_key, ret) != -1, "Timed out entry not reused.");
+    ck_assert_msg(onion_announce_find_entry(onion_a, far_key) != -1, "Far key not found.");
+    kill_onion_announce(onion_a);
+
+    /* Announce throughput with a constantly churning big store. */
+    onion_a = new_onion_announce_ex(dht, NUM_STORE_BENCH_ENTRIES);
+    ck_assert_msg(onion_a != NULL, "Onion_Announce failed initializing.");
+    uint32_t num_added = 0;
+    clock_t start = clock();
+
+    for (i = 0; i < NUM_STORE_BENCH_OPS; ++i) {
+        uint8_t *key = keys[i % NUM_STORE_KEYS];
+        memcpy(key, &i, sizeof(i));
+
+        if (onion_announce_add_entry(onion_a, ip_port, key, key, ret) != -1)
+            ++num_added;
+
+        onion_announce_find_entry(onion_a, keys[(i * 7) % NUM_STORE_KEYS]);
+    }
+
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%u announces and lookups with %u entries took %f seconds (%u stored)\n", NUM_STORE_BENCH_OPS,
+           NUM_STORE_BENCH_ENTRIES, secs, num_added);
+    ck_assert_msg(secs < 10.0, "Announce store too slow: %f seconds", secs);
+
+    kill_onion_announce(onion_a);
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+#define NUM_FORWARD_BURST 128
+#define NUM_FORWARD_PACKETS 100000
+
+static uint32_t forwarded_packets;
+static int handle_forwarded(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    ++forwarded_packets;
+    return 0;
+}
+
+START_TEST(test_forward_bench)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+    Onion *onion1 = new_onion(new_DHT(new_networking(ip, 34581)));
+    Onion *onion2 = new_onion(new_DHT(new_networking(ip, 34582)));
+    ck_assert_msg((onion1 != NULL) && (onion2 != NULL), "Onion failed initializing.");
+    networking_registerhandler(onion2->net, NET_PACKET_ONION_SEND_1, &handle_forwarded, onion2);
+
+    /* onion1 is the first hop of the path, onion2 the second. */
+    Node_format nodes[3];
+    IP_Port on1 = {ip, onion1->net->port};
+    IP_Port on2 = {ip, onion2->net->port};
+    memcpy(nodes[0].public_key, onion1->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+    nodes[0].ip_port = on1;
+    memcpy(nodes[1].public_key, onion2->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+    nodes[1].ip_port = on2;
+    memcpy(nodes[2].public_key, onion2->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+    nodes[2].ip_port = on2;
+    Onion_Path path;
+    create_onion_path(onion2->dht, &path, nodes);
+
+    uint8_t data[128];
+    randombytes(data, sizeof(data));
+    uint8_t packet[ONION_MAX_PACKET_SIZE];
+    int length = create_onion_packet(packet, sizeof(packet), &path, on2, data, sizeof(data));
+    ck_assert_msg(length != -1, "Failed to create onion packet.");
+
+    uint32_t num_sent = 0;
+    clock_t hop_time = 0;
+    forwarded_packets = 0;
+
+    while (num_sent < NUM_FORWARD_PACKETS) {
+        uint32_t i;
+
+        for (i = 0; i < NUM_FORWARD_BURST; ++i) {
+            sendpacket(onion2->net, on1, packet, length);
+        }
+
+        num_sent += NUM_FORWARD_BURST;
+        c_sleep(1);
+        clock_t start = clock();
+        networking_poll(onion1->net);
+        hop_time += clock() - start;
+        c_sleep(1);
+        networking_poll(onion2->net);
+    }
+
+    double secs = (double)hop_time / CLOCKS_PER_SEC;
+    printf("first hop forwarded %u of %u packets in %f seconds of cpu time (%.0f packets/sec)\n", forwarded_packets, num_sent,
+           secs, forwarded_packets / secs);
+    ck_assert_msg(forwarded_packets > num_sent / 2, "Only %u of %u packets forwarded.", forwarded_packets, num_sent);
+
+    kill_onion(onion1);
+    kill_onion(onion2);
+}
+END_TEST
+
+START_TEST(test_forward_workers)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+    Onion *onion1 = new_onion_ex(new_DHT(new_networking(ip, 34583)), 2);
+    Onion *onion2 = new_onion(new_DHT(new_networking(ip, 34584)));
+    ck_assert_msg((onion1 != NULL) && (onion2 != NULL), "Onion failed initializing.");
+    ck_assert_msg(onion1->num_workers == 2, "Workers not started.");
+    networking_registerhandler(onion2->net, NET_PACKET_ONION_SEND_1, &handle_forwarded, onion2);
+
+    Node_format nodes[3];
+    IP_Port on1 = {ip, onion1->net->port};
+    IP_Port on2 = {ip, onion2->net->port};
+    memcpy(nodes[0].public_key, onion1->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+    nodes[0].ip_port = on1;
+    memcpy(nodes[1].public_key, onion2->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+    nodes[1].ip_port = on2;
+    memcpy(nodes[2].public_key, onion2->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+    nodes[2].ip_port = on2;
+
+    uint8_t data[128];
+    randombytes(data, sizeof(data));
+    uint32_t num_sent = 0;
+    forwarded_packets = 0;
+    uint64_t start = current_time_monotonic();
+
+    while (num_sent < NUM_FORWARD_PACKETS) {
+        /* A new path for every burst so that the packets are spread over the workers. */
+        Onion_Path path;
+        create_onion_path(onion2->dht, &path, nodes);
+        uint8_t packet[ONION_MAX_PACKET_SIZE];
+        int length = create_onion_packet(packet, sizeof(packet), &path, on2, data, sizeof(data));
+        ck_assert_msg(length != -1, "Failed to create onion packet.");
+
+        uint32_t i;
+
+        for (i = 0; i < NUM_FORWARD_BURST; ++i) {
+            sendpacket(onion2->net, on1, packet, length);
+        }
+
+        num_sent += NUM_FORWARD_BURST;
+        c_sleep(1);
+        networking_poll(onion1->net);
+        c_sleep(1);
+        networking_poll(onion2->net);
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < 50 && forwarded_packets < num_sent / 2; ++i) {
+        c_sleep(10);
+        networking_poll(onion2->net);
+    }
+
+    uint64_t dropped = 0;
+
+    for (i = 0; i < onion1->num_workers; ++i) {
+        dropped += onion1->workers[i].num_dropped;
+    }
+
+    printf("workers forwarded %u of %u packets (%llu dropped) in %llu ms\n", forwarded_packets, num_sent,
+           (unsigned long long)dropped, (unsigned long long)(current_time_monotonic() - start));
+    ck_assert_msg(forwarded_packets > num_sent / 2, "Only %u of %u packets forwarded.", forwarded_packets, num_sent);
+
+    kill_onion(onion1);
+    kill_onion(onion2);
+}
+END_TEST
+
+static uint32_t lookup_packets;
+static int handle_lookup(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    ++lookup_packets;
+    return 0;
+}
+
+/* Run onion_c for runs rounds (one per second) and return the average number of
+ * packets it sent per round.
+ */
+static double lookup_rate(Onion_Client *onion_c, Networking_Core *sink, unsigned int runs)
+{
+    lookup_packets = 0;
+    unsigned int i = 0;
+
+    while (i < runs) {
+        networking_poll(onion_c->net);
+        uint64_t last_run = onion_c->last_run;
+        do_onion_client(onion_c);
+
+        if (onion_c->last_run != last_run)
+            ++i;
+
+        c_sleep(20);
+        networking_poll(sink);
+    }
+
+    return (double)lookup_packets / runs;
+}
+
+#define NUM_LOOKUP_FRIENDS 1000
+
+START_TEST(test_friend_lookups)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    Networking_Core *sink = new_networking(ip, 34585);
+    Onion_Client *onion_c = new_onion_client(new_net_crypto(new_DHT(new_networking(ip, 34586)), &proxy_info));
+    ck_assert_msg(sink && onion_c, "Failed to initialize.");
+    networking_registerhandler(sink, NET_PACKET_ONION_SEND_INITIAL, &handle_lookup, NULL);
+
+    /* Every path starts at the sink, which counts the packets instead of relaying them. */
+    IP_Port sink_ip_port = {ip, sink->port};
+    uint32_t i;
+
+    for (i = 0; i < MAX_PATH_NODES; ++i) {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        randombytes(public_key, sizeof(public_key));
+        addto_lists(onion_c->dht, sink_ip_port, public_key);
+        memcpy(onion_c->path_nodes[i].public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        onion_c->path_nodes[i].ip_port = sink_ip_port;
+    }
+
+    onion_c->path_nodes_index = MAX_PATH_NODES;
+    onion_c->onion_connected = ~0U / 2;
+
+    uint32_t num_friends = 0, target;
+
+    for (target = 10; target <= NUM_LOOKUP_FRIENDS; target *= 10) {
+        for (; num_friends < target; ++num_friends) {
+            uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+            randombytes(public_key, sizeof(public_key));
+            ck_assert_msg(onion_addfriend(onion_c, public_key) == num_friends, "Failed to add friend.");
+        }
+
+        double rate = lookup_rate(onion_c, sink, 3);
+        printf("%u friends: %.0f packets/sec\n", num_friends, rate);
+        ck_assert_msg(rate <= ONION_FRIEND_LOOKUP_BUDGET + MAX_ONION_CLIENTS * 2, "%u friends sent %.0f packets/sec",
+                      num_friends, rate);
+    }
+
+    /* Friends that haven't been seen for long are looked up less and less often. */
+    for (i = 0; i < num_friends; ++i) {
+        onion_c->friends_list[i].last_seen = 1;
+    }
+
+    double rate = lookup_rate(onion_c, sink, 4);
+    uint32_t backed_off = 0;
+
+    for (i = 0; i < num_friends; ++i) {
+        backed_off += onion_c->friends_list[i].lookup_interval > 1;
+    }
+
+    printf("%u friends not seen for long: %.0f packets/sec, %u backed off\n", num_friends, rate, backed_off);
+    ck_assert_msg(backed_off != 0, "No friend backed off.");
+
+    /* A friend that is seen again is looked up right away. */
+    uint32_t friendnum = 0;
+
+    while (onion_c->friends_list[friendnum].lookup_interval <= 1) {
+        ++friendnum;
+    }
+
+    onion_c->friends_list[friendnum].last_seen = unix_time();
+    lookup_rate(onion_c, sink, 2);
+    ck_assert_msg(onion_c->friends_list[friendnum].lookup_interval == 1, "Friend seen again still backed off.");
+
+    Net_Crypto *c = onion_c->c;
+    DHT *dht = onion_c->dht;
+    Networking_Core *net = onion_c->net;
+    kill_onion_client(onion_c);
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+    kill_networking(sink);
+}
+END_TEST
+
+#define NUM_CHURN_ONIONS 16
+#define NUM_CHURN_KILLED 4
+#define CHURN_TIME 20000
+
+static Packet_Handles announce_response_handler;
+static uint32_t announce_responses;
+static int count_announce_response(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    ++announce_responses;
+    return announce_response_handler.function(announce_response_handler.object, source, packet, length);
+}
+
+static _Bool is_announce_node(const Onion_Client *onion_c, IP_Port ip_port)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAX_ONION_CLIENTS; ++i) {
+        if (ipport_equal(&onion_c->clients_announce_list[i].ip_port, &ip_port)
+                || ipport_equal(&onion_c->friends_list[0].clients_list[i].ip_port, &ip_port))
+            return 1;
+    }
+
+    return 0;
+}
+
+START_TEST(test_path_churn)
+{
+    Onions *onions[NUM_CHURN_ONIONS];
+    _Bool killed[NUM_CHURN_ONIONS] = {0};
+    uint32_t i, j;
+
+    for (i = 0; i < NUM_CHURN_ONIONS; ++i) {
+        onions[i] = new_onions(i + 34600);
+        ck_assert_msg(onions[i] != 0, "Failed to create onions.");
+    }
+
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+
+    for (i = 1; i < NUM_CHURN_ONIONS; ++i) {
+        IP_Port ip_port = {ip, onions[i - 1]->onion->net->port};
+        DHT_bootstrap(onions[i]->onion->dht, ip_port, onions[i - 1]->onion->dht->self_public_key);
+    }
+
+    /* A friend that is never online keeps the friend paths of the first node busy. */
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    randombytes(public_key, sizeof(public_key));
+    onion_addfriend(onions[0]->onion_c, public_key);
+
+    while (!onion_connection_status(onions[0]->onion_c)) {
+        for (i = 0; i < NUM_CHURN_ONIONS; ++i) {
+            do_onions(onions[i]);
+        }
+
+        c_sleep(50);
+    }
+
+    /* Kill the nodes the friend paths of the first node go through, but not the
+     * ones it sends its requests to, as no path helps with those. */
+    uint32_t num_killed = 0;
+
+    for (i = 0; i < NUMBER_ONION_PATHS && num_killed < NUM_CHURN_KILLED; ++i) {
+        Node_format nodes[3];
+
+        if (onion_path_to_nodes(nodes, 3, &onions[0]->onion_c->onion_paths_friends.paths[i]) == -1)
+            continue;
+
+        for (j = 0; j < 3 && num_killed < NUM_CHURN_KILLED; ++j) {
+            uint32_t num = ntohs(nodes[j].ip_port.port) - 34600;
+
+            if (num != 0 && num < NUM_CHURN_ONIONS && !killed[num] && !is_announce_node(onions[0]->onion_c, nodes[j].ip_port)) {
+                kill_onions(onions[num]);
+                killed[num] = 1;
+                ++num_killed;
+            }
+        }
+    }
+
+    for (i = NUM_CHURN_ONIONS - 1; i != 0 && num_killed < NUM_CHURN_KILLED; --i) {
+        if (killed[i])
+            continue;
+
+        IP_Port ip_port = {ip, onions[i]->onion->net->port};
+
+        if (!is_announce_node(onions[0]->onion_c, ip_port)) {
+            kill_onions(onions[i]);
+            killed[i] = 1;
+            ++num_killed;
+        }
+    }
+
+    /* Count the responses to the announce requests of the first node. */
+    Networking_Core *net = onions[0]->onion->net;
+    announce_response_handler = net->packethandlers[NET_PACKET_ANNOUNCE_RESPONSE];
+    networking_registerhandler(net, NET_PACKET_ANNOUNCE_RESPONSE, &count_announce_response, NULL);
+    announce_responses = 0;
+    uint32_t requests = onions[0]->onion_c->announce_ping_array.last_added;
+    uint64_t start = current_time_monotonic();
+
+    while (current_time_monotonic() - start < CHURN_TIME) {
+        for (i = 0; i < NUM_CHURN_ONIONS; ++i) {
+            if (!killed[i])
+                do_onions(onions[i]);
+        }
+
+        c_sleep(50);
+    }
+
+    requests = onions[0]->onion_c->announce_ping_array.last_added - requests;
+    printf("%u of %u announce requests answered in %u seconds after %u of %u nodes died\n", announce_responses,
+           requests, CHURN_TIME / 1000, num_killed, NUM_CHURN_ONIONS);
+    ck_assert_msg(announce_responses * 2 > requests, "Only %u of %u announce requests answered.", announce_responses,
+                  requests);
+
+    for (i = 0; i < NUM_CHURN_ONIONS; ++i) {
+        if (!killed[i])
+            kill_onions(onions[i]);
+    }
+}
+END_TEST
+
 Suite *onion_suite(void)
 {
     Suite *s = suite_create("Onion");
 
     DEFTESTCASE_SLOW(basic, 5);
+    DEFTESTCASE_SLOW(announce_store, 20);
+    DEFTESTCASE_SLOW(forward_bench, 60);
+    DEFTESTCASE_SLOW(forward_workers, 60);
+    DEFTESTCASE_SLOW(friend_lookups, 60);
+    DEFTESTCASE_SLOW(path_churn, 90);
     //DEFTESTCASE_SLOW(announce, 50); //TODO: fix test.
     return s;
 }
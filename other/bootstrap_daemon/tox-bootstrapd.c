@@ -55,11 +55,15 @@
 #define DAEMON_NAME "tox-bootstrapd"
 #define DAEMON_VERSION_NUMBER 2014101200UL // yyyymmmddvv format: yyyy year, mm month, dd day, vv version change count for that day
 
+// How often, in seconds, changed nodes are appended to the node cache file
+#define NODE_CACHE_WRITE_INTERVAL 60
+
 #define SLEEP_TIME_MILLISECONDS 30
 #define sleep usleep(1000*SLEEP_TIME_MILLISECONDS)
 
 #define DEFAULT_PID_FILE_PATH         "tox-bootstrapd.pid"
 #define DEFAULT_KEYS_FILE_PATH        "tox-bootstrapd.keys"
+#define DEFAULT_NODE_CACHE_FILE_PATH  "tox-bootstrapd.nodes"
 #define DEFAULT_PORT                  33445
 #define DEFAULT_ENABLE_IPV6           1 // 1 - true, 0 - false
 #define DEFAULT_ENABLE_IPV4_FALLBACK  1 // 1 - true, 0 - false
@@ -69,6 +73,10 @@
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_PRECOMPUTE_THREADS    0 // 0 - compute handshakes in the main loop
+#define DEFAULT_ONION_ANNOUNCE_ENTRIES 4096
+#define DEFAULT_ONION_THREADS         0 // 0 - relay onion packets in the main loop
+#define DEFAULT_TCP_RELAY_THREADS     0 // 0 - run TCP relay connections in the main loop
 
 #define MIN_ALLOWED_PORT 1
 #define MAX_ALLOWED_PORT 65535
@@ -118,6 +126,97 @@ int manage_keys(DHT *dht, char *keys_file_path)
     return 1;
 }
 
+// Loads the node cache from `node_cache_file_path` and opens the file for appending,
+// rewriting it first if it grew much bigger than the cache
+//
+// returns the opened file on success
+//         NULL on failure
+
+FILE *manage_node_cache(Node_Cache *node_cache, const char *node_cache_file_path)
+{
+    FILE *node_cache_file = fopen(node_cache_file_path, "rb");
+    long file_size = 0;
+
+    if (node_cache_file != NULL) {
+        fseek(node_cache_file, 0, SEEK_END);
+        file_size = ftell(node_cache_file);
+        fseek(node_cache_file, 0, SEEK_SET);
+
+        uint8_t *data = malloc(file_size);
+
+        if (data == NULL || fread(data, sizeof(uint8_t), file_size, node_cache_file) != (size_t)file_size) {
+            free(data);
+            fclose(node_cache_file);
+            return NULL;
+        }
+
+        fclose(node_cache_file);
+
+        int num = node_cache_load(node_cache, data, file_size);
+        free(data);
+
+        if (num == -1) {
+            return NULL;
+        }
+
+        syslog(LOG_DEBUG, "Read %d node cache records, %u nodes.\n", num, node_cache->num_entries);
+    }
+
+    // Old records of a node are never needed again, drop them once they make up most of the file
+    if (file_size > 2 * (long)node_cache_size(node_cache) + NODE_CACHE_SIZE * NODE_CACHE_RECORD_SIZE) {
+        uint32_t size = node_cache_size(node_cache);
+        uint8_t *data = malloc(size);
+
+        if (data == NULL) {
+            return NULL;
+        }
+
+        node_cache_save(node_cache, data);
+        node_cache_file = fopen(node_cache_file_path, "wb");
+
+        if (node_cache_file == NULL || fwrite(data, sizeof(uint8_t), size, node_cache_file) != size) {
+            free(data);
+
+            if (node_cache_file != NULL) {
+                fclose(node_cache_file);
+            }
+
+            return NULL;
+        }
+
+        free(data);
+        fclose(node_cache_file);
+        syslog(LOG_DEBUG, "Compacted the node cache file.\n");
+    }
+
+    return fopen(node_cache_file_path, "ab");
+}
+
+// Appends the nodes that changed since the last call to the node cache file
+
+void write_node_cache(Node_Cache *node_cache, FILE *node_cache_file)
+{
+    uint32_t size = node_cache_flush_size(node_cache);
+
+    if (size == 0) {
+        return;
+    }
+
+    uint8_t *data = malloc(size);
+
+    if (data == NULL) {
+        return;
+    }
+
+    size = node_cache_flush(node_cache, data, size);
+
+    if (fwrite(data, sizeof(uint8_t), size, node_cache_file) != size || fflush(node_cache_file) != 0) {
+        syslog(LOG_WARNING, "Couldn't write to the node cache file.\n");
+    }
+
+    free(data);
+}
+
 // Parses tcp relay ports from `cfg` and puts them into `tcp_relay_ports` array
 //
 // Supposed to be called from get_general_config only
@@ -226,29 +325,36 @@ void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_ports, int
 
 // Gets general config options
 //
-// Important: you are responsible for freeing `pid_file_path` and `keys_file_path`
+// Important: you are responsible for freeing `pid_file_path`, `keys_file_path` and `node_cache_file_path`
 //            also, iff `tcp_relay_ports_count` > 0, then you are responsible for freeing `tcp_relay_ports`
 //            and also `motd` iff `enable_motd` is set
 //
 // returns 1 on success
 //         0 on failure, doesn't modify any data pointed by arguments
 
-int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
+int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path,
+                       char **node_cache_file_path, int *port,
                        int *enable_ipv6,
                        int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay, uint16_t **tcp_relay_ports,
-                       int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       int *tcp_relay_port_count, int *enable_motd, char **motd, int *precompute_threads,
+                       int *onion_announce_entries, int *onion_threads, int *tcp_relay_threads)
 {
     config_t cfg;
 
     const char *NAME_PORT                 = "port";
     const char *NAME_PID_FILE_PATH        = "pid_file_path";
     const char *NAME_KEYS_FILE_PATH       = "keys_file_path";
+    const char *NAME_NODE_CACHE_FILE_PATH = "node_cache_file_path";
     const char *NAME_ENABLE_IPV6          = "enable_ipv6";
     const char *NAME_ENABLE_IPV4_FALLBACK = "enable_ipv4_fallback";
     const char *NAME_ENABLE_LAN_DISCOVERY = "enable_lan_discovery";
     const char *NAME_ENABLE_TCP_RELAY     = "enable_tcp_relay";
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
+    const char *NAME_PRECOMPUTE_THREADS   = "precompute_threads";
+    const char *NAME_ONION_ANNOUNCE_ENTRIES = "onion_announce_entries";
+    const char *NAME_ONION_THREADS        = "onion_threads";
+    const char *NAME_TCP_RELAY_THREADS    = "tcp_relay_threads";
 
     config_init(&cfg);
 
@@ -290,6 +396,18 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     *keys_file_path = malloc(strlen(tmp_keys_file) + 1);
     strcpy(*keys_file_path, tmp_keys_file);
 
+    // Get node cache file location
+    const char *tmp_node_cache_file;
+
+    if (config_lookup_string(&cfg, NAME_NODE_CACHE_FILE_PATH, &tmp_node_cache_file) == CONFIG_FALSE) {
+        syslog(LOG_WARNING, "No '%s' setting in configuration file.\n", NAME_NODE_CACHE_FILE_PATH);
+        syslog(LOG_WARNING, "Using default '%s': %s\n", NAME_NODE_CACHE_FILE_PATH, DEFAULT_NODE_CACHE_FILE_PATH);
+        tmp_node_cache_file = DEFAULT_NODE_CACHE_FILE_PATH;
+    }
+
+    *node_cache_file_path = malloc(strlen(tmp_node_cache_file) + 1);
+    strcpy(*node_cache_file_path, tmp_node_cache_file);
+
     // Get IPv6 option
     if (config_lookup_bool(&cfg, NAME_ENABLE_IPV6, enable_ipv6) == CONFIG_FALSE) {
         syslog(LOG_WARNING, "No '%s' setting in configuration file.\n", NAME_ENABLE_IPV6);
@@ -352,11 +470,40 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         (*motd)[motd_length - 1] = '\0';
     }
 
+    // Get number of handshake precompute threads
+    if (config_lookup_int(&cfg, NAME_PRECOMPUTE_THREADS, precompute_threads) == CONFIG_FALSE) {
+        syslog(LOG_WARNING, "No '%s' setting in configuration file.\n", NAME_PRECOMPUTE_THREADS);
+        syslog(LOG_WARNING, "Using default '%s': %d\n", NAME_PRECOMPUTE_THREADS, DEFAULT_PRECOMPUTE_THREADS);
+        *precompute_threads = DEFAULT_PRECOMPUTE_THREADS;
+    }
+
+    // Get number of onion announcements to store
+    if (config_lookup_int(&cfg, NAME_ONION_ANNOUNCE_ENTRIES, onion_announce_entries) == CONFIG_FALSE) {
+        syslog(LOG_WARNING, "No '%s' setting in configuration file.\n", NAME_ONION_ANNOUNCE_ENTRIES);
+        syslog(LOG_WARNING, "Using default '%s': %d\n", NAME_ONION_ANNOUNCE_ENTRIES, DEFAULT_ONION_ANNOUNCE_ENTRIES);
+        *onion_announce_entries = DEFAULT_ONION_ANNOUNCE_ENTRIES;
+    }
+
+    // Get number of onion relay threads
+    if (config_lookup_int(&cfg, NAME_ONION_THREADS, onion_threads) == CONFIG_FALSE) {
+        syslog(LOG_WARNING, "No '%s' setting in configuration file.\n", NAME_ONION_THREADS);
+        syslog(LOG_WARNING, "Using default '%s': %d\n", NAME_ONION_THREADS, DEFAULT_ONION_THREADS);
+        *onion_threads = DEFAULT_ONION_THREADS;
+    }
+
+    // Get number of TCP relay threads
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_THREADS, tcp_relay_threads) == CONFIG_FALSE) {
+        syslog(LOG_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_THREADS);
+        syslog(LOG_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_THREADS, DEFAULT_TCP_RELAY_THREADS);
+        *tcp_relay_threads = DEFAULT_TCP_RELAY_THREADS;
+    }
+
     config_destroy(&cfg);
 
     syslog(LOG_DEBUG, "Successfully read:\n");
     syslog(LOG_DEBUG, "'%s': %s\n", NAME_PID_FILE_PATH,        *pid_file_path);
     syslog(LOG_DEBUG, "'%s': %s\n", NAME_KEYS_FILE_PATH,       *keys_file_path);
+    syslog(LOG_DEBUG, "'%s': %s\n", NAME_NODE_CACHE_FILE_PATH, *node_cache_file_path);
     syslog(LOG_DEBUG, "'%s': %d\n", NAME_PORT,                 *port);
     syslog(LOG_DEBUG, "'%s': %s\n", NAME_ENABLE_IPV6,          *enable_ipv6          ? "true" : "false");
     syslog(LOG_DEBUG, "'%s': %s\n", NAME_ENABLE_IPV4_FALLBACK, *enable_ipv4_fallback ? "true" : "false");
@@ -384,6 +531,11 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         syslog(LOG_DEBUG, "'%s': %s\n", NAME_MOTD, *motd);
     }
 
+    syslog(LOG_DEBUG, "'%s': %d\n", NAME_PRECOMPUTE_THREADS,   *precompute_threads);
+    syslog(LOG_DEBUG, "'%s': %d\n", NAME_ONION_ANNOUNCE_ENTRIES, *onion_announce_entries);
+    syslog(LOG_DEBUG, "'%s': %d\n", NAME_ONION_THREADS,        *onion_threads);
+    syslog(LOG_DEBUG, "'%s': %d\n", NAME_TCP_RELAY_THREADS,    *tcp_relay_threads);
+
     return 1;
 }
 
@@ -525,7 +677,7 @@ int main(int argc, char *argv[])
     }
 
     const char *cfg_file_path = argv[1];
-    char *pid_file_path, *keys_file_path;
+    char *pid_file_path, *keys_file_path, *node_cache_file_path;
     int port;
     int enable_ipv6;
     int enable_ipv4_fallback;
@@ -535,9 +687,15 @@ int main(int argc, char *argv[])
     int tcp_relay_port_count;
     int enable_motd;
     char *motd;
-
-    if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+    int precompute_threads;
+    int onion_announce_entries;
+    int onion_threads;
+    int tcp_relay_threads;
+
+    if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &node_cache_file_path, &port, &enable_ipv6,
+                           &enable_ipv4_fallback, &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count,
+                           &enable_motd, &motd, &precompute_threads, &onion_announce_entries,
+                           &onion_threads, &tcp_relay_threads)) {
         syslog(LOG_DEBUG, "General config read successfully\n");
     } else {
         syslog(LOG_ERR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -588,7 +746,12 @@ int main(int argc, char *argv[])
     }
 
     Onion *onion = new_onion(dht);
-    Onion_Announce *onion_a = new_onion_announce(dht);
+    if (onion_announce_entries <= 0) {
+        syslog(LOG_ERR, "Invalid onion_announce_entries: %d, should be positive. Exiting.\n", onion_announce_entries);
+        return 1;
+    }
+
+    Onion_Announce *onion_a = new_onion_announce_ex(dht, onion_announce_entries);
 
     if (!(onion && onion_a)) {
         syslog(LOG_ERR, "Couldn't initialize Tox Onion. Exiting.\n");
@@ -613,6 +776,22 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // The file is opened before the daemon changes its working directory
+    Node_Cache *node_cache = new_node_cache();
+    FILE *node_cache_file = NULL;
+
+    if (node_cache) {
+        node_cache_file = manage_node_cache(node_cache, node_cache_file_path);
+    }
+
+    if (node_cache_file) {
+        dht->node_cache = node_cache;
+        syslog(LOG_DEBUG, "Loaded the node cache successfully.\n");
+    } else {
+        syslog(LOG_ERR, "Couldn't read/write: %s. Exiting.\n", node_cache_file_path);
+        return 1;
+    }
+
     TCP_Server *tcp_server = NULL;
 
     if (enable_tcp_relay) {
@@ -654,6 +833,7 @@ int main(int argc, char *argv[])
 
     free(pid_file_path);
     free(keys_file_path);
+    free(node_cache_file_path);
 
     // Fork off from the parent process
     const pid_t pid = fork();
@@ -693,6 +873,7 @@ int main(int argc, char *argv[])
     close(STDERR_FILENO);
 
     uint64_t last_LANdiscovery = 0;
+    uint64_t last_node_cache_write = unix_time();
     const uint16_t htons_port = htons(port);
 
     int waiting_for_dht_connection = 1;
@@ -702,7 +883,49 @@ int main(int argc, char *argv[])
         syslog(LOG_DEBUG, "Initialized LAN discovery.\n");
     }
 
+    // Threads don't survive fork(), so the pool is only created now
+    Precompute_Pool *precompute_pool = NULL;
+
+    if (precompute_threads > 0) {
+        precompute_pool = new_precompute_pool(precompute_threads, PRECOMPUTE_DEFAULT_QUEUE_SIZE);
+
+        if (precompute_pool == NULL) {
+            syslog(LOG_ERR, "Couldn't start %d precompute threads. Exiting.\n", precompute_threads);
+            return 1;
+        }
+
+        dht->precompute_pool = precompute_pool;
+
+        if (enable_tcp_relay) {
+            tcp_server->precompute_pool = precompute_pool;
+        }
+
+        syslog(LOG_DEBUG, "Started %d precompute threads.\n", precompute_threads);
+    }
+
+    if (onion_threads > 0) {
+        if (onion_start_workers(onion, onion_threads) == -1) {
+            syslog(LOG_ERR, "Couldn't start %d onion threads. Exiting.\n", onion_threads);
+            return 1;
+        }
+
+        syslog(LOG_DEBUG, "Started %d onion threads.\n", onion_threads);
+    }
+
+    if (enable_tcp_relay && tcp_relay_threads > 0) {
+        if (TCP_server_start_workers(tcp_server, tcp_relay_threads) == -1) {
+            syslog(LOG_ERR, "Couldn't start %d TCP relay threads. Exiting.\n", tcp_relay_threads);
+            return 1;
+        }
+
+        syslog(LOG_DEBUG, "Started %d TCP relay threads.\n", tcp_relay_threads);
+    }
+
     while (1) {
+        if (precompute_pool) {
+            do_precompute_pool(precompute_pool);
+        }
+
         do_DHT(dht);
 
         if (enable_lan_discovery && is_timeout(last_LANdiscovery, LAN_DISCOVERY_INTERVAL)) {
@@ -716,6 +939,11 @@ int main(int argc, char *argv[])
 
         networking_poll(dht->net);
 
+        if (is_timeout(last_node_cache_write, NODE_CACHE_WRITE_INTERVAL)) {
+            write_node_cache(node_cache, node_cache_file);
+            last_node_cache_write = unix_time();
+        }
+
         if (waiting_for_dht_connection && DHT_isconnected(dht)) {
             syslog(LOG_DEBUG, "Connected to other bootstrap node successfully.\n");
             waiting_for_dht_connection = 0;
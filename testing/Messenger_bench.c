@@ -0,0 +1,148 @@
+/* Messenger benchmark
+ *
+ * Connects two Messenger instances over the loopback interface and has one
+ * send messages to the other as fast as the connection takes them, then
+ * prints how many messages and read receipts went through and how long the
+ * calls took.
+ *
+ * Usage: Messenger_bench <message length> <seconds>
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/Messenger.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT 33520
+
+static uint64_t received, receipts;
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void message_callback(Messenger *m, uint32_t friendnumber, unsigned int type, const uint8_t *message,
+                             size_t length, void *userdata)
+{
+    ++received;
+}
+
+static void read_receipt_callback(Messenger *m, uint32_t friendnumber, uint32_t receipt, void *userdata)
+{
+    ++receipts;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        printf("Usage: %s <message length> <seconds>\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t length = atoi(argv[1]);
+    uint32_t seconds = atoi(argv[2]);
+
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE - 2) {
+        printf("Message length must be between 1 and %u.\n", (unsigned int)(MAX_CRYPTO_DATA_SIZE - 2));
+        return 1;
+    }
+
+    Messenger_Options options;
+    memset(&options, 0, sizeof(options));
+    options.port_range[0] = options.port_range[1] = BENCH_PORT;
+    Messenger *m_a = new_messenger(&options, 0);
+    options.port_range[0] = options.port_range[1] = BENCH_PORT + 1;
+    Messenger *m_b = new_messenger(&options, 0);
+
+    if (m_a == NULL || m_b == NULL) {
+        printf("Failed to create the Messengers.\n");
+        return 1;
+    }
+
+    int32_t friend_a = m_addfriend_norequest(m_a, m_b->net_crypto->self_public_key);
+    m_addfriend_norequest(m_b, m_a->net_crypto->self_public_key);
+    m_callback_friendmessage(m_b, message_callback, NULL);
+    m_callback_read_receipt(m_a, read_receipt_callback, NULL);
+
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_port.ip.family = AF_INET;
+    ip_port.ip.ip4.uint32 = htonl(0x7F000001);
+    ip_port.port = m_b->dht->net->port;
+    DHT_bootstrap(m_a->dht, ip_port, m_b->dht->self_public_key);
+
+    uint64_t start = current_time_monotonic();
+
+    while (m_get_friend_connectionstatus(m_a, friend_a) == 0) {
+        if (current_time_monotonic() - start > 60000) {
+            printf("Failed to connect.\n");
+            return 1;
+        }
+
+        do_messenger(m_a);
+        do_messenger(m_b);
+        usleep(10000);
+    }
+
+    uint8_t message[length];
+    memset(message, 'a', length);
+    uint64_t sent = 0, send_ns = 0, loop_ns = 0, loops = 0;
+    start = current_time_monotonic();
+
+    while (current_time_monotonic() - start < seconds * 1000ULL) {
+        uint64_t t = time_ns();
+
+        /* Fill the send queue. */
+        while (m_send_message_generic(m_a, friend_a, MESSAGE_NORMAL, message, length, NULL) == 0) {
+            ++sent;
+        }
+
+        send_ns += time_ns() - t;
+
+        t = time_ns();
+        do_messenger(m_a);
+        do_messenger(m_b);
+        loop_ns += time_ns() - t;
+        ++loops;
+    }
+
+    uint64_t elapsed = current_time_monotonic() - start;
+    printf("%u byte messages: %llu sent, %llu received, %llu read receipts in %llu ms (%.0f messages/s)\n", length,
+           (unsigned long long)sent, (unsigned long long)received, (unsigned long long)receipts,
+           (unsigned long long)elapsed, elapsed ? (double)receipts * 1000 / elapsed : 0.0);
+    printf("send: %.2f us per message, do_messenger: %.2f us per loop\n",
+           sent ? (double)send_ns / sent / 1000 : 0.0, loops ? (double)loop_ns / loops / 1000 : 0.0);
+
+    kill_messenger(m_a);
+    kill_messenger(m_b);
+    return 0;
+}
@@ -0,0 +1,292 @@
+/* TCP fan-out benchmark
+ *
+ * Connects two Net_Crypto instances through TCP relays only and has writer
+ * threads send lossy packets to the other side while the main loop services
+ * the relays, then prints how long the writers were held up.
+ *
+ * Usage: TCP_fanout_bench <writer threads> <relays> <seconds>
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_RELAY_PORT 33460
+#define BENCH_PORT 33470
+#define BENCH_MAX_RELAYS 8
+#define BENCH_PACKET_SIZE 512
+/* Packets a writer sends between short sleeps. */
+#define BENCH_BURST 16
+
+typedef struct {
+    pthread_t thread;
+    uint64_t sent;
+    uint64_t failed;
+    uint64_t total_ns; /* Time spent in send_lossy_cryptpacket(). */
+    uint64_t max_ns;
+} Bench_Writer;
+
+static volatile _Bool running = 1;
+static Net_Crypto *nc_a, *nc_b;
+static int conn_a = -1, conn_b = -1;
+static IP_Port relay_ip_ports[BENCH_MAX_RELAYS];
+static uint8_t relay_public_keys[BENCH_MAX_RELAYS][crypto_box_PUBLICKEYBYTES];
+static uint32_t num_relays;
+static uint64_t received;
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int lossy_callback(void *object, int id, const uint8_t *data, uint16_t length)
+{
+    ++received;
+    return 0;
+}
+
+static int new_connection_callback(void *object, New_Connection *n_c)
+{
+    conn_b = accept_crypto_connection(nc_b, n_c);
+
+    if (conn_b == -1)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < num_relays; ++i) {
+        add_tcp_relay_peer(nc_b, conn_b, relay_ip_ports[i], relay_public_keys[i]);
+    }
+
+    connection_lossy_data_handler(nc_b, conn_b, lossy_callback, NULL, 0);
+    return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+    Bench_Writer *writer = arg;
+    uint8_t packet[BENCH_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_LOSSY_RANGE_START;
+
+    while (running) {
+        uint32_t i;
+
+        for (i = 0; i < BENCH_BURST; ++i) {
+            uint64_t start = time_ns();
+            int ret = send_lossy_cryptpacket(nc_a, conn_a, packet, sizeof(packet));
+            uint64_t elapsed = time_ns() - start;
+
+            writer->total_ns += elapsed;
+
+            if (elapsed > writer->max_ns)
+                writer->max_ns = elapsed;
+
+            if (ret == 0) {
+                ++writer->sent;
+            } else {
+                ++writer->failed;
+            }
+        }
+
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4) {
+        printf("Usage: %s <writer threads> <relays> <seconds>\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t num_writers = atoi(argv[1]);
+    num_relays = atoi(argv[2]);
+    uint32_t seconds = atoi(argv[3]);
+
+    if (num_writers == 0 || num_relays == 0 || num_relays > BENCH_MAX_RELAYS) {
+        printf("Need at least one writer and between 1 and %u relays.\n", BENCH_MAX_RELAYS);
+        return 1;
+    }
+
+    unix_time_update();
+    TCP_Server *relays[BENCH_MAX_RELAYS];
+    uint32_t i;
+
+    for (i = 0; i < num_relays; ++i) {
+        uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(relay_public_keys[i], secret_key);
+        uint16_t port = BENCH_RELAY_PORT + i;
+        relays[i] = new_TCP_server(0, 1, &port, relay_public_keys[i], secret_key, NULL);
+
+        if (relays[i] == NULL) {
+            printf("Failed to create TCP relay on port %u.\n", port);
+            return 1;
+        }
+
+        relay_ip_ports[i].ip.family = AF_INET;
+        relay_ip_ports[i].ip.ip4.uint32 = htonl(0x7F000001);
+        relay_ip_ports[i].port = htons(port);
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    DHT *dht_a = new_DHT(new_networking(ip, BENCH_PORT));
+    DHT *dht_b = new_DHT(new_networking(ip, BENCH_PORT + 1));
+
+    if (dht_a == NULL || dht_b == NULL) {
+        printf("Failed to create the DHTs.\n");
+        return 1;
+    }
+
+    nc_a = new_net_crypto(dht_a, &proxy_info);
+    nc_b = new_net_crypto(dht_b, &proxy_info);
+
+    if (nc_a == NULL || nc_b == NULL) {
+        printf("Failed to create Net_Crypto.\n");
+        return 1;
+    }
+
+    new_connection_handler(nc_b, new_connection_callback, NULL);
+
+    for (i = 0; i < num_relays; ++i) {
+        add_tcp_relay(nc_a, relay_ip_ports[i], relay_public_keys[i]);
+        add_tcp_relay(nc_b, relay_ip_ports[i], relay_public_keys[i]);
+    }
+
+    conn_a = new_crypto_connection(nc_a, nc_b->self_public_key);
+    set_connection_dht_public_key(nc_a, conn_a, dht_b->self_public_key);
+
+    for (i = 0; i < num_relays; ++i) {
+        add_tcp_relay_peer(nc_a, conn_a, relay_ip_ports[i], relay_public_keys[i]);
+    }
+
+    /* Wait for the connection and for the peer to be online on every relay. */
+    uint64_t start = current_time_monotonic();
+    uint8_t direct_connected;
+
+    while (current_time_monotonic() - start < 30000) {
+        unix_time_update();
+        do_net_crypto(nc_a);
+        do_net_crypto(nc_b);
+
+        for (i = 0; i < num_relays; ++i) {
+            do_TCP_server(relays[i]);
+        }
+
+        if (crypto_connection_status(nc_a, conn_a, &direct_connected) == CRYPTO_CONN_ESTABLISHED
+                && nc_a->crypto_connections[conn_a].num_tcp_online == num_relays)
+            break;
+
+        usleep(1000);
+    }
+
+    if (crypto_connection_status(nc_a, conn_a, &direct_connected) != CRYPTO_CONN_ESTABLISHED) {
+        printf("Failed to connect.\n");
+        return 1;
+    }
+
+    Bench_Writer *writers = calloc(num_writers, sizeof(Bench_Writer));
+
+    if (writers == NULL) {
+        printf("calloc failed.\n");
+        return 1;
+    }
+
+    for (i = 0; i < num_writers; ++i) {
+        if (pthread_create(&writers[i].thread, NULL, writer_thread, &writers[i]) != 0) {
+            printf("Failed to start writer thread %u.\n", i);
+            return 1;
+        }
+    }
+
+    uint64_t received_start = received, loop_total_ns = 0, loop_max_ns = 0, loops = 0;
+    start = current_time_monotonic();
+
+    while (current_time_monotonic() - start < seconds * 1000ULL) {
+        uint64_t loop_start = time_ns();
+        unix_time_update();
+        do_net_crypto(nc_a);
+        do_net_crypto(nc_b);
+
+        for (i = 0; i < num_relays; ++i) {
+            do_TCP_server(relays[i]);
+        }
+
+        uint64_t elapsed = time_ns() - loop_start;
+        loop_total_ns += elapsed;
+
+        if (elapsed > loop_max_ns)
+            loop_max_ns = elapsed;
+
+        ++loops;
+        usleep(500);
+    }
+
+    running = 0;
+    uint64_t sent = 0, failed = 0, total_ns = 0, max_ns = 0;
+
+    for (i = 0; i < num_writers; ++i) {
+        pthread_join(writers[i].thread, NULL);
+        sent += writers[i].sent;
+        failed += writers[i].failed;
+        total_ns += writers[i].total_ns;
+
+        if (writers[i].max_ns > max_ns)
+            max_ns = writers[i].max_ns;
+    }
+
+    uint64_t elapsed = current_time_monotonic() - start;
+    printf("%u writers, %u relays: %llu packets sent (%llu failed), %llu received in %llu ms\n", num_writers, num_relays,
+           (unsigned long long)sent, (unsigned long long)failed, (unsigned long long)(received - received_start),
+           (unsigned long long)elapsed);
+    printf("send: %.2f us average, %.2f us max\n", sent + failed ? (double)total_ns / (sent + failed) / 1000 : 0.0,
+           (double)max_ns / 1000);
+    printf("main loop: %.2f us average, %.2f us max\n", loops ? (double)loop_total_ns / loops / 1000 : 0.0,
+           (double)loop_max_ns / 1000);
+
+    free(writers);
+    kill_net_crypto(nc_a);
+    kill_net_crypto(nc_b);
+
+    for (i = 0; i < num_relays; ++i) {
+        kill_TCP_server(relays[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,364 @@
+/* TCP relay benchmark
+ *
+ * Runs a TCP relay and pairs of clients that send each other data through it
+ * as fast as they can, then prints how many packets per second were relayed.
+ *
+ * Usage: TCP_relay_bench <relay threads> <client threads> <pairs> <seconds> [slow ms]
+ *
+ * With slow ms set one client of each pair only reads from the relay every
+ * slow ms, so the relay has to queue what is sent to it.
+ *
+ * With 0 relay threads the relay runs in the main loop, more threads need a
+ * toxcore built with TCP_SERVER_USE_EPOLL.
+ *
+ * On Linux the socket calls (recv, send, sendmsg and ioctl) made by the relay
+ * and the clients are counted as well.
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* RTLD_NEXT */
+#endif
+
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/TCP_client.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define c_sleep(x) usleep(1000*x)
+
+#if defined(__linux__)
+#include <dlfcn.h>
+#include <stdarg.h>
+
+static uint64_t num_socket_calls;
+
+/* Wrappers around the libc socket calls, that count them. */
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags)
+{
+    static ssize_t (*real_recv)(int, void *, size_t, int);
+
+    if (real_recv == NULL)
+        real_recv = dlsym(RTLD_NEXT, "recv");
+
+    __sync_fetch_and_add(&num_socket_calls, 1);
+    return real_recv(sockfd, buf, len, flags);
+}
+
+ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+{
+    static ssize_t (*real_send)(int, const void *, size_t, int);
+
+    if (real_send == NULL)
+        real_send = dlsym(RTLD_NEXT, "send");
+
+    __sync_fetch_and_add(&num_socket_calls, 1);
+    return real_send(sockfd, buf, len, flags);
+}
+
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+    static ssize_t (*real_sendmsg)(int, const struct msghdr *, int);
+
+    if (real_sendmsg == NULL)
+        real_sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+
+    __sync_fetch_and_add(&num_socket_calls, 1);
+    return real_sendmsg(sockfd, msg, flags);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    static int (*real_ioctl)(int, unsigned long, ...);
+
+    if (real_ioctl == NULL)
+        real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+
+    va_list args;
+    va_start(args, request);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+
+    __sync_fetch_and_add(&num_socket_calls, 1);
+    return real_ioctl(fd, request, arg);
+}
+#endif
+
+#define BENCH_PORT 33450
+#define BENCH_PACKET_SIZE 512
+/* Packets a client sends per run of its thread. */
+#define BENCH_BURST 32
+
+typedef struct {
+    TCP_Client_Connection *conn;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t peer_public_key[crypto_box_PUBLICKEYBYTES];
+    int connection_id; /* -1 until the relay answered the routing request. */
+    _Bool online;
+    _Bool requested;
+    _Bool slow;
+    uint64_t next_run;
+    uint64_t received;
+} Bench_Client;
+
+typedef struct {
+    Bench_Client *clients;
+    uint32_t num_clients;
+    pthread_t thread;
+} Bench_Thread;
+
+static volatile _Bool running = 1;
+static uint32_t slow_ms;
+
+static int response_callback(void *object, uint8_t connection_id, const uint8_t *public_key)
+{
+    Bench_Client *client = object;
+    client->connection_id = connection_id;
+    return 0;
+}
+
+static int status_callback(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    Bench_Client *client = object;
+    client->online = (status == 2);
+    return 0;
+}
+
+static int data_callback(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data, uint16_t length)
+{
+    Bench_Client *client = object;
+    ++client->received;
+    return 0;
+}
+
+static void *client_thread(void *arg)
+{
+    Bench_Thread *thread = arg;
+    uint8_t packet[BENCH_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+
+    while (running) {
+        uint32_t i, j;
+
+        for (i = 0; i < thread->num_clients; ++i) {
+            Bench_Client *client = &thread->clients[i];
+
+            if (client->slow && client->online) {
+                uint64_t temp_time = current_time_monotonic();
+
+                if (temp_time < client->next_run)
+                    continue;
+
+                client->next_run = temp_time + slow_ms;
+            }
+
+            do_TCP_connection(client->conn);
+
+            if (client->conn->status != TCP_CLIENT_CONFIRMED)
+                continue;
+
+            if (!client->requested) {
+                client->requested = (send_routing_request(client->conn, client->peer_public_key) == 1);
+                continue;
+            }
+
+            if (!client->online)
+                continue;
+
+            for (j = 0; j < BENCH_BURST; ++j) {
+                if (send_data(client->conn, client->connection_id, packet, sizeof(packet)) != 1)
+                    break;
+            }
+        }
+
+        usleep(100);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 5 && argc != 6) {
+        printf("Usage: %s <relay threads> <client threads> <pairs> <seconds> [slow ms]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t num_workers = atoi(argv[1]);
+    uint32_t num_threads = atoi(argv[2]);
+    uint32_t num_pairs = atoi(argv[3]);
+    uint32_t seconds = atoi(argv[4]);
+
+    if (argc == 6)
+        slow_ms = atoi(argv[5]);
+
+    if (num_threads == 0 || num_pairs == 0 || num_pairs * 2 < num_threads) {
+        printf("Need at least one client thread and a pair per two threads.\n");
+        return 1;
+    }
+
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    uint16_t port = BENCH_PORT;
+    TCP_Server *tcp_s = new_TCP_server(0, 1, &port, self_public_key, self_secret_key, NULL);
+
+    if (tcp_s == NULL) {
+        printf("Failed to create TCP relay on port %u.\n", port);
+        return 1;
+    }
+
+    if (num_workers && TCP_server_start_workers(tcp_s, num_workers) == -1) {
+        printf("Failed to start %u relay threads.\n", num_workers);
+        return 1;
+    }
+
+    IP_Port ip_port;
+    ip_port.ip.family = AF_INET;
+    ip_port.ip.ip4.uint32 = htonl(0x7F000001);
+    ip_port.port = htons(port);
+
+    uint32_t num_clients = num_pairs * 2;
+    Bench_Client *clients = calloc(num_clients, sizeof(Bench_Client));
+    Bench_Thread *threads = calloc(num_threads, sizeof(Bench_Thread));
+
+    if (clients == NULL || threads == NULL) {
+        printf("calloc failed.\n");
+        return 1;
+    }
+
+    uint32_t i;
+    uint8_t secret_keys[num_clients][crypto_box_SECRETKEYBYTES];
+
+    for (i = 0; i < num_clients; ++i) {
+        crypto_box_keypair(clients[i].public_key, secret_keys[i]);
+    }
+
+    for (i = 0; i < num_clients; ++i) {
+        Bench_Client *client = &clients[i];
+        memcpy(client->peer_public_key, clients[i ^ 1].public_key, crypto_box_PUBLICKEYBYTES);
+        client->connection_id = -1;
+        client->slow = slow_ms && (i % 2);
+        client->conn = new_TCP_connection(ip_port, self_public_key, client->public_key, secret_keys[i], 0);
+
+        if (client->conn == NULL) {
+            printf("Failed to create client %u.\n", i);
+            return 1;
+        }
+
+        routing_response_handler(client->conn, response_callback, client);
+        routing_status_handler(client->conn, status_callback, client);
+        routing_data_handler(client->conn, data_callback, client);
+    }
+
+    /* Both clients of a pair run on the same thread. */
+    uint32_t pairs_per_thread = num_pairs / num_threads, first = 0;
+
+    for (i = 0; i < num_threads; ++i) {
+        uint32_t pairs = pairs_per_thread + (i < num_pairs % num_threads);
+        threads[i].clients = &clients[first];
+        threads[i].num_clients = pairs * 2;
+        first += pairs * 2;
+
+        if (pthread_create(&threads[i].thread, NULL, client_thread, &threads[i]) != 0) {
+            printf("Failed to start client thread %u.\n", i);
+            return 1;
+        }
+    }
+
+    /* Wait for every pair to be linked before measuring. */
+    uint32_t num_online = 0;
+    uint64_t start = current_time_monotonic();
+
+    while (num_online != num_clients && current_time_monotonic() - start < 30000) {
+        unix_time_update();
+        do_TCP_server(tcp_s);
+        c_sleep(1);
+
+        for (num_online = 0, i = 0; i < num_clients; ++i) {
+            num_online += clients[i].online;
+        }
+    }
+
+    if (num_online != num_clients) {
+        printf("Only %u of %u clients came online.\n", num_online, num_clients);
+        return 1;
+    }
+
+    uint64_t received_start = 0, received_end = 0;
+#if defined(__linux__)
+    uint64_t calls_start = __sync_fetch_and_add(&num_socket_calls, 0);
+#endif
+
+    for (i = 0; i < num_clients; ++i) {
+        received_start += clients[i].received;
+    }
+
+    start = current_time_monotonic();
+
+    while (current_time_monotonic() - start < seconds * 1000ULL) {
+        unix_time_update();
+        do_TCP_server(tcp_s);
+        c_sleep(1);
+    }
+
+    for (i = 0; i < num_clients; ++i) {
+        received_end += clients[i].received;
+    }
+
+#if defined(__linux__)
+    uint64_t calls = __sync_fetch_and_add(&num_socket_calls, 0) - calls_start;
+#endif
+
+    uint64_t elapsed = current_time_monotonic() - start;
+    running = 0;
+
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    printf("%u relay threads, %u client threads, %u pairs, %u ms slow receivers: %llu packets of %u bytes relayed in %llu ms, %.0f packets/s\n",
+           num_workers, num_threads, num_pairs, slow_ms, (unsigned long long)(received_end - received_start),
+           BENCH_PACKET_SIZE, (unsigned long long)elapsed, (double)(received_end - received_start) * 1000 / elapsed);
+#if defined(__linux__)
+    printf("%llu socket calls, %.2f per relayed packet\n", (unsigned long long)calls,
+           received_end - received_start ? (double)calls / (received_end - received_start) : 0.0);
+#endif
+
+    for (i = 0; i < num_clients; ++i) {
+        kill_TCP_connection(clients[i].conn);
+    }
+
+    kill_TCP_server(tcp_s);
+    free(clients);
+    free(threads);
+    return 0;
+}
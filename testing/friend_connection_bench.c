@@ -0,0 +1,131 @@
+/* Friend connection benchmark
+ *
+ * Adds many friends that are never online, finds the DHT key of some of them,
+ * then calls do_friend_connections() in a loop and prints how long the calls
+ * took.
+ *
+ * Usage: friend_connection_bench <friends> <friends with a DHT key> <seconds>
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/friend_connection.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT 33510
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4) {
+        printf("Usage: %s <friends> <friends with a DHT key> <seconds>\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t num_friends = atoi(argv[1]);
+    uint32_t num_found = atoi(argv[2]);
+    uint32_t seconds = atoi(argv[3]);
+
+    if (num_found > num_friends) {
+        printf("Can't find the DHT key of more friends than there are.\n");
+        return 1;
+    }
+
+    unix_time_update();
+    IP ip;
+    ip_init(&ip, 0);
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    DHT *dht = new_DHT(new_networking(ip, BENCH_PORT));
+
+    if (dht == NULL) {
+        printf("Failed to create the DHT.\n");
+        return 1;
+    }
+
+    Net_Crypto *nc = new_net_crypto(dht, &proxy_info);
+    Onion_Client *onion_c = new_onion_client(nc);
+    Friend_Connections *fr_c = new_friend_connections(onion_c);
+
+    if (fr_c == NULL) {
+        printf("Failed to create Friend_Connections.\n");
+        return 1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < num_friends; ++i) {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(public_key, secret_key);
+        int friendcon_id = new_friend_connection(fr_c, public_key);
+
+        if (friendcon_id == -1) {
+            printf("Failed to add friend %u.\n", i);
+            return 1;
+        }
+
+        if (i < num_found) {
+            crypto_box_keypair(public_key, secret_key);
+            set_dht_temp_pk(fr_c, friendcon_id, public_key);
+        }
+    }
+
+    uint64_t total_ns = 0, max_ns = 0, loops = 0;
+    uint64_t start = current_time_monotonic();
+
+    while (current_time_monotonic() - start < seconds * 1000ULL) {
+        unix_time_update();
+        uint64_t loop_start = time_ns();
+        do_friend_connections(fr_c);
+        uint64_t elapsed = time_ns() - loop_start;
+        total_ns += elapsed;
+
+        if (elapsed > max_ns)
+            max_ns = elapsed;
+
+        ++loops;
+        usleep(1000);
+    }
+
+    printf("%u friends, %u with a DHT key: %llu calls, %.2f us average, %.2f us max\n", num_friends, num_found,
+           (unsigned long long)loops, loops ? (double)total_ns / loops / 1000 : 0.0, (double)max_ns / 1000);
+
+    kill_friend_connections(fr_c);
+    kill_onion_client(onion_c);
+    kill_net_crypto(nc);
+    kill_DHT(dht);
+    return 0;
+}
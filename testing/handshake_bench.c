@@ -0,0 +1,258 @@
+/* Handshake benchmark
+ *
+ * Connects two Net_Crypto instances over and over while a share of the UDP
+ * packets they send is dropped, then prints percentiles of how long it took
+ * to establish the connections and how many cookie request and handshake
+ * packets were sent for it.
+ *
+ * Usage: handshake_bench <loss percent> <relays> <connections>
+ *
+ * With relays set the instances also know each other's TCP relays, packets
+ * sent over the relays are never dropped.
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* RTLD_NEXT */
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <dlfcn.h>
+
+static uint32_t loss_percent;
+
+/* Wrapper around the libc sendto, that drops loss_percent of the packets. */
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr,
+               socklen_t addrlen)
+{
+    static ssize_t (*real_sendto)(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
+
+    if (real_sendto == NULL)
+        real_sendto = dlsym(RTLD_NEXT, "sendto");
+
+    if ((uint32_t)(rand() % 100) < loss_percent)
+        return len;
+
+    return real_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+}
+#endif
+
+#define BENCH_RELAY_PORT 33490
+#define BENCH_PORT 33500
+#define BENCH_MAX_RELAYS 8
+/* Time in ms after which a connection attempt counts as failed. */
+#define BENCH_CONNECT_TIMEOUT 20000
+
+static Net_Crypto *nc_b;
+static int conn_b = -1;
+static IP_Port relay_ip_ports[BENCH_MAX_RELAYS];
+static uint8_t relay_public_keys[BENCH_MAX_RELAYS][crypto_box_PUBLICKEYBYTES];
+static uint32_t num_relays;
+
+static int new_connection_callback(void *object, New_Connection *n_c)
+{
+    conn_b = accept_crypto_connection(nc_b, n_c);
+
+    if (conn_b == -1)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < num_relays; ++i) {
+        add_tcp_relay_peer(nc_b, conn_b, relay_ip_ports[i], relay_public_keys[i]);
+    }
+
+    return 0;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    if (x < y)
+        return -1;
+
+    if (x > y)
+        return 1;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4) {
+        printf("Usage: %s <loss percent> <relays> <connections>\n", argv[0]);
+        return 1;
+    }
+
+#if defined(__linux__)
+    loss_percent = atoi(argv[1]);
+#else
+    printf("Packet loss is only emulated on Linux.\n");
+#endif
+    num_relays = atoi(argv[2]);
+    uint32_t num_connections = atoi(argv[3]);
+
+    if (num_connections == 0 || num_relays > BENCH_MAX_RELAYS) {
+        printf("Need at least one connection and at most %u relays.\n", BENCH_MAX_RELAYS);
+        return 1;
+    }
+
+    srand(1);
+    unix_time_update();
+    TCP_Server *relays[BENCH_MAX_RELAYS];
+    uint32_t i, j;
+
+    for (i = 0; i < num_relays; ++i) {
+        uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(relay_public_keys[i], secret_key);
+        uint16_t port = BENCH_RELAY_PORT + i;
+        relays[i] = new_TCP_server(0, 1, &port, relay_public_keys[i], secret_key, NULL);
+
+        if (relays[i] == NULL) {
+            printf("Failed to create TCP relay on port %u.\n", port);
+            return 1;
+        }
+
+        relay_ip_ports[i].ip.family = AF_INET;
+        relay_ip_ports[i].ip.ip4.uint32 = htonl(0x7F000001);
+        relay_ip_ports[i].port = htons(port);
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    DHT *dht_a = new_DHT(new_networking(ip, BENCH_PORT));
+    DHT *dht_b = new_DHT(new_networking(ip, BENCH_PORT + 1));
+
+    if (dht_a == NULL || dht_b == NULL) {
+        printf("Failed to create the DHTs.\n");
+        return 1;
+    }
+
+    IP_Port ip_port_b;
+    memset(&ip_port_b, 0, sizeof(ip_port_b));
+    ip_port_b.ip.family = AF_INET;
+    ip_port_b.ip.ip4.uint32 = htonl(0x7F000001);
+    ip_port_b.port = dht_b->net->port;
+
+    uint32_t *connect_times = calloc(num_connections, sizeof(uint32_t));
+
+    if (connect_times == NULL) {
+        printf("calloc failed.\n");
+        return 1;
+    }
+
+    uint32_t num_connected = 0;
+    uint64_t packets_sent = 0;
+
+    for (i = 0; i < num_connections; ++i) {
+        /* New instances have new keys, so every connection starts from scratch. */
+        Net_Crypto *nc_a = new_net_crypto(dht_a, &proxy_info);
+        nc_b = new_net_crypto(dht_b, &proxy_info);
+        conn_b = -1;
+
+        if (nc_a == NULL || nc_b == NULL) {
+            printf("Failed to create Net_Crypto.\n");
+            return 1;
+        }
+
+        new_connection_handler(nc_b, new_connection_callback, NULL);
+
+        for (j = 0; j < num_relays; ++j) {
+            add_tcp_relay(nc_a, relay_ip_ports[j], relay_public_keys[j]);
+            add_tcp_relay(nc_b, relay_ip_ports[j], relay_public_keys[j]);
+        }
+
+        int conn_a = new_crypto_connection(nc_a, nc_b->self_public_key);
+        set_direct_ip_port(nc_a, conn_a, ip_port_b);
+        set_connection_dht_public_key(nc_a, conn_a, dht_b->self_public_key);
+
+        for (j = 0; j < num_relays; ++j) {
+            add_tcp_relay_peer(nc_a, conn_a, relay_ip_ports[j], relay_public_keys[j]);
+        }
+
+        uint64_t start = current_time_monotonic();
+        uint8_t direct_connected;
+
+        while (current_time_monotonic() - start < BENCH_CONNECT_TIMEOUT) {
+            networking_poll(dht_a->net);
+            networking_poll(dht_b->net);
+            do_net_crypto(nc_a);
+            do_net_crypto(nc_b);
+
+            for (j = 0; j < num_relays; ++j) {
+                do_TCP_server(relays[j]);
+            }
+
+            if (crypto_connection_status(nc_a, conn_a, &direct_connected) == CRYPTO_CONN_ESTABLISHED)
+                break;
+
+            usleep(1000);
+        }
+
+        Crypto_Connection *conn = &nc_a->crypto_connections[conn_a];
+
+        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
+            connect_times[num_connected] = conn->connect_time;
+            ++num_connected;
+        }
+
+        packets_sent += conn->handshake_num_sent;
+
+        if (conn_b != -1)
+            packets_sent += nc_b->crypto_connections[conn_b].handshake_num_sent;
+
+        kill_net_crypto(nc_a);
+        kill_net_crypto(nc_b);
+    }
+
+    qsort(connect_times, num_connected, sizeof(uint32_t), cmp_uint32);
+    printf("%u%% loss, %u relays: %u of %u connections established, %.1f handshake packets sent per connection\n",
+           atoi(argv[1]), num_relays, num_connected, num_connections, (double)packets_sent / num_connections);
+
+    if (num_connected) {
+        printf("time to connect: p50 %u ms, p90 %u ms, p99 %u ms, max %u ms\n", connect_times[num_connected * 50 / 100],
+               connect_times[num_connected * 90 / 100], connect_times[num_connected * 99 / 100],
+               connect_times[num_connected - 1]);
+    }
+
+    free(connect_times);
+
+    for (i = 0; i < num_relays; ++i) {
+        kill_TCP_server(relays[i]);
+    }
+
+    return 0;
+}
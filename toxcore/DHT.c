@@ -57,6 +57,17 @@
 /* Interval in seconds between punching attempts*/
 #define PUNCH_INTERVAL 3
 
+/* Number of guessed ports tried per second during a punching attempt, spread
+ * over the PUNCH_INTERVAL the attempt lasts. */
+#define PUNCH_PORTS_PER_SECOND 32
+
+/* Ports a NAT gives out in sequence are at most this far apart. */
+#define NAT_MAX_PORT_STEP 16
+
+/* Number of ports after the highest reported one tried for NATs that give
+ * out ports in sequence. */
+#define NAT_SEQUENTIAL_GUESSES 64
+
 #define MAX_NORMAL_PUNCHING_TRIES 5
 
 #define NAT_PING_REQUEST    0
@@ -91,13 +102,34 @@ int id_closest(const uint8_t *id, const uint8_t *id1, const uint8_t *id2)
     return 0;
 }
 
-/* Shared key generations are costly, it is therefor smart to store commonly used
- * ones so that they can re used later without being computed again.
+/* Copy the shared key for client_id stored in shared_keys into shared_key.
  *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
+ * return 1 if it was found.
+ * return 0 if it wasn't.
  */
-void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *client_id)
+int get_stored_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *client_id)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
+        int index = client_id[30] * MAX_KEYS_PER_SLOT + i;
+
+        if (shared_keys->keys[index].stored
+                && memcmp(client_id, shared_keys->keys[index].client_id, CLIENT_ID_SIZE) == 0) {
+            memcpy(shared_key, shared_keys->keys[index].shared_key, crypto_box_BEFORENMBYTES);
+            ++shared_keys->keys[index].times_requested;
+            shared_keys->keys[index].time_last_requested = unix_time();
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Store shared_key for client_id in shared_keys, replacing the least used
+ * (or a timed out) entry of its slot.
+ */
+void store_shared_key(Shared_Keys *shared_keys, const uint8_t *shared_key, const uint8_t *client_id)
 {
     uint32_t i, num = ~0, curr = 0;
 
@@ -106,10 +138,9 @@ void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t
 
         if (shared_keys->keys[index].stored) {
             if (memcmp(client_id, shared_keys->keys[index].client_id, CLIENT_ID_SIZE) == 0) {
-                memcpy(shared_key, shared_keys->keys[index].shared_key, crypto_box_BEFORENMBYTES);
-                ++shared_keys->keys[index].times_requested;
-                shared_keys->keys[index].time_last_requested = unix_time();
-                return;
+                num = 0;
+                curr = index;
+                break;
             }
 
             if (num != 0) {
@@ -129,8 +160,6 @@ void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t
         }
     }
 
-    encrypt_precompute(client_id, secret_key, shared_key);
-
     if (num != (uint32_t)~0) {
         shared_keys->keys[curr].stored = 1;
         shared_keys->keys[curr].times_requested = 1;
@@ -140,6 +169,21 @@ void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t
     }
 }
 
+/* Shared key generations are costly, it is therefor smart to store commonly used
+ * ones so that they can re used later without being computed again.
+ *
+ * If shared key is already in shared_keys, copy it to shared_key.
+ * else generate it into shared_key and copy it to shared_keys
+ */
+void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *client_id)
+{
+    if (get_stored_shared_key(shared_keys, shared_key, client_id))
+        return;
+
+    encrypt_precompute(client_id, secret_key, shared_key);
+    store_shared_key(shared_keys, shared_key, client_id);
+}
+
 /* Copy shared_key to encrypt/decrypt DHT packet from client_id into shared_key
  * for packets that we receive.
  */
@@ -156,6 +200,154 @@ void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *clien
     return get_shared_key(&dht->shared_keys_sent, shared_key, dht->self_secret_key, client_id);
 }
 
+/* return index of the stats of client_id in node_stats.
+ * return -1 if there are none.
+ */
+static int get_node_stats(const Node_Stats *node_stats, const uint8_t *client_id)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAX_NODE_STATS_PER_SLOT; ++i) {
+        int index = client_id[30] * MAX_NODE_STATS_PER_SLOT + i;
+
+        if (node_stats->nodes[index].stored && id_equal(client_id, node_stats->nodes[index].client_id))
+            return index;
+    }
+
+    return -1;
+}
+
+/* Note that a request that expects a response was sent to the node with client_id. */
+void DHT_node_request_sent(DHT *dht, const uint8_t *client_id)
+{
+    Node_Stats *node_stats = &dht->node_stats;
+    int index = get_node_stats(node_stats, client_id);
+
+    if (index == -1) {
+        /* Replace an empty, timed out or the least recently updated entry of the slot. */
+        uint32_t i;
+        uint64_t oldest = ~0;
+
+        for (i = 0; i < MAX_NODE_STATS_PER_SLOT; ++i) {
+            int curr = client_id[30] * MAX_NODE_STATS_PER_SLOT + i;
+
+            if (!node_stats->nodes[curr].stored || is_timeout(node_stats->nodes[curr].time_last_updated, NODE_STATS_TIMEOUT)) {
+                index = curr;
+                break;
+            }
+
+            if (node_stats->nodes[curr].time_last_updated < oldest) {
+                oldest = node_stats->nodes[curr].time_last_updated;
+                index = curr;
+            }
+        }
+
+        memset(&node_stats->nodes[index], 0, sizeof(node_stats->nodes[index]));
+        id_copy(node_stats->nodes[index].client_id, client_id);
+        node_stats->nodes[index].stored = 1;
+    }
+
+    if (node_stats->nodes[index].requests >= NODE_STATS_WINDOW) {
+        node_stats->nodes[index].requests /= 2;
+        node_stats->nodes[index].responses /= 2;
+    }
+
+    ++node_stats->nodes[index].requests;
+    node_stats->nodes[index].time_last_updated = unix_time();
+}
+
+/* Note that the node with client_id answered a request sent at sent_time (current_time_monotonic()).
+ * sent_time is 0 if the time isn't known.
+ */
+void DHT_node_response(DHT *dht, const uint8_t *client_id, uint64_t sent_time)
+{
+    int index = get_node_stats(&dht->node_stats, client_id);
+
+    if (index == -1)
+        return;
+
+    if (sent_time) {
+        uint64_t rtt = current_time_monotonic() - sent_time;
+
+        if (rtt == 0)
+            rtt = 1;
+
+        if (rtt > UINT16_MAX)
+            rtt = UINT16_MAX;
+
+        if (dht->node_stats.nodes[index].rtt == 0) {
+            dht->node_stats.nodes[index].rtt = rtt;
+        } else {
+            dht->node_stats.nodes[index].rtt = ((uint64_t)dht->node_stats.nodes[index].rtt * 7 + rtt) / 8;
+        }
+
+        if (dht->node_cache)
+            node_cache_rtt(dht->node_cache, client_id, rtt);
+    }
+
+    if (dht->node_stats.nodes[index].responses < dht->node_stats.nodes[index].requests)
+        ++dht->node_stats.nodes[index].responses;
+
+    dht->node_stats.nodes[index].time_last_updated = unix_time();
+}
+
+/* return the expected cost in ms of sending a request to the node with client_id,
+ * based on its round trip time and the ratio of requests it didn't answer.
+ */
+uint32_t DHT_node_cost(const DHT *dht, const uint8_t *client_id)
+{
+    int index = get_node_stats(&dht->node_stats, client_id);
+
+    if (index == -1)
+        return NODE_STATS_DEFAULT_RTT;
+
+    uint32_t cost = dht->node_stats.nodes[index].rtt;
+
+    if (cost == 0)
+        cost = NODE_STATS_DEFAULT_RTT;
+
+    uint32_t requests = dht->node_stats.nodes[index].requests;
+    uint32_t lost = requests - dht->node_stats.nodes[index].responses;
+
+    /* The last request might still be on its way. */
+    if (lost)
+        --lost;
+
+    if (requests)
+        cost += (lost * 100 / requests) * NODE_STATS_LOSS_COST;
+
+    return cost;
+}
+
+/* return the smoothed round trip time in ms of the node with client_id.
+ * return 0 if it isn't known.
+ */
+uint16_t DHT_node_rtt(const DHT *dht, const uint8_t *client_id)
+{
+    int index = get_node_stats(&dht->node_stats, client_id);
+
+    if (index == -1)
+        return 0;
+
+    return dht->node_stats.nodes[index].rtt;
+}
+
+/* return 1 if the node with client_id didn't answer most of our recent requests.
+ * return 0 if it did or if we don't know.
+ */
+int DHT_node_unreliable(const DHT *dht, const uint8_t *client_id)
+{
+    int index = get_node_stats(&dht->node_stats, client_id);
+
+    if (index == -1)
+        return 0;
+
+    uint32_t requests = dht->node_stats.nodes[index].requests;
+    uint32_t responses = dht->node_stats.nodes[index].responses;
+
+    return requests >= NODE_STATS_WINDOW / 2 && responses * 2 + 1 < requests;
+}
+
 void to_net_family(IP *ip)
 {
     if (ip->family == AF_INET)
@@ -606,6 +798,7 @@ int get_close_nodes(const DHT *dht, const uint8_t *client_id, Node_format *nodes
 }
 
 static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
+static const DHT *cmp_dht;
 static int cmp_dht_entry(const void *a, const void *b)
 {
     Client_data entry1, entry2;
@@ -623,6 +816,17 @@ static int cmp_dht_entry(const void *a, const void *b)
     if (t2)
         return 1;
 
+    t1 = DHT_node_unreliable(cmp_dht, entry1.client_id);
+    t2 = DHT_node_unreliable(cmp_dht, entry2.client_id);
+
+    if (t1 != t2) {
+        if (t1)
+            return -1;
+
+        if (t2)
+            return 1;
+    }
+
     t1 = hardening_correct(&entry1.assoc4.hardening) != HARDENING_ALL_OK
          && hardening_correct(&entry1.assoc6.hardening) != HARDENING_ALL_OK;
     t2 = hardening_correct(&entry2.assoc4.hardening) != HARDENING_ALL_OK
@@ -648,13 +852,16 @@ static int cmp_dht_entry(const void *a, const void *b)
 }
 
 /* Is it ok to store node with client_id in client.
+ * Nodes that stopped answering most of our requests can be replaced by any node.
  *
  * return 0 if node can't be stored.
  * return 1 if it can.
  */
-static unsigned int store_node_ok(const Client_data *client, const uint8_t *client_id, const uint8_t *comp_client_id)
+static unsigned int store_node_ok(const DHT *dht, const Client_data *client, const uint8_t *client_id,
+                                  const uint8_t *comp_client_id)
 {
     if ((is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT))
+            || DHT_node_unreliable(dht, client->client_id)
             || (id_closest(comp_client_id, client->client_id, client_id) == 2)) {
         return 1;
     } else {
@@ -663,6 +870,7 @@ static unsigned int store_node_ok(const Client_data *client, const uint8_t *clie
 }
 
 /* Replace a first bad (or empty) node with this one
+ *  or replace a node that stopped answering most of our requests
  *  or replace a possibly bad node (tests failed or not done yet)
  *  that is further than any other in the list
  *  from the comp_client_id
@@ -675,7 +883,8 @@ static unsigned int store_node_ok(const Client_data *client, const uint8_t *clie
  *  than client_id.
  *
  *  returns True(1) when the item was stored, False(0) otherwise */
-static int replace_all(   Client_data    *list,
+static int replace_all(   const DHT      *dht,
+                          Client_data    *list,
                           uint16_t        length,
                           const uint8_t  *client_id,
                           IP_Port         ip_port,
@@ -685,11 +894,12 @@ static int replace_all(   Client_data    *list,
         return 0;
 
     memcpy(cmp_public_key, comp_client_id, crypto_box_PUBLICKEYBYTES);
+    cmp_dht = dht;
     qsort(list, length, sizeof(Client_data), cmp_dht_entry);
 
     Client_data *client = &list[0];
 
-    if (store_node_ok(client, client_id, comp_client_id)) {
+    if (store_node_ok(dht, client, client_id, comp_client_id)) {
         IPPTsPng *ipptp_write = NULL;
         IPPTsPng *ipptp_clear = NULL;
 
@@ -726,14 +936,14 @@ static int replace_all(   Client_data    *list,
  */
 static unsigned int ping_node_from_getnodes_ok(DHT *dht, const uint8_t *client_id)
 {
-    if (store_node_ok(&dht->close_clientlist[0], client_id, dht->self_public_key)) {
+    if (store_node_ok(dht, &dht->close_clientlist[0], client_id, dht->self_public_key)) {
         return 1;
     }
 
     unsigned int i;
 
     for (i = 0; i < dht->num_friends; ++i) {
-        if (store_node_ok(&dht->friends_list[i].client_list[0], client_id, dht->self_public_key)) {
+        if (store_node_ok(dht, &dht->friends_list[i].client_list[0], client_id, dht->self_public_key)) {
             return 1;
         }
     }
@@ -760,7 +970,7 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *client_id)
      * to replace the first ip by the second.
      */
     if (!client_or_ip_port_in_list(dht->close_clientlist, LCLIENT_LIST, client_id, ip_port)) {
-        if (replace_all(dht->close_clientlist, LCLIENT_LIST, client_id, ip_port, dht->self_public_key))
+        if (replace_all(dht, dht->close_clientlist, LCLIENT_LIST, client_id, ip_port, dht->self_public_key))
             used++;
     } else
         used++;
@@ -770,7 +980,7 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *client_id)
     for (i = 0; i < dht->num_friends; ++i) {
         if (!client_or_ip_port_in_list(dht->friends_list[i].client_list,
                                        MAX_FRIEND_CLIENTS, client_id, ip_port)) {
-            if (replace_all(dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS,
+            if (replace_all(dht, dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS,
                             client_id, ip_port, dht->friends_list[i].client_id)) {
 
                 DHT_Friend *friend = &dht->friends_list[i];
@@ -792,6 +1002,9 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *client_id)
         }
     }
 
+    if (dht->node_cache)
+        node_cache_seen(dht->node_cache, client_id, ip_port);
+
     if (friend_foundip) {
         uint32_t j;
 
@@ -885,6 +1098,9 @@ end:
     return 0;
 }
 
+/* receiver, time sent and sendback_node stored for each getnodes request. */
+#define GET_NODES_DATA_SIZE (sizeof(Node_format) * 2 + sizeof(uint64_t))
+
 /* Send a getnodes request.
    sendback_node is the node that it will send back the response to (set to NULL to disable this) */
 static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const uint8_t *client_id,
@@ -894,20 +1110,22 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
     if (id_equal(public_key, dht->self_public_key))
         return -1;
 
-    uint8_t plain_message[sizeof(Node_format) * 2] = {0};
+    uint8_t plain_message[GET_NODES_DATA_SIZE] = {0};
 
     Node_format receiver;
     memcpy(receiver.public_key, public_key, CLIENT_ID_SIZE);
     receiver.ip_port = ip_port;
     memcpy(plain_message, &receiver, sizeof(receiver));
+    uint64_t temp_time = current_time_monotonic();
+    memcpy(plain_message + sizeof(receiver), &temp_time, sizeof(temp_time));
 
     uint64_t ping_id = 0;
 
     if (sendback_node != NULL) {
-        memcpy(plain_message + sizeof(receiver), sendback_node, sizeof(Node_format));
+        memcpy(plain_message + sizeof(receiver) + sizeof(temp_time), sendback_node, sizeof(Node_format));
         ping_id = ping_array_add(&dht->dht_harden_ping_array, plain_message, sizeof(plain_message));
     } else {
-        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, sizeof(receiver));
+        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, sizeof(receiver) + sizeof(temp_time));
     }
 
     if (ping_id == 0)
@@ -940,6 +1158,7 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
     memcpy(data + 1 + CLIENT_ID_SIZE, nonce, crypto_box_NONCEBYTES);
     memcpy(data + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES, encrypt, len);
 
+    DHT_node_request_sent(dht, public_key);
     return sendpacket(dht->net, ip_port, data, sizeof(data));
 }
 
@@ -1023,23 +1242,26 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
 
     return 0;
 }
-/* return 0 if no
+/* Put the time (current_time_monotonic()) the request was sent at in sent_time.
+ *
+   return 0 if no
    return 1 if yes */
 static uint8_t sent_getnode_to_node(DHT *dht, const uint8_t *client_id, IP_Port node_ip_port, uint64_t ping_id,
-                                    Node_format *sendback_node)
+                                    Node_format *sendback_node, uint64_t *sent_time)
 {
-    uint8_t data[sizeof(Node_format) * 2];
+    uint8_t data[GET_NODES_DATA_SIZE];
 
-    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == sizeof(Node_format)) {
+    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == sizeof(Node_format) + sizeof(uint64_t)) {
         memset(sendback_node, 0, sizeof(Node_format));
     } else if (ping_array_check(data, sizeof(data), &dht->dht_harden_ping_array, ping_id) == sizeof(data)) {
-        memcpy(sendback_node, data + sizeof(Node_format), sizeof(Node_format));
+        memcpy(sendback_node, data + sizeof(Node_format) + sizeof(uint64_t), sizeof(Node_format));
     } else {
         return 0;
     }
 
     Node_format test;
     memcpy(&test, data, sizeof(Node_format));
+    memcpy(sent_time, data + sizeof(Node_format), sizeof(uint64_t));
 
     if (!ipport_equal(&test.ip_port, &node_ip_port) || memcmp(test.public_key, client_id, CLIENT_ID_SIZE) != 0)
         return 0;
@@ -1085,11 +1307,12 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
         return 1;
 
     Node_format sendback_node;
+    uint64_t sent_time;
 
     uint64_t ping_id;
     memcpy(&ping_id, plain + 1 + data_size, sizeof(ping_id));
 
-    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node))
+    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node, &sent_time))
         return 1;
 
     uint16_t length_nodes = 0;
@@ -1106,6 +1329,7 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
 
     /* store the address the *request* was sent to */
     addto_lists(dht, source, packet + 1);
+    DHT_node_response(dht, packet + 1, sent_time);
 
     *num_nodes_out = num_nodes;
 
@@ -1364,7 +1588,13 @@ static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, co
     }
 
     if ((num_nodes != 0) && (is_timeout(*lastgetnode, GET_NODE_INTERVAL) || *bootstrap_times < MAX_BOOTSTRAP_TIMES)) {
+        /* Of two random good nodes, ask the one that answers faster and more reliably. */
         uint32_t rand_node = rand() % num_nodes;
+        uint32_t rand_node2 = rand() % num_nodes;
+
+        if (DHT_node_cost(dht, client_list[rand_node2]->client_id) < DHT_node_cost(dht, client_list[rand_node]->client_id))
+            rand_node = rand_node2;
+
         getnodes(dht, assoc_list[rand_node]->ip_port, client_list[rand_node]->client_id,
                  client_id, NULL);
         *lastgetnode = temp_time;
@@ -1778,13 +2008,102 @@ static uint16_t NAT_getports(uint16_t *portlist, IP_Port *ip_portlist, uint16_t
     return num;
 }
 
-static void punch_holes(DHT *dht, IP ip, uint16_t *port_list, uint16_t numports, uint16_t friend_num)
+/* Guess the port the NAT of a friend gave to the mapping towards us from
+ * port_list, the ports (numports of them) its close nodes see it on.
+ *
+ * If all the ports are the same that port is the only guess. NATs that give
+ * out ports in sequence gave ours shortly after the highest port they gave to
+ * the nodes, by the same step. For other NATs every port of the range
+ * the reported ports are in (widened by half on each side) is tried in a
+ * spread out order, every other guess being a port next to a reported one.
+ *
+ * index is the position of the first guess in the sequence, so that a later
+ * call continues where the last one stopped.
+ *
+ * return number of ports put in ports.
+ */
+static uint16_t NAT_predict_ports(uint16_t *ports, uint16_t num, const uint16_t *port_list, uint16_t numports,
+                                  uint32_t index)
+{
+    if (num == 0 || numports == 0 || numports > MAX_FRIEND_CLIENTS)
+        return 0;
+
+    uint16_t sorted[MAX_FRIEND_CLIENTS];
+    uint32_t i, j, num_sorted = 0;
+
+    for (i = 0; i < numports; ++i) {
+        for (j = num_sorted; j > 0 && sorted[j - 1] > port_list[i]; --j)
+            sorted[j] = sorted[j - 1];
+
+        sorted[j] = port_list[i];
+        ++num_sorted;
+    }
+
+    /* Remove duplicates and find the smallest gap between two ports. */
+    uint32_t step = 65536;
+
+    for (i = 1, j = 1; i < num_sorted; ++i) {
+        if (sorted[i] == sorted[j - 1])
+            continue;
+
+        if ((uint32_t)(sorted[i] - sorted[j - 1]) < step)
+            step = sorted[i] - sorted[j - 1];
+
+        sorted[j] = sorted[i];
+        ++j;
+    }
+
+    num_sorted = j;
+    uint32_t low = sorted[0], high = sorted[num_sorted - 1];
+
+    if (num_sorted == 1) {
+        ports[0] = low;
+        return 1;
+    }
+
+    /* In sequence if the ports are no more than 4 times as spread out as they
+     * would be if the nodes had got consecutive ports. */
+    _Bool sequential = step <= NAT_MAX_PORT_STEP && high - low <= step * (num_sorted - 1) * 4;
+    uint32_t margin = (high - low) / 2;
+    uint32_t range_low = low > 1024 + margin ? low - margin : 1024;
+    uint32_t range_high = high + margin < 65535 ? high + margin : 65535;
+    uint32_t range = range_high - range_low + 1;
+    /* A prime, so that stepping by it modulo range visits the whole range. */
+    uint32_t stride = range % 7919 ? 7919 : 1;
+
+    for (i = 0; i < num; ++i) {
+        uint32_t n = index + i, port;
+
+        if (sequential) {
+            port = high + step * (n % NAT_SEQUENTIAL_GUESSES + 1);
+
+            if (port > 65535)
+                port = 1024 + (port - 65536) % (65536 - 1024);
+        } else if (n % 2 == 0) {
+            n /= 2;
+            port = port_list[(n / 2) % numports] + (n / (2 * numports)) * ((n % 2) ? -1 : 1);
+            port &= 0xFFFF;
+        } else {
+            n /= 2;
+            port = range_low + ((uint64_t)n * stride) % range;
+        }
+
+        ports[i] = port;
+    }
+
+    return num;
+}
+
+/* Send up to num pings to the ports the NAT of the friend most likely opened
+ * towards us, continuing from the last guesses sent.
+ */
+static void punch_holes(DHT *dht, IP ip, uint16_t *port_list, uint16_t numports, uint16_t friend_num, uint16_t num)
 {
     if (numports > MAX_FRIEND_CLIENTS || numports == 0)
         return;
 
+    NAT *nat = &dht->friends_list[friend_num].nat;
     uint32_t i;
-    uint32_t top = dht->friends_list[friend_num].nat.punching_index + MAX_PUNCHING_PORTS;
     uint16_t firstport = port_list[0];
 
     for (i = 0; i < numports; ++i) {
@@ -1792,39 +2111,53 @@ static void punch_holes(DHT *dht, IP ip, uint16_t *port_list, uint16_t numports,
             break;
     }
 
-    if (i == numports) { /* If all ports are the same, only try that one port. */
-        IP_Port pinging;
-        ip_copy(&pinging.ip, &ip);
-        pinging.port = htons(firstport);
-        send_ping_request(dht->ping, pinging, dht->friends_list[friend_num].client_id);
-    } else {
-        for (i = dht->friends_list[friend_num].nat.punching_index; i != top; ++i) {
-            /* TODO: Improve port guessing algorithm. */
-            uint16_t port = port_list[(i / 2) % numports] + (i / (2 * numports)) * ((i % 2) ? -1 : 1);
-            IP_Port pinging;
-            ip_copy(&pinging.ip, &ip);
-            pinging.port = htons(port);
+    IP_Port pinging;
+    ip_copy(&pinging.ip, &ip);
+
+    if (i == numports) { /* If all ports are the same, only try that one port once a round. */
+        if (nat->round_sent == 0) {
+            pinging.port = htons(firstport);
             send_ping_request(dht->ping, pinging, dht->friends_list[friend_num].client_id);
+            ++dht->punch_packets;
         }
 
-        dht->friends_list[friend_num].nat.punching_index = i;
+        return;
     }
 
-    if (dht->friends_list[friend_num].nat.tries > MAX_NORMAL_PUNCHING_TRIES) {
-        top = dht->friends_list[friend_num].nat.punching_index2 + MAX_PUNCHING_PORTS;
-        uint16_t port = 1024;
-        IP_Port pinging;
-        ip_copy(&pinging.ip, &ip);
+    uint16_t ports[PUNCH_PORTS_PER_SECOND * PUNCH_INTERVAL];
 
-        for (i = dht->friends_list[friend_num].nat.punching_index2; i != top; ++i) {
-            pinging.port = htons(port + i);
-            send_ping_request(dht->ping, pinging, dht->friends_list[friend_num].client_id);
-        }
+    if (num > sizeof(ports) / sizeof(uint16_t))
+        num = sizeof(ports) / sizeof(uint16_t);
+
+    num = NAT_predict_ports(ports, num, port_list, numports, nat->punching_index);
+
+    for (i = 0; i < num; ++i) {
+        pinging.port = htons(ports[i]);
+        send_ping_request(dht->ping, pinging, dht->friends_list[friend_num].client_id);
+    }
 
-        dht->friends_list[friend_num].nat.punching_index2 = i - (MAX_PUNCHING_PORTS / 2);
+    nat->punching_index += num;
+    dht->punch_packets += num;
+}
+
+/* Try the ports of the low range in a burst, for NATs that give out ports in
+ * sequence from the start of it.
+ */
+static void punch_low_ports(DHT *dht, IP ip, uint16_t friend_num)
+{
+    NAT *nat = &dht->friends_list[friend_num].nat;
+    uint32_t i, top = nat->punching_index2 + MAX_PUNCHING_PORTS;
+    uint16_t port = 1024;
+    IP_Port pinging;
+    ip_copy(&pinging.ip, &ip);
+
+    for (i = nat->punching_index2; i != top; ++i) {
+        pinging.port = htons(port + i);
+        send_ping_request(dht->ping, pinging, dht->friends_list[friend_num].client_id);
     }
 
-    ++dht->friends_list[friend_num].nat.tries;
+    nat->punching_index2 = i - (MAX_PUNCHING_PORTS / 2);
+    dht->punch_packets += MAX_PUNCHING_PORTS;
 }
 
 static void do_NAT(DHT *dht)
@@ -1833,33 +2166,74 @@ static void do_NAT(DHT *dht)
     uint64_t temp_time = unix_time();
 
     for (i = 0; i < dht->num_friends; ++i) {
+        NAT *nat = &dht->friends_list[i].nat;
         IP_Port ip_list[MAX_FRIEND_CLIENTS];
         int num = friend_iplist(dht, ip_list, i);
 
+        if (num == 0 && nat->punching_since) {
+            IP_Port ip_port;
+
+            if (DHT_getfriendip(dht, dht->friends_list[i].client_id, &ip_port) == 1) {
+                ++dht->punch_successes;
+                LOGGER_DEBUG("punched a hole to friend %u in %llu seconds, %u of %u attempts succeeded", i,
+                             (unsigned long long)(temp_time - nat->punching_since), dht->punch_successes, dht->punch_attempts);
+                nat->punching_since = 0;
+                nat->round_start = 0;
+            }
+        }
+
         /* If already connected or friend is not online don't try to hole punch. */
         if (num < MAX_FRIEND_CLIENTS / 2)
             continue;
 
-        if (dht->friends_list[i].nat.NATping_timestamp + PUNCH_INTERVAL < temp_time) {
-            send_NATping(dht, dht->friends_list[i].client_id, dht->friends_list[i].nat.NATping_id, NAT_PING_REQUEST);
-            dht->friends_list[i].nat.NATping_timestamp = temp_time;
+        if (nat->NATping_timestamp + PUNCH_INTERVAL < temp_time) {
+            send_NATping(dht, dht->friends_list[i].client_id, nat->NATping_id, NAT_PING_REQUEST);
+            nat->NATping_timestamp = temp_time;
         }
 
-        if (dht->friends_list[i].nat.hole_punching == 1 &&
-                dht->friends_list[i].nat.punching_timestamp + PUNCH_INTERVAL < temp_time &&
-                dht->friends_list[i].nat.recvNATping_timestamp + PUNCH_INTERVAL * 2 >= temp_time) {
+        IP ip = NAT_commonip(ip_list, num, MAX_FRIEND_CLIENTS / 2);
+
+        if (!ip_isset(&ip))
+            continue;
+
+        uint16_t port_list[MAX_FRIEND_CLIENTS];
+        uint16_t numports = NAT_getports(port_list, ip_list, num, ip);
+
+        if (nat->hole_punching == 1 &&
+                nat->punching_timestamp + PUNCH_INTERVAL < temp_time &&
+                nat->recvNATping_timestamp + PUNCH_INTERVAL * 2 >= temp_time) {
 
-            IP ip = NAT_commonip(ip_list, num, MAX_FRIEND_CLIENTS / 2);
+            if (nat->punching_since == 0) {
+                nat->punching_since = temp_time;
+                ++dht->punch_attempts;
+            }
+
+            if (nat->tries > MAX_NORMAL_PUNCHING_TRIES)
+                punch_low_ports(dht, ip, i);
+
+            ++nat->tries;
+            nat->round_start = current_time_monotonic();
+            nat->round_sent = 0;
+            nat->punching_timestamp = temp_time;
+            nat->hole_punching = 0;
+        }
 
-            if (!ip_isset(&ip))
+        /* Guesses are spread over the round rather than sent at once, so that
+         * the NATs on the way don't drop them for coming too fast. */
+        if (nat->round_start) {
+            uint64_t elapsed = current_time_monotonic() - nat->round_start;
+
+            if (elapsed >= PUNCH_INTERVAL * 1000) {
+                nat->round_start = 0;
                 continue;
+            }
 
-            uint16_t port_list[MAX_FRIEND_CLIENTS];
-            uint16_t numports = NAT_getports(port_list, ip_list, num, ip);
-            punch_holes(dht, ip, port_list, numports, i);
+            uint32_t due = elapsed * PUNCH_PORTS_PER_SECOND / 1000 + 1;
 
-            dht->friends_list[i].nat.punching_timestamp = temp_time;
-            dht->friends_list[i].nat.hole_punching = 0;
+            if (due > nat->round_sent) {
+                punch_holes(dht, ip, port_list, numports, i, due - nat->round_sent);
+                nat->round_sent = due;
+            }
         }
     }
 }
@@ -2032,6 +2406,10 @@ static int handle_hardening(void *object, IP_Port source, const uint8_t *source_
 
             /* If Nodes look good and the request checks out */
             temp->hardening.send_nodes_ok = 1;
+
+            if (dht->node_cache)
+                node_cache_hardened(dht->node_cache, packet + 1);
+
             return 0;/* success*/
         }
     }
@@ -2160,6 +2538,30 @@ void cryptopacket_registerhandler(DHT *dht, uint8_t byte, cryptopacket_handler_c
     dht->cryptopackethandlers[byte].object = object;
 }
 
+static int handle_cryptopacket_for_us(DHT *dht, IP_Port source, const uint8_t *shared_key, const uint8_t *packet,
+                                      uint16_t length)
+{
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t data[MAX_CRYPTO_REQUEST_SIZE];
+    uint8_t number;
+    int len = handle_request_precomputed(dht->self_public_key, shared_key, public_key, data, &number, packet, length);
+
+    if (len == -1 || len == 0)
+        return 1;
+
+    if (!dht->cryptopackethandlers[number].function) return 1;
+
+    return dht->cryptopackethandlers[number].function(dht->cryptopackethandlers[number].object, source, public_key,
+            data, len);
+}
+
+static void cryptopacket_precomputed(void *object, Precompute_Job *job)
+{
+    DHT *dht = object;
+    store_shared_key(&dht->shared_keys_recv, job->shared_key, job->public_key);
+    handle_cryptopacket_for_us(dht, job->source, job->shared_key, job->data, job->length);
+}
+
 static int cryptopacket_handle(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
 {
     DHT *dht = object;
@@ -2170,6 +2572,20 @@ static int cryptopacket_handle(void *object, IP_Port source, const uint8_t *pack
             return 1;
 
         if (memcmp(packet + 1, dht->self_public_key, crypto_box_PUBLICKEYBYTES) == 0) { // Check if request is for us.
+            if (dht->precompute_pool) {
+                const uint8_t *sender_public_key = packet + 1 + crypto_box_PUBLICKEYBYTES;
+                uint8_t shared_key[crypto_box_BEFORENMBYTES];
+
+                if (get_stored_shared_key(&dht->shared_keys_recv, shared_key, sender_public_key))
+                    return handle_cryptopacket_for_us(dht, source, shared_key, packet, length);
+
+                if (precompute_pool_add(dht->precompute_pool, sender_public_key, dht->self_secret_key, NULL,
+                                        &cryptopacket_precomputed, dht, source, 0, 0, packet, length) == -1)
+                    return 1;
+
+                return 0;
+            }
+
             uint8_t public_key[crypto_box_PUBLICKEYBYTES];
             uint8_t data[MAX_CRYPTO_REQUEST_SIZE];
             uint8_t number;
@@ -2226,8 +2642,8 @@ DHT *new_DHT(Networking_Core *net)
     new_symmetric_key(dht->secret_symmetric_key);
     crypto_box_keypair(dht->self_public_key, dht->self_secret_key);
 
-    ping_array_init(&dht->dht_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
-    ping_array_init(&dht->dht_harden_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
+    ping_array_init(&dht->dht_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT, GET_NODES_DATA_SIZE);
+    ping_array_init(&dht->dht_harden_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT, GET_NODES_DATA_SIZE);
 #ifdef ENABLE_ASSOC_DHT
     dht->assoc = new_Assoc_default(dht->self_public_key);
 #endif
@@ -2242,6 +2658,33 @@ DHT *new_DHT(Networking_Core *net)
     return dht;
 }
 
+/* Bootstrap from the best nodes of the node cache, NODE_CACHE_BOOTSTRAP_NUM each second,
+ * until we are connected.
+ */
+static void do_node_cache_bootstrap(DHT *dht)
+{
+    Node_Cache *cache = dht->node_cache;
+
+    if (cache == NULL || dht->node_cache_bootstrapped >= cache->num_entries)
+        return;
+
+    if (DHT_isconnected(dht)) {
+        dht->node_cache_bootstrapped = cache->num_entries;
+        return;
+    }
+
+    if (dht->node_cache_bootstrapped == 0)
+        node_cache_sort(cache);
+
+    uint32_t i;
+
+    for (i = 0; i < NODE_CACHE_BOOTSTRAP_NUM && dht->node_cache_bootstrapped < cache->num_entries; ++i) {
+        Node_Cache_Entry *entry = &cache->entries[dht->node_cache_bootstrapped];
+        DHT_bootstrap(dht, entry->ip_port, entry->public_key);
+        ++dht->node_cache_bootstrapped;
+    }
+}
+
 void do_DHT(DHT *dht)
 {
     // Load friends/clients if first call to do_DHT
@@ -2256,6 +2699,7 @@ void do_DHT(DHT *dht)
         return;
     }
 
+    do_node_cache_bootstrap(dht);
     do_Close(dht);
     do_DHT_friends(dht);
     do_NAT(dht);
@@ -2271,6 +2715,9 @@ void do_DHT(DHT *dht)
 }
 void kill_DHT(DHT *dht)
 {
+    if (dht->precompute_pool)
+        precompute_pool_cancel(dht->precompute_pool, dht);
+
 #ifdef ENABLE_ASSOC_DHT
     kill_Assoc(dht->assoc);
 #endif
@@ -27,6 +27,8 @@
 #include "crypto_core.h"
 #include "network.h"
 #include "ping_array.h"
+#include "precompute_pool.h"
+#include "node_cache.h"
 
 /* Size of the client_id in bytes. */
 #define CLIENT_ID_SIZE crypto_box_PUBLICKEYBYTES
@@ -60,6 +62,9 @@
 #define TOX_TCP_INET 130
 #define TOX_TCP_INET6 138
 
+/* Number of node cache nodes to bootstrap from each second while not connected. */
+#define NODE_CACHE_BOOTSTRAP_NUM 8
+
 /* The number of "fake" friends to add (for optimization purposes and so our paths for the onion part are more random) */
 #define DHT_FAKE_FRIEND_NUMBER 4
 
@@ -122,6 +127,13 @@ typedef struct {
     uint64_t    recvNATping_timestamp;
     uint64_t    NATping_id;
     uint64_t    NATping_timestamp;
+
+    /* current_time_monotonic() when the current round of punching started, 0 if none. */
+    uint64_t    round_start;
+    /* Number of ports tried in the current round. */
+    uint32_t    round_sent;
+    /* unix_time() when we started punching holes to the friend, 0 if we aren't. */
+    uint64_t    punching_since;
 } NAT;
 
 #define DHT_FRIEND_MAX_LOCKS 32
@@ -185,6 +197,27 @@ typedef struct {
     } keys[256 * MAX_KEYS_PER_SLOT];
 } Shared_Keys;
 
+/*----------------------------------------------------------------------------------*/
+/* struct to store the round trip time and reliability of the nodes we send requests to. */
+#define MAX_NODE_STATS_PER_SLOT 4
+#define NODE_STATS_TIMEOUT 3600
+/* requests and responses are halved when requests reaches this. */
+#define NODE_STATS_WINDOW 16
+/* Cost of a node we don't have a round trip time for, in ms. */
+#define NODE_STATS_DEFAULT_RTT 500
+/* Extra cost of a node per percent of lost requests, in ms. */
+#define NODE_STATS_LOSS_COST 10
+typedef struct {
+    struct {
+        uint8_t  client_id[CLIENT_ID_SIZE];
+        uint16_t rtt; /* smoothed round trip time in ms, 0 if not measured yet. */
+        uint8_t  requests;
+        uint8_t  responses;
+        uint8_t  stored; /* 0 if not, 1 if is */
+        uint64_t time_last_updated;
+    } nodes[256 * MAX_NODE_STATS_PER_SLOT];
+} Node_Stats;
+
 /*----------------------------------------------------------------------------------*/
 
 typedef int (*cryptopacket_handler_callback)(void *object, IP_Port ip_port, const uint8_t *source_pubkey,
@@ -222,6 +255,13 @@ typedef struct {
     Shared_Keys shared_keys_recv;
     Shared_Keys shared_keys_sent;
 
+    Node_Stats     node_stats;
+
+    /* Hole punching results. */
+    uint32_t       punch_attempts; /* Number of times we started punching holes to a friend. */
+    uint32_t       punch_successes; /* Number of those after which the friend was reached directly. */
+    uint64_t       punch_packets; /* Number of pings sent to guessed ports. */
+
     struct PING   *ping;
     Ping_Array    dht_ping_array;
     Ping_Array    dht_harden_ping_array;
@@ -230,10 +270,31 @@ typedef struct {
 #endif
     uint64_t       last_run;
 
+    /* If set, shared keys that aren't cached yet are computed on this pool
+     * instead of in the packet handlers. The pool must outlive the DHT. */
+    Precompute_Pool *precompute_pool;
+
+    /* If set, the nodes that answer us are recorded in it and on startup the DHT
+     * bootstraps from its best nodes. The cache must outlive the DHT. */
+    Node_Cache    *node_cache;
+    uint32_t       node_cache_bootstrapped; /* number of cache nodes already bootstrapped from. */
+
     Cryptopacket_Handles cryptopackethandlers[256];
 } DHT;
 /*----------------------------------------------------------------------------------*/
 
+/* Copy the shared key for client_id stored in shared_keys into shared_key.
+ *
+ * return 1 if it was found.
+ * return 0 if it wasn't.
+ */
+int get_stored_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *client_id);
+
+/* Store shared_key for client_id in shared_keys, replacing the least used
+ * (or a timed out) entry of its slot.
+ */
+void store_shared_key(Shared_Keys *shared_keys, const uint8_t *shared_key, const uint8_t *client_id);
+
 /* Shared key generations are costly, it is therefor smart to store commonly used
  * ones so that they can re used later without being computed again.
  *
@@ -252,6 +313,29 @@ void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *clien
  */
 void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *client_id);
 
+/* Note that a request that expects a response was sent to the node with client_id. */
+void DHT_node_request_sent(DHT *dht, const uint8_t *client_id);
+
+/* Note that the node with client_id answered a request sent at sent_time (current_time_monotonic()).
+ * sent_time is 0 if the time isn't known.
+ */
+void DHT_node_response(DHT *dht, const uint8_t *client_id, uint64_t sent_time);
+
+/* return the expected cost in ms of sending a request to the node with client_id,
+ * based on its round trip time and the ratio of requests it didn't answer.
+ */
+uint32_t DHT_node_cost(const DHT *dht, const uint8_t *client_id);
+
+/* return the smoothed round trip time in ms of the node with client_id.
+ * return 0 if it isn't known.
+ */
+uint16_t DHT_node_rtt(const DHT *dht, const uint8_t *client_id);
+
+/* return 1 if the node with client_id didn't answer most of our recent requests.
+ * return 0 if it did or if we don't know.
+ */
+int DHT_node_unreliable(const DHT *dht, const uint8_t *client_id);
+
 void DHT_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id);
 
 /* Add a new friend to the friends list.
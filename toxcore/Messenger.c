@@ -313,16 +313,11 @@ static int clear_receipts(Messenger *m, int32_t friendnumber)
     if (friend_not_valid(m, friendnumber))
         return -1;
 
-    struct Receipts *receipts = m->friendlist[friendnumber].receipts_start;
-
-    while (receipts) {
-        struct Receipts *temp_r = receipts->next;
-        free(receipts);
-        receipts = temp_r;
-    }
-
-    m->friendlist[friendnumber].receipts_start = NULL;
-    m->friendlist[friendnumber].receipts_end = NULL;
+    free(m->friendlist[friendnumber].receipts);
+    m->friendlist[friendnumber].receipts = NULL;
+    m->friendlist[friendnumber].receipts_size = 0;
+    m->friendlist[friendnumber].receipts_start = 0;
+    m->friendlist[friendnumber].receipts_end = 0;
     return 0;
 }
 
@@ -331,24 +326,36 @@ static int add_receipt(Messenger *m, int32_t friendnumber, uint32_t packet_num,
     if (friend_not_valid(m, friendnumber))
         return -1;
 
-    struct Receipts *new = calloc(1, sizeof(struct Receipts));
+    Friend *f = &m->friendlist[friendnumber];
+    uint32_t num = f->receipts_end - f->receipts_start;
 
-    if (!new)
-        return -1;
+    if (num == f->receipts_size) {
+        uint32_t size = f->receipts_size ? f->receipts_size * 2 : RECEIPTS_INITIAL_SIZE;
+        struct Receipts *receipts = malloc(size * sizeof(struct Receipts));
 
-    new->packet_num = packet_num;
-    new->msg_id = msg_id;
+        if (!receipts)
+            return -1;
 
-    if (!m->friendlist[friendnumber].receipts_start) {
-        m->friendlist[friendnumber].receipts_start = new;
-    } else {
-        m->friendlist[friendnumber].receipts_end->next = new;
+        uint32_t i;
+
+        for (i = 0; i < num; ++i) {
+            receipts[i] = f->receipts[(f->receipts_start + i) % f->receipts_size];
+        }
+
+        free(f->receipts);
+        f->receipts = receipts;
+        f->receipts_size = size;
+        f->receipts_start = 0;
+        f->receipts_end = num;
     }
 
-    m->friendlist[friendnumber].receipts_end = new;
-    new->next = NULL;
+    struct Receipts *receipt = &f->receipts[f->receipts_end % f->receipts_size];
+    receipt->packet_num = packet_num;
+    receipt->msg_id = msg_id;
+    ++f->receipts_end;
     return 0;
 }
+
 /*
  * return -1 on failure.
  * return 0 if packet was received.
@@ -367,24 +374,49 @@ static int do_receipts(Messenger *m, int32_t friendnumber)
     if (friend_not_valid(m, friendnumber))
         return -1;
 
-    struct Receipts *receipts = m->friendlist[friendnumber].receipts_start;
+    Friend *f = &m->friendlist[friendnumber];
+    uint32_t num = f->receipts_end - f->receipts_start;
 
-    while (receipts) {
-        struct Receipts *temp_r = receipts->next;
+    if (num == 0)
+        return 0;
 
-        if (friend_received_packet(m, friendnumber, receipts->packet_num) == -1)
-            break;
+    int crypt_connection_id = friend_connection_crypt_connection_id(m->fr_c, f->friendcon_id);
 
-        if (m->read_receipt)
-            (*m->read_receipt)(m, friendnumber, receipts->msg_id, m->read_receipt_userdata);
+    /* Messages are sent in order and the other side receives them in order
+     * so the received ones are at the start of the ring, find where they end. */
+    uint32_t low = 0, high = num;
 
-        free(receipts);
-        m->friendlist[friendnumber].receipts_start = temp_r;
-        receipts = temp_r;
+    if (cryptpacket_received(m->net_crypto, crypt_connection_id,
+                             f->receipts[(f->receipts_end - 1) % f->receipts_size].packet_num) == -1) {
+        high = num - 1;
+
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+
+            if (cryptpacket_received(m->net_crypto, crypt_connection_id,
+                                     f->receipts[(f->receipts_start + mid) % f->receipts_size].packet_num) == 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
     }
 
-    if (!m->friendlist[friendnumber].receipts_start)
-        m->friendlist[friendnumber].receipts_end = NULL;
+    uint32_t i;
+
+    for (i = 0; i < high; ++i) {
+        struct Receipts receipt = m->friendlist[friendnumber].receipts[m->friendlist[friendnumber].receipts_start %
+                                  m->friendlist[friendnumber].receipts_size];
+        ++m->friendlist[friendnumber].receipts_start;
+
+        if (m->read_receipt)
+            (*m->read_receipt)(m, friendnumber, receipt.msg_id, m->read_receipt_userdata);
+
+        /* The callback can remove the friend or put it offline. */
+        if (friend_not_valid(m, friendnumber) || m->friendlist[friendnumber].receipts_start ==
+                m->friendlist[friendnumber].receipts_end)
+            break;
+    }
 
     return 0;
 }
@@ -78,10 +78,13 @@ typedef struct {
 } Messenger_Options;
 
 
+/* Number of receipts the ring of a friend starts with, doubled every time it
+ * gets full. Must be a power of 2. */
+#define RECEIPTS_INITIAL_SIZE 64
+
 struct Receipts {
     uint32_t packet_num;
     uint32_t msg_id;
-    struct Receipts *next;
 };
 
 /* Status definitions. */
@@ -210,8 +213,13 @@ typedef struct {
         void *object;
     } lossy_rtp_packethandlers[PACKET_LOSSY_AV_RESERVED];
 
-    struct Receipts *receipts_start;
-    struct Receipts *receipts_end;
+    /* Ring of the receipts of sent messages in the order they were sent.
+     * receipts {receipts_start, receipts_end} are waiting for the friend to
+     * receive the message. */
+    struct Receipts *receipts;
+    uint32_t receipts_size;
+    uint32_t receipts_start;
+    uint32_t receipts_end;
 } Friend;
 
 
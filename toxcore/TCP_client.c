@@ -213,6 +213,21 @@ static int proxy_socks5_read_connection_response(TCP_Client_Connection *TCP_conn
     return -1;
 }
 
+/* Add the time since ping_sent_time to the smoothed round trip time of con.
+ */
+static void add_rtt_sample(TCP_Client_Connection *con)
+{
+    uint64_t rtt = current_time_monotonic() - con->ping_sent_time;
+
+    if (rtt == 0)
+        rtt = 1;
+
+    if (rtt > UINT16_MAX)
+        rtt = UINT16_MAX;
+
+    con->rtt = con->rtt ? ((uint32_t)con->rtt * 7 + rtt) / 8 : rtt;
+}
+
 /* return 0 on success.
  * return -1 on failure.
  */
@@ -285,65 +300,12 @@ static int send_pending_data_nonpriority(TCP_Client_Connection *con)
  */
 static int send_pending_data(TCP_Client_Connection *con)
 {
-    /* finish sending current non-priority packet */
+    /* finish sending the handshake */
     if (send_pending_data_nonpriority(con) == -1) {
         return -1;
     }
 
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, p->data + p->sent, left, MSG_NOSIGNAL);
-
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
-
-            break;
-        }
-
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-
-    con->priority_queue_start = p;
-
-    if (!p) {
-        con->priority_queue_end = NULL;
-        return 0;
-    }
-
-    return -1;
-}
-
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static _Bool add_priority(TCP_Client_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
-{
-    TCP_Priority_List *p = con->priority_queue_end, *new;
-    new = malloc(sizeof(TCP_Priority_List) + size);
-
-    if (!new) {
-        return 0;
-    }
-
-    new->next = NULL;
-    new->size = size;
-    new->sent = sent;
-    memcpy(new->data, packet, size);
-
-    if (p) {
-        p->next = new;
-    } else {
-        con->priority_queue_start = new;
-    }
-
-    con->priority_queue_end = new;
-    return 1;
+    return TCP_send_queue_flush(&con->send_queue, con->sock);
 }
 
 /* return 1 on success.
@@ -356,18 +318,16 @@ static int write_packet_TCP_secure_connection(TCP_Client_Connection *con, const
     if (length + crypto_box_MACBYTES > MAX_PACKET_SIZE)
         return -1;
 
-    _Bool sendpriority = 1;
-
-    if (send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
-    }
+    /* Packets are only written once the server answered the handshake, so
+     * this only fails if that was sent and answered through a proxy. */
+    if (send_pending_data_nonpriority(con) == -1)
+        return 0;
 
     uint8_t packet[sizeof(uint16_t) + length + crypto_box_MACBYTES];
 
+    if (!TCP_send_queue_room(&con->send_queue, sizeof(packet), priority))
+        return 0;
+
     uint16_t c_length = htons(length + crypto_box_MACBYTES);
     memcpy(packet, &c_length, sizeof(uint16_t));
     int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
@@ -375,36 +335,14 @@ static int write_packet_TCP_secure_connection(TCP_Client_Connection *con, const
     if ((unsigned int)len != (sizeof(packet) - sizeof(uint16_t)))
         return -1;
 
-    if (priority) {
-        len = sendpriority ? send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL) : 0;
-
-        if (len <= 0) {
-            len = 0;
-        }
+    int ret = TCP_send_queue_write(&con->send_queue, con->sock, packet, sizeof(packet), priority);
 
+    if (ret == 1) {
         increment_nonce(con->sent_nonce);
-
-        if ((unsigned int)len == sizeof(packet)) {
-            return 1;
-        }
-
-        return add_priority(con, packet, sizeof(packet), len);
+        con->bytes_written += sizeof(packet);
     }
 
-    len = send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL);
-
-    if (len <= 0)
-        return 0;
-
-    increment_nonce(con->sent_nonce);
-
-    if ((unsigned int)len == sizeof(packet))
-        return 1;
-
-    memcpy(con->last_packet, packet, sizeof(packet));
-    con->last_packet_length = sizeof(packet);
-    con->last_packet_sent = len;
-    return 1;
+    return ret;
 }
 
 /* return 1 on success.
@@ -773,6 +711,7 @@ static int handle_TCP_packet(TCP_Client_Connection *conn, const uint8_t *data, u
 
             if (ping_id) {
                 if (ping_id == conn->ping_id) {
+                    add_rtt_sample(conn);
                     conn->ping_id = 0;
                 }
 
@@ -828,6 +767,7 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn)
             ++ping_id;
 
         conn->ping_request_id = conn->ping_id = ping_id;
+        conn->ping_sent_time = current_time_monotonic();
         send_ping_request(conn);
         conn->last_pinged = unix_time();
     }
@@ -837,7 +777,7 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn)
         return 0;
     }
 
-    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key,
+    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key,
                   conn->recv_nonce, packet, sizeof(packet)))) {
         if (len == -1) {
             conn->status = TCP_CLIENT_DISCONNECTED;
@@ -913,6 +853,8 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection)
 
     if (TCP_connection->status == TCP_CLIENT_CONNECTING) {
         if (send_pending_data(TCP_connection) == 0) {
+            /* The answer to the handshake gives the first round trip time. */
+            TCP_connection->ping_sent_time = current_time_monotonic();
             TCP_connection->status = TCP_CLIENT_UNCONFIRMED;
         }
     }
@@ -923,6 +865,7 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection)
 
         if (sizeof(data) == len) {
             if (handle_handshake(TCP_connection, data) == 0) {
+                add_rtt_sample(TCP_connection);
                 TCP_connection->kill_at = ~0;
                 TCP_connection->status = TCP_CLIENT_CONFIRMED;
             } else {
@@ -941,6 +884,13 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection)
     }
 }
 
+/* return the number of bytes that were sent to the relay.
+ */
+uint64_t TCP_client_bytes_sent(const TCP_Client_Connection *con)
+{
+    return con->bytes_written - con->send_queue.length;
+}
+
 /* Kill the TCP connection
  */
 void kill_TCP_connection(TCP_Client_Connection *TCP_connection)
@@ -949,6 +899,8 @@ void kill_TCP_connection(TCP_Client_Connection *TCP_connection)
         return;
 
     kill_sock(TCP_connection->sock);
+    TCP_send_queue_free(&TCP_connection->send_queue);
+    TCP_recv_buffer_free(&TCP_connection->recv_buffer);
     memset(TCP_connection, 0, sizeof(TCP_Client_Connection));
     free(TCP_connection);
 }
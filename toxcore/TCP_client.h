@@ -60,20 +60,25 @@ typedef struct  {
     uint8_t recv_nonce[crypto_box_NONCEBYTES]; /* Nonce of received packets. */
     uint8_t sent_nonce[crypto_box_NONCEBYTES]; /* Nonce of sent packets. */
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    uint16_t next_packet_length;
+    TCP_Recv_Buffer recv_buffer;
 
     uint8_t temp_secret_key[crypto_box_SECRETKEYBYTES];
 
+    /* Proxy requests and the handshake, sent before any packet. */
     uint8_t last_packet[2 + MAX_PACKET_SIZE];
     uint16_t last_packet_length;
     uint16_t last_packet_sent;
 
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    TCP_Send_Queue send_queue;
 
     uint64_t kill_at;
 
     uint64_t last_pinged;
     uint64_t ping_id;
+    uint64_t ping_sent_time; /* current_time_monotonic() when ping_id (or the handshake) was sent. */
+    uint16_t rtt; /* Smoothed round trip time to the relay in ms, 0 until measured. */
+
+    uint64_t bytes_written; /* Bytes of all the packets sent or queued. */
 
     uint64_t ping_response_id;
     uint64_t ping_request_id;
@@ -111,6 +116,10 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection);
  */
 void kill_TCP_connection(TCP_Client_Connection *TCP_connection);
 
+/* return the number of bytes that were sent to the relay.
+ */
+uint64_t TCP_client_bytes_sent(const TCP_Client_Connection *con);
+
 /* return 1 on success.
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
@@ -30,6 +30,12 @@
 #include <sys/ioctl.h>
 #endif
 
+#ifdef TCP_SERVER_USE_EPOLL
+#include <sys/eventfd.h>
+#endif
+
+#include <stddef.h>
+
 #include "util.h"
 
 /* return 1 on success
@@ -94,17 +100,242 @@ static int realloc_connection(TCP_Server *TCP_server, uint32_t num)
     return 0;
 }
 
-/* return index corresponding to connection with peer on success
+/* Both the accepted connections of a server and the connections of an accepted
+ * connection are found by public key in open addressing (linear probing) hash
+ * tables of index + 1, where 0 is an empty entry. Tables are at most half full.
+ */
+typedef const uint8_t *(*key_table_key_cb)(const void *object, uint32_t index);
+
+static uint32_t key_hash(uint64_t salt, const uint8_t *public_key)
+{
+    uint64_t hash = salt;
+    uint32_t i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, public_key + i, sizeof(uint64_t));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+/* return position of the entry for public_key in table, or of the empty entry
+ * it would go in.
+ */
+static uint32_t key_table_pos(const uint32_t *table, uint32_t size, uint64_t salt, const uint8_t *public_key,
+                              key_table_key_cb key, const void *object)
+{
+    uint32_t pos = key_hash(salt, public_key) & (size - 1);
+
+    while (table[pos] && memcmp(key(object, table[pos] - 1), public_key, crypto_box_PUBLICKEYBYTES) != 0) {
+        pos = (pos + 1) & (size - 1);
+    }
+
+    return pos;
+}
+
+/* Empty the entry at pos in table, moving back the entries after it that
+ * couldn't be found anymore.
+ */
+static void key_table_remove(uint32_t *table, uint32_t size, uint64_t salt, uint32_t pos, key_table_key_cb key,
+                             const void *object)
+{
+    uint32_t next = pos;
+
+    while (1) {
+        next = (next + 1) & (size - 1);
+
+        if (table[next] == 0)
+            break;
+
+        uint32_t home = key_hash(salt, key(object, table[next] - 1)) & (size - 1);
+
+        /* Move the entry unless its home is after pos. */
+        if (((next - home) & (size - 1)) >= ((next - pos) & (size - 1))) {
+            table[pos] = table[next];
+            pos = next;
+        }
+    }
+
+    table[pos] = 0;
+}
+
+static const uint8_t *accepted_key(const void *object, uint32_t index)
+{
+    const TCP_Server *TCP_server = object;
+    return TCP_server->accepted_connection_array[index].public_key;
+}
+
+static const uint8_t *connection_key(const void *object, uint32_t index)
+{
+    const TCP_Secure_Connection *con = object;
+    return con->connections[index].public_key;
+}
+
+/* return index of the accepted connection with public_key on success.
+ * return -1 on failure.
+ */
+int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    if (TCP_server->key_table_size == 0)
+        return -1;
+
+    uint32_t pos = key_table_pos(TCP_server->key_table, TCP_server->key_table_size, TCP_server->key_salt, public_key,
+                                 accepted_key, TCP_server);
+    return (int)TCP_server->key_table[pos] - 1;
+}
+
+/* Make room in the key table for one more accepted connection.
+ *
+ * return 0 on success.
  * return -1 on failure.
  */
-static int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t *public_key)
+static int key_table_reserve(TCP_Server *TCP_server)
+{
+    if ((TCP_server->num_accepted_connections + 1) * 2 <= TCP_server->key_table_size)
+        return 0;
+
+    uint32_t size = TCP_server->key_table_size ? TCP_server->key_table_size * 2 : 16;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+
+    if (table == NULL)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        if (TCP_server->accepted_connection_array[i].status == TCP_STATUS_NO_STATUS)
+            continue;
+
+        table[key_table_pos(table, size, TCP_server->key_salt, TCP_server->accepted_connection_array[i].public_key,
+                            accepted_key, TCP_server)] = i + 1;
+    }
+
+    free(TCP_server->key_table);
+    TCP_server->key_table = table;
+    TCP_server->key_table_size = size;
+    return 0;
+}
+
+/* return slot of the connection of con to public_key.
+ * return -1 if there is none.
+ */
+static int get_connection_slot(const TCP_Server *TCP_server, const TCP_Secure_Connection *con,
+                               const uint8_t *public_key)
 {
-    return bs_list_find(&TCP_server->accepted_key_list, public_key);
+    if (con->connection_table == NULL)
+        return -1;
+
+    uint32_t pos = key_table_pos(con->connection_table, TCP_CONNECTION_TABLE_SIZE, TCP_server->key_salt, public_key,
+                                 connection_key, con);
+    return (int)con->connection_table[pos] - 1;
+}
+
+/* return lowest free slot of con.
+ * return -1 if all are in use.
+ */
+static int free_connection_slot(const TCP_Secure_Connection *con)
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_CLIENT_CONNECTIONS; i += 32) {
+        uint32_t used = con->used_connections[i / 32];
+
+        if (used == 0xFFFFFFFF)
+            continue;
+
+        uint32_t slot = i;
+
+        while (used & 1) {
+            used >>= 1;
+            ++slot;
+        }
+
+        return slot < NUM_CLIENT_CONNECTIONS ? (int)slot : -1;
+    }
+
+    return -1;
+}
+
+/* Use free slot of con for a connection to public_key, its connection table
+ * must be allocated.
+ */
+static void add_connection_slot(const TCP_Server *TCP_server, TCP_Secure_Connection *con, uint32_t slot,
+                                const uint8_t *public_key)
+{
+    con->connections[slot].status = 1;
+    memcpy(con->connections[slot].public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    con->connection_table[key_table_pos(con->connection_table, TCP_CONNECTION_TABLE_SIZE, TCP_server->key_salt,
+                                        public_key, connection_key, con)] = slot + 1;
+    con->used_connections[slot / 32] |= 1u << (slot % 32);
+}
+
+/* Free slot (in use) of con.
+ */
+static void remove_connection_slot(const TCP_Server *TCP_server, TCP_Secure_Connection *con, uint32_t slot)
+{
+    uint32_t pos = key_table_pos(con->connection_table, TCP_CONNECTION_TABLE_SIZE, TCP_server->key_salt,
+                                 con->connections[slot].public_key, connection_key, con);
+    key_table_remove(con->connection_table, TCP_CONNECTION_TABLE_SIZE, TCP_server->key_salt, pos, connection_key, con);
+    con->used_connections[slot / 32] &= ~(1u << (slot % 32));
+    con->connections[slot].status = 0;
 }
 
 
 static int kill_accepted(TCP_Server *TCP_server, int index);
 
+/* Remove accepted connection index from the ping timer wheel.
+ */
+static void ping_wheel_remove(TCP_Server *TCP_server, uint32_t index)
+{
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
+
+    if (con->ping_wheel_time == 0)
+        return;
+
+    if (con->ping_wheel_prev) {
+        TCP_server->accepted_connection_array[con->ping_wheel_prev - 1].ping_wheel_next = con->ping_wheel_next;
+    } else {
+        TCP_server->ping_wheel[con->ping_wheel_time % TCP_PING_WHEEL_SIZE] = con->ping_wheel_next;
+    }
+
+    if (con->ping_wheel_next)
+        TCP_server->accepted_connection_array[con->ping_wheel_next - 1].ping_wheel_prev = con->ping_wheel_prev;
+
+    con->ping_wheel_time = 0;
+    con->ping_wheel_next = 0;
+    con->ping_wheel_prev = 0;
+}
+
+/* Make do_TCP_ping() run for accepted connection index at time.
+ */
+static void ping_wheel_add(TCP_Server *TCP_server, uint32_t index, uint64_t time)
+{
+    ping_wheel_remove(TCP_server, index);
+
+    /* Slots up to ping_wheel_run were already run and the wheel only covers
+     * TCP_PING_WHEEL_SIZE seconds. */
+    if (time <= TCP_server->ping_wheel_run) {
+        time = TCP_server->ping_wheel_run + 1;
+    } else if (time >= TCP_server->ping_wheel_run + TCP_PING_WHEEL_SIZE) {
+        time = TCP_server->ping_wheel_run + TCP_PING_WHEEL_SIZE - 1;
+    }
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
+    uint32_t *head = &TCP_server->ping_wheel[time % TCP_PING_WHEEL_SIZE];
+
+    con->ping_wheel_time = time;
+    con->ping_wheel_prev = 0;
+    con->ping_wheel_next = *head;
+
+    if (*head)
+        TCP_server->accepted_connection_array[*head - 1].ping_wheel_prev = index + 1;
+
+    *head = index + 1;
+}
+
 /* Add accepted TCP connection to the list.
  *
  * return index on success
@@ -140,15 +371,19 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
         return -1;
     }
 
-    if (!bs_list_add(&TCP_server->accepted_key_list, con->public_key, index))
+    if (key_table_reserve(TCP_server) == -1)
         return -1;
 
     memcpy(&TCP_server->accepted_connection_array[index], con, sizeof(TCP_Secure_Connection));
+    TCP_server->key_table[key_table_pos(TCP_server->key_table, TCP_server->key_table_size, TCP_server->key_salt,
+                                        con->public_key, accepted_key, TCP_server)] = index + 1;
     TCP_server->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
     ++TCP_server->num_accepted_connections;
     TCP_server->accepted_connection_array[index].identifier = ++TCP_server->counter;
     TCP_server->accepted_connection_array[index].last_pinged = unix_time();
     TCP_server->accepted_connection_array[index].ping_id = 0;
+    TCP_server->accepted_connection_array[index].ping_wheel_time = 0;
+    ping_wheel_add(TCP_server, index, unix_time() + TCP_PING_FREQUENCY);
 
     return index;
 }
@@ -166,14 +401,27 @@ static int del_accepted(TCP_Server *TCP_server, int index)
     if (TCP_server->accepted_connection_array[index].status == TCP_STATUS_NO_STATUS)
         return -1;
 
-    if (!bs_list_remove(&TCP_server->accepted_key_list, TCP_server->accepted_connection_array[index].public_key, index))
+    uint32_t pos = key_table_pos(TCP_server->key_table, TCP_server->key_table_size, TCP_server->key_salt,
+                                 TCP_server->accepted_connection_array[index].public_key, accepted_key, TCP_server);
+
+    if (TCP_server->key_table[pos] != (uint32_t)index + 1)
         return -1;
 
+    key_table_remove(TCP_server->key_table, TCP_server->key_table_size, TCP_server->key_salt, pos, accepted_key,
+                     TCP_server);
+    ping_wheel_remove(TCP_server, index);
+    TCP_send_queue_free(&TCP_server->accepted_connection_array[index].send_queue);
+    TCP_recv_buffer_free(&TCP_server->accepted_connection_array[index].recv_buffer);
+    free(TCP_server->accepted_connection_array[index].connection_table);
     memset(&TCP_server->accepted_connection_array[index], 0, sizeof(TCP_Secure_Connection));
     --TCP_server->num_accepted_connections;
 
-    if (TCP_server->num_accepted_connections == 0)
+    if (TCP_server->num_accepted_connections == 0) {
         realloc_connection(TCP_server, 0);
+        free(TCP_server->key_table);
+        TCP_server->key_table = NULL;
+        TCP_server->key_table_size = 0;
+    }
 
     return 0;
 }
@@ -249,138 +497,218 @@ int read_TCP_packet(sock_t sock, uint8_t *data, uint16_t length)
     return -1;
 }
 
-/* return length of received packet on success.
- * return 0 if could not read any packet.
- * return -1 on failure (connection must be killed).
+void TCP_recv_buffer_free(TCP_Recv_Buffer *buffer)
+{
+    free(buffer->data);
+    memset(buffer, 0, sizeof(TCP_Recv_Buffer));
+}
+
+/* return length of the next packet in buffer if all of it was received.
+ * return 0 if it wasn't.
+ * return -1 if the length is invalid.
  */
-int read_packet_TCP_secure_connection(sock_t sock, uint16_t *next_packet_length, const uint8_t *shared_key,
-                                      uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
+static int recv_buffer_packet_length(const TCP_Recv_Buffer *buffer)
 {
-    if (*next_packet_length == 0) {
-        uint16_t len = read_TCP_length(sock);
+    if (buffer->length < sizeof(uint16_t))
+        return 0;
 
-        if (len == (uint16_t)~0)
-            return -1;
+    uint16_t length;
+    memcpy(&length, buffer->data + buffer->start, sizeof(uint16_t));
+    length = ntohs(length);
 
-        if (len == 0)
-            return 0;
+    if (length == 0 || length > MAX_PACKET_SIZE)
+        return -1;
 
-        *next_packet_length = len;
-    }
+    if (buffer->length < sizeof(uint16_t) + length)
+        return 0;
 
-    if (max_len + crypto_box_MACBYTES < *next_packet_length)
-        return -1;
+    return length;
+}
 
-    uint8_t data_encrypted[*next_packet_length];
-    int len_packet = read_TCP_packet(sock, data_encrypted, *next_packet_length);
+/* Move the buffered bytes to the start of buffer and read as many bytes as
+ * fit after them from sock, with a single system call.
+ *
+ * return 0 on success (even if nothing was read).
+ * return -1 on failure (connection closed or buffer couldn't be allocated).
+ */
+static int recv_buffer_fill(TCP_Recv_Buffer *buffer, sock_t sock)
+{
+    if (buffer->data == NULL) {
+        buffer->data = malloc(TCP_RECV_BUFFER_SIZE);
 
-    if (len_packet != *next_packet_length)
-        return 0;
+        if (buffer->data == NULL)
+            return -1;
+    }
 
-    *next_packet_length = 0;
+    if (buffer->start) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->length);
+        buffer->start = 0;
+    }
 
-    int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, len_packet, data);
+    int len = recv(sock, (char *)buffer->data + buffer->length, TCP_RECV_BUFFER_SIZE - buffer->length, MSG_NOSIGNAL);
 
-    if (len + crypto_box_MACBYTES != len_packet)
+    if (len == 0)
         return -1;
 
-    increment_nonce(recv_nonce);
+    if (len > 0)
+        buffer->length += len;
 
-    return len;
+    return 0;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Decrypt the next packet in buffer into data. Only reads from sock, as much
+ * as fits in the buffer, when no whole packet is buffered.
+ *
+ * return length of received packet on success.
+ * return 0 if could not read any packet.
+ * return -1 on failure (connection must be killed).
  */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
+int read_packet_TCP_secure_connection(sock_t sock, TCP_Recv_Buffer *buffer, const uint8_t *shared_key,
+                                      uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
 {
-    if (con->last_packet_length == 0) {
-        return 0;
+    int length = recv_buffer_packet_length(buffer);
+
+    if (length == 0) {
+        if (recv_buffer_fill(buffer, sock) == -1)
+            return -1;
+
+        length = recv_buffer_packet_length(buffer);
     }
 
-    uint16_t left = con->last_packet_length - con->last_packet_sent;
-    int len = send(con->sock, con->last_packet + con->last_packet_sent, left, MSG_NOSIGNAL);
+    if (length <= 0)
+        return length;
 
-    if (len <= 0)
+    if (max_len + crypto_box_MACBYTES < length)
         return -1;
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
-    }
+    const uint8_t *data_encrypted = buffer->data + buffer->start + sizeof(uint16_t);
+    int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, length, data);
 
-    con->last_packet_sent += len;
-    return -1;
+    if (len + crypto_box_MACBYTES != length)
+        return -1;
+
+    buffer->length -= sizeof(uint16_t) + length;
+    buffer->start = buffer->length ? buffer->start + sizeof(uint16_t) + length : 0;
+    increment_nonce(recv_nonce);
 
+    return len;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Send as much of queue to sock as it takes, with a single system call.
+ *
+ * return 0 if the queue is empty.
+ * return -1 if it isn't.
  */
-static int send_pending_data(TCP_Secure_Connection *con)
+int TCP_send_queue_flush(TCP_Send_Queue *queue, sock_t sock)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
+    if (queue->length == 0)
+        return 0;
 
-    TCP_Priority_List *p = con->priority_queue_start;
+    uint32_t first = MIN(queue->length, TCP_SEND_QUEUE_SIZE - queue->start);
+    int len;
 
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, p->data + p->sent, left, MSG_NOSIGNAL);
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+    /* The queued data wraps around the end of the ring at most once. */
+    struct iovec iov[2];
+    iov[0].iov_base = queue->data + queue->start;
+    iov[0].iov_len = first;
+    iov[1].iov_base = queue->data;
+    iov[1].iov_len = queue->length - first;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (first == queue->length) ? 1 : 2;
+    len = sendmsg(sock, &msg, MSG_NOSIGNAL);
+#else
+    len = send(sock, (const char *)queue->data + queue->start, first, MSG_NOSIGNAL);
+#endif
 
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
+    if (len <= 0)
+        return -1;
 
-            break;
-        }
+    queue->length -= len;
 
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
+    if (queue->length == 0) {
+        queue->start = 0;
+        return 0;
     }
 
-    con->priority_queue_start = p;
+    queue->start = (queue->start + len) % TCP_SEND_QUEUE_SIZE;
+    return -1;
+}
 
-    if (!p) {
-        con->priority_queue_end = NULL;
-        return 0;
+/* Copy the length bytes of data to the end of queue, which must have room.
+ *
+ * return 0 on success.
+ * return -1 on failure (the ring couldn't be allocated).
+ */
+static int send_queue_add(TCP_Send_Queue *queue, const uint8_t *data, uint32_t length)
+{
+    if (queue->data == NULL) {
+        queue->data = malloc(TCP_SEND_QUEUE_SIZE);
+
+        if (queue->data == NULL)
+            return -1;
     }
 
-    return -1;
+    uint32_t end = (queue->start + queue->length) % TCP_SEND_QUEUE_SIZE;
+    uint32_t first = MIN(length, TCP_SEND_QUEUE_SIZE - end);
+    memcpy(queue->data + end, data, first);
+    memcpy(queue->data, data + first, length - first);
+    queue->length += length;
+    return 0;
 }
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
+/* return 1 if TCP_send_queue_write() would take a packet of length.
+ * return 0 if it would refuse it.
  */
-static _Bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+_Bool TCP_send_queue_room(const TCP_Send_Queue *queue, uint16_t length, _Bool priority)
 {
-    TCP_Priority_List *p = con->priority_queue_end, *new;
-    new = malloc(sizeof(TCP_Priority_List) + size);
+    uint32_t limit = priority ? TCP_SEND_QUEUE_SIZE : TCP_SEND_QUEUE_HIGH_WATER;
+    return queue->length + length <= limit;
+}
 
-    if (!new) {
+/* Send the encrypted packet of length to sock, or queue it behind the packets
+ * already queued. Non priority packets are only queued below
+ * TCP_SEND_QUEUE_HIGH_WATER.
+ *
+ * A non empty queue means the socket was full, it is only sent again by
+ * TCP_send_queue_flush().
+ *
+ * return 1 on success.
+ * return 0 if the packet was neither sent nor queued.
+ * return -1 on failure (connection must be killed).
+ */
+int TCP_send_queue_write(TCP_Send_Queue *queue, sock_t sock, const uint8_t *packet, uint16_t length, _Bool priority)
+{
+    if (!TCP_send_queue_room(queue, length, priority))
         return 0;
-    }
 
-    new->next = NULL;
-    new->size = size;
-    new->sent = sent;
-    memcpy(new->data, packet, size);
+    int len = 0;
 
-    if (p) {
-        p->next = new;
-    } else {
-        con->priority_queue_start = new;
+    if (queue->length == 0) {
+        len = send(sock, (const char *)packet, length, MSG_NOSIGNAL);
+
+        if (len == length)
+            return 1;
+
+        if (len < 0)
+            len = 0;
     }
 
-    con->priority_queue_end = new;
+    if (send_queue_add(queue, packet + len, length - len) == -1)
+        return len ? -1 : 0;
+
     return 1;
 }
 
+void TCP_send_queue_free(TCP_Send_Queue *queue)
+{
+    free(queue->data);
+    memset(queue, 0, sizeof(TCP_Send_Queue));
+}
+
 /* return 1 on success.
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
@@ -391,18 +719,12 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
     if (length + crypto_box_MACBYTES > MAX_PACKET_SIZE)
         return -1;
 
-    _Bool sendpriority = 1;
-
-    if (send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
-    }
-
     uint8_t packet[sizeof(uint16_t) + length + crypto_box_MACBYTES];
 
+    /* Don't encrypt packets that would be dropped anyway. */
+    if (!TCP_send_queue_room(&con->send_queue, sizeof(packet), priority))
+        return 0;
+
     uint16_t c_length = htons(length + crypto_box_MACBYTES);
     memcpy(packet, &c_length, sizeof(uint16_t));
     int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
@@ -410,36 +732,12 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
     if ((unsigned int)len != (sizeof(packet) - sizeof(uint16_t)))
         return -1;
 
-    if (priority) {
-        len = sendpriority ? send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL) : 0;
-
-        if (len <= 0) {
-            len = 0;
-        }
+    int ret = TCP_send_queue_write(&con->send_queue, con->sock, packet, sizeof(packet), priority);
 
+    if (ret == 1)
         increment_nonce(con->sent_nonce);
 
-        if ((unsigned int)len == sizeof(packet)) {
-            return 1;
-        }
-
-        return add_priority(con, packet, sizeof(packet), len);
-    }
-
-    len = send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL);
-
-    if (len <= 0)
-        return 0;
-
-    increment_nonce(con->sent_nonce);
-
-    if ((unsigned int)len == sizeof(packet))
-        return 1;
-
-    memcpy(con->last_packet, packet, sizeof(packet));
-    con->last_packet_length = sizeof(packet);
-    con->last_packet_sent = len;
-    return 1;
+    return ret;
 }
 
 /* Kill a TCP_Secure_Connection
@@ -447,6 +745,9 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
 static void kill_TCP_connection(TCP_Secure_Connection *con)
 {
     kill_sock(con->sock);
+    TCP_send_queue_free(&con->send_queue);
+    TCP_recv_buffer_free(&con->recv_buffer);
+    free(con->connection_table);
     memset(con, 0, sizeof(TCP_Secure_Connection));
 }
 
@@ -477,20 +778,24 @@ static int kill_accepted(TCP_Server *TCP_server, int index)
     return 0;
 }
 
-/* return 1 if everything went well.
- * return -1 if the connection must be killed.
+/* The part of the handshake that is computed before anything is sent back. */
+typedef struct {
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint8_t sent_nonce[crypto_box_NONCEBYTES];
+    uint8_t recv_nonce[crypto_box_NONCEBYTES];
+    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+} TCP_Handshake_Result;
+
+/* Decrypt the handshake in data with shared_key (the key between the public key in
+ * the handshake and ours) and create our response to it.
+ *
+ * This touches no connection state so it is safe to call from a worker thread.
+ *
+ * return 0 on success.
+ * return -1 on failure.
  */
-static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-                                const uint8_t *self_secret_key)
+static int create_TCP_handshake_response(TCP_Handshake_Result *result, const uint8_t *data, const uint8_t *shared_key)
 {
-    if (length != TCP_CLIENT_HANDSHAKE_SIZE)
-        return -1;
-
-    if (con->status != TCP_STATUS_CONNECTED)
-        return -1;
-
-    uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    encrypt_precompute(data, self_secret_key, shared_key);
     uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
     int len = decrypt_data_symmetric(shared_key, data + crypto_box_PUBLICKEYBYTES,
                                      data + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES, TCP_HANDSHAKE_PLAIN_SIZE + crypto_box_MACBYTES, plain);
@@ -498,44 +803,110 @@ static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data,
     if (len != TCP_HANDSHAKE_PLAIN_SIZE)
         return -1;
 
-    memcpy(con->public_key, data, crypto_box_PUBLICKEYBYTES);
     uint8_t temp_secret_key[crypto_box_SECRETKEYBYTES];
     uint8_t resp_plain[TCP_HANDSHAKE_PLAIN_SIZE];
     crypto_box_keypair(resp_plain, temp_secret_key);
-    random_nonce(con->sent_nonce);
-    memcpy(resp_plain + crypto_box_PUBLICKEYBYTES, con->sent_nonce, crypto_box_NONCEBYTES);
-    memcpy(con->recv_nonce, plain + crypto_box_PUBLICKEYBYTES, crypto_box_NONCEBYTES);
+    random_nonce(result->sent_nonce);
+    memcpy(resp_plain + crypto_box_PUBLICKEYBYTES, result->sent_nonce, crypto_box_NONCEBYTES);
+    memcpy(result->recv_nonce, plain + crypto_box_PUBLICKEYBYTES, crypto_box_NONCEBYTES);
 
-    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
-    new_nonce(response);
+    random_nonce(result->response);
 
-    len = encrypt_data_symmetric(shared_key, response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
-                                 response + crypto_box_NONCEBYTES);
+    len = encrypt_data_symmetric(shared_key, result->response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
+                                 result->response + crypto_box_NONCEBYTES);
 
     if (len != TCP_HANDSHAKE_PLAIN_SIZE + crypto_box_MACBYTES)
         return -1;
 
-    if (TCP_SERVER_HANDSHAKE_SIZE != send(con->sock, response, TCP_SERVER_HANDSHAKE_SIZE, MSG_NOSIGNAL))
+    encrypt_precompute(plain, temp_secret_key, result->shared_key);
+    return 0;
+}
+
+/* Send the handshake response and set up con with the result.
+ *
+ * return 1 if everything went well.
+ * return -1 if the connection must be killed.
+ */
+static int finish_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *public_key,
+                                const TCP_Handshake_Result *result)
+{
+    if (TCP_SERVER_HANDSHAKE_SIZE != send(con->sock, result->response, TCP_SERVER_HANDSHAKE_SIZE, MSG_NOSIGNAL))
         return -1;
 
-    encrypt_precompute(plain, temp_secret_key, con->shared_key);
+    memcpy(con->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(con->sent_nonce, result->sent_nonce, crypto_box_NONCEBYTES);
+    memcpy(con->recv_nonce, result->recv_nonce, crypto_box_NONCEBYTES);
+    memcpy(con->shared_key, result->shared_key, crypto_box_BEFORENMBYTES);
     con->status = TCP_STATUS_UNCONFIRMED;
     return 1;
 }
 
+/* return 1 if everything went well.
+ * return -1 if the connection must be killed.
+ */
+static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
+                                const uint8_t *self_secret_key)
+{
+    if (length != TCP_CLIENT_HANDSHAKE_SIZE)
+        return -1;
+
+    if (con->status != TCP_STATUS_CONNECTED)
+        return -1;
+
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    encrypt_precompute(data, self_secret_key, shared_key);
+    TCP_Handshake_Result result;
+
+    if (create_TCP_handshake_response(&result, data, shared_key) == -1)
+        return -1;
+
+    return finish_TCP_handshake(con, data, &result);
+}
+
+static void TCP_handshake_precomputed(void *object, Precompute_Job *job);
+
+/* Runs on a precompute pool worker. */
+static void TCP_handshake_work(Precompute_Job *job)
+{
+    TCP_Handshake_Result result;
+
+    if (create_TCP_handshake_response(&result, job->data, job->shared_key) == -1) {
+        job->result = -1;
+        return;
+    }
+
+    memcpy(job->data, &result, sizeof(result));
+    job->length = sizeof(result);
+}
+
 /* return 1 if connection handshake was handled correctly.
- * return 0 if we didn't get it yet.
+ * return 0 if we didn't get it yet (or it is being computed).
  * return -1 if the connection must be killed.
  */
-static int read_connection_handshake(TCP_Secure_Connection *con, const uint8_t *self_secret_key)
+static int read_connection_handshake(TCP_Server *TCP_server, uint32_t i)
 {
+    TCP_Secure_Connection *con = &TCP_server->incomming_connection_queue[i];
     uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
     int len = 0;
 
-    if ((len = read_TCP_packet(con->sock, data, TCP_CLIENT_HANDSHAKE_SIZE)) != -1) {
-        return handle_TCP_handshake(con, data, len, self_secret_key);
-    }
+    if ((len = read_TCP_packet(con->sock, data, TCP_CLIENT_HANDSHAKE_SIZE)) == -1)
+        return 0;
+
+    if (!TCP_server->precompute_pool)
+        return handle_TCP_handshake(con, data, len, TCP_server->secret_key);
+
+    if (len != TCP_CLIENT_HANDSHAKE_SIZE)
+        return -1;
+
+    IP_Port source;
+    memset(&source, 0, sizeof(source));
+
+    /* If the pool is full the connection is dropped, the client will retry. */
+    if (precompute_pool_add(TCP_server->precompute_pool, data, TCP_server->secret_key, &TCP_handshake_work,
+                            &TCP_handshake_precomputed, TCP_server, source, i, con->identifier, data, len) == -1)
+        return -1;
 
+    con->status = TCP_STATUS_PRECOMPUTING;
     return 0;
 }
 
@@ -573,13 +944,84 @@ static int send_disconnect_notification(TCP_Secure_Connection *con, uint8_t id)
     return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
 }
 
+/* return the worker the connection with public_key lives on.
+ * Only call this on a worker or on a server with workers.
+ */
+static TCP_Server *key_worker(const TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    const TCP_Server *main_server = TCP_server->parent ? TCP_server->parent : TCP_server;
+    uint32_t num;
+    memcpy(&num, public_key, sizeof(num));
+    return main_server->workers[num % main_server->num_workers];
+}
+
+/* return 1 if the connection with public_key lives on another worker.
+ * return 0 if it is ours (or there are no workers).
+ */
+static _Bool key_elsewhere(const TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    return TCP_server->parent && key_worker(TCP_server, public_key) != TCP_server;
+}
+
+/* Queue msg for the thread running TCP_server.
+ *
+ * return 0 on success.
+ * return -1 if its queue is full.
+ */
+static int send_TCP_message(TCP_Server *TCP_server, const TCP_Message *msg)
+{
+    TCP_Message_Queue *queue = &TCP_server->queue;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    if (queue->last - queue->first >= TCP_WORKER_QUEUE_SIZE) {
+        ++queue->num_dropped;
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+
+    memcpy(&queue->messages[queue->last % TCP_WORKER_QUEUE_SIZE], msg, offsetof(TCP_Message, data) + msg->length);
+    ++queue->last;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    /* The thread empties the queue before it waits again, so it only needs to be
+     * woken up for the first message. */
+    _Bool wake = (queue->last - queue->first == 1);
+#endif
+    pthread_mutex_unlock(&queue->mutex);
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (wake && queue->event_fd != -1) {
+        uint64_t one = 1;
+
+        if (write(queue->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* Only fails if the counter is full, in which case the thread is awake. */
+        }
+    }
+
+#endif
+    return 0;
+}
+
+/* Fill in the connection con (in connections slot id) of TCP_server as the
+ * sender of msg.
+ */
+static void set_message_source(TCP_Message *msg, const TCP_Server *TCP_server, const TCP_Secure_Connection *con,
+                               uint8_t id)
+{
+    msg->worker = TCP_server->worker_num;
+    msg->index = con - TCP_server->accepted_connection_array;
+    msg->id = id;
+    memcpy(msg->public_key, con->public_key, crypto_box_PUBLICKEYBYTES);
+    msg->identifier = con->identifier;
+}
+
 /* return 0 on success.
  * return -1 on failure (connection must be killed).
  */
 static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const uint8_t *public_key)
 {
-    uint32_t i;
-    uint32_t index = ~0;
     TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[con_id];
 
     /* If person tries to cennect to himself we deny the request*/
@@ -590,21 +1032,21 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
         return 0;
     }
 
-    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-        if (con->connections[i].status != 0) {
-            if (memcmp(public_key, con->connections[i].public_key, crypto_box_PUBLICKEYBYTES) == 0) {
-                if (send_routing_response(con, i + NUM_RESERVED_PORTS, public_key) == -1) {
-                    return -1;
-                } else {
-                    return 0;
-                }
-            }
-        } else if (index == (uint32_t)~0) {
-            index = i;
-        }
+    int slot = get_connection_slot(TCP_server, con, public_key);
+
+    if (slot != -1) {
+        if (send_routing_response(con, slot + NUM_RESERVED_PORTS, public_key) == -1)
+            return -1;
+
+        return 0;
     }
 
-    if (index == (uint32_t)~0) {
+    if (con->connection_table == NULL)
+        con->connection_table = calloc(TCP_CONNECTION_TABLE_SIZE, sizeof(uint32_t));
+
+    int index = free_connection_slot(con);
+
+    if (index == -1 || con->connection_table == NULL) {
         if (send_routing_response(con, 0, public_key) == -1)
             return -1;
 
@@ -619,29 +1061,34 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
     if (ret == -1)
         return -1;
 
-    con->connections[index].status = 1;
-    memcpy(con->connections[index].public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    add_connection_slot(TCP_server, con, index, public_key);
+
+    /* The worker of the other connection links it if it is online. */
+    if (key_elsewhere(TCP_server, public_key)) {
+        TCP_Message msg;
+        msg.type = TCP_MESSAGE_LINK;
+        set_message_source(&msg, TCP_server, con, index);
+        memcpy(msg.dest_public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        msg.length = 0;
+        send_TCP_message(key_worker(TCP_server, public_key), &msg);
+        return 0;
+    }
+
     int other_index = get_TCP_connection_index(TCP_server, public_key);
 
     if (other_index != -1) {
-        uint32_t other_id = ~0;
         TCP_Secure_Connection *other_conn = &TCP_server->accepted_connection_array[other_index];
+        int other_id = get_connection_slot(TCP_server, other_conn, con->public_key);
 
-        for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-            if (other_conn->connections[i].status == 1
-                    && memcmp(other_conn->connections[i].public_key, con->public_key, crypto_box_PUBLICKEYBYTES) == 0) {
-                other_id = i;
-                break;
-            }
-        }
-
-        if (other_id != (uint32_t)~0) {
+        if (other_id != -1 && other_conn->connections[other_id].status == 1) {
             con->connections[index].status = 2;
             con->connections[index].index = other_index;
             con->connections[index].other_id = other_id;
+            con->connections[index].worker = TCP_server->worker_num;
             other_conn->connections[other_id].status = 2;
             other_conn->connections[other_id].index = con_id;
             other_conn->connections[other_id].other_id = index;
+            other_conn->connections[other_id].worker = TCP_server->worker_num;
             //TODO: return values?
             send_connect_notification(con, index);
             send_connect_notification(other_conn, other_id);
@@ -662,6 +1109,17 @@ static int handle_TCP_oob_send(TCP_Server *TCP_server, uint32_t con_id, const ui
 
     TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[con_id];
 
+    if (key_elsewhere(TCP_server, public_key)) {
+        TCP_Message msg;
+        msg.type = TCP_MESSAGE_OOB;
+        set_message_source(&msg, TCP_server, con, 0);
+        memcpy(msg.dest_public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(msg.data, data, length);
+        msg.length = length;
+        send_TCP_message(key_worker(TCP_server, public_key), &msg);
+        return 0;
+    }
+
     int other_index = get_TCP_connection_index(TCP_server, public_key);
 
     if (other_index != -1) {
@@ -690,13 +1148,23 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
         uint32_t index = con->connections[con_number].index;
         uint8_t other_id = con->connections[con_number].other_id;
 
-        if (con->connections[con_number].status == 2) {
+        if (con->connections[con_number].status == 2 && con->connections[con_number].worker != TCP_server->worker_num) {
+            TCP_Message msg;
+            msg.type = TCP_MESSAGE_UNLINK;
+            set_message_source(&msg, TCP_server, con, con_number);
+            msg.dest_index = index;
+            msg.dest_id = other_id;
+            memcpy(msg.dest_public_key, con->connections[con_number].public_key, crypto_box_PUBLICKEYBYTES);
+            msg.length = 0;
+            send_TCP_message(TCP_server->parent->workers[con->connections[con_number].worker], &msg);
+        } else if (con->connections[con_number].status == 2) {
 
             if (index >= TCP_server->size_accepted_connections)
                 return -1;
 
             TCP_server->accepted_connection_array[index].connections[other_id].other_id = 0;
             TCP_server->accepted_connection_array[index].connections[other_id].index = 0;
+            TCP_server->accepted_connection_array[index].connections[other_id].worker = 0;
             TCP_server->accepted_connection_array[index].connections[other_id].status = 1;
             //TODO: return values?
             send_disconnect_notification(&TCP_server->accepted_connection_array[index], other_id);
@@ -704,24 +1172,29 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
 
         con->connections[con_number].index = 0;
         con->connections[con_number].other_id = 0;
-        con->connections[con_number].status = 0;
+        con->connections[con_number].worker = 0;
+        remove_connection_slot(TCP_server, con, con_number);
         return 0;
     } else {
         return -1;
     }
 }
 
-static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+/* Send the onion response in data of length to accepted connection index,
+ * if it still has identifier.
+ *
+ * return 0 on success.
+ * return 1 on failure.
+ */
+static int send_TCP_onion_response(TCP_Server *TCP_server, uint32_t index, uint64_t identifier, const uint8_t *data,
+                                   uint16_t length)
 {
-    TCP_Server *TCP_server = object;
-    uint32_t index = dest.ip.ip6.uint32[0];
-
     if (index >= TCP_server->size_accepted_connections)
         return 1;
 
     TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
 
-    if (con->identifier != dest.ip.ip6.uint64[1])
+    if (con->identifier != identifier)
         return 1;
 
     uint8_t packet[1 + length];
@@ -734,9 +1207,47 @@ static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
-/* return 0 on success
- * return -1 on failure
+static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    TCP_Server *TCP_server = object;
+    uint32_t index = dest.ip.ip6.uint32[0];
+    uint32_t worker = dest.ip.ip6.uint32[1];
+
+    if (TCP_server->num_workers == 0)
+        return send_TCP_onion_response(TCP_server, index, dest.ip.ip6.uint64[1], data, length);
+
+    if (worker >= TCP_server->num_workers || length > MAX_PACKET_SIZE)
+        return 1;
+
+    TCP_Message msg;
+    msg.type = TCP_MESSAGE_ONION_RESPONSE;
+    msg.dest_index = index;
+    msg.identifier = dest.ip.ip6.uint64[1];
+    memcpy(msg.data, data, length);
+    msg.length = length;
+
+    if (send_TCP_message(TCP_server->workers[worker], &msg) == -1)
+        return 1;
+
+    return 0;
+}
+
+/* Pass the onion request packet of length from connection index (with identifier)
+ * of worker to the onion.
  */
+static void send_TCP_onion_request(TCP_Server *TCP_server, uint32_t worker, uint32_t index, uint64_t identifier,
+                                   const uint8_t *data, uint16_t length)
+{
+    IP_Port source;
+    source.port = 0;  // dummy initialise
+    source.ip.family = TCP_ONION_FAMILY;
+    source.ip.ip6.uint32[0] = index;
+    source.ip.ip6.uint32[1] = worker;
+    source.ip.ip6.uint64[1] = identifier;
+    onion_send_1(TCP_server->onion, data + 1 + crypto_box_NONCEBYTES, length - (1 + crypto_box_NONCEBYTES), source,
+                 data + 1);
+}
+
 static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint8_t *data, uint16_t length)
 {
     if (length == 0)
@@ -804,18 +1315,22 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
         }
 
         case TCP_PACKET_ONION_REQUEST: {
-            if (TCP_server->onion) {
+            if (TCP_server->parent ? TCP_server->parent->onion : TCP_server->onion) {
                 if (length <= 1 + crypto_box_NONCEBYTES + ONION_SEND_BASE * 2)
                     return -1;
 
-                IP_Port source;
-                source.port = 0;  // dummy initialise
-                source.ip.family = TCP_ONION_FAMILY;
-                source.ip.ip6.uint32[0] = con_id;
-                source.ip.ip6.uint32[1] = 0;
-                source.ip.ip6.uint64[1] = con->identifier;
-                onion_send_1(TCP_server->onion, data + 1 + crypto_box_NONCEBYTES, length - (1 + crypto_box_NONCEBYTES), source,
-                             data + 1);
+                /* The onion belongs to the main thread. */
+                if (TCP_server->parent) {
+                    TCP_Message msg;
+                    msg.type = TCP_MESSAGE_ONION_REQUEST;
+                    set_message_source(&msg, TCP_server, con, 0);
+                    memcpy(msg.data, data, length);
+                    msg.length = length;
+                    send_TCP_message(TCP_server->parent, &msg);
+                    return 0;
+                }
+
+                send_TCP_onion_request(TCP_server, 0, con_id, con->identifier, data, length);
             }
 
             return 0;
@@ -834,48 +1349,331 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
             if (c_id >= NUM_CLIENT_CONNECTIONS)
                 return -1;
 
-            if (con->connections[c_id].status == 0)
-                return -1;
+            if (con->connections[c_id].status == 0)
+                return -1;
+
+            if (con->connections[c_id].status != 2)
+                return 0;
+
+            uint32_t index = con->connections[c_id].index;
+            uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
+
+            if (con->connections[c_id].worker != TCP_server->worker_num) {
+                TCP_Message msg;
+                msg.type = TCP_MESSAGE_DATA;
+                set_message_source(&msg, TCP_server, con, c_id);
+                msg.dest_index = index;
+                msg.dest_id = con->connections[c_id].other_id;
+                memcpy(msg.dest_public_key, con->connections[c_id].public_key, crypto_box_PUBLICKEYBYTES);
+                memcpy(msg.data, data, length);
+                msg.length = length;
+                send_TCP_message(TCP_server->parent->workers[con->connections[c_id].worker], &msg);
+                return 0;
+            }
+
+            uint8_t new_data[length];
+            memcpy(new_data, data, length);
+            new_data[0] = other_c_id;
+            int ret = write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[index], new_data, length, 0);
+
+            if (ret == -1)
+                return -1;
+
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Hand con, which just sent its first packet (data of length), to the worker
+ * its public key maps to.
+ */
+static void move_to_worker(TCP_Server *TCP_server, TCP_Secure_Connection *con, const uint8_t *data, uint16_t length)
+{
+    TCP_Message msg;
+    msg.type = TCP_MESSAGE_ADOPT;
+    msg.con = malloc(sizeof(TCP_Secure_Connection));
+
+    if (msg.con == NULL) {
+        kill_TCP_connection(con);
+        return;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+    struct epoll_event ev;
+    epoll_ctl(TCP_server->efd, EPOLL_CTL_DEL, con->sock, &ev);
+#endif
+
+    memcpy(msg.con, con, sizeof(TCP_Secure_Connection));
+    memcpy(msg.data, data, length);
+    msg.length = length;
+
+    if (send_TCP_message(key_worker(TCP_server, con->public_key), &msg) == -1) {
+        free(msg.con);
+        kill_TCP_connection(con);
+        return;
+    }
+
+    memset(con, 0, sizeof(TCP_Secure_Connection));
+}
+
+static int confirm_TCP_connection(TCP_Server *TCP_server, TCP_Secure_Connection *con, const uint8_t *data,
+                                  uint16_t length)
+{
+    if (TCP_server->num_workers) {
+        move_to_worker(TCP_server, con, data, length);
+        return -1;
+    }
+
+    int index = add_accepted(TCP_server, con);
+
+    if (index == -1) {
+        kill_TCP_connection(con);
+        return -1;
+    }
+
+    memset(con, 0, sizeof(TCP_Secure_Connection));
+
+    if (handle_TCP_packet(TCP_server, index, data, length) == -1) {
+        kill_accepted(TCP_server, index);
+        return -1;
+    }
+
+    return index;
+}
+
+/* return the accepted connection msg is for.
+ * return NULL if it is gone.
+ */
+static TCP_Secure_Connection *message_dest(TCP_Server *TCP_server, const TCP_Message *msg)
+{
+    if (msg->dest_index >= TCP_server->size_accepted_connections || msg->dest_id >= NUM_CLIENT_CONNECTIONS)
+        return NULL;
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[msg->dest_index];
+
+    if (con->status != TCP_STATUS_CONFIRMED
+            || memcmp(con->public_key, msg->dest_public_key, crypto_box_PUBLICKEYBYTES) != 0)
+        return NULL;
+
+    return con;
+}
+
+static void do_confirmed_recv(TCP_Server *TCP_server, uint32_t i);
+
+static void handle_message_adopt(TCP_Server *TCP_server, TCP_Message *msg)
+{
+    TCP_Secure_Connection *con = msg->con;
+#ifdef TCP_SERVER_USE_EPOLL
+    sock_t sock = con->sock;
+#endif
+    int index = confirm_TCP_connection(TCP_server, con, msg->data, msg->length);
+    free(con);
+
+    if (index == -1)
+        return;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP,
+        .data.u64 = sock | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index << 48)
+    };
+
+    if (epoll_ctl(TCP_server->efd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        kill_accepted(TCP_server, index);
+        return;
+    }
+
+#endif
+    /* Packets read along with the first one won't be signalled again. */
+    do_confirmed_recv(TCP_server, index);
+}
+
+/* A connection on another worker made a routing request for one of ours, link
+ * them if ours made one for it too.
+ */
+static void handle_message_link(TCP_Server *TCP_server, const TCP_Message *msg)
+{
+    int other_index = get_TCP_connection_index(TCP_server, msg->dest_public_key);
+
+    if (other_index == -1)
+        return;
+
+    TCP_Secure_Connection *other_conn = &TCP_server->accepted_connection_array[other_index];
+    int i = get_connection_slot(TCP_server, other_conn, msg->public_key);
+
+    if (i == -1 || other_conn->connections[i].status != 1)
+        return;
+
+    other_conn->connections[i].status = 2;
+    other_conn->connections[i].index = msg->index;
+    other_conn->connections[i].other_id = msg->id;
+    other_conn->connections[i].worker = msg->worker;
+    send_connect_notification(other_conn, i);
+
+    TCP_Message reply;
+    reply.type = TCP_MESSAGE_LINKED;
+    set_message_source(&reply, TCP_server, other_conn, i);
+    reply.dest_index = msg->index;
+    reply.dest_id = msg->id;
+    memcpy(reply.dest_public_key, msg->public_key, crypto_box_PUBLICKEYBYTES);
+    reply.length = 0;
+    send_TCP_message(TCP_server->parent->workers[msg->worker], &reply);
+}
+
+/* The worker of the connection ours made a routing request for linked it to ours.
+ */
+static void handle_message_linked(TCP_Server *TCP_server, const TCP_Message *msg)
+{
+    TCP_Secure_Connection *con = message_dest(TCP_server, msg);
+
+    if (con == NULL || con->connections[msg->dest_id].status == 0
+            || memcmp(con->connections[msg->dest_id].public_key, msg->public_key, crypto_box_PUBLICKEYBYTES) != 0) {
+        /* Our side went away, unlink theirs. */
+        TCP_Message reply;
+        reply.type = TCP_MESSAGE_UNLINK;
+        reply.worker = TCP_server->worker_num;
+        reply.index = msg->dest_index;
+        reply.id = msg->dest_id;
+        memcpy(reply.public_key, msg->dest_public_key, crypto_box_PUBLICKEYBYTES);
+        reply.dest_index = msg->index;
+        reply.dest_id = msg->id;
+        memcpy(reply.dest_public_key, msg->public_key, crypto_box_PUBLICKEYBYTES);
+        reply.length = 0;
+        send_TCP_message(TCP_server->parent->workers[msg->worker], &reply);
+        return;
+    }
+
+    /* Both sides may have linked at the same time. */
+    _Bool was_online = (con->connections[msg->dest_id].status == 2);
+    con->connections[msg->dest_id].status = 2;
+    con->connections[msg->dest_id].index = msg->index;
+    con->connections[msg->dest_id].other_id = msg->id;
+    con->connections[msg->dest_id].worker = msg->worker;
+
+    if (!was_online)
+        send_connect_notification(con, msg->dest_id);
+}
+
+static void handle_message_unlink(TCP_Server *TCP_server, const TCP_Message *msg)
+{
+    TCP_Secure_Connection *con = message_dest(TCP_server, msg);
+
+    if (con == NULL || con->connections[msg->dest_id].status != 2)
+        return;
+
+    if (con->connections[msg->dest_id].worker != msg->worker || con->connections[msg->dest_id].index != msg->index
+            || memcmp(con->connections[msg->dest_id].public_key, msg->public_key, crypto_box_PUBLICKEYBYTES) != 0)
+        return;
+
+    con->connections[msg->dest_id].status = 1;
+    con->connections[msg->dest_id].index = 0;
+    con->connections[msg->dest_id].other_id = 0;
+    con->connections[msg->dest_id].worker = 0;
+    send_disconnect_notification(con, msg->dest_id);
+}
+
+static void handle_message_data(TCP_Server *TCP_server, TCP_Message *msg)
+{
+    TCP_Secure_Connection *con = message_dest(TCP_server, msg);
+
+    if (con == NULL || con->connections[msg->dest_id].status != 2
+            || memcmp(con->connections[msg->dest_id].public_key, msg->public_key, crypto_box_PUBLICKEYBYTES) != 0)
+        return;
+
+    msg->data[0] = msg->dest_id + NUM_RESERVED_PORTS;
+    write_packet_TCP_secure_connection(con, msg->data, msg->length, 0);
+}
+
+static void handle_message_oob(TCP_Server *TCP_server, const TCP_Message *msg)
+{
+    int other_index = get_TCP_connection_index(TCP_server, msg->dest_public_key);
+
+    if (other_index == -1)
+        return;
+
+    uint8_t resp_packet[1 + crypto_box_PUBLICKEYBYTES + msg->length];
+    resp_packet[0] = TCP_PACKET_OOB_RECV;
+    memcpy(resp_packet + 1, msg->public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(resp_packet + 1 + crypto_box_PUBLICKEYBYTES, msg->data, msg->length);
+    write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[other_index], resp_packet,
+                                       sizeof(resp_packet), 0);
+}
+
+static void handle_TCP_message(TCP_Server *TCP_server, TCP_Message *msg)
+{
+    switch (msg->type) {
+        case TCP_MESSAGE_ADOPT: {
+            handle_message_adopt(TCP_server, msg);
+            break;
+        }
+
+        case TCP_MESSAGE_LINK: {
+            handle_message_link(TCP_server, msg);
+            break;
+        }
+
+        case TCP_MESSAGE_LINKED: {
+            handle_message_linked(TCP_server, msg);
+            break;
+        }
+
+        case TCP_MESSAGE_UNLINK: {
+            handle_message_unlink(TCP_server, msg);
+            break;
+        }
 
-            if (con->connections[c_id].status != 2)
-                return 0;
+        case TCP_MESSAGE_DATA: {
+            handle_message_data(TCP_server, msg);
+            break;
+        }
 
-            uint32_t index = con->connections[c_id].index;
-            uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
-            uint8_t new_data[length];
-            memcpy(new_data, data, length);
-            new_data[0] = other_c_id;
-            int ret = write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[index], new_data, length, 0);
+        case TCP_MESSAGE_OOB: {
+            handle_message_oob(TCP_server, msg);
+            break;
+        }
 
-            if (ret == -1)
-                return -1;
+        case TCP_MESSAGE_ONION_REQUEST: {
+            if (TCP_server->onion)
+                send_TCP_onion_request(TCP_server, msg->worker, msg->index, msg->identifier, msg->data, msg->length);
 
-            return 0;
+            break;
         }
-    }
 
-    return 0;
+        case TCP_MESSAGE_ONION_RESPONSE: {
+            send_TCP_onion_response(TCP_server, msg->dest_index, msg->identifier, msg->data, msg->length);
+            break;
+        }
+    }
 }
 
-
-static int confirm_TCP_connection(TCP_Server *TCP_server, TCP_Secure_Connection *con, const uint8_t *data,
-                                  uint16_t length)
+/* Handle the messages queued for TCP_server.
+ */
+static void do_TCP_messages(TCP_Server *TCP_server)
 {
-    int index = add_accepted(TCP_server, con);
+    TCP_Message_Queue *queue = &TCP_server->queue;
 
-    if (index == -1) {
-        kill_TCP_connection(con);
-        return -1;
-    }
+    pthread_mutex_lock(&queue->mutex);
 
-    memset(con, 0, sizeof(TCP_Secure_Connection));
+    while (queue->first != queue->last) {
+        uint32_t start = queue->first;
+        uint32_t num = queue->last - queue->first;
+        pthread_mutex_unlock(&queue->mutex);
 
-    if (handle_TCP_packet(TCP_server, index, data, length) == -1) {
-        kill_accepted(TCP_server, index);
-        return -1;
+        /* Other threads only write messages past last. */
+        uint32_t i;
+
+        for (i = 0; i < num; ++i) {
+            handle_TCP_message(TCP_server, &queue->messages[(start + i) % TCP_WORKER_QUEUE_SIZE]);
+        }
+
+        pthread_mutex_lock(&queue->mutex);
+        queue->first += num;
     }
 
-    return index;
+    pthread_mutex_unlock(&queue->mutex);
 }
 
 /* return index on success
@@ -905,7 +1703,7 @@ static int accept_connection(TCP_Server *TCP_server, sock_t sock)
 
     conn->status = TCP_STATUS_CONNECTED;
     conn->sock = sock;
-    conn->next_packet_length = 0;
+    conn->identifier = ++TCP_server->counter;
 
     ++TCP_server->incomming_connection_queue_index;
     return index;
@@ -951,8 +1749,14 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
         return NULL;
 
     temp->socks_listening = calloc(num_sockets, sizeof(sock_t));
+    temp->incomming_connection_queue = calloc(MAX_INCOMMING_CONNECTIONS, sizeof(TCP_Secure_Connection));
+    temp->unconfirmed_connection_queue = calloc(MAX_INCOMMING_CONNECTIONS, sizeof(TCP_Secure_Connection));
 
-    if (temp->socks_listening == NULL) {
+    if (temp->socks_listening == NULL || temp->incomming_connection_queue == NULL
+            || temp->unconfirmed_connection_queue == NULL) {
+        free(temp->socks_listening);
+        free(temp->incomming_connection_queue);
+        free(temp->unconfirmed_connection_queue);
         free(temp);
         return NULL;
     }
@@ -962,6 +1766,8 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
 
     if (temp->efd == -1) {
         free(temp->socks_listening);
+        free(temp->incomming_connection_queue);
+        free(temp->unconfirmed_connection_queue);
         free(temp);
         return NULL;
     }
@@ -1002,6 +1808,8 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
 
     if (temp->num_listening_socks == 0) {
         free(temp->socks_listening);
+        free(temp->incomming_connection_queue);
+        free(temp->unconfirmed_connection_queue);
         free(temp);
         return NULL;
     }
@@ -1014,7 +1822,10 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     memcpy(temp->public_key, public_key, crypto_box_PUBLICKEYBYTES);
     memcpy(temp->secret_key, secret_key, crypto_box_SECRETKEYBYTES);
 
-    bs_list_init(&temp->accepted_key_list, crypto_box_PUBLICKEYBYTES, 8);
+    temp->key_salt = random_64b();
+
+    unix_time_update();
+    temp->ping_wheel_run = unix_time();
 
     return temp;
 }
@@ -1034,31 +1845,87 @@ static void do_TCP_accept_new(TCP_Server *TCP_server)
     }
 }
 
+/* Move incoming connection i that completed its handshake to the unconfirmed queue.
+ *
+ * return index in the unconfirmed queue.
+ */
+static int move_to_unconfirmed(TCP_Server *TCP_server, uint32_t i)
+{
+    int index_new = TCP_server->unconfirmed_connection_queue_index % MAX_INCOMMING_CONNECTIONS;
+    TCP_Secure_Connection *conn_old = &TCP_server->incomming_connection_queue[i];
+    TCP_Secure_Connection *conn_new = &TCP_server->unconfirmed_connection_queue[index_new];
+
+    if (conn_new->status != TCP_STATUS_NO_STATUS)
+        kill_TCP_connection(conn_new);
+
+    memcpy(conn_new, conn_old, sizeof(TCP_Secure_Connection));
+    memset(conn_old, 0, sizeof(TCP_Secure_Connection));
+    ++TCP_server->unconfirmed_connection_queue_index;
+
+    return index_new;
+}
+
 static int do_incoming(TCP_Server *TCP_server, uint32_t i)
 {
     if (TCP_server->incomming_connection_queue[i].status != TCP_STATUS_CONNECTED)
         return -1;
 
-    int ret = read_connection_handshake(&TCP_server->incomming_connection_queue[i], TCP_server->secret_key);
+    int ret = read_connection_handshake(TCP_server, i);
 
     if (ret == -1) {
         kill_TCP_connection(&TCP_server->incomming_connection_queue[i]);
     } else if (ret == 1) {
-        int index_new = TCP_server->unconfirmed_connection_queue_index % MAX_INCOMMING_CONNECTIONS;
-        TCP_Secure_Connection *conn_old = &TCP_server->incomming_connection_queue[i];
-        TCP_Secure_Connection *conn_new = &TCP_server->unconfirmed_connection_queue[index_new];
+        return move_to_unconfirmed(TCP_server, i);
+    }
+
+    return -1;
+}
+
+/* Called by the precompute pool when the handshake of incoming connection
+ * job->number was computed.
+ */
+static void TCP_handshake_precomputed(void *object, Precompute_Job *job)
+{
+    TCP_Server *TCP_server = object;
+
+    if (job->number >= MAX_INCOMMING_CONNECTIONS)
+        return;
 
-        if (conn_new->status != TCP_STATUS_NO_STATUS)
-            kill_TCP_connection(conn_new);
+    TCP_Secure_Connection *con = &TCP_server->incomming_connection_queue[job->number];
 
-        memcpy(conn_new, conn_old, sizeof(TCP_Secure_Connection));
-        memset(conn_old, 0, sizeof(TCP_Secure_Connection));
-        ++TCP_server->unconfirmed_connection_queue_index;
+    /* The connection was killed or its slot reused while the job was queued. */
+    if (con->status != TCP_STATUS_PRECOMPUTING || con->identifier != job->id)
+        return;
+
+    TCP_Handshake_Result result;
 
-        return index_new;
+    if (job->result == -1 || job->length != sizeof(result)) {
+        kill_TCP_connection(con);
+        return;
     }
 
-    return -1;
+    memcpy(&result, job->data, sizeof(result));
+
+    if (finish_TCP_handshake(con, job->public_key, &result) == -1) {
+        kill_TCP_connection(con);
+        return;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+    sock_t sock = con->sock;
+    int index_new = move_to_unconfirmed(TCP_server, job->number);
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLET | EPOLLRDHUP,
+        .data.u64 = sock | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 48)
+    };
+
+    if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &ev) == -1) {
+        kill_TCP_connection(&TCP_server->unconfirmed_connection_queue[index_new]);
+    }
+
+#else
+    move_to_unconfirmed(TCP_server, job->number);
+#endif
 }
 
 static int do_unconfirmed(TCP_Server *TCP_server, uint32_t i)
@@ -1069,7 +1936,7 @@ static int do_unconfirmed(TCP_Server *TCP_server, uint32_t i)
         return -1;
 
     uint8_t packet[MAX_PACKET_SIZE];
-    int len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key, conn->recv_nonce,
+    int len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key, conn->recv_nonce,
               packet, sizeof(packet));
 
     if (len == 0) {
@@ -1089,7 +1956,7 @@ static void do_confirmed_recv(TCP_Server *TCP_server, uint32_t i)
     uint8_t packet[MAX_PACKET_SIZE];
     int len;
 
-    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key,
+    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key,
                   conn->recv_nonce, packet, sizeof(packet)))) {
         if (len == -1) {
             kill_accepted(TCP_server, i);
@@ -1121,74 +1988,142 @@ static void do_TCP_unconfirmed(TCP_Server *TCP_server)
     }
 }
 
-static void do_TCP_confirmed(TCP_Server *TCP_server)
+/* Called by the ping timer wheel when accepted connection i is due.
+ */
+static void do_TCP_ping(TCP_Server *TCP_server, uint32_t i)
 {
-#ifdef TCP_SERVER_USE_EPOLL
+    TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
 
-    if (TCP_server->last_run_pinged == unix_time())
+    if (conn->status != TCP_STATUS_CONFIRMED)
         return;
 
-    TCP_server->last_run_pinged = unix_time();
-#endif
-    uint32_t i;
+    uint64_t temp_time = unix_time();
 
-    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
-        TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
+    if (conn->ping_id) {
+        if (is_timeout(conn->last_pinged, TCP_PING_TIMEOUT)) {
+            kill_accepted(TCP_server, i);
+            return;
+        }
 
-        if (conn->status != TCP_STATUS_CONFIRMED)
-            continue;
+        ping_wheel_add(TCP_server, i, conn->last_pinged + TCP_PING_TIMEOUT);
+        return;
+    }
 
-        if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY)) {
-            uint8_t ping[1 + sizeof(uint64_t)];
-            ping[0] = TCP_PACKET_PING;
-            uint64_t ping_id = random_64b();
+    if (!is_timeout(conn->last_pinged, TCP_PING_FREQUENCY)) {
+        ping_wheel_add(TCP_server, i, conn->last_pinged + TCP_PING_FREQUENCY);
+        return;
+    }
 
-            if (!ping_id)
-                ++ping_id;
+    uint8_t ping[1 + sizeof(uint64_t)];
+    ping[0] = TCP_PACKET_PING;
+    uint64_t ping_id = random_64b();
 
-            memcpy(ping + 1, &ping_id, sizeof(uint64_t));
-            int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
+    if (!ping_id)
+        ++ping_id;
 
-            if (ret == 1) {
-                conn->last_pinged = unix_time();
-                conn->ping_id = ping_id;
-            } else {
-                if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
-                    kill_accepted(TCP_server, i);
-                    continue;
-                }
-            }
-        }
+    memcpy(ping + 1, &ping_id, sizeof(uint64_t));
+    int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
 
-        if (conn->ping_id && is_timeout(conn->last_pinged, TCP_PING_TIMEOUT)) {
-            kill_accepted(TCP_server, i);
-            continue;
+    if (ret == 1) {
+        conn->last_pinged = temp_time;
+        conn->ping_id = ping_id;
+        ping_wheel_add(TCP_server, i, temp_time + TCP_PING_TIMEOUT);
+    } else if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
+        kill_accepted(TCP_server, i);
+    } else {
+        ping_wheel_add(TCP_server, i, temp_time + 1);
+    }
+}
+
+/* Run the slots of the ping timer wheel up to the current second.
+ */
+static void do_TCP_ping_wheel(TCP_Server *TCP_server)
+{
+    uint64_t temp_time = unix_time();
+
+    /* Every connection is at most TCP_PING_WHEEL_SIZE seconds away. */
+    if (temp_time > TCP_server->ping_wheel_run + TCP_PING_WHEEL_SIZE)
+        TCP_server->ping_wheel_run = temp_time - TCP_PING_WHEEL_SIZE;
+
+    while (TCP_server->ping_wheel_run < temp_time) {
+        ++TCP_server->ping_wheel_run;
+        uint32_t *head = &TCP_server->ping_wheel[TCP_server->ping_wheel_run % TCP_PING_WHEEL_SIZE];
+
+        /* do_TCP_ping() always moves the connection to a later slot or kills it. */
+        while (*head) {
+            uint32_t index = *head - 1;
+            ping_wheel_remove(TCP_server, index);
+            do_TCP_ping(TCP_server, index);
         }
+    }
+}
+
+/* Flush the data queued on accepted connection i.
+ */
+static void do_confirmed_send(TCP_Server *TCP_server, uint32_t i)
+{
+    if (i >= TCP_server->size_accepted_connections)
+        return;
+
+    TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
+
+    if (conn->status != TCP_STATUS_CONFIRMED)
+        return;
+
+    TCP_send_queue_flush(&conn->send_queue, conn->sock);
+}
 
-        send_pending_data(conn);
+static void do_TCP_confirmed(TCP_Server *TCP_server)
+{
+    do_TCP_ping_wheel(TCP_server);
 
 #ifndef TCP_SERVER_USE_EPOLL
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        if (TCP_server->accepted_connection_array[i].status != TCP_STATUS_CONFIRMED)
+            continue;
 
+        do_confirmed_send(TCP_server, i);
         do_confirmed_recv(TCP_server, i);
+    }
 
 #endif
-    }
 }
 
 #ifdef TCP_SERVER_USE_EPOLL
-static void do_TCP_epoll(TCP_Server *TCP_server)
+/* Handle the events of the sockets of TCP_server, waiting at most timeout ms
+ * for the first ones.
+ */
+static void do_TCP_epoll(TCP_Server *TCP_server, int timeout)
 {
 #define MAX_EVENTS 16
+#define MAX_ROUNDS 64
     struct epoll_event events[MAX_EVENTS];
-    int nfds;
+    int nfds, rounds = 0;
 
-    while ((nfds = epoll_wait(TCP_server->efd, events, MAX_EVENTS, 0)) > 0) {
+    /* Busy sockets always have new events, return to the caller once in a while
+     * (the events left are still there on the next call). */
+    while (rounds < MAX_ROUNDS && (nfds = epoll_wait(TCP_server->efd, events, MAX_EVENTS, timeout)) > 0) {
         int n;
+        timeout = 0;
+        ++rounds;
 
         for (n = 0; n < nfds; ++n) {
             sock_t sock = events[n].data.u64 & 0xFFFFFFFF;
             int status = (events[n].data.u64 >> 32) & 0xFFFF, index = (events[n].data.u64 >> 48);
 
+            if (status == TCP_SOCKET_QUEUE) {
+                uint64_t count;
+
+                if (read(sock, &count, sizeof(count)) != sizeof(count)) {
+                    /* Nothing new, the queue was emptied after the last wakeup. */
+                }
+
+                do_TCP_messages(TCP_server);
+                continue;
+            }
+
             if ((events[n].events & EPOLLERR) || (events[n].events & EPOLLHUP) || (events[n].events & EPOLLRDHUP)) {
                 switch (status) {
                     case TCP_SOCKET_LISTENING: {
@@ -1216,6 +2151,11 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
             }
 
 
+            /* Socket of an accepted connection has room again, send what was queued. */
+            if (status == TCP_SOCKET_CONFIRMED && (events[n].events & EPOLLOUT)) {
+                do_confirmed_send(TCP_server, index);
+            }
+
             if (!(events[n].events & EPOLLIN)) {
                 continue;
             }
@@ -1273,7 +2213,7 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                     int index_new;
 
                     if ((index_new = do_unconfirmed(TCP_server, index)) != -1) {
-                        events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+                        events[n].events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
                         events[n].data.u64 = sock | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index_new << 48);
 
                         if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &events[n]) == -1) {
@@ -1281,6 +2221,9 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                             kill_accepted(TCP_server, index_new);
                             break;
                         }
+
+                        /* Packets read along with the first one won't be signalled again. */
+                        do_confirmed_recv(TCP_server, index_new);
                     }
 
                     break;
@@ -1294,16 +2237,224 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
         }
     }
 
+#undef MAX_ROUNDS
 #undef MAX_EVENTS
 }
+
+static void *TCP_worker_thread(void *arg)
+{
+    TCP_Server *worker = arg;
+
+    while (1) {
+        pthread_mutex_lock(&worker->queue.mutex);
+        _Bool shutdown = worker->shutdown;
+        pthread_mutex_unlock(&worker->queue.mutex);
+
+        if (shutdown)
+            break;
+
+        /* unix_time() is kept up to date by do_TCP_server() on the main thread. */
+        do_TCP_epoll(worker, 1000);
+        do_TCP_ping_wheel(worker);
+    }
+
+    return NULL;
+}
+
+static int init_message_queue(TCP_Message_Queue *queue, int event_fd)
+{
+    queue->messages = calloc(TCP_WORKER_QUEUE_SIZE, sizeof(TCP_Message));
+
+    if (queue->messages == NULL)
+        return -1;
+
+    if (pthread_mutex_init(&queue->mutex, NULL) != 0) {
+        free(queue->messages);
+        queue->messages = NULL;
+        return -1;
+    }
+
+    queue->event_fd = event_fd;
+    return 0;
+}
+
+static void free_message_queue(TCP_Message_Queue *queue)
+{
+    if (queue->messages == NULL)
+        return;
+
+    /* Connections that were on their way to a worker. */
+    for (; queue->first != queue->last; ++queue->first) {
+        TCP_Message *msg = &queue->messages[queue->first % TCP_WORKER_QUEUE_SIZE];
+
+        if (msg->type == TCP_MESSAGE_ADOPT) {
+            kill_TCP_connection(msg->con);
+            free(msg->con);
+        }
+    }
+
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->messages);
+    queue->messages = NULL;
+}
+
+static void kill_TCP_worker(TCP_Server *worker)
+{
+    uint32_t i;
+
+    for (i = 0; i < worker->size_accepted_connections; ++i) {
+        if (worker->accepted_connection_array[i].status != TCP_STATUS_NO_STATUS)
+            kill_TCP_connection(&worker->accepted_connection_array[i]);
+    }
+
+    free_message_queue(&worker->queue);
+    free(worker->key_table);
+    close(worker->efd);
+    free(worker->accepted_connection_array);
+    free(worker);
+}
+
+static TCP_Server *new_TCP_worker(TCP_Server *TCP_server, uint32_t worker_num)
+{
+    TCP_Server *worker = calloc(1, sizeof(TCP_Server));
+
+    if (worker == NULL)
+        return NULL;
+
+    worker->efd = epoll_create(8);
+
+    if (worker->efd == -1) {
+        free(worker);
+        return NULL;
+    }
+
+    int event_fd = eventfd(0, EFD_NONBLOCK);
+
+    if (event_fd == -1) {
+        close(worker->efd);
+        free(worker);
+        return NULL;
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.u64 = event_fd | ((uint64_t)TCP_SOCKET_QUEUE << 32)
+    };
+
+    if (epoll_ctl(worker->efd, EPOLL_CTL_ADD, event_fd, &ev) == -1 || init_message_queue(&worker->queue, event_fd) == -1) {
+        close(event_fd);
+        close(worker->efd);
+        free(worker);
+        return NULL;
+    }
+
+    worker->parent = TCP_server;
+    worker->worker_num = worker_num;
+    memcpy(worker->public_key, TCP_server->public_key, crypto_box_PUBLICKEYBYTES);
+    worker->key_salt = TCP_server->key_salt;
+    worker->ping_wheel_run = TCP_server->ping_wheel_run;
+    return worker;
+}
+
+static void stop_TCP_workers(TCP_Server *TCP_server)
+{
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->num_workers; ++i) {
+        TCP_Server *worker = TCP_server->workers[i];
+        pthread_mutex_lock(&worker->queue.mutex);
+        worker->shutdown = 1;
+        pthread_mutex_unlock(&worker->queue.mutex);
+
+        uint64_t one = 1;
+
+        if (write(worker->queue.event_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* The worker is awake already. */
+        }
+    }
+
+    for (i = 0; i < TCP_server->num_workers; ++i) {
+        pthread_join(TCP_server->workers[i]->thread, NULL);
+    }
+
+    /* Only free once all threads stopped, they post to each other. */
+    for (i = 0; i < TCP_server->num_workers; ++i) {
+        int event_fd = TCP_server->workers[i]->queue.event_fd;
+        kill_TCP_worker(TCP_server->workers[i]);
+        close(event_fd);
+    }
+
+    free(TCP_server->workers);
+    TCP_server->workers = NULL;
+    TCP_server->num_workers = 0;
+    free_message_queue(&TCP_server->queue);
+}
+#endif
+
+/* Move the accepted connections of the server to num_workers threads.
+ * Only available with TCP_SERVER_USE_EPOLL.
+ *
+ * Threads don't survive fork(), call this after it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int TCP_server_start_workers(TCP_Server *TCP_server, uint32_t num_workers)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->parent || TCP_server->num_workers || TCP_server->num_accepted_connections)
+        return -1;
+
+    if (num_workers == 0 || num_workers > TCP_MAX_WORKERS)
+        return -1;
+
+    if (init_message_queue(&TCP_server->queue, -1) == -1)
+        return -1;
+
+    TCP_server->workers = calloc(num_workers, sizeof(TCP_Server *));
+
+    if (TCP_server->workers == NULL) {
+        free_message_queue(&TCP_server->queue);
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < num_workers; ++i) {
+        TCP_Server *worker = new_TCP_worker(TCP_server, i);
+
+        if (worker == NULL)
+            break;
+
+        if (pthread_create(&worker->thread, NULL, TCP_worker_thread, worker) != 0) {
+            int event_fd = worker->queue.event_fd;
+            kill_TCP_worker(worker);
+            close(event_fd);
+            break;
+        }
+
+        TCP_server->workers[i] = worker;
+        ++TCP_server->num_workers;
+    }
+
+    if (TCP_server->num_workers != num_workers) {
+        stop_TCP_workers(TCP_server);
+        return -1;
+    }
+
+    return 0;
+#else
+    return -1;
 #endif
+}
 
 void do_TCP_server(TCP_Server *TCP_server)
 {
     unix_time_update();
 
 #ifdef TCP_SERVER_USE_EPOLL
-    do_TCP_epoll(TCP_server);
+    do_TCP_epoll(TCP_server, 0);
 
 #else
     do_TCP_accept_new(TCP_server);
@@ -1312,10 +2463,20 @@ void do_TCP_server(TCP_Server *TCP_server)
 #endif
 
     do_TCP_confirmed(TCP_server);
+
+    /* Onion packets and connections handed back by the workers. */
+    if (TCP_server->num_workers)
+        do_TCP_messages(TCP_server);
 }
 
 void kill_TCP_server(TCP_Server *TCP_server)
 {
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->num_workers)
+        stop_TCP_workers(TCP_server);
+
+#endif
     uint32_t i;
 
     for (i = 0; i < TCP_server->num_listening_socks; ++i) {
@@ -1326,13 +2487,29 @@ void kill_TCP_server(TCP_Server *TCP_server)
         set_callback_handle_recv_1(TCP_server->onion, NULL, NULL);
     }
 
-    bs_list_free(&TCP_server->accepted_key_list);
+    if (TCP_server->precompute_pool) {
+        precompute_pool_cancel(TCP_server->precompute_pool, TCP_server);
+    }
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        TCP_send_queue_free(&TCP_server->accepted_connection_array[i].send_queue);
+        TCP_recv_buffer_free(&TCP_server->accepted_connection_array[i].recv_buffer);
+        free(TCP_server->accepted_connection_array[i].connection_table);
+    }
+
+    for (i = 0; i < MAX_INCOMMING_CONNECTIONS; ++i) {
+        TCP_recv_buffer_free(&TCP_server->unconfirmed_connection_queue[i].recv_buffer);
+    }
+
+    free(TCP_server->key_table);
 
 #ifdef TCP_SERVER_USE_EPOLL
     close(TCP_server->efd);
 #endif
 
     free(TCP_server->socks_listening);
+    free(TCP_server->incomming_connection_queue);
+    free(TCP_server->unconfirmed_connection_queue);
     free(TCP_server->accepted_connection_array);
     free(TCP_server);
 }
@@ -25,7 +25,6 @@
 
 #include "crypto_core.h"
 #include "onion.h"
-#include "list.h"
 
 #ifdef TCP_SERVER_USE_EPOLL
 #include "sys/epoll.h"
@@ -49,6 +48,11 @@
 #define NUM_RESERVED_PORTS 16
 #define NUM_CLIENT_CONNECTIONS (256 - NUM_RESERVED_PORTS)
 
+/* Connections are found by public key in open addressing hash tables that are
+ * kept at most half full, this is the size of the table of one connection.
+ */
+#define TCP_CONNECTION_TABLE_SIZE 512
+
 #define TCP_PACKET_ROUTING_REQUEST  0
 #define TCP_PACKET_ROUTING_RESPONSE 1
 #define TCP_PACKET_CONNECTION_NOTIFICATION 2
@@ -66,11 +70,22 @@
 #define TCP_PING_FREQUENCY 30
 #define TCP_PING_TIMEOUT 10
 
+/* Number of one second slots in the ping timer wheel, must be bigger than
+ * TCP_PING_FREQUENCY + TCP_PING_TIMEOUT. */
+#define TCP_PING_WHEEL_SIZE 64
+
+/* Maximum number of worker threads, see TCP_server_start_workers(). */
+#define TCP_MAX_WORKERS 64
+
+/* Number of messages that can wait for a worker (or the main thread). */
+#define TCP_WORKER_QUEUE_SIZE 512
+
 #ifdef TCP_SERVER_USE_EPOLL
 #define TCP_SOCKET_LISTENING 0
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_QUEUE 4 /* eventfd signalled when messages were queued for a worker. */
 #endif
 
 enum {
@@ -78,15 +93,39 @@ enum {
     TCP_STATUS_CONNECTED,
     TCP_STATUS_UNCONFIRMED,
     TCP_STATUS_CONFIRMED,
+    TCP_STATUS_PRECOMPUTING, /* handshake is being computed by the precompute pool. */
 };
 
-typedef struct TCP_Priority_List TCP_Priority_List;
+/* Size of the queue for the packets of a connection that didn't fit its socket. */
+#define TCP_SEND_QUEUE_SIZE (32 * 1024)
 
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size, sent;
-    uint8_t data[0];
-};
+/* Non priority packets are refused once this many bytes are queued, so that
+ * there is always room for the priority ones. */
+#define TCP_SEND_QUEUE_HIGH_WATER (8 * 1024)
+
+/* Encrypted packets waiting for room in the socket, in the order they were
+ * encrypted in. A ring of TCP_SEND_QUEUE_SIZE bytes, allocated the first time
+ * a packet doesn't fit.
+ */
+typedef struct {
+    uint8_t *data;
+    uint32_t start;
+    uint32_t length;
+} TCP_Send_Queue;
+
+/* Size of the buffer received data is read into, so that one recv() can return
+ * many small packets at once. Always holds at least one packet of any size.
+ */
+#define TCP_RECV_BUFFER_SIZE (2 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+
+/* Received bytes not yet parsed into packets, at data + start. Allocated on the
+ * first read.
+ */
+typedef struct {
+    uint8_t *data;
+    uint16_t start;
+    uint16_t length;
+} TCP_Recv_Buffer;
 
 typedef struct TCP_Secure_Connection {
     uint8_t status;
@@ -95,41 +134,91 @@ typedef struct TCP_Secure_Connection {
     uint8_t recv_nonce[crypto_box_NONCEBYTES]; /* Nonce of received packets. */
     uint8_t sent_nonce[crypto_box_NONCEBYTES]; /* Nonce of sent packets. */
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    uint16_t next_packet_length;
+    TCP_Recv_Buffer recv_buffer;
     struct {
         uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
         uint8_t public_key[crypto_box_PUBLICKEYBYTES];
         uint32_t index;
         uint8_t other_id;
+        uint8_t worker; /* worker of the other connection if status is 2. */
     } connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
-
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    /* Slot + 1 of each connection by public key, see TCP_CONNECTION_TABLE_SIZE.
+     * Allocated on the first routing request. */
+    uint32_t *connection_table;
+    uint32_t used_connections[(NUM_CLIENT_CONNECTIONS + 31) / 32]; /* Bit set for each slot in use. */
+    TCP_Send_Queue send_queue;
 
     uint64_t identifier;
 
     uint64_t last_pinged;
     uint64_t ping_id;
+
+    /* Time the connection is due in the ping timer wheel, 0 if it isn't in it. */
+    uint64_t ping_wheel_time;
+    /* Neighbours in the wheel slot (index in accepted_connection_array + 1, 0 if none). */
+    uint32_t ping_wheel_next, ping_wheel_prev;
 } TCP_Secure_Connection;
 
+/* Messages between the workers of a server and its main thread. */
+enum {
+    TCP_MESSAGE_ADOPT, /* take over a connection that finished its handshake. */
+    TCP_MESSAGE_LINK, /* a connection made a routing request for one of ours. */
+    TCP_MESSAGE_LINKED, /* the connection we made a routing request for is online. */
+    TCP_MESSAGE_UNLINK, /* the other side of a routing request went offline. */
+    TCP_MESSAGE_DATA,
+    TCP_MESSAGE_OOB,
+    TCP_MESSAGE_ONION_REQUEST, /* to the main thread, which owns the onion. */
+    TCP_MESSAGE_ONION_RESPONSE,
+};
+
+typedef struct {
+    uint8_t type;
+
+    /* Connection the message is from. */
+    uint32_t worker;
+    uint32_t index;
+    uint8_t id; /* in its connections array. */
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint64_t identifier;
+
+    /* Connection the message is for, TCP_MESSAGE_LINK and TCP_MESSAGE_OOB only
+     * have the public key. */
+    uint32_t dest_index;
+    uint8_t dest_id;
+    uint8_t dest_public_key[crypto_box_PUBLICKEYBYTES];
+
+    TCP_Secure_Connection *con; /* TCP_MESSAGE_ADOPT only, freed by the receiver. */
+    uint16_t length;
+    uint8_t data[MAX_PACKET_SIZE];
+} TCP_Message;
 
 typedef struct {
+    TCP_Message *messages;
+    /* Both only ever increase, messages are at (number % TCP_WORKER_QUEUE_SIZE). */
+    uint32_t first;
+    uint32_t last;
+    uint64_t num_dropped; /* number of messages dropped because the queue was full. */
+
+    pthread_mutex_t mutex;
+    int event_fd; /* written to wake up the worker, -1 for the main thread. */
+} TCP_Message_Queue;
+
+typedef struct TCP_Server TCP_Server;
+
+struct TCP_Server {
     Onion *onion;
 
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
-    uint64_t last_run_pinged;
 #endif
     sock_t *socks_listening;
     unsigned int num_listening_socks;
 
     uint8_t public_key[crypto_box_PUBLICKEYBYTES];
     uint8_t secret_key[crypto_box_SECRETKEYBYTES];
-    TCP_Secure_Connection incomming_connection_queue[MAX_INCOMMING_CONNECTIONS];
+    TCP_Secure_Connection *incomming_connection_queue; /* MAX_INCOMMING_CONNECTIONS long. */
     uint16_t incomming_connection_queue_index;
-    TCP_Secure_Connection unconfirmed_connection_queue[MAX_INCOMMING_CONNECTIONS];
+    TCP_Secure_Connection *unconfirmed_connection_queue; /* MAX_INCOMMING_CONNECTIONS long. */
     uint16_t unconfirmed_connection_queue_index;
 
     TCP_Secure_Connection *accepted_connection_array;
@@ -138,14 +227,50 @@ typedef struct {
 
     uint64_t counter;
 
-    BS_LIST accepted_key_list;
-} TCP_Server;
+    /* Index + 1 of each accepted connection by public key, see
+     * TCP_CONNECTION_TABLE_SIZE. key_table_size is a power of 2. */
+    uint32_t *key_table;
+    uint32_t key_table_size;
+    uint64_t key_salt; /* Hash salt, so that clients can't pick keys that collide. */
+
+    /* Accepted connections by the second they next need a ping or a ping timeout
+     * check, so that idle connections cost nothing until then. */
+    uint32_t ping_wheel[TCP_PING_WHEEL_SIZE];
+    uint64_t ping_wheel_run; /* last second that was run. */
+
+    /* If set, handshakes of incoming connections are computed on this pool.
+     * The pool must outlive the server. */
+    Precompute_Pool *precompute_pool;
+
+    /* With workers the main server only accepts connections and does their
+     * handshakes. Each accepted connection then lives on the worker its public
+     * key maps to, which runs it on its own thread with its own epoll set.
+     * Workers are TCP_Servers without listening sockets. */
+    TCP_Server **workers;
+    uint32_t num_workers;
+
+    TCP_Server *parent; /* main server of a worker, NULL on the main server. */
+    uint32_t worker_num;
+    TCP_Message_Queue queue;
+    pthread_t thread;
+    _Bool shutdown;
+};
 
 /* Create new TCP server instance.
  */
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *public_key,
                            const uint8_t *secret_key, Onion *onion);
 
+/* Move the accepted connections of the server to num_workers threads.
+ * Only available with TCP_SERVER_USE_EPOLL.
+ *
+ * Threads don't survive fork(), call this after it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int TCP_server_start_workers(TCP_Server *TCP_server, uint32_t num_workers);
+
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *TCP_server);
@@ -154,6 +279,11 @@ void do_TCP_server(TCP_Server *TCP_server);
  */
 void kill_TCP_server(TCP_Server *TCP_server);
 
+/* return index of the accepted connection with public_key on success.
+ * return -1 on failure.
+ */
+int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t *public_key);
+
 /* return the amount of data in the tcp recv buffer.
  * return 0 on failure.
  */
@@ -175,11 +305,43 @@ uint16_t read_TCP_length(sock_t sock);
  */
 int read_TCP_packet(sock_t sock, uint8_t *data, uint16_t length);
 
-/* return length of received packet on success.
+/* Send as much of queue to sock as it takes, with a single system call.
+ *
+ * return 0 if the queue is empty.
+ * return -1 if it isn't.
+ */
+int TCP_send_queue_flush(TCP_Send_Queue *queue, sock_t sock);
+
+/* return 1 if TCP_send_queue_write() would take a packet of length.
+ * return 0 if it would refuse it.
+ */
+_Bool TCP_send_queue_room(const TCP_Send_Queue *queue, uint16_t length, _Bool priority);
+
+/* Send the encrypted packet of length to sock, or queue it behind the packets
+ * already queued. Non priority packets are only queued below
+ * TCP_SEND_QUEUE_HIGH_WATER.
+ *
+ * A non empty queue means the socket was full, it is only sent again by
+ * TCP_send_queue_flush().
+ *
+ * return 1 on success.
+ * return 0 if the packet was neither sent nor queued.
+ * return -1 on failure (connection must be killed).
+ */
+int TCP_send_queue_write(TCP_Send_Queue *queue, sock_t sock, const uint8_t *packet, uint16_t length, _Bool priority);
+
+void TCP_send_queue_free(TCP_Send_Queue *queue);
+
+void TCP_recv_buffer_free(TCP_Recv_Buffer *buffer);
+
+/* Decrypt the next packet in buffer into data. Only reads from sock, as much
+ * as fits in the buffer, when no whole packet is buffered.
+ *
+ * return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
-int read_packet_TCP_secure_connection(sock_t sock, uint16_t *next_packet_length, const uint8_t *shared_key,
+int read_packet_TCP_secure_connection(sock_t sock, TCP_Recv_Buffer *buffer, const uint8_t *shared_key,
                                       uint8_t *recv_nonce, uint8_t *data, uint16_t max_len);
 
 
@@ -97,6 +97,13 @@ int encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
     if (length == 0)
         return -1;
 
+#ifndef VANILLA_NACL
+
+    /* No padding needed, so no copies. */
+    if (crypto_box_easy_afternm(encrypted, plain, length, nonce, secret_key) != 0)
+        return -1;
+
+#else
     uint8_t temp_plain[length + crypto_box_ZEROBYTES];
     uint8_t temp_encrypted[length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES];
 
@@ -108,6 +115,7 @@ int encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
 
     /* Unpad the encrypted message. */
     memcpy(encrypted, temp_encrypted + crypto_box_BOXZEROBYTES, length + crypto_box_MACBYTES);
+#endif
     return length + crypto_box_MACBYTES;
 }
 
@@ -117,6 +125,12 @@ int decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
     if (length <= crypto_box_BOXZEROBYTES)
         return -1;
 
+#ifndef VANILLA_NACL
+
+    if (crypto_box_open_easy_afternm(plain, encrypted, length, nonce, secret_key) != 0)
+        return -1;
+
+#else
     uint8_t temp_plain[length + crypto_box_ZEROBYTES];
     uint8_t temp_encrypted[length + crypto_box_BOXZEROBYTES];
 
@@ -127,6 +141,7 @@ int decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
         return -1;
 
     memcpy(plain, temp_plain + crypto_box_ZEROBYTES, length - crypto_box_MACBYTES);
+#endif
     return length - crypto_box_MACBYTES;
 }
 
@@ -253,6 +268,26 @@ int create_request(const uint8_t *send_public_key, const uint8_t *send_secret_ke
  */
 int handle_request(const uint8_t *self_public_key, const uint8_t *self_secret_key, uint8_t *public_key, uint8_t *data,
                    uint8_t *request_id, const uint8_t *packet, uint16_t length)
+{
+    if (length > crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1 + crypto_box_MACBYTES &&
+            length <= MAX_CRYPTO_REQUEST_SIZE) {
+        if (memcmp(packet + 1, self_public_key, crypto_box_PUBLICKEYBYTES) == 0) {
+            uint8_t k[crypto_box_BEFORENMBYTES];
+            encrypt_precompute(packet + 1 + crypto_box_PUBLICKEYBYTES, self_secret_key, k);
+            return handle_request_precomputed(self_public_key, k, public_key, data, request_id, packet, length);
+        }
+    }
+
+    return -1;
+}
+
+/* Same as handle_request() but uses shared_key, the precomputed key between the
+ * sender of the request and us, instead of computing it.
+ *
+ *  return -1 if not valid request.
+ */
+int handle_request_precomputed(const uint8_t *self_public_key, const uint8_t *shared_key, uint8_t *public_key,
+                               uint8_t *data, uint8_t *request_id, const uint8_t *packet, uint16_t length)
 {
     if (length > crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1 + crypto_box_MACBYTES &&
             length <= MAX_CRYPTO_REQUEST_SIZE) {
@@ -261,9 +296,9 @@ int handle_request(const uint8_t *self_public_key, const uint8_t *self_secret_ke
             uint8_t nonce[crypto_box_NONCEBYTES];
             uint8_t temp[MAX_CRYPTO_REQUEST_SIZE];
             memcpy(nonce, packet + 1 + crypto_box_PUBLICKEYBYTES * 2, crypto_box_NONCEBYTES);
-            int len1 = decrypt_data(public_key, self_secret_key, nonce,
-                                    packet + 1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES,
-                                    length - (crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1), temp);
+            int len1 = decrypt_data_symmetric(shared_key, nonce,
+                                              packet + 1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES,
+                                              length - (crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1), temp);
 
             if (len1 == -1 || len1 == 0)
                 return -1;
@@ -145,5 +145,11 @@ int create_request(const uint8_t *send_public_key, const uint8_t *send_secret_ke
 int handle_request(const uint8_t *self_public_key, const uint8_t *self_secret_key, uint8_t *public_key, uint8_t *data,
                    uint8_t *request_id, const uint8_t *packet, uint16_t length);
 
+/* Same as handle_request() but uses shared_key, the precomputed key between the
+   sender of the request and us, instead of computing it.
+   return -1 if not valid request. */
+int handle_request_precomputed(const uint8_t *self_public_key, const uint8_t *shared_key, uint8_t *public_key,
+                               uint8_t *data, uint8_t *request_id, const uint8_t *packet, uint16_t length);
+
 
 #endif
@@ -93,6 +93,56 @@ static int create_friend_conn(Friend_Connections *fr_c)
     return id;
 }
 
+/* Remove friend connection friendcon_id from the timer wheel.
+ */
+static void wheel_remove(Friend_Connections *fr_c, int friendcon_id)
+{
+    Friend_Conn *friend_con = &fr_c->conns[friendcon_id];
+
+    if (friend_con->wheel_time == 0)
+        return;
+
+    if (friend_con->wheel_prev) {
+        fr_c->conns[friend_con->wheel_prev - 1].wheel_next = friend_con->wheel_next;
+    } else {
+        fr_c->wheel[friend_con->wheel_time % FRIEND_CONN_WHEEL_SIZE] = friend_con->wheel_next;
+    }
+
+    if (friend_con->wheel_next)
+        fr_c->conns[friend_con->wheel_next - 1].wheel_prev = friend_con->wheel_prev;
+
+    friend_con->wheel_time = 0;
+    friend_con->wheel_next = 0;
+    friend_con->wheel_prev = 0;
+}
+
+/* Make do_friend_conn() run for friend connection friendcon_id at time.
+ */
+static void wheel_add(Friend_Connections *fr_c, int friendcon_id, uint64_t time)
+{
+    wheel_remove(fr_c, friendcon_id);
+
+    /* Slots up to wheel_run were already run and the wheel only covers
+     * FRIEND_CONN_WHEEL_SIZE seconds. */
+    if (time <= fr_c->wheel_run) {
+        time = fr_c->wheel_run + 1;
+    } else if (time >= fr_c->wheel_run + FRIEND_CONN_WHEEL_SIZE) {
+        time = fr_c->wheel_run + FRIEND_CONN_WHEEL_SIZE - 1;
+    }
+
+    Friend_Conn *friend_con = &fr_c->conns[friendcon_id];
+    uint32_t *head = &fr_c->wheel[time % FRIEND_CONN_WHEEL_SIZE];
+
+    friend_con->wheel_time = time;
+    friend_con->wheel_prev = 0;
+    friend_con->wheel_next = *head;
+
+    if (*head)
+        fr_c->conns[*head - 1].wheel_prev = friendcon_id + 1;
+
+    *head = friendcon_id + 1;
+}
+
 /* Wipe a friend connection.
  *
  * return -1 on failure.
@@ -104,6 +154,7 @@ static int wipe_friend_conn(Friend_Connections *fr_c, int friendcon_id)
         return -1;
 
     uint32_t i;
+    wheel_remove(fr_c, friendcon_id);
     memset(&(fr_c->conns[friendcon_id]), 0 , sizeof(Friend_Conn));
 
     for (i = fr_c->num_cons; i != 0; --i) {
@@ -127,6 +178,61 @@ static Friend_Conn *get_conn(const Friend_Connections *fr_c, int friendcon_id)
     return &fr_c->conns[friendcon_id];
 }
 
+/* return the time do_friend_conn() must next run for friend_con.
+ * return 0 if it only has to when something about the friend changes.
+ */
+static uint64_t friend_conn_next_time(const Friend_Conn *friend_con)
+{
+    uint64_t next = 0;
+
+    if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
+        if (friend_con->dht_lock) {
+            if (friend_con->crypt_connection_id == -1)
+                return unix_time();
+
+            next = friend_con->dht_ping_lastrecv + FRIEND_DHT_TIMEOUT + 1;
+        }
+
+        if (friend_con->dht_ip_port.ip.family != 0) {
+            uint64_t ip_port_timeout = friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT + 1;
+
+            if (next == 0 || ip_port_timeout < next)
+                next = ip_port_timeout;
+        }
+    } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
+        next = friend_con->ping_lastsent + FRIEND_PING_INTERVAL + 1;
+
+        if (friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT + 1 < next)
+            next = friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT + 1;
+    }
+
+    return next;
+}
+
+/* Put friend connection friendcon_id in the timer wheel if something about it
+ * changed that makes do_friend_conn() have to run for it sooner.
+ */
+static void friend_conn_schedule(Friend_Connections *fr_c, int friendcon_id)
+{
+    Friend_Conn *friend_con = get_conn(fr_c, friendcon_id);
+
+    if (!friend_con)
+        return;
+
+    uint64_t next = friend_conn_next_time(friend_con);
+
+    if (next == 0) {
+        wheel_remove(fr_c, friendcon_id);
+        return;
+    }
+
+    /* do_friend_conn() puts it back at the right time if it is due early. */
+    if (friend_con->wheel_time != 0 && friend_con->wheel_time <= next)
+        return;
+
+    wheel_add(fr_c, friendcon_id, next);
+}
+
 /* return friendcon_id corresponding to the real public key on success.
  * return -1 on failure.
  */
@@ -179,6 +285,7 @@ static void dht_ip_callback(void *object, int32_t number, IP_Port ip_port)
     set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, ip_port);
     friend_con->dht_ip_port = ip_port;
     friend_con->dht_ip_port_lastrecv = unix_time();
+    friend_conn_schedule(fr_c, number);
 }
 
 /* Callback for dht public key changes. */
@@ -214,6 +321,7 @@ static void dht_pk_callback(void *object, int32_t number, const uint8_t *dht_pub
     onion_set_friend_DHT_pubkey(fr_c->onion_c, friend_con->onion_friendnum, dht_public_key);
 
     memcpy(friend_con->dht_temp_pk, dht_public_key, crypto_box_PUBLICKEYBYTES);
+    friend_conn_schedule(fr_c, number);
 }
 
 static int handle_status(void *object, int number, uint8_t status)
@@ -235,6 +343,7 @@ static int handle_status(void *object, int number, uint8_t status)
         onion_set_friend_online(fr_c->onion_c, friend_con->onion_friendnum, status);
     }
 
+    friend_conn_schedule(fr_c, number);
     unsigned int i;
 
     for (i = 0; i < MAX_FRIEND_CONNECTION_CALLBACKS; ++i) {
@@ -339,6 +448,7 @@ static int handle_new_connections(void *object, New_Connection *n_c)
         dht_pk_callback(fr_c, friendcon_id, n_c->dht_public_key);
 
         nc_dht_pk_callback(fr_c->net_crypto, id, &dht_pk_callback, fr_c, friendcon_id);
+        friend_conn_schedule(fr_c, friendcon_id);
         return 0;
     }
 
@@ -621,53 +731,77 @@ Friend_Connections *new_friend_connections(Onion_Client *onion_c)
     temp->dht = onion_c->dht;
     temp->net_crypto = onion_c->c;
     temp->onion_c = onion_c;
+    temp->wheel_run = unix_time();
 
     new_connection_handler(temp->net_crypto, &handle_new_connections, temp);
 
     return temp;
 }
 
+/* Called by the timer wheel when friend connection i is due.
+ */
+static void do_friend_conn(Friend_Connections *fr_c, int i)
+{
+    Friend_Conn *friend_con = get_conn(fr_c, i);
+
+    if (!friend_con)
+        return;
+
+    uint64_t temp_time = unix_time();
+
+    if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
+        if (friend_con->dht_ping_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
+            if (friend_con->dht_lock) {
+                DHT_delfriend(fr_c->dht, friend_con->dht_temp_pk, friend_con->dht_lock);
+                friend_con->dht_lock = 0;
+            }
+        }
+
+        if (friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
+            friend_con->dht_ip_port.ip.family = 0;
+        }
+
+        if (friend_con->dht_lock) {
+            if (friend_new_connection(fr_c, i) == 0) {
+                set_connection_dht_public_key(fr_c->net_crypto, friend_con->crypt_connection_id, friend_con->dht_temp_pk);
+                set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, friend_con->dht_ip_port);
+            }
+        }
+
+    } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
+        if (friend_con->ping_lastsent + FRIEND_PING_INTERVAL < temp_time) {
+            send_ping(fr_c, i);
+        }
+
+        if (friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT < temp_time) {
+            /* If we stopped receiving ping packets, kill it. */
+            crypto_kill(fr_c->net_crypto, friend_con->crypt_connection_id);
+            friend_con->crypt_connection_id = -1;
+            handle_status(fr_c, i, 0); /* Going offline. */
+        }
+    }
+
+    friend_conn_schedule(fr_c, i);
+}
+
 /* main friend_connections loop. */
 void do_friend_connections(Friend_Connections *fr_c)
 {
-    uint32_t i;
     uint64_t temp_time = unix_time();
 
-    for (i = 0; i < fr_c->num_cons; ++i) {
-        Friend_Conn *friend_con = get_conn(fr_c, i);
+    /* Every connection is at most FRIEND_CONN_WHEEL_SIZE seconds away. */
+    if (temp_time > fr_c->wheel_run + FRIEND_CONN_WHEEL_SIZE)
+        fr_c->wheel_run = temp_time - FRIEND_CONN_WHEEL_SIZE;
 
-        if (friend_con) {
-            if (friend_con->status == FRIENDCONN_STATUS_CONNECTING) {
-                if (friend_con->dht_ping_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
-                    if (friend_con->dht_lock) {
-                        DHT_delfriend(fr_c->dht, friend_con->dht_temp_pk, friend_con->dht_lock);
-                        friend_con->dht_lock = 0;
-                    }
-                }
-
-                if (friend_con->dht_ip_port_lastrecv + FRIEND_DHT_TIMEOUT < temp_time) {
-                    friend_con->dht_ip_port.ip.family = 0;
-                }
-
-                if (friend_con->dht_lock) {
-                    if (friend_new_connection(fr_c, i) == 0) {
-                        set_connection_dht_public_key(fr_c->net_crypto, friend_con->crypt_connection_id, friend_con->dht_temp_pk);
-                        set_direct_ip_port(fr_c->net_crypto, friend_con->crypt_connection_id, friend_con->dht_ip_port);
-                    }
-                }
-
-            } else if (friend_con->status == FRIENDCONN_STATUS_CONNECTED) {
-                if (friend_con->ping_lastsent + FRIEND_PING_INTERVAL < temp_time) {
-                    send_ping(fr_c, i);
-                }
-
-                if (friend_con->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT < temp_time) {
-                    /* If we stopped receiving ping packets, kill it. */
-                    crypto_kill(fr_c->net_crypto, friend_con->crypt_connection_id);
-                    friend_con->crypt_connection_id = -1;
-                    handle_status(fr_c, i, 0); /* Going offline. */
-                }
-            }
+    while (fr_c->wheel_run < temp_time) {
+        ++fr_c->wheel_run;
+        uint32_t *head = &fr_c->wheel[fr_c->wheel_run % FRIEND_CONN_WHEEL_SIZE];
+
+        /* do_friend_conn() only ever puts the connection in a later slot. */
+        while (*head) {
+            uint32_t friendcon_id = *head - 1;
+            wheel_remove(fr_c, friendcon_id);
+            do_friend_conn(fr_c, friendcon_id);
         }
     }
 }
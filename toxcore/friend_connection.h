@@ -47,6 +47,10 @@
 /* Time before friend is removed from the DHT after last hearing about him. */
 #define FRIEND_DHT_TIMEOUT BAD_NODE_TIMEOUT
 
+/* Number of one second slots in the timer wheel, connections due later go in
+ * the last slot and get put back when it is run. */
+#define FRIEND_CONN_WHEEL_SIZE 32
+
 
 enum {
     FRIENDCONN_STATUS_NONE,
@@ -83,6 +87,11 @@ typedef struct {
     } callbacks[MAX_FRIEND_CONNECTION_CALLBACKS];
 
     uint16_t lock_count;
+
+    /* Time the connection is due in the timer wheel, 0 if it isn't in it. */
+    uint64_t wheel_time;
+    /* Neighbours in the wheel slot (friendcon_id + 1, 0 if none). */
+    uint32_t wheel_next, wheel_prev;
 } Friend_Conn;
 
 
@@ -94,6 +103,11 @@ typedef struct {
     Friend_Conn *conns;
     uint32_t num_cons;
 
+    /* Connections that have something to do at some time, those that only
+     * wait for the friend to be found are not in it. */
+    uint32_t wheel[FRIEND_CONN_WHEEL_SIZE];
+    uint64_t wheel_run; /* last second that was run. */
+
     int (*fr_request_callback)(void *object, const uint8_t *source_pubkey, const uint8_t *data, uint16_t len);
     void *fr_request_object;
 } Friend_Connections;
@@ -38,6 +38,54 @@
 
 #define INDEX(i) (~i)
 
+/* The elements are also counted in a small counting bloom filter (two counters per element)
+ * so that bs_list_find() can reject most data that isn't in the list, like packets from
+ * random sources, without doing the search.
+ * -counters that reach 255 stay there forever so that the filter never gives a false negative
+ */
+static uint32_t filter_hash(const BS_LIST *list, const void *data)
+{
+    const uint8_t *bytes = data;
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for (i = 0; i < list->element_size; ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+#define FILTER_INDEX_1(hash) ((hash) % BS_LIST_FILTER_SIZE)
+#define FILTER_INDEX_2(hash) (((hash) >> 16) % BS_LIST_FILTER_SIZE)
+
+static void filter_add(BS_LIST *list, uint32_t hash)
+{
+    if (list->filter[FILTER_INDEX_1(hash)] != UINT8_MAX)
+        ++list->filter[FILTER_INDEX_1(hash)];
+
+    if (list->filter[FILTER_INDEX_2(hash)] != UINT8_MAX)
+        ++list->filter[FILTER_INDEX_2(hash)];
+}
+
+static void filter_remove(BS_LIST *list, uint32_t hash)
+{
+    if (list->filter[FILTER_INDEX_1(hash)] != UINT8_MAX)
+        --list->filter[FILTER_INDEX_1(hash)];
+
+    if (list->filter[FILTER_INDEX_2(hash)] != UINT8_MAX)
+        --list->filter[FILTER_INDEX_2(hash)];
+}
+
+/* return 0 if data is certainly not in the list.
+ * return 1 if it might be.
+ */
+static int filter_check(const BS_LIST *list, uint32_t hash)
+{
+    return list->filter[FILTER_INDEX_1(hash)] && list->filter[FILTER_INDEX_2(hash)];
+}
+
 /* Find data in list
  *
  * return value:
@@ -143,6 +191,7 @@ int bs_list_init(BS_LIST *list, uint32_t element_size, uint32_t initial_capacity
     list->capacity = 0;
     list->data = NULL;
     list->ids = NULL;
+    memset(list->filter, 0, sizeof(list->filter));
 
     if (initial_capacity != 0) {
         if (!resize(list, initial_capacity)) {
@@ -164,6 +213,10 @@ void bs_list_free(BS_LIST *list)
 
 int bs_list_find(const BS_LIST *list, const void *data)
 {
+    if (!filter_check(list, filter_hash(list, data))) {
+        return -1;
+    }
+
     int r = find(list, data);
 
     //return only -1 and positive values
@@ -211,6 +264,8 @@ int bs_list_add(BS_LIST *list, const void *data, int id)
     //increase n
     list->n++;
 
+    filter_add(list, filter_hash(list, data));
+
     return 1;
 }
 
@@ -227,6 +282,9 @@ int bs_list_remove(BS_LIST *list, const void *data, int id)
         return 0;
     }
 
+    //data may point into the list, hash it before it moves
+    filter_remove(list, filter_hash(list, data));
+
     //decrease the size of the arrays if needed
     if (list->n < list->capacity / 2) {
         const uint32_t new_capacity = list->capacity / 2;
@@ -30,12 +30,16 @@
 #include <stdint.h>
 #include <string.h>
 
+/* Number of counters in the filter of each list, must be a power of 2. */
+#define BS_LIST_FILTER_SIZE 1024
+
 typedef struct {
     uint32_t n; //number of elements
     uint32_t capacity; //number of elements memory is allocated for
     uint32_t element_size; //size of the elements
     void *data; //array of elements
     int *ids; //array of element ids
+    uint8_t filter[BS_LIST_FILTER_SIZE]; //counting bloom filter of the elements, lets unknown data be rejected without a search
 } BS_LIST;
 
 /* Initialize a list, element_size is the size of the elements in the list and
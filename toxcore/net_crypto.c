@@ -386,6 +386,152 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
  * return -1 on failure.
  * return 0 on success.
  */
+/* return the time in ms a packet of length sent through TCP connection
+ * tcp_index is expected to take to reach the relay.
+ */
+static uint64_t tcp_send_delay(const Net_Crypto *c, uint32_t tcp_index, uint16_t length)
+{
+    const TCP_Client_Connection *tcp_con = c->tcp_connections[tcp_index];
+    uint64_t rate = c->tcp_rate[tcp_index] ? c->tcp_rate[tcp_index] : TCP_RATE_DEFAULT;
+    return tcp_con->rtt / 2 + ((uint64_t)tcp_con->send_queue.length + length) * 1000 / rate;
+}
+
+/* Try to lock TCP connection tcp_index without waiting.
+ *
+ * return 1 if it was locked and the connection exists.
+ * return 0 if not.
+ */
+static int try_lock_tcp_connection(Net_Crypto *c, uint32_t tcp_index)
+{
+    if (pthread_mutex_trylock(&c->tcp_locks[tcp_index]) != 0)
+        return 0;
+
+    if (c->tcp_connections[tcp_index] == NULL) {
+        pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Pick the relay the data packet of length to conn goes through, so that
+ * packets are spread over all the relays the friend is online on by how
+ * fast they are. Relays that are as fast take turns.
+ * Relays that had no room for the packet are counted in tcp_refused, relays
+ * that are locked (busy with their I/O or another sender) are skipped.
+ *
+ * return index of the TCP connection, locked, on success.
+ * return -1 if no relay has room for the packet.
+ */
+static int select_tcp_connection(Net_Crypto *c, const Crypto_Connection *conn, uint16_t length)
+{
+    uint32_t i;
+    int best = -1;
+    uint64_t best_delay = ~0;
+
+    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
+        uint32_t tcp_index = (conn->last_relay_sentto + i) % MAX_TCP_CONNECTIONS;
+
+        if (conn->status_tcp[tcp_index] != STATUS_TCP_ONLINE)
+            continue;
+
+        if (!try_lock_tcp_connection(c, tcp_index))
+            continue;
+
+        if (c->tcp_sends[tcp_index] >= TCP_RELAY_WINDOW) {
+            c->tcp_sends[tcp_index] /= 2;
+            c->tcp_refused[tcp_index] /= 2;
+        }
+
+        ++c->tcp_sends[tcp_index];
+
+        if (!TCP_send_queue_room(&c->tcp_connections[tcp_index]->send_queue, length, 0)) {
+            ++c->tcp_refused[tcp_index];
+            pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
+            continue;
+        }
+
+        uint64_t delay = tcp_send_delay(c, tcp_index, length);
+
+        if (delay < best_delay) {
+            if (best != -1)
+                pthread_mutex_unlock(&c->tcp_locks[best]);
+
+            best = tcp_index;
+            best_delay = delay;
+        } else {
+            pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
+        }
+    }
+
+    return best;
+}
+
+/* Measure the throughput of TCP connection tcp_index over the last elapsed ms.
+ *
+ * Call with the TCP connection locked.
+ */
+static void update_tcp_rate(Net_Crypto *c, uint32_t tcp_index, uint64_t elapsed)
+{
+    TCP_Client_Connection *tcp_con = c->tcp_connections[tcp_index];
+    uint64_t sent = TCP_client_bytes_sent(tcp_con);
+    uint64_t rate = (sent - c->tcp_bytes_sent[tcp_index]) * 1000 / elapsed;
+    c->tcp_bytes_sent[tcp_index] = sent;
+
+    /* A connection with nothing queued may well be able to send more, and
+     * the first measurement (or one after a pause) covers too long a time. */
+    if (tcp_con->send_queue.length == 0 || elapsed > TCP_RATE_INTERVAL * 4)
+        return;
+
+    if (rate > UINT32_MAX)
+        rate = UINT32_MAX;
+
+    c->tcp_rate[tcp_index] = c->tcp_rate[tcp_index] ? (c->tcp_rate[tcp_index] * 3ULL + rate) / 4 : rate;
+}
+
+/* return the expected cost in ms of sending through TCP connection tcp_index,
+ * based on its round trip time and the ratio of data packets it had no room for.
+ */
+static uint32_t tcp_relay_cost(const Net_Crypto *c, uint32_t tcp_index)
+{
+    uint32_t cost = c->tcp_connections[tcp_index]->rtt;
+
+    if (cost == 0)
+        cost = TCP_RELAY_DEFAULT_RTT;
+
+    if (c->tcp_sends[tcp_index])
+        cost += (c->tcp_refused[tcp_index] * 100 / c->tcp_sends[tcp_index]) * TCP_RELAY_REFUSED_COST;
+
+    return cost;
+}
+
+/* Put the indexes of the TCP connections in indexes (of size MAX_TCP_CONNECTIONS),
+ * cheapest first, and their costs in costs.
+ *
+ * return the number of TCP connections.
+ */
+static uint32_t sort_tcp_connections(const Net_Crypto *c, uint32_t *indexes, uint32_t *costs)
+{
+    uint32_t i, num = 0;
+
+    for (i = 0; i < c->num_tcp_active; ++i) {
+        uint32_t cost = tcp_relay_cost(c, c->tcp_active[i]);
+        uint32_t j = num;
+
+        while (j > 0 && costs[j - 1] > cost) {
+            indexes[j] = indexes[j - 1];
+            costs[j] = costs[j - 1];
+            --j;
+        }
+
+        indexes[j] = c->tcp_active[i];
+        costs[j] = cost;
+        ++num;
+    }
+
+    return num;
+}
+
 static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
 {
 //TODO TCP, etc...
@@ -418,7 +564,6 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
 
     pthread_mutex_unlock(&conn->mutex);
 
-    //TODO: detect and kill bad relays.
     uint32_t i;
 
     unsigned int r;
@@ -429,18 +574,34 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
         r = conn->last_relay_sentto - 1;
     }
 
+    /* Relays are only tried, never waited for: a relay that is busy is skipped
+     * and if none could take the packet it is sent again later. */
+    if (conn->num_tcp_online && data[0] == NET_PACKET_CRYPTO_DATA) {
+        int tcp_index = select_tcp_connection(c, conn, length);
+
+        if (tcp_index != -1) {
+            int ret = send_data(c->tcp_connections[tcp_index], conn->con_number_tcp[tcp_index], data, length);
+            pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
+
+            if (ret == 1) {
+                conn->last_relay_sentto = tcp_index + 1;
+                return 0;
+            }
+        }
+    }
+
     if (conn->num_tcp_online) {
         for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-            pthread_mutex_lock(&c->tcp_mutex);
-
             unsigned int tcp_index = (i + r) % MAX_TCP_CONNECTIONS;
-            int ret = 0;
 
-            if (conn->status_tcp[tcp_index] == STATUS_TCP_ONLINE) {/* friend is connected to this relay. */
-                ret = send_data(c->tcp_connections[tcp_index], conn->con_number_tcp[tcp_index], data, length);
-            }
+            if (conn->status_tcp[tcp_index] != STATUS_TCP_ONLINE) /* friend is connected to this relay. */
+                continue;
 
-            pthread_mutex_unlock(&c->tcp_mutex);
+            if (!try_lock_tcp_connection(c, tcp_index))
+                continue;
+
+            int ret = send_data(c->tcp_connections[tcp_index], conn->con_number_tcp[tcp_index], data, length);
+            pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
 
             if (ret == 1) {
                 conn->last_relay_sentto = tcp_index + 1;
@@ -450,16 +611,16 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     }
 
     for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        pthread_mutex_lock(&c->tcp_mutex);
-
         unsigned int tcp_index = (i + r) % MAX_TCP_CONNECTIONS;
-        int ret = 0;
 
-        if (conn->status_tcp[tcp_index] == STATUS_TCP_INVISIBLE) {
-            ret = send_oob_packet(c->tcp_connections[tcp_index], conn->dht_public_key, data, length);
-        }
+        if (conn->status_tcp[tcp_index] != STATUS_TCP_INVISIBLE)
+            continue;
+
+        if (!try_lock_tcp_connection(c, tcp_index))
+            continue;
 
-        pthread_mutex_unlock(&c->tcp_mutex);
+        int ret = send_oob_packet(c->tcp_connections[tcp_index], conn->dht_public_key, data, length);
+        pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
 
         if (ret == 1) {
             conn->last_relay_sentto = tcp_index + 1;
@@ -474,6 +635,60 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     return -1;
 }
 
+/* Send a cookie request or handshake packet over every path we have to the peer:
+ * directly if we know their ip and over every relay they are or might be
+ * connected to, so that it gets through over whichever path works first.
+ *
+ * return -1 on failure.
+ * return number of paths it was sent over on success.
+ */
+static int send_packet_all_paths(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    int num_sent = 0;
+
+    pthread_mutex_lock(&conn->mutex);
+
+    if (conn->ip_port.ip.family != 0) {
+        if ((uint32_t)sendpacket(c->dht->net, conn->ip_port, data, length) == length)
+            ++num_sent;
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+
+    uint32_t i;
+
+    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
+        if (conn->status_tcp[i] != STATUS_TCP_ONLINE && conn->status_tcp[i] != STATUS_TCP_INVISIBLE)
+            continue;
+
+        if (!try_lock_tcp_connection(c, i))
+            continue;
+
+        int ret;
+
+        if (conn->status_tcp[i] == STATUS_TCP_ONLINE) {
+            ret = send_data(c->tcp_connections[i], conn->con_number_tcp[i], data, length);
+        } else {
+            ret = send_oob_packet(c->tcp_connections[i], conn->dht_public_key, data, length);
+        }
+
+        pthread_mutex_unlock(&c->tcp_locks[i]);
+
+        if (ret == 1)
+            ++num_sent;
+    }
+
+    if (num_sent == 0)
+        return -1;
+
+    return num_sent;
+}
+
 /** START: Array Related functions **/
 
 
@@ -1069,6 +1284,51 @@ static int clear_temp_packet(const Net_Crypto *c, int crypt_connection_id)
 }
 
 
+/* return the time in ms to wait for the first try of a cookie request or
+ * handshake to be answered before sending it again.
+ *
+ * That is twice the round trip time measured with the cookie request, or else
+ * the one of the DHT node of the peer, or else twice the one of the best relay
+ * they are on as packets cross it both ways.
+ */
+static uint32_t handshake_rto(const Net_Crypto *c, const Crypto_Connection *conn)
+{
+    uint32_t rtt = conn->handshake_rtt;
+
+    if (rtt == 0 && conn->dht_public_key_set && conn->ip_port.ip.family != 0)
+        rtt = DHT_node_rtt(c->dht, conn->dht_public_key);
+
+    if (rtt == 0) {
+        uint32_t i;
+
+        for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
+            if (conn->status_tcp[i] != STATUS_TCP_ONLINE && conn->status_tcp[i] != STATUS_TCP_INVISIBLE)
+                continue;
+
+            if (c->tcp_connections[i] == NULL || c->tcp_connections[i]->rtt == 0)
+                continue;
+
+            uint32_t relay_rtt = c->tcp_connections[i]->rtt * 2;
+
+            if (rtt == 0 || relay_rtt < rtt)
+                rtt = relay_rtt;
+        }
+    }
+
+    if (rtt == 0)
+        rtt = CRYPTO_HANDSHAKE_DEFAULT_RTT;
+
+    uint32_t rto = rtt * 2;
+
+    if (rto < CRYPTO_HANDSHAKE_MIN_RTO)
+        rto = CRYPTO_HANDSHAKE_MIN_RTO;
+
+    if (rto > CRYPTO_SEND_PACKET_INTERVAL)
+        rto = CRYPTO_SEND_PACKET_INTERVAL;
+
+    return rto;
+}
+
 /* Send the temp packet.
  *
  * return -1 on failure.
@@ -1084,11 +1344,26 @@ static int send_temp_packet(Net_Crypto *c, int crypt_connection_id)
     if (!conn->temp_packet)
         return -1;
 
-    if (send_packet_to(c, crypt_connection_id, conn->temp_packet, conn->temp_packet_length) != 0)
+    int num_paths = send_packet_all_paths(c, crypt_connection_id, conn->temp_packet, conn->temp_packet_length);
+
+    if (num_paths == -1)
         return -1;
 
-    conn->temp_packet_sent_time = current_time_monotonic();
+    uint64_t temp_time = current_time_monotonic();
+
+    if (conn->temp_packet_num_sent == 0) {
+        conn->temp_packet_first_sent_time = temp_time;
+        conn->temp_packet_rto = handshake_rto(c, conn);
+    } else {
+        conn->temp_packet_rto = MIN(conn->temp_packet_rto * 2, CRYPTO_SEND_PACKET_INTERVAL);
+    }
+
+    if (conn->connect_start_time == 0)
+        conn->connect_start_time = temp_time;
+
+    conn->temp_packet_sent_time = temp_time;
     ++conn->temp_packet_num_sent;
+    conn->handshake_num_sent += num_paths;
     return 0;
 }
 
@@ -1187,6 +1462,9 @@ static int handle_data_packet_helper(const Net_Crypto *c, int crypt_connection_i
         clear_temp_packet(c, crypt_connection_id);
         conn->status = CRYPTO_CONN_ESTABLISHED;
 
+        if (conn->connect_start_time)
+            conn->connect_time = current_time_monotonic() - conn->connect_start_time;
+
         if (conn->connection_status_callback)
             conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 1);
     }
@@ -1276,6 +1554,12 @@ static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, cons
             if (number != conn->cookie_request_number)
                 return -1;
 
+            /* Only a request that wasn't sent again tells which try was answered. */
+            if (conn->temp_packet_num_sent == 1) {
+                uint64_t rtt = current_time_monotonic() - conn->temp_packet_sent_time;
+                conn->handshake_rtt = rtt ? MIN(rtt, UINT16_MAX) : 1;
+            }
+
             if (create_send_handshake(c, crypt_connection_id, cookie, conn->dht_public_key) != 0)
                 return -1;
 
@@ -1675,13 +1959,15 @@ static int disconnect_peer_tcp(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
-    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        if (conn->status_tcp[i] != STATUS_TCP_NULL) {
-            pthread_mutex_lock(&c->tcp_mutex);
-            send_disconnect_request(c->tcp_connections[i], conn->con_number_tcp[i]);
-            set_conn_tcp_status(conn, i, STATUS_TCP_NULL);
-            conn->con_number_tcp[i] = 0;
-            pthread_mutex_unlock(&c->tcp_mutex);
+    for (i = 0; i < c->num_tcp_active; ++i) {
+        uint32_t tcp_index = c->tcp_active[i];
+
+        if (conn->status_tcp[tcp_index] != STATUS_TCP_NULL) {
+            pthread_mutex_lock(&c->tcp_locks[tcp_index]);
+            send_disconnect_request(c->tcp_connections[tcp_index], conn->con_number_tcp[tcp_index]);
+            set_conn_tcp_status(conn, tcp_index, STATUS_TCP_NULL);
+            conn->con_number_tcp[tcp_index] = 0;
+            pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
         }
     }
 
@@ -1702,14 +1988,13 @@ static int connect_peer_tcp(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
-    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        if (c->tcp_connections[i] == NULL)
-            continue;
+    for (i = 0; i < c->num_tcp_active; ++i) {
+        uint32_t tcp_index = c->tcp_active[i];
 
-        pthread_mutex_lock(&c->tcp_mutex);
+        pthread_mutex_lock(&c->tcp_locks[tcp_index]);
         //TODO check function return?
-        send_routing_request(c->tcp_connections[i], conn->dht_public_key);
-        pthread_mutex_unlock(&c->tcp_mutex);
+        send_routing_request(c->tcp_connections[tcp_index], conn->dht_public_key);
+        pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
     }
 
     return 0;
@@ -1798,6 +2083,7 @@ int set_direct_ip_port(Net_Crypto *c, int crypt_connection_id, IP_Port ip_port)
             bs_list_remove(&c->ip_port_list, &conn->ip_port, crypt_connection_id);
             conn->ip_port = ip_port;
             conn->direct_lastrecv_time = 0;
+            conn->resume_num_sent = 0;
             return 0;
         }
     }
@@ -1890,9 +2176,9 @@ static int tcp_data_callback(void *object, uint32_t number, uint8_t connection_i
     if (conn == 0)
         return -1;
 
-    pthread_mutex_unlock(&c->tcp_mutex);
+    pthread_mutex_unlock(&c->tcp_locks[TCP_con->net_crypto_location]);
     int ret = handle_packet_connection(c, number, data, length);
-    pthread_mutex_lock(&c->tcp_mutex);
+    pthread_mutex_lock(&c->tcp_locks[TCP_con->net_crypto_location]);
 
     if (ret != 0)
         return -1;
@@ -1933,9 +2219,9 @@ static int tcp_oob_callback(void *object, const uint8_t *public_key, const uint8
         return 0;
     }
 
-    pthread_mutex_unlock(&c->tcp_mutex);
+    pthread_mutex_unlock(&c->tcp_locks[location]);
     int ret = handle_packet_connection(c, crypt_connection_id, data, length);
-    pthread_mutex_lock(&c->tcp_mutex);
+    pthread_mutex_lock(&c->tcp_locks[location]);
 
     if (ret != 0)
         return -1;
@@ -1971,21 +2257,20 @@ static int tcp_connection_check(const Net_Crypto *c, const uint8_t *public_key)
             return -1;
     }
 
-    uint32_t num = 0;
-
-    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        if (c->tcp_connections[i] == NULL)
-            continue;
-
-        if (memcmp(c->tcp_connections[i]->public_key, public_key, crypto_box_PUBLICKEYBYTES) == 0)
+    for (i = 0; i < c->num_tcp_active; ++i) {
+        if (memcmp(c->tcp_connections[c->tcp_active[i]]->public_key, public_key, crypto_box_PUBLICKEYBYTES) == 0)
             return -1;
-
-        ++num;
     }
 
-    if (num == MAX_TCP_CONNECTIONS)
+    if (c->num_tcp_active == MAX_TCP_CONNECTIONS)
         return -1;
 
+    for (i = 0; i < TCP_RELAY_EVICTED_NUM; ++i) {
+        if (c->tcp_evicted[i].time && !is_timeout(c->tcp_evicted[i].time, TCP_RELAY_EVICTED_TIMEOUT)
+                && memcmp(c->tcp_evicted[i].public_key, public_key, crypto_box_PUBLICKEYBYTES) == 0)
+            return -1;
+    }
+
     return 0;
 }
 
@@ -2029,13 +2314,16 @@ int add_tcp_relay_peer(Net_Crypto *c, int crypt_connection_id, IP_Port ip_port,
         ++conn->num_tcp_relays;
     }
 
-    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        if (c->tcp_connections[i] == NULL)
-            continue;
+    for (i = 0; i < c->num_tcp_active; ++i) {
+        uint32_t tcp_index = c->tcp_active[i];
 
-        if (memcmp(c->tcp_connections[i]->public_key, public_key, crypto_box_PUBLICKEYBYTES) == 0) {
-            if (conn->status_tcp[i] == STATUS_TCP_OFFLINE)
-                set_conn_tcp_status(conn, i, STATUS_TCP_INVISIBLE);
+        if (memcmp(c->tcp_connections[tcp_index]->public_key, public_key, crypto_box_PUBLICKEYBYTES) == 0) {
+            pthread_mutex_lock(&c->tcp_locks[tcp_index]);
+
+            if (conn->status_tcp[tcp_index] == STATUS_TCP_OFFLINE)
+                set_conn_tcp_status(conn, tcp_index, STATUS_TCP_INVISIBLE);
+
+            pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
         }
     }
 
@@ -2075,7 +2363,19 @@ int add_tcp_relay(Net_Crypto *c, IP_Port ip_port, const uint8_t *public_key)
     return -1;
 }
 
+/* return a random TCP connection number.
+ * return -1 if there are none.
+ */
+static int random_tcp_con_number(const Net_Crypto *c)
+{
+    if (c->num_tcp_active == 0)
+        return -1;
+
+    return c->tcp_active[rand() % c->num_tcp_active];
+}
+
 /* Return a random TCP connection number for use in send_tcp_onion_request.
+ * The better of two random relays is picked.
  *
  * TODO: This number is just the index of an array that the elements can
  * change without warning.
@@ -2085,15 +2385,17 @@ int add_tcp_relay(Net_Crypto *c, IP_Port ip_port, const uint8_t *public_key)
  */
 int get_random_tcp_con_number(Net_Crypto *c)
 {
-    unsigned int i, r = rand();
+    int first = random_tcp_con_number(c);
 
-    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        if (c->tcp_connections[(i + r) % MAX_TCP_CONNECTIONS]) {
-            return (i + r) % MAX_TCP_CONNECTIONS;
-        }
-    }
+    if (first == -1)
+        return -1;
 
-    return -1;
+    int second = random_tcp_con_number(c);
+
+    if (tcp_relay_cost(c, second) < tcp_relay_cost(c, first))
+        return second;
+
+    return first;
 }
 
 /* Send an onion packet via the TCP relay corresponding to TCP_conn_number.
@@ -2103,14 +2405,14 @@ int get_random_tcp_con_number(Net_Crypto *c)
  */
 int send_tcp_onion_request(Net_Crypto *c, unsigned int TCP_conn_number, const uint8_t *data, uint16_t length)
 {
-    if (TCP_conn_number > MAX_TCP_CONNECTIONS) {
+    if (TCP_conn_number >= MAX_TCP_CONNECTIONS) {
         return -1;
     }
 
     if (c->tcp_connections[TCP_conn_number]) {
-        pthread_mutex_lock(&c->tcp_mutex);
+        pthread_mutex_lock(&c->tcp_locks[TCP_conn_number]);
         int ret = send_onion_request(c->tcp_connections[TCP_conn_number], data, length);
-        pthread_mutex_unlock(&c->tcp_mutex);
+        pthread_mutex_unlock(&c->tcp_locks[TCP_conn_number]);
 
         if (ret == 1)
             return 0;
@@ -2128,7 +2430,7 @@ void tcp_onion_response_handler(Net_Crypto *c, int (*tcp_onion_callback)(void *o
     c->tcp_onion_callback_object = object;
 }
 
-/* Copy a maximum of num TCP relays we are connected to to tcp_relays.
+/* Copy a maximum of num TCP relays we are connected to to tcp_relays, best first.
  * NOTE that the family of the copied ip ports will be set to TCP_INET or TCP_INET6.
  *
  * return number of relays copied to tcp_relays on success.
@@ -2136,28 +2438,46 @@ void tcp_onion_response_handler(Net_Crypto *c, int (*tcp_onion_callback)(void *o
  */
 unsigned int copy_connected_tcp_relays(const Net_Crypto *c, Node_format *tcp_relays, uint16_t num)
 {
-    if (num == 0)
-        return 0;
+    uint32_t indexes[MAX_TCP_CONNECTIONS], costs[MAX_TCP_CONNECTIONS];
+    uint32_t num_sorted = sort_tcp_connections(c, indexes, costs);
+    uint16_t copied;
 
-    uint32_t i;
-    uint16_t copied = 0;
+    for (copied = 0; copied < num && copied < num_sorted; ++copied) {
+        const TCP_Client_Connection *tcp_con = c->tcp_connections[indexes[copied]];
+        memcpy(tcp_relays[copied].public_key, tcp_con->public_key, crypto_box_PUBLICKEYBYTES);
+        tcp_relays[copied].ip_port = tcp_con->ip_port;
 
-    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        if (c->tcp_connections[i] != NULL) {
-            memcpy(tcp_relays[copied].public_key, c->tcp_connections[i]->public_key, crypto_box_PUBLICKEYBYTES);
-            tcp_relays[copied].ip_port = c->tcp_connections[i]->ip_port;
-
-            if (tcp_relays[copied].ip_port.ip.family == AF_INET) {
-                tcp_relays[copied].ip_port.ip.family = TCP_INET;
-            } else if (tcp_relays[copied].ip_port.ip.family == AF_INET6) {
-                tcp_relays[copied].ip_port.ip.family = TCP_INET6;
-            }
+        if (tcp_relays[copied].ip_port.ip.family == AF_INET) {
+            tcp_relays[copied].ip_port.ip.family = TCP_INET;
+        } else if (tcp_relays[copied].ip_port.ip.family == AF_INET6) {
+            tcp_relays[copied].ip_port.ip.family = TCP_INET6;
+        }
+    }
+
+    return copied;
+}
 
-            ++copied;
+/* Copy the stats of a maximum of num TCP relays we are connected to to stats, best first.
+ *
+ * return number of relays copied to stats.
+ */
+unsigned int copy_tcp_relay_stats(const Net_Crypto *c, TCP_Relay_Stats *stats, unsigned int num)
+{
+    uint32_t indexes[MAX_TCP_CONNECTIONS], costs[MAX_TCP_CONNECTIONS];
+    uint32_t num_sorted = sort_tcp_connections(c, indexes, costs);
+    unsigned int copied;
 
-            if (copied == num)
-                return copied;
-        }
+    for (copied = 0; copied < num && copied < num_sorted; ++copied) {
+        uint32_t tcp_index = indexes[copied];
+        const TCP_Client_Connection *tcp_con = c->tcp_connections[tcp_index];
+        memcpy(stats[copied].public_key, tcp_con->public_key, crypto_box_PUBLICKEYBYTES);
+        stats[copied].ip_port = tcp_con->ip_port;
+        stats[copied].connected_time = c->tcp_connected_time[tcp_index];
+        stats[copied].rtt = tcp_con->rtt;
+        stats[copied].rate = c->tcp_rate[tcp_index];
+        stats[copied].sends = c->tcp_sends[tcp_index];
+        stats[copied].refused = c->tcp_refused[tcp_index];
+        stats[copied].cost = costs[copied];
     }
 
     return copied;
@@ -2207,7 +2527,18 @@ static int add_tcp_connected(Net_Crypto *c, TCP_Client_Connection *tcp_con)
     routing_data_handler(tcp_con, tcp_data_callback, tcp_con);
     oob_data_handler(tcp_con, tcp_oob_callback, tcp_con);
     onion_response_handler(tcp_con, tcp_onion_callback, c);
+
+    pthread_mutex_lock(&c->tcp_locks[tcp_num]);
     c->tcp_connections[tcp_num] = tcp_con;
+    c->tcp_rate[tcp_num] = 0;
+    c->tcp_bytes_sent[tcp_num] = 0;
+    c->tcp_sends[tcp_num] = 0;
+    c->tcp_refused[tcp_num] = 0;
+    c->tcp_connected_time[tcp_num] = unix_time();
+    pthread_mutex_unlock(&c->tcp_locks[tcp_num]);
+
+    c->tcp_active[c->num_tcp_active] = tcp_num;
+    ++c->num_tcp_active;
     return 0;
 }
 
@@ -2215,35 +2546,39 @@ static void do_tcp(Net_Crypto *c)
 {
     uint32_t i;
 
+    /* Only this thread adds and removes TCP connections, so the new ones
+     * aren't shared yet and don't need a lock. */
     for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
         if (c->tcp_connections_new[i] == NULL)
             continue;
 
-        pthread_mutex_lock(&c->tcp_mutex);
         do_TCP_connection(c->tcp_connections_new[i]);
-        pthread_mutex_unlock(&c->tcp_mutex);
 
         if (c->tcp_connections_new[i]->status == TCP_CLIENT_CONFIRMED) {
-            pthread_mutex_lock(&c->tcp_mutex);
-            int ret = add_tcp_connected(c, c->tcp_connections_new[i]);
-            pthread_mutex_unlock(&c->tcp_mutex);
-
-            if (ret == 0) {
-                c->tcp_connections_new[i] = NULL;
-            } else {
+            if (add_tcp_connected(c, c->tcp_connections_new[i]) != 0)
                 kill_TCP_connection(c->tcp_connections_new[i]);
-                c->tcp_connections_new[i] = NULL;
-            }
+
+            c->tcp_connections_new[i] = NULL;
         }
     }
 
-    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        if (c->tcp_connections[i] == NULL)
-            continue;
+    uint64_t temp_time = current_time_monotonic();
+    uint64_t elapsed = temp_time - c->last_tcp_rate_update;
+    _Bool update_rates = (elapsed >= TCP_RATE_INTERVAL);
+
+    if (update_rates)
+        c->last_tcp_rate_update = temp_time;
+
+    for (i = 0; i < c->num_tcp_active; ++i) {
+        uint32_t tcp_index = c->tcp_active[i];
+
+        pthread_mutex_lock(&c->tcp_locks[tcp_index]);
+        do_TCP_connection(c->tcp_connections[tcp_index]);
+
+        if (update_rates)
+            update_tcp_rate(c, tcp_index, elapsed);
 
-        pthread_mutex_lock(&c->tcp_mutex);
-        do_TCP_connection(c->tcp_connections[i]);
-        pthread_mutex_unlock(&c->tcp_mutex);
+        pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
     }
 }
 
@@ -2259,9 +2594,40 @@ static void clear_disconnected_tcp_peer(Crypto_Connection *conn, uint32_t number
     conn->con_number_tcp[number] = 0;
 }
 
+/* Kill TCP connection tcp_index and clear it from the crypto connections.
+ */
+static void remove_tcp_connection(Net_Crypto *c, uint32_t tcp_index)
+{
+    TCP_Client_Connection *tcp_con = c->tcp_connections[tcp_index];
+    uint32_t i;
+
+    pthread_mutex_lock(&c->tcp_locks[tcp_index]);
+    c->tcp_connections[tcp_index] = NULL;
+    kill_TCP_connection(tcp_con);
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        Crypto_Connection *conn = get_crypto_connection(c, i);
+
+        if (conn == 0)
+            continue;
+
+        clear_disconnected_tcp_peer(conn, tcp_index);
+    }
+
+    pthread_mutex_unlock(&c->tcp_locks[tcp_index]);
+
+    for (i = 0; i < c->num_tcp_active; ++i) {
+        if (c->tcp_active[i] == tcp_index) {
+            --c->num_tcp_active;
+            c->tcp_active[i] = c->tcp_active[c->num_tcp_active];
+            break;
+        }
+    }
+}
+
 static void clear_disconnected_tcp(Net_Crypto *c)
 {
-    uint32_t i, j;
+    uint32_t i;
 
     for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
         if (c->tcp_connections_new[i] == NULL)
@@ -2274,32 +2640,87 @@ static void clear_disconnected_tcp(Net_Crypto *c)
         c->tcp_connections_new[i] = NULL;
     }
 
-    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
-        if (c->tcp_connections[i] == NULL)
-            continue;
-
-        TCP_Client_Connection *tcp_con = c->tcp_connections[i];
+    /* Backwards as removing a connection moves the last one of tcp_active. */
+    for (i = c->num_tcp_active; i-- > 0;) {
+        uint32_t tcp_index = c->tcp_active[i];
+        TCP_Client_Connection *tcp_con = c->tcp_connections[tcp_index];
 
         if (tcp_con->status != TCP_CLIENT_DISCONNECTED)
             continue;
 
         /* Try reconnecting to relay on disconnect. */
         add_tcp_relay(c, tcp_con->ip_port, tcp_con->public_key);
+        remove_tcp_connection(c, tcp_index);
+    }
+}
 
-        pthread_mutex_lock(&c->tcp_mutex);
-        c->tcp_connections[i] = NULL;
-        kill_TCP_connection(tcp_con);
+/* return 1 if a crypto connection only reaches its peer through TCP connection tcp_index.
+ * return 0 if not.
+ */
+static int tcp_connection_needed(const Net_Crypto *c, uint32_t tcp_index)
+{
+    uint32_t i;
 
-        for (j = 0; j < c->crypto_connections_length; ++j) {
-            Crypto_Connection *conn = get_crypto_connection(c, j);
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        const Crypto_Connection *conn = &c->crypto_connections[i];
 
-            if (conn == 0)
-                continue;
+        if (conn->status == CRYPTO_CONN_NO_CONNECTION || conn->num_tcp_online != 1)
+            continue;
 
-            clear_disconnected_tcp_peer(conn, i);
-        }
+        if (conn->status_tcp[tcp_index] != STATUS_TCP_ONLINE)
+            continue;
 
-        pthread_mutex_unlock(&c->tcp_mutex);
+        if ((UDP_DIRECT_TIMEOUT + conn->direct_lastrecv_time) > current_time_monotonic())
+            continue;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Disconnect from a bad TCP relay so that a better one can take its place.
+ *
+ * A relay is bad when it costs more than TCP_RELAY_BAD_COST and TCP_RELAY_BAD_FACTOR
+ * times the median relay. The relay is remembered so that we don't connect to it
+ * again for TCP_RELAY_EVICTED_TIMEOUT seconds.
+ */
+static void evict_bad_tcp_relay(Net_Crypto *c)
+{
+    if (!is_timeout(c->last_tcp_evict_check, TCP_RELAY_EVICT_INTERVAL))
+        return;
+
+    c->last_tcp_evict_check = unix_time();
+
+    uint32_t indexes[MAX_TCP_CONNECTIONS], costs[MAX_TCP_CONNECTIONS];
+    uint32_t num = sort_tcp_connections(c, indexes, costs);
+
+    if (num < TCP_RELAY_EVICT_MIN_RELAYS)
+        return;
+
+    uint32_t bad_cost = costs[num / 2] * TCP_RELAY_BAD_FACTOR;
+
+    if (bad_cost < TCP_RELAY_BAD_COST)
+        bad_cost = TCP_RELAY_BAD_COST;
+
+    uint32_t i = num;
+
+    while (i > 0 && costs[i - 1] > bad_cost) {
+        --i;
+        uint32_t tcp_index = indexes[i];
+
+        if (!is_timeout(c->tcp_connected_time[tcp_index], TCP_RELAY_EVICT_MIN_AGE))
+            continue;
+
+        if (tcp_connection_needed(c, tcp_index))
+            continue;
+
+        memcpy(c->tcp_evicted[c->tcp_evicted_index].public_key, c->tcp_connections[tcp_index]->public_key,
+               crypto_box_PUBLICKEYBYTES);
+        c->tcp_evicted[c->tcp_evicted_index].time = unix_time();
+        c->tcp_evicted_index = (c->tcp_evicted_index + 1) % TCP_RELAY_EVICTED_NUM;
+        remove_tcp_connection(c, tcp_index);
+        return;
     }
 }
 
@@ -2442,6 +2863,7 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
 
     pthread_mutex_lock(&conn->mutex);
     conn->direct_lastrecv_time = current_time_monotonic();
+    conn->direct_send_rate = conn->packet_send_rate;
     pthread_mutex_unlock(&conn->mutex);
     return 0;
 }
@@ -2454,12 +2876,208 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
  * the number of ms between request packets to send at that ratio
  */
 #define REQUEST_PACKETS_COMPARE_CONSTANT (0.5 * 100.0)
+
+/* Make the congestion control act as if conn had been sending rate packets per
+ * second until now, so that the time the old path of a resumed session was
+ * dead doesn't hold its speed down.
+ */
+static void restore_send_rate(Crypto_Connection *conn, double rate)
+{
+    uint32_t i, queue_size = num_packets_array(&conn->send_array);
+    long signed int num_packets = rate * (PACKET_COUNTER_AVERAGE_INTERVAL / 1000.0) + 0.5;
+
+    for (i = 0; i < CONGESTION_QUEUE_ARRAY_SIZE; ++i) {
+        conn->last_sendqueue_size[i] = queue_size;
+        conn->last_num_packets_sent[i] = num_packets;
+    }
+
+    if (rate > conn->packet_send_rate)
+        conn->packet_send_rate = rate;
+}
+
+#define CRYPTO_RESUME_PLAIN_SIZE (1 + sizeof(uint64_t) + sizeof(uint64_t))
+#define CRYPTO_RESUME_PACKET_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + CRYPTO_RESUME_PLAIN_SIZE + crypto_box_MACBYTES)
+
+/* Create a resume packet of type (CRYPTO_RESUME_REQUEST or CRYPTO_RESUME_RESPONSE)
+ * for conn in packet (of size CRYPTO_RESUME_PACKET_SIZE).
+ *
+ * Packet contents are:
+ * [uint8_t 28][our session public key][random nonce][encrypted with the session shared key:
+ * [uint8_t type][uint64_t number][uint64_t echo id]]
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int create_resume_packet(const Crypto_Connection *conn, uint8_t *packet, uint8_t type, uint64_t number,
+                                uint64_t echo_id)
+{
+    uint8_t plain[CRYPTO_RESUME_PLAIN_SIZE];
+    plain[0] = type;
+    memcpy(plain + 1, &number, sizeof(uint64_t));
+    memcpy(plain + 1 + sizeof(uint64_t), &echo_id, sizeof(uint64_t));
+
+    packet[0] = NET_PACKET_CRYPTO_RESUME;
+    memcpy(packet + 1, conn->sessionpublic_key, crypto_box_PUBLICKEYBYTES);
+    new_nonce(packet + 1 + crypto_box_PUBLICKEYBYTES);
+    int len = encrypt_data_symmetric(conn->shared_key, packet + 1 + crypto_box_PUBLICKEYBYTES, plain, sizeof(plain),
+                                     packet + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
+
+    if (len != sizeof(plain) + crypto_box_MACBYTES)
+        return -1;
+
+    return 0;
+}
+
+/* Get the established crypto connection id from the session public key of the peer.
+ *
+ *  return -1 if there are no connections like we are looking for.
+ *  return id if it found it.
+ */
+static int getcryptconnection_id_session_pubkey(const Net_Crypto *c, const uint8_t *session_public_key)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        if (c->crypto_connections[i].status == CRYPTO_CONN_ESTABLISHED)
+            if (memcmp(session_public_key, c->crypto_connections[i].peersessionpublic_key, crypto_box_PUBLICKEYBYTES) == 0)
+                return i;
+    }
+
+    return -1;
+}
+
+/* Handle resume packets.
+ *
+ * A resume request moves an established session to the address it came from
+ * in one round trip, the send and receive buffers are kept so nothing already
+ * sent or received is lost.
+ */
+static int udp_handle_resume_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    if (length != CRYPTO_RESUME_PACKET_SIZE)
+        return 1;
+
+    Net_Crypto *c = object;
+    int crypt_connection_id = getcryptconnection_id_session_pubkey(c, packet + 1);
+
+    if (crypt_connection_id == -1)
+        return 1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return 1;
+
+    uint8_t plain[CRYPTO_RESUME_PLAIN_SIZE];
+    int len = decrypt_data_symmetric(conn->shared_key, packet + 1 + crypto_box_PUBLICKEYBYTES,
+                                     packet + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES,
+                                     length - (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES), plain);
+
+    if (len != sizeof(plain))
+        return 1;
+
+    uint64_t number, echo_id;
+    memcpy(&number, plain + 1, sizeof(uint64_t));
+    memcpy(&echo_id, plain + 1 + sizeof(uint64_t), sizeof(uint64_t));
+
+    if (plain[0] == CRYPTO_RESUME_REQUEST) {
+        /* Requests must be newer than the last one, or a recorded one could be
+         * sent again from somewhere else to move the session away. */
+        if (number <= conn->resume_recv_number)
+            return 1;
+
+        uint8_t response[CRYPTO_RESUME_PACKET_SIZE];
+
+        if (create_resume_packet(conn, response, CRYPTO_RESUME_RESPONSE, 0, echo_id) != 0)
+            return 1;
+
+        conn->resume_recv_number = number;
+        sendpacket(c->dht->net, source, response, sizeof(response));
+    } else if (plain[0] == CRYPTO_RESUME_RESPONSE) {
+        if (conn->resume_id == 0 || echo_id != conn->resume_id)
+            return 1;
+
+        conn->resume_id = 0;
+    } else {
+        return 1;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    crypto_connection_add_source(c, crypt_connection_id, source);
+    pthread_mutex_unlock(&conn->mutex);
+
+    restore_send_rate(conn, conn->direct_send_rate);
+
+    /* Tell the peer which packets we are missing so that what was lost while
+     * the old path was dead is sent again right away. */
+    send_request_packet(c, crypt_connection_id);
+    return 0;
+}
+
+/* Send resume requests directly to the established connections that stopped
+ * receiving packets from their direct address.
+ *
+ * If we moved the peer will answer our new address, if they moved the requests
+ * go nowhere until they send theirs. Either way only a round trip is needed.
+ */
+static void send_resume_requests(Net_Crypto *c)
+{
+    uint32_t i;
+    uint64_t temp_time = current_time_monotonic();
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        Crypto_Connection *conn = get_crypto_connection(c, i);
+
+        if (conn == 0)
+            return;
+
+        if (conn->status != CRYPTO_CONN_ESTABLISHED)
+            continue;
+
+        if (conn->ip_port.ip.family != AF_INET && conn->ip_port.ip.family != AF_INET6)
+            continue;
+
+        if (conn->direct_lastrecv_time + CRYPTO_RESUME_TIMEOUT > temp_time)
+            continue;
+
+        if (conn->resume_lastrecv_time != conn->direct_lastrecv_time) {
+            conn->resume_lastrecv_time = conn->direct_lastrecv_time;
+            conn->resume_num_sent = 0;
+        }
+
+        if (conn->resume_num_sent >= MAX_NUM_SENDPACKET_TRIES)
+            continue;
+
+        if (conn->resume_num_sent && conn->resume_sent_time + CRYPTO_RESUME_INTERVAL > temp_time)
+            continue;
+
+        uint8_t packet[CRYPTO_RESUME_PACKET_SIZE];
+        uint64_t resume_id = random_64b() | 1;
+
+        if (create_resume_packet(conn, packet, CRYPTO_RESUME_REQUEST, conn->resume_number + 1, resume_id) != 0)
+            continue;
+
+        pthread_mutex_lock(&conn->mutex);
+        int ret = sendpacket(c->dht->net, conn->ip_port, packet, sizeof(packet));
+        pthread_mutex_unlock(&conn->mutex);
+
+        if ((uint32_t)ret != sizeof(packet))
+            continue;
+
+        ++conn->resume_number;
+        conn->resume_id = resume_id;
+        conn->resume_sent_time = temp_time;
+        ++conn->resume_num_sent;
+    }
+}
+
 static void send_crypto_packets(Net_Crypto *c)
 {
     uint32_t i;
     uint64_t temp_time = current_time_monotonic();
     double total_send_rate = 0;
     uint32_t peak_request_packet_interval = ~0;
+    uint32_t temp_packet_interval = ~0;
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
         Crypto_Connection *conn = get_crypto_connection(c, i);
@@ -2467,8 +3085,23 @@ static void send_crypto_packets(Net_Crypto *c)
         if (conn == 0)
             return;
 
-        if (CRYPTO_SEND_PACKET_INTERVAL + conn->temp_packet_sent_time < temp_time) {
-            send_temp_packet(c, i);
+        if (conn->temp_packet_rto + conn->temp_packet_sent_time < temp_time) {
+            /* Connections are confirmed by the first data packet the peer
+             * receives, so one goes with every handshake. */
+            if (send_temp_packet(c, i) == 0 && conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
+                if (send_request_packet(c, i) == 0) {
+                    conn->last_request_packet_sent = temp_time;
+                }
+            }
+        }
+
+        if (conn->temp_packet) {
+            uint64_t next_send_time = conn->temp_packet_rto + conn->temp_packet_sent_time;
+            uint32_t interval = next_send_time > temp_time ? next_send_time - temp_time : 0;
+
+            if (interval < temp_packet_interval) {
+                temp_packet_interval = interval;
+            }
         }
 
         if ((conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED)
@@ -2573,6 +3206,10 @@ static void send_crypto_packets(Net_Crypto *c)
         c->current_sleep_time = sleep_time;
     }
 
+    if (c->current_sleep_time > temp_packet_interval) {
+        c->current_sleep_time = temp_packet_interval + 1;
+    }
+
     if (total_send_rate > CRYPTO_PACKET_MIN_RATE) {
         sleep_time = (1000.0 / total_send_rate);
 
@@ -2816,12 +3453,24 @@ Net_Crypto *new_net_crypto(DHT *dht, TCP_Proxy_Info *proxy_info)
     if (temp == NULL)
         return NULL;
 
-    if (create_recursive_mutex(&temp->tcp_mutex) != 0 ||
-            pthread_mutex_init(&temp->connections_mutex, NULL) != 0) {
+    if (pthread_mutex_init(&temp->connections_mutex, NULL) != 0) {
         free(temp);
         return NULL;
     }
 
+    uint32_t i;
+
+    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
+        if (create_recursive_mutex(&temp->tcp_locks[i]) != 0) {
+            while (i-- > 0)
+                pthread_mutex_destroy(&temp->tcp_locks[i]);
+
+            pthread_mutex_destroy(&temp->connections_mutex);
+            free(temp);
+            return NULL;
+        }
+    }
+
     temp->dht = dht;
 
     new_keys(temp);
@@ -2833,6 +3482,7 @@ Net_Crypto *new_net_crypto(DHT *dht, TCP_Proxy_Info *proxy_info)
     networking_registerhandler(dht->net, NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
+    networking_registerhandler(dht->net, NET_PACKET_CRYPTO_RESUME, &udp_handle_resume_packet, temp);
 
     bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
 
@@ -2857,7 +3507,8 @@ static void kill_timedout(Net_Crypto *c)
 
         if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
                 || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-            if (conn->temp_packet_num_sent < MAX_NUM_SENDPACKET_TRIES)
+            if (conn->temp_packet_num_sent == 0
+                    || conn->temp_packet_first_sent_time + CRYPTO_HANDSHAKE_TIMEOUT > current_time_monotonic())
                 continue;
 
             conn->killed = 1;
@@ -2895,6 +3546,8 @@ void do_net_crypto(Net_Crypto *c)
     kill_timedout(c);
     do_tcp(c);
     clear_disconnected_tcp(c);
+    evict_bad_tcp_relay(c);
+    send_resume_requests(c);
     send_crypto_packets(c);
 }
 
@@ -2911,7 +3564,10 @@ void kill_net_crypto(Net_Crypto *c)
         kill_TCP_connection(c->tcp_connections[i]);
     }
 
-    pthread_mutex_destroy(&c->tcp_mutex);
+    for (i = 0; i < MAX_TCP_CONNECTIONS; ++i) {
+        pthread_mutex_destroy(&c->tcp_locks[i]);
+    }
+
     pthread_mutex_destroy(&c->connections_mutex);
 
     bs_list_free(&c->ip_port_list);
@@ -2919,6 +3575,7 @@ void kill_net_crypto(Net_Crypto *c)
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_RESPONSE, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_HS, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_DATA, NULL, NULL);
+    networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_RESUME, NULL, NULL);
     memset(c, 0, sizeof(Net_Crypto));
     free(c);
 }
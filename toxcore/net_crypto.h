@@ -27,6 +27,7 @@
 #include "DHT.h"
 #include "LAN_discovery.h"
 #include "TCP_client.h"
+#include "list.h"
 #include <pthread.h>
 
 #define CRYPTO_CONN_NO_CONNECTION 0
@@ -60,9 +61,30 @@
    before giving up. */
 #define MAX_NUM_SENDPACKET_TRIES 8
 
+/* Cookie requests and handshakes are sent again if they weren't answered after
+ * twice the round trip time of the path to the peer (in ms), the wait doubles
+ * after every try up to CRYPTO_SEND_PACKET_INTERVAL. */
+#define CRYPTO_HANDSHAKE_MIN_RTO 100
+#define CRYPTO_HANDSHAKE_DEFAULT_RTT 250
+
+/* Time in ms after the first try at which a cookie request or handshake is given up. */
+#define CRYPTO_HANDSHAKE_TIMEOUT (MAX_NUM_SENDPACKET_TRIES * CRYPTO_SEND_PACKET_INTERVAL)
+
 /* The timeout of no received UDP packets before the direct UDP connection is considered dead. */
 #define UDP_DIRECT_TIMEOUT (MAX_NUM_SENDPACKET_TRIES * CRYPTO_SEND_PACKET_INTERVAL)
 
+/* Established connections send a request packet at least every
+ * CRYPTO_SEND_PACKET_INTERVAL, if nothing arrived directly for this long (in ms)
+ * the direct path is assumed to have changed and resume packets are sent to
+ * move the session to the new path without a new handshake. */
+#define CRYPTO_RESUME_TIMEOUT (CRYPTO_SEND_PACKET_INTERVAL * 5 / 2)
+
+/* Interval in ms between resume requests. */
+#define CRYPTO_RESUME_INTERVAL CRYPTO_SEND_PACKET_INTERVAL
+
+#define CRYPTO_RESUME_REQUEST 0
+#define CRYPTO_RESUME_RESPONSE 1
+
 #define PACKET_ID_PADDING 0 /* Denotes padding */
 #define PACKET_ID_REQUEST 1 /* Used to request unreceived packets */
 #define PACKET_ID_KILL    2 /* Used to kill connection */
@@ -73,6 +95,36 @@
 #define MAX_TCP_CONNECTIONS 64
 #define MAX_TCP_RELAYS_PEER 4
 
+/* Interval in ms at which the throughput of the TCP relay connections is measured. */
+#define TCP_RATE_INTERVAL 1000
+
+/* Throughput in bytes per second a TCP relay connection is assumed to have
+ * until it was measured. */
+#define TCP_RATE_DEFAULT (64 * 1024)
+
+/* Data packet counts of a TCP relay connection are halved when this many were sent. */
+#define TCP_RELAY_WINDOW 64
+/* Cost of a TCP relay we don't have a round trip time for, in ms. */
+#define TCP_RELAY_DEFAULT_RTT 500
+/* Extra cost of a TCP relay per percent of data packets it had no room for, in ms. */
+#define TCP_RELAY_REFUSED_COST 10
+
+/* A TCP relay costing more than TCP_RELAY_BAD_COST ms and more than
+ * TCP_RELAY_BAD_FACTOR times the median relay is bad and gets replaced. */
+#define TCP_RELAY_BAD_COST 500
+#define TCP_RELAY_BAD_FACTOR 4
+/* Seconds between checks for bad relays, at most one is replaced per check. */
+#define TCP_RELAY_EVICT_INTERVAL 10
+/* Relays are only replaced once connected for this many seconds, so that
+ * their round trip time is measured more than once. */
+#define TCP_RELAY_EVICT_MIN_AGE 60
+/* Relays are only replaced when connected to at least this many. */
+#define TCP_RELAY_EVICT_MIN_RELAYS 3
+/* Number of replaced relays that are remembered and for how many seconds
+ * they aren't connected to again. */
+#define TCP_RELAY_EVICTED_NUM 16
+#define TCP_RELAY_EVICTED_TIMEOUT 600
+
 #define STATUS_TCP_NULL      0
 #define STATUS_TCP_OFFLINE   1
 #define STATUS_TCP_INVISIBLE 2 /* we know the other peer is connected to this relay but he isn't appearing online */
@@ -121,11 +173,26 @@ typedef struct {
     uint8_t *temp_packet; /* Where the cookie request/handshake packet is stored while it is being sent. */
     uint16_t temp_packet_length;
     uint64_t temp_packet_sent_time; /* The time at which the last temp_packet was sent in ms. */
+    uint64_t temp_packet_first_sent_time; /* The time at which temp_packet was first sent in ms. */
     uint32_t temp_packet_num_sent;
+    uint32_t temp_packet_rto; /* ms to wait for an answer before sending temp_packet again. */
+    uint16_t handshake_rtt; /* Round trip time in ms measured with the cookie request, 0 if unknown. */
+
+    uint64_t connect_start_time; /* The time at which the first cookie request or handshake was sent in ms. */
+    uint32_t connect_time; /* ms it took from connect_start_time until the connection was established. */
+    uint32_t handshake_num_sent; /* Number of cookie request and handshake packets sent over all paths. */
 
     IP_Port ip_port; /* The ip and port to contact this guy directly.*/
     uint64_t direct_lastrecv_time; /* The Time at which we last received a direct packet in ms. */
 
+    uint64_t resume_id; /* Echoed back in the response to our last resume request, 0 if none is pending. */
+    uint64_t resume_number; /* Number of the last resume request we sent. */
+    uint64_t resume_recv_number; /* Number of the last resume request we accepted. */
+    uint64_t resume_lastrecv_time; /* direct_lastrecv_time when the current resume requests were started. */
+    uint64_t resume_sent_time;
+    uint32_t resume_num_sent;
+    double direct_send_rate; /* packet_send_rate when we last received a direct packet. */
+
     Packets_Array send_array;
     Packets_Array recv_array;
 
@@ -184,13 +251,50 @@ typedef struct {
     uint8_t cookie_length;
 } New_Connection;
 
+typedef struct {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    IP_Port ip_port;
+    uint64_t connected_time; /* unix_time() when we connected to the relay. */
+    uint16_t rtt; /* Smoothed round trip time in ms, 0 if not measured yet. */
+    uint32_t rate; /* Throughput in bytes per second, 0 if not measured yet. */
+    uint8_t sends; /* Recent data packets meant for the relay */
+    uint8_t refused; /* and how many of them it had no room for. */
+    uint32_t cost; /* Expected cost in ms of sending through the relay, lower is better. */
+} TCP_Relay_Stats;
+
 typedef struct {
     DHT *dht;
 
     Crypto_Connection *crypto_connections;
     TCP_Client_Connection *tcp_connections_new[MAX_TCP_CONNECTIONS];
     TCP_Client_Connection *tcp_connections[MAX_TCP_CONNECTIONS];
-    pthread_mutex_t tcp_mutex;
+    /* Lock of each of tcp_connections, held while it is used. Threads sending
+     * packets only try the locks so that they never wait for the relay I/O. */
+    pthread_mutex_t tcp_locks[MAX_TCP_CONNECTIONS];
+    /* Indexes of the used tcp_connections, only changed by the thread running
+     * do_net_crypto(). */
+    uint8_t tcp_active[MAX_TCP_CONNECTIONS];
+    uint32_t num_tcp_active;
+
+    /* Throughput of each of tcp_connections in bytes per second, 0 if unknown.
+     * Only measured while packets wait in its send queue, when it sends as fast
+     * as it can. */
+    uint32_t tcp_rate[MAX_TCP_CONNECTIONS];
+    uint64_t tcp_bytes_sent[MAX_TCP_CONNECTIONS];
+    uint64_t last_tcp_rate_update;
+
+    /* Recent data packets meant for each of tcp_connections and how many of
+     * them it had no room for, see TCP_RELAY_WINDOW. */
+    uint8_t tcp_sends[MAX_TCP_CONNECTIONS];
+    uint8_t tcp_refused[MAX_TCP_CONNECTIONS];
+    uint64_t tcp_connected_time[MAX_TCP_CONNECTIONS];
+
+    struct {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        uint64_t time;
+    } tcp_evicted[TCP_RELAY_EVICTED_NUM];
+    uint32_t tcp_evicted_index;
+    uint64_t last_tcp_evict_check;
 
     pthread_mutex_t connections_mutex;
     unsigned int connection_use_counter;
@@ -370,6 +474,7 @@ void tcp_onion_response_handler(Net_Crypto *c, int (*tcp_onion_callback)(void *o
                                 uint16_t length), void *object);
 
 /* Return a random TCP connection number for use in send_tcp_onion_request.
+ * The better of two random relays is picked.
  *
  * return TCP connection number on success.
  * return -1 on failure.
@@ -383,7 +488,7 @@ int get_random_tcp_con_number(Net_Crypto *c);
  */
 int send_tcp_onion_request(Net_Crypto *c, unsigned int TCP_conn_number, const uint8_t *data, uint16_t length);
 
-/* Copy a maximum of num TCP relays we are connected to to tcp_relays.
+/* Copy a maximum of num TCP relays we are connected to to tcp_relays, best first.
  * NOTE that the family of the copied ip ports will be set to TCP_INET or TCP_INET6.
  *
  * return number of relays copied to tcp_relays on success.
@@ -391,6 +496,12 @@ int send_tcp_onion_request(Net_Crypto *c, unsigned int TCP_conn_number, const ui
  */
 unsigned int copy_connected_tcp_relays(const Net_Crypto *c, Node_format *tcp_relays, uint16_t num);
 
+/* Copy the stats of a maximum of num TCP relays we are connected to to stats, best first.
+ *
+ * return number of relays copied to stats.
+ */
+unsigned int copy_tcp_relay_stats(const Net_Crypto *c, TCP_Relay_Stats *stats, unsigned int num);
+
 /* Kill a crypto connection.
  *
  * return -1 on failure.
@@ -25,6 +25,11 @@
 #define _WIN32_WINNT  0x501
 #endif
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* for sendmmsg() */
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -281,24 +286,25 @@ uint64_t current_time_monotonic(void)
 /* Basic network functions:
  * Function to send packet(data) of length length to ip_port.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+/* Fill addr with the address to send to ip_port from the socket of net.
+ *
+ * return size of the address on success.
+ * return 0 on failure.
+ */
+static size_t ip_port_to_addr(const Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr)
 {
     if (net->family == 0) /* Socket not initialized */
-        return -1;
+        return 0;
 
     /* socket AF_INET, but target IP NOT: can't send */
     if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET))
-        return -1;
-
-    struct sockaddr_storage addr;
-    size_t addrsize = 0;
+        return 0;
 
     if (ip_port.ip.family == AF_INET) {
         if (net->family == AF_INET6) {
             /* must convert to IPV4-in-IPV6 address */
-            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
-            addrsize = sizeof(struct sockaddr_in6);
             addr6->sin6_family = AF_INET6;
             addr6->sin6_port = ip_port.port;
 
@@ -314,29 +320,39 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
 
             addr6->sin6_flowinfo = 0;
             addr6->sin6_scope_id = 0;
+            return sizeof(struct sockaddr_in6);
         } else {
-            struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+            struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
 
-            addrsize = sizeof(struct sockaddr_in);
             addr4->sin_family = AF_INET;
             addr4->sin_addr = ip_port.ip.ip4.in_addr;
             addr4->sin_port = ip_port.port;
+            return sizeof(struct sockaddr_in);
         }
     } else if (ip_port.ip.family == AF_INET6) {
-        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
-        addrsize = sizeof(struct sockaddr_in6);
         addr6->sin6_family = AF_INET6;
         addr6->sin6_port = ip_port.port;
         addr6->sin6_addr = ip_port.ip.ip6.in6_addr;
 
         addr6->sin6_flowinfo = 0;
         addr6->sin6_scope_id = 0;
-    } else {
-        /* unknown address type*/
-        return -1;
+        return sizeof(struct sockaddr_in6);
     }
 
+    /* unknown address type*/
+    return 0;
+}
+
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    struct sockaddr_storage addr;
+    size_t addrsize = ip_port_to_addr(net, ip_port, &addr);
+
+    if (addrsize == 0)
+        return -1;
+
     int res = sendto(net->sock, (char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
 
     loglogdata("O=>", data, length, ip_port, res);
@@ -344,6 +360,122 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
     return res;
 }
 
+/* Fill packet with data of length to send to ip_port from the socket of net.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_queue_packet(const Networking_Core *net, Queued_Packet *packet, IP_Port ip_port, const uint8_t *data,
+                            uint16_t length)
+{
+    if (length > MAX_UDP_PACKET_SIZE)
+        return -1;
+
+    packet->addrsize = ip_port_to_addr(net, ip_port, &packet->addr);
+
+    if (packet->addrsize == 0)
+        return -1;
+
+    packet->ip_port = ip_port;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+    return 0;
+}
+
+/* Send num packets filled by networking_queue_packet() with as few system calls
+ * as possible.
+ *
+ * Unlike the other networking functions this one can be called from any thread.
+ */
+void sendpacket_batch(const Networking_Core *net, const Queued_Packet *packets, uint32_t num)
+{
+    uint32_t i;
+
+#if defined(__linux__)
+    struct mmsghdr msgs[NET_SEND_QUEUE_SIZE];
+    struct iovec iovs[NET_SEND_QUEUE_SIZE];
+
+    while (num > NET_SEND_QUEUE_SIZE) {
+        sendpacket_batch(net, packets, NET_SEND_QUEUE_SIZE);
+        packets += NET_SEND_QUEUE_SIZE;
+        num -= NET_SEND_QUEUE_SIZE;
+    }
+
+    for (i = 0; i < num; ++i) {
+        iovs[i].iov_base = (void *)packets[i].data;
+        iovs[i].iov_len = packets[i].length;
+        memset(&msgs[i], 0, sizeof(struct mmsghdr));
+        msgs[i].msg_hdr.msg_name = (void *)&packets[i].addr;
+        msgs[i].msg_hdr.msg_namelen = packets[i].addrsize;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    i = 0;
+
+    while (i < num) {
+        int sent = sendmmsg(net->sock, msgs + i, num - i, 0);
+
+        if (sent <= 0) {
+            /* Skip the packet that failed to send. */
+            loglogdata("O=>", packets[i].data, packets[i].length, packets[i].ip_port, -1);
+            ++i;
+            continue;
+        }
+
+        i += sent;
+    }
+
+#else
+
+    for (i = 0; i < num; ++i) {
+        int res = sendto(net->sock, (char *) packets[i].data, packets[i].length, 0, (struct sockaddr *)&packets[i].addr,
+                         packets[i].addrsize);
+        loglogdata("O=>", packets[i].data, packets[i].length, packets[i].ip_port, res);
+    }
+
+#endif
+}
+
+/* Same as sendpacket() but if it is called from a packet handler, the packet is
+ * queued and sent with the other queued ones (with a single system call where
+ * possible) before networking_poll() returns.
+ *
+ * Use it for packets that are only forwarded, when failing to send them isn't
+ * reported to anyone.
+ *
+ * return length on success (packet sent or queued).
+ * return -1 on failure.
+ */
+int sendpacket_queued(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    if (!net->in_poll)
+        return sendpacket(net, ip_port, data, length);
+
+    if (net->send_queue == NULL) {
+        net->send_queue = malloc(NET_SEND_QUEUE_SIZE * sizeof(Queued_Packet));
+
+        if (net->send_queue == NULL)
+            return sendpacket(net, ip_port, data, length);
+    }
+
+    if (net->send_queue_length == NET_SEND_QUEUE_SIZE)
+        networking_send_queued(net);
+
+    if (networking_queue_packet(net, &net->send_queue[net->send_queue_length], ip_port, data, length) == -1)
+        return -1;
+
+    ++net->send_queue_length;
+    return length;
+}
+
+/* Send the packets queued by sendpacket_queued(). */
+void networking_send_queued(Networking_Core *net)
+{
+    sendpacket_batch(net, net->send_queue, net->send_queue_length);
+    net->send_queue_length = 0;
+}
+
 /* Function to receive data
  *  ip and port of sender is put into ip_port.
  *  Packet data is put into data.
@@ -412,6 +544,8 @@ void networking_poll(Networking_Core *net)
     uint8_t data[MAX_UDP_PACKET_SIZE];
     uint32_t length;
 
+    net->in_poll = 1;
+
     while (receivepacket(net->sock, &ip_port, data, &length) != -1) {
         if (length < 1) continue;
 
@@ -422,6 +556,11 @@ void networking_poll(Networking_Core *net)
 
         net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length);
     }
+
+    net->in_poll = 0;
+
+    if (net->send_queue_length)
+        networking_send_queued(net);
 }
 
 #ifndef VANILLA_NACL
@@ -679,6 +818,7 @@ void kill_networking(Networking_Core *net)
     if (net->family != 0) /* Socket not initialized */
         kill_sock(net->sock);
 
+    free(net->send_queue);
     free(net);
     return;
 }
@@ -102,6 +102,7 @@ typedef int sock_t;
 #define NET_PACKET_COOKIE_RESPONSE 25  /* Cookie response packet */
 #define NET_PACKET_CRYPTO_HS       26  /* Crypto handshake packet */
 #define NET_PACKET_CRYPTO_DATA     27  /* Crypto data packet */
+#define NET_PACKET_CRYPTO_RESUME   28  /* Crypto session resume packet */
 #define NET_PACKET_CRYPTO          32  /* Encrypted data packet ID. */
 #define NET_PACKET_LAN_DISCOVERY   33  /* LAN discovery packet ID. */
 
@@ -293,6 +294,17 @@ typedef struct {
     void *object;
 } Packet_Handles;
 
+/* Maximum number of packets sendpacket_queued() holds before sending them. */
+#define NET_SEND_QUEUE_SIZE 64
+
+typedef struct {
+    struct sockaddr_storage addr;
+    uint32_t addrsize;
+    IP_Port ip_port;
+    uint16_t length;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+} Queued_Packet;
+
 typedef struct {
     Packet_Handles packethandlers[256];
 
@@ -300,6 +312,10 @@ typedef struct {
     uint16_t port;
     /* Our UDP socket. */
     sock_t sock;
+
+    _Bool in_poll; /* set while networking_poll() is running the packet handlers. */
+    Queued_Packet *send_queue; /* allocated the first time sendpacket_queued() queues. */
+    uint32_t send_queue_length;
 } Networking_Core;
 
 /* Run this before creating sockets.
@@ -349,6 +365,36 @@ uint64_t current_time_monotonic(void);
 /* Function to send packet(data) of length length to ip_port. */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/* Same as sendpacket() but if it is called from a packet handler, the packet is
+ * queued and sent with the other queued ones (with a single system call where
+ * possible) before networking_poll() returns.
+ *
+ * Use it for packets that are only forwarded, when failing to send them isn't
+ * reported to anyone.
+ *
+ * return length on success (packet sent or queued).
+ * return -1 on failure.
+ */
+int sendpacket_queued(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
+
+/* Send the packets queued by sendpacket_queued(). */
+void networking_send_queued(Networking_Core *net);
+
+/* Fill packet with data of length to send to ip_port from the socket of net.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_queue_packet(const Networking_Core *net, Queued_Packet *packet, IP_Port ip_port, const uint8_t *data,
+                            uint16_t length);
+
+/* Send num packets filled by networking_queue_packet() with as few system calls
+ * as possible.
+ *
+ * Unlike the other networking functions this one can be called from any thread.
+ */
+void sendpacket_batch(const Networking_Core *net, const Queued_Packet *packets, uint32_t num);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
 
@@ -0,0 +1,366 @@
+/* node_cache.c
+ *
+ * Cache of DHT nodes with quality scores that can be kept in an append only
+ * file so that the DHT can warm start from known good nodes.
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "node_cache.h"
+#include "util.h"
+
+Node_Cache *new_node_cache(void)
+{
+    return calloc(1, sizeof(Node_Cache));
+}
+
+void kill_node_cache(Node_Cache *cache)
+{
+    free(cache);
+}
+
+/* return index of the node with public_key.
+ * return -1 if it isn't in the cache.
+ */
+static int find_node(const Node_Cache *cache, const uint8_t *public_key)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache->num_entries; ++i) {
+        if (id_equal(cache->entries[i].public_key, public_key))
+            return i;
+    }
+
+    return -1;
+}
+
+/* return index of a free entry, or of the worst node if the cache is full.
+ */
+static uint32_t free_entry(Node_Cache *cache)
+{
+    if (cache->num_entries < NODE_CACHE_SIZE)
+        return cache->num_entries++;
+
+    uint32_t i, worst = 0;
+    int64_t worst_score = node_cache_score(&cache->entries[0]);
+
+    for (i = 1; i < cache->num_entries; ++i) {
+        int64_t score = node_cache_score(&cache->entries[i]);
+
+        if (score < worst_score) {
+            worst = i;
+            worst_score = score;
+        }
+    }
+
+    if (cache->entries[worst].dirty)
+        --cache->num_dirty;
+
+    return worst;
+}
+
+static void set_dirty(Node_Cache *cache, Node_Cache_Entry *entry)
+{
+    if (!entry->dirty) {
+        entry->dirty = 1;
+        ++cache->num_dirty;
+    }
+}
+
+/* Note that the node with public_key answered us from ip_port.
+ * If the cache is full the worst node is replaced.
+ */
+void node_cache_seen(Node_Cache *cache, const uint8_t *public_key, IP_Port ip_port)
+{
+    if (ip_port.ip.family != AF_INET && ip_port.ip.family != AF_INET6)
+        return;
+
+    uint64_t temp_time = unix_time();
+    int index = find_node(cache, public_key);
+    Node_Cache_Entry *entry;
+
+    if (index == -1) {
+        entry = &cache->entries[free_entry(cache)];
+        memset(entry, 0, sizeof(Node_Cache_Entry));
+        memcpy(entry->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        entry->first_seen = temp_time;
+        set_dirty(cache, entry);
+    } else {
+        entry = &cache->entries[index];
+
+        if (is_timeout(entry->last_seen, NODE_CACHE_UPTIME_GAP)) {
+            entry->first_seen = temp_time;
+            set_dirty(cache, entry);
+        }
+
+        if (!ipport_equal(&entry->ip_port, &ip_port))
+            set_dirty(cache, entry);
+    }
+
+    entry->ip_port = ip_port;
+    entry->last_seen = temp_time;
+
+    if (is_timeout(entry->last_written, NODE_CACHE_FLUSH_INTERVAL))
+        set_dirty(cache, entry);
+}
+
+/* Add a round trip time measurement of rtt ms to the node with public_key. */
+void node_cache_rtt(Node_Cache *cache, const uint8_t *public_key, uint16_t rtt)
+{
+    int index = find_node(cache, public_key);
+
+    if (index == -1)
+        return;
+
+    Node_Cache_Entry *entry = &cache->entries[index];
+
+    if (rtt == 0)
+        rtt = 1;
+
+    if (entry->rtt == 0) {
+        entry->rtt = rtt;
+    } else {
+        entry->rtt = ((uint32_t)entry->rtt * 7 + rtt) / 8;
+    }
+}
+
+/* Note that the node with public_key passed a hardening check. */
+void node_cache_hardened(Node_Cache *cache, const uint8_t *public_key)
+{
+    int index = find_node(cache, public_key);
+
+    if (index == -1)
+        return;
+
+    Node_Cache_Entry *entry = &cache->entries[index];
+
+    if (!(entry->flags & NODE_CACHE_FLAG_HARDENED)) {
+        entry->flags |= NODE_CACHE_FLAG_HARDENED;
+        set_dirty(cache, entry);
+    }
+}
+
+/* return the quality score of entry, higher is better.
+ * Long uptime, recently seen, hardened and low rtt nodes score best.
+ */
+int64_t node_cache_score(const Node_Cache_Entry *entry)
+{
+    uint64_t temp_time = unix_time();
+    int64_t score = 0;
+
+    /* A point per minute of uptime, up to a day. */
+    score += MIN((entry->last_seen - entry->first_seen) / 60, 24 * 60);
+
+    /* Minus a point per minute since the node was last seen, up to a week. */
+    if (temp_time > entry->last_seen)
+        score -= MIN((temp_time - entry->last_seen) / 60, 7 * 24 * 60);
+
+    if (entry->flags & NODE_CACHE_FLAG_HARDENED)
+        score += 60;
+
+    score -= entry->rtt / 10;
+    return score;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+    int64_t score1 = node_cache_score(a);
+    int64_t score2 = node_cache_score(b);
+
+    if (score1 > score2)
+        return -1;
+
+    if (score1 < score2)
+        return 1;
+
+    return 0;
+}
+
+/* Sort the entries by score, best first. */
+void node_cache_sort(Node_Cache *cache)
+{
+    qsort(cache->entries, cache->num_entries, sizeof(Node_Cache_Entry), cmp_entry);
+}
+
+static uint8_t *write_record(const Node_Cache_Entry *entry, uint8_t *data)
+{
+    *data = NODE_CACHE_RECORD_NODE;
+    ++data;
+    memcpy(data, entry->public_key, crypto_box_PUBLICKEYBYTES);
+    data += crypto_box_PUBLICKEYBYTES;
+
+    memset(data + 1, 0, 16);
+
+    if (entry->ip_port.ip.family == AF_INET) {
+        *data = 4;
+        memcpy(data + 1, &entry->ip_port.ip.ip4, SIZE_IP4);
+    } else {
+        *data = 6;
+        memcpy(data + 1, &entry->ip_port.ip.ip6, SIZE_IP6);
+    }
+
+    data += 1 + 16;
+    memcpy(data, &entry->ip_port.port, sizeof(uint16_t));
+    data += sizeof(uint16_t);
+    memcpy(data, &entry->first_seen, sizeof(uint64_t));
+    data += sizeof(uint64_t);
+    memcpy(data, &entry->last_seen, sizeof(uint64_t));
+    data += sizeof(uint64_t);
+    memcpy(data, &entry->rtt, sizeof(uint16_t));
+    data += sizeof(uint16_t);
+    *data = entry->flags;
+    ++data;
+    return data;
+}
+
+/* return -1 if the record is invalid.
+ * return 0 on success.
+ */
+static int read_record(Node_Cache_Entry *entry, const uint8_t *data)
+{
+    if (*data != NODE_CACHE_RECORD_NODE)
+        return -1;
+
+    ++data;
+    memset(entry, 0, sizeof(Node_Cache_Entry));
+    memcpy(entry->public_key, data, crypto_box_PUBLICKEYBYTES);
+    data += crypto_box_PUBLICKEYBYTES;
+
+    if (*data == 4) {
+        entry->ip_port.ip.family = AF_INET;
+        memcpy(&entry->ip_port.ip.ip4, data + 1, SIZE_IP4);
+    } else if (*data == 6) {
+        entry->ip_port.ip.family = AF_INET6;
+        memcpy(&entry->ip_port.ip.ip6, data + 1, SIZE_IP6);
+    } else {
+        return -1;
+    }
+
+    data += 1 + 16;
+    memcpy(&entry->ip_port.port, data, sizeof(uint16_t));
+    data += sizeof(uint16_t);
+    memcpy(&entry->first_seen, data, sizeof(uint64_t));
+    data += sizeof(uint64_t);
+    memcpy(&entry->last_seen, data, sizeof(uint64_t));
+    data += sizeof(uint64_t);
+    memcpy(&entry->rtt, data, sizeof(uint16_t));
+    data += sizeof(uint16_t);
+    entry->flags = *data;
+
+    if (entry->first_seen > entry->last_seen)
+        entry->first_seen = entry->last_seen;
+
+    entry->last_written = entry->last_seen;
+    return 0;
+}
+
+/* return the size of the data node_cache_flush() will write. */
+uint32_t node_cache_flush_size(const Node_Cache *cache)
+{
+    return cache->num_dirty * NODE_CACHE_RECORD_SIZE;
+}
+
+/* Write the records of the nodes that changed since the last flush to data
+ * of length, so that they can be appended to the cache file.
+ *
+ * return the number of bytes written.
+ */
+uint32_t node_cache_flush(Node_Cache *cache, uint8_t *data, uint32_t length)
+{
+    uint32_t i, written = 0;
+
+    for (i = 0; i < cache->num_entries && cache->num_dirty; ++i) {
+        Node_Cache_Entry *entry = &cache->entries[i];
+
+        if (!entry->dirty)
+            continue;
+
+        if (length - written < NODE_CACHE_RECORD_SIZE)
+            break;
+
+        write_record(entry, data + written);
+        written += NODE_CACHE_RECORD_SIZE;
+        entry->last_written = entry->last_seen;
+        entry->dirty = 0;
+        --cache->num_dirty;
+    }
+
+    return written;
+}
+
+/* return the size of the data node_cache_save() will write. */
+uint32_t node_cache_size(const Node_Cache *cache)
+{
+    return cache->num_entries * NODE_CACHE_RECORD_SIZE;
+}
+
+/* Write the records of all the nodes to data (of size node_cache_size()).
+ * Used to compact a cache file that grew too big.
+ */
+void node_cache_save(Node_Cache *cache, uint8_t *data)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache->num_entries; ++i) {
+        Node_Cache_Entry *entry = &cache->entries[i];
+        data = write_record(entry, data);
+        entry->last_written = entry->last_seen;
+        entry->dirty = 0;
+    }
+
+    cache->num_dirty = 0;
+}
+
+/* Load records from data of length.
+ * Later records of a node replace older ones, an incomplete record at the
+ * end (from an interrupted write) is ignored.
+ *
+ * return the number of records read.
+ * return -1 on failure (invalid record).
+ */
+int node_cache_load(Node_Cache *cache, const uint8_t *data, uint32_t length)
+{
+    uint32_t num = 0;
+
+    while (length >= NODE_CACHE_RECORD_SIZE) {
+        Node_Cache_Entry entry;
+
+        if (read_record(&entry, data) == -1)
+            return -1;
+
+        int index = find_node(cache, entry.public_key);
+
+        if (index == -1) {
+            index = free_entry(cache);
+        } else if (cache->entries[index].dirty) {
+            --cache->num_dirty;
+        }
+
+        cache->entries[index] = entry;
+        data += NODE_CACHE_RECORD_SIZE;
+        length -= NODE_CACHE_RECORD_SIZE;
+        ++num;
+    }
+
+    return num;
+}
@@ -0,0 +1,116 @@
+/* node_cache.h
+ *
+ * Cache of DHT nodes with quality scores that can be kept in an append only
+ * file so that the DHT can warm start from known good nodes.
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef NODE_CACHE_H
+#define NODE_CACHE_H
+
+#include "crypto_core.h"
+
+/* Maximum number of nodes in the cache. */
+#define NODE_CACHE_SIZE 256
+
+/* A node not seen for this many seconds starts a new uptime when seen again. */
+#define NODE_CACHE_UPTIME_GAP (5 * 60)
+
+/* A node is only written again if it was last written this many seconds ago. */
+#define NODE_CACHE_FLUSH_INTERVAL (10 * 60)
+
+/* Node answered a hardening check correctly. */
+#define NODE_CACHE_FLAG_HARDENED 1
+
+#define NODE_CACHE_RECORD_NODE 1
+
+/* type, public key, family, ip, port, first seen, last seen, rtt, flags */
+#define NODE_CACHE_RECORD_SIZE (1 + crypto_box_PUBLICKEYBYTES + 1 + 16 + sizeof(uint16_t) + sizeof(uint64_t) * 2 + sizeof(uint16_t) + 1)
+
+typedef struct {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    IP_Port ip_port;
+
+    uint64_t first_seen; /* Start of the current uptime of the node. */
+    uint64_t last_seen;
+    uint64_t last_written; /* last_seen when the node was last written. */
+
+    uint16_t rtt; /* Smoothed round trip time in ms, 0 if unknown. */
+    uint8_t flags;
+    _Bool dirty; /* Changed since the last node_cache_flush(). */
+} Node_Cache_Entry;
+
+typedef struct {
+    Node_Cache_Entry entries[NODE_CACHE_SIZE];
+    uint32_t num_entries;
+    uint32_t num_dirty;
+} Node_Cache;
+
+Node_Cache *new_node_cache(void);
+
+void kill_node_cache(Node_Cache *cache);
+
+/* Note that the node with public_key answered us from ip_port.
+ * If the cache is full the worst node is replaced.
+ */
+void node_cache_seen(Node_Cache *cache, const uint8_t *public_key, IP_Port ip_port);
+
+/* Add a round trip time measurement of rtt ms to the node with public_key. */
+void node_cache_rtt(Node_Cache *cache, const uint8_t *public_key, uint16_t rtt);
+
+/* Note that the node with public_key passed a hardening check. */
+void node_cache_hardened(Node_Cache *cache, const uint8_t *public_key);
+
+/* return the quality score of entry, higher is better.
+ * Long uptime, recently seen, hardened and low rtt nodes score best.
+ */
+int64_t node_cache_score(const Node_Cache_Entry *entry);
+
+/* Sort the entries by score, best first. */
+void node_cache_sort(Node_Cache *cache);
+
+/* return the size of the data node_cache_flush() will write. */
+uint32_t node_cache_flush_size(const Node_Cache *cache);
+
+/* Write the records of the nodes that changed since the last flush to data
+ * of length, so that they can be appended to the cache file.
+ *
+ * return the number of bytes written.
+ */
+uint32_t node_cache_flush(Node_Cache *cache, uint8_t *data, uint32_t length);
+
+/* return the size of the data node_cache_save() will write. */
+uint32_t node_cache_size(const Node_Cache *cache);
+
+/* Write the records of all the nodes to data (of size node_cache_size()).
+ * Used to compact a cache file that grew too big.
+ */
+void node_cache_save(Node_Cache *cache, uint8_t *data);
+
+/* Load records from data of length.
+ * Later records of a node replace older ones, an incomplete record at the
+ * end (from an interrupted write) is ignored.
+ *
+ * return the number of records read.
+ * return -1 on failure (invalid record).
+ */
+int node_cache_load(Node_Cache *cache, const uint8_t *data, uint32_t length);
+
+#endif
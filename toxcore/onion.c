@@ -40,8 +40,16 @@
 static void change_symmetric_key(Onion *onion)
 {
     if (is_timeout(onion->timestamp, KEY_REFRESH_INTERVAL)) {
-        new_symmetric_key(onion->secret_symmetric_key);
+        new_symmetric_key(onion->relay.secret_symmetric_key);
         onion->timestamp = unix_time();
+
+        uint32_t i;
+
+        for (i = 0; i < onion->num_workers; ++i) {
+            pthread_mutex_lock(&onion->workers[i].mutex);
+            memcpy(onion->workers[i].secret_symmetric_key, onion->relay.secret_symmetric_key, crypto_box_KEYBYTES);
+            pthread_mutex_unlock(&onion->workers[i].mutex);
+        }
     }
 }
 
@@ -306,31 +314,42 @@ int send_onion_response(Networking_Core *net, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
-static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
-{
-    Onion *onion = object;
-
-    if (length > ONION_MAX_PACKET_SIZE)
-        return 1;
+/* Onion packets are forwarded by decrypting the layer for the next hop straight
+ * into the buffer that is sent. The layer starts with the ip_port to send it to,
+ * which is unpacked and then overwritten by the header of the next packet, so
+ * that the rest never has to be moved.
+ */
+#define FORWARD_PLAIN_OFFSET (1 + crypto_box_NONCEBYTES - SIZE_IPPORT)
 
-    if (length <= 1 + SEND_1)
-        return 1;
+/* Put a new nonce for the return path in nonce. */
+static void relay_nonce(Onion_Relay *relay, uint8_t *nonce)
+{
+    increment_nonce(relay->nonce);
+    memcpy(nonce, relay->nonce, crypto_box_NONCEBYTES);
+}
 
-    change_symmetric_key(onion);
+static int relay_send(const Onion *onion, Onion_Relay *relay, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    if (relay->send_queue == NULL)
+        return sendpacket_queued(onion->net, ip_port, data, length);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    get_shared_key(&onion->shared_keys_1, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
-                                     length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES), plain);
+    if (relay->send_queue_length == NET_SEND_QUEUE_SIZE) {
+        sendpacket_batch(onion->net, relay->send_queue, relay->send_queue_length);
+        relay->send_queue_length = 0;
+    }
 
-    if (len != length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES))
-        return 1;
+    if (networking_queue_packet(onion->net, &relay->send_queue[relay->send_queue_length], ip_port, data, length) == -1)
+        return -1;
 
-    return onion_send_1(onion, plain, len, source, packet + 1);
+    ++relay->send_queue_length;
+    return length;
 }
 
-int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce)
+/* Forward the decrypted layer of length len at data + FORWARD_PLAIN_OFFSET
+ * (data is ONION_MAX_PACKET_SIZE big) as a NET_PACKET_ONION_SEND_1 packet.
+ */
+static int forward_send_1(const Onion *onion, Onion_Relay *relay, uint8_t *data, uint16_t len, IP_Port source,
+                          const uint8_t *nonce)
 {
     if (len > ONION_MAX_PACKET_SIZE + SIZE_IPPORT - (1 + crypto_box_NONCEBYTES + ONION_RETURN_1))
         return 1;
@@ -340,20 +359,18 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
 
     IP_Port send_to;
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1)
+    if (ipport_unpack(&send_to, data + FORWARD_PLAIN_OFFSET, len, 0) == -1)
         return 1;
 
     uint8_t ip_port[SIZE_IPPORT];
     ipport_pack(ip_port, &source);
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
     data[0] = NET_PACKET_ONION_SEND_1;
     memcpy(data + 1, nonce, crypto_box_NONCEBYTES);
-    memcpy(data + 1 + crypto_box_NONCEBYTES, plain + SIZE_IPPORT, len - SIZE_IPPORT);
     uint16_t data_len = 1 + crypto_box_NONCEBYTES + (len - SIZE_IPPORT);
     uint8_t *ret_part = data + data_len;
-    new_nonce(ret_part);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ip_port, SIZE_IPPORT,
+    relay_nonce(relay, ret_part);
+    len = encrypt_data_symmetric(relay->secret_symmetric_key, ret_part, ip_port, SIZE_IPPORT,
                                  ret_part + crypto_box_NONCEBYTES);
 
     if (len != SIZE_IPPORT + crypto_box_MACBYTES)
@@ -361,49 +378,115 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
 
     data_len += crypto_box_NONCEBYTES + len;
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
+    if ((uint32_t)relay_send(onion, relay, send_to, data, data_len) != data_len)
         return 1;
 
     return 0;
 }
 
-static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+static int relay_send_initial_precomputed(const Onion *onion, Onion_Relay *relay, IP_Port source,
+        const uint8_t *shared_key, const uint8_t *packet, uint16_t length)
+{
+    uint8_t data[ONION_MAX_PACKET_SIZE];
+    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
+                                     length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES), data + FORWARD_PLAIN_OFFSET);
+
+    if (len != length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES))
+        return 1;
+
+    return forward_send_1(onion, relay, data, len, source, packet + 1);
+}
+
+static int relay_send_initial(const Onion *onion, Onion_Relay *relay, IP_Port source, const uint8_t *packet,
+                              uint16_t length)
+{
+    if (length > ONION_MAX_PACKET_SIZE)
+        return 1;
+
+    if (length <= 1 + SEND_1)
+        return 1;
+
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(&relay->shared_keys_1, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
+    return relay_send_initial_precomputed(onion, relay, source, shared_key, packet, length);
+}
+
+static void send_initial_precomputed(void *object, Precompute_Job *job)
+{
+    Onion *onion = object;
+    store_shared_key(&onion->relay.shared_keys_1, job->shared_key, job->public_key);
+    relay_send_initial_precomputed(onion, &onion->relay, job->source, job->shared_key, job->data, job->length);
+}
+
+static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
 {
     Onion *onion = object;
 
     if (length > ONION_MAX_PACKET_SIZE)
         return 1;
 
-    if (length <= 1 + SEND_2)
+    if (length <= 1 + SEND_1)
         return 1;
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    get_shared_key(&onion->shared_keys_2, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
+    const uint8_t *public_key = packet + 1 + crypto_box_NONCEBYTES;
+
+    if (onion->dht->precompute_pool && !get_stored_shared_key(&onion->relay.shared_keys_1, shared_key, public_key)) {
+        if (precompute_pool_add(onion->dht->precompute_pool, public_key, onion->dht->self_secret_key, NULL,
+                                &send_initial_precomputed, onion, source, 0, 0, packet, length) == -1)
+            return 1;
+
+        return 0;
+    }
+
+    return relay_send_initial(onion, &onion->relay, source, packet, length);
+}
+
+int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce)
+{
+    if (len > ONION_MAX_PACKET_SIZE + SIZE_IPPORT - (1 + crypto_box_NONCEBYTES + ONION_RETURN_1))
+        return 1;
+
+    uint8_t data[ONION_MAX_PACKET_SIZE];
+    memcpy(data + FORWARD_PLAIN_OFFSET, plain, len);
+    /* Only ever called on the main thread. */
+    return forward_send_1(onion, (Onion_Relay *)&onion->relay, data, len, source, nonce);
+}
+
+static int relay_send_1(const Onion *onion, Onion_Relay *relay, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    if (length > ONION_MAX_PACKET_SIZE)
+        return 1;
+
+    if (length <= 1 + SEND_2)
+        return 1;
+
+    uint8_t data[ONION_MAX_PACKET_SIZE];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(&relay->shared_keys_2, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
-                                     length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_1), plain);
+                                     length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_1),
+                                     data + FORWARD_PLAIN_OFFSET);
 
     if (len != length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_1 + crypto_box_MACBYTES))
         return 1;
 
     IP_Port send_to;
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1)
+    if (ipport_unpack(&send_to, data + FORWARD_PLAIN_OFFSET, len, 0) == -1)
         return 1;
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
     data[0] = NET_PACKET_ONION_SEND_2;
     memcpy(data + 1, packet + 1, crypto_box_NONCEBYTES);
-    memcpy(data + 1 + crypto_box_NONCEBYTES, plain + SIZE_IPPORT, len - SIZE_IPPORT);
     uint16_t data_len = 1 + crypto_box_NONCEBYTES + (len - SIZE_IPPORT);
     uint8_t *ret_part = data + data_len;
-    new_nonce(ret_part);
+    relay_nonce(relay, ret_part);
     uint8_t ret_data[RETURN_1 + SIZE_IPPORT];
     ipport_pack(ret_data, &source);
     memcpy(ret_data + SIZE_IPPORT, packet + (length - RETURN_1), RETURN_1);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
+    len = encrypt_data_symmetric(relay->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
                                  ret_part + crypto_box_NONCEBYTES);
 
     if (len != RETURN_2 - crypto_box_NONCEBYTES)
@@ -411,27 +494,25 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
 
     data_len += crypto_box_NONCEBYTES + len;
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
+    if ((uint32_t)relay_send(onion, relay, send_to, data, data_len) != data_len)
         return 1;
 
     return 0;
 }
 
-static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+static int relay_send_2(const Onion *onion, Onion_Relay *relay, IP_Port source, const uint8_t *packet, uint16_t length)
 {
-    Onion *onion = object;
-
     if (length > ONION_MAX_PACKET_SIZE)
         return 1;
 
     if (length <= 1 + SEND_3)
         return 1;
 
-    change_symmetric_key(onion);
-
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
+    /* The packet sent is the decrypted layer without the ip_port in front. */
+    uint8_t plain[SIZE_IPPORT + ONION_MAX_PACKET_SIZE];
+    uint8_t *data = plain + SIZE_IPPORT;
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    get_shared_key(&onion->shared_keys_3, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
+    get_shared_key(&relay->shared_keys_3, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
                                      length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_2), plain);
 
@@ -443,15 +524,13 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
     if (ipport_unpack(&send_to, plain, len, 0) == -1)
         return 1;
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
-    memcpy(data, plain + SIZE_IPPORT, len - SIZE_IPPORT);
     uint16_t data_len = (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + (len - SIZE_IPPORT);
-    new_nonce(ret_part);
+    uint8_t *ret_part = data + data_len;
+    relay_nonce(relay, ret_part);
     uint8_t ret_data[RETURN_2 + SIZE_IPPORT];
     ipport_pack(ret_data, &source);
     memcpy(ret_data + SIZE_IPPORT, packet + (length - RETURN_2), RETURN_2);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
+    len = encrypt_data_symmetric(relay->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
                                  ret_part + crypto_box_NONCEBYTES);
 
     if (len != RETURN_3 - crypto_box_NONCEBYTES)
@@ -459,85 +538,109 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
 
     data_len += RETURN_3;
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
+    if ((uint32_t)relay_send(onion, relay, send_to, data, data_len) != data_len)
         return 1;
 
     return 0;
 }
 
-
-static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+/* Decrypt the ip_port and return path of length return_length in the return path at
+ * packet + 1 into data (ONION_MAX_PACKET_SIZE + SIZE_IPPORT big) and put the
+ * packet for the next hop of the return path with the id packet_id right after it.
+ *
+ * return length of the packet at data + SIZE_IPPORT - 1 to send to send_to.
+ * return -1 on failure.
+ */
+static int forward_return(const Onion_Relay *relay, uint8_t *data, IP_Port *send_to, uint8_t packet_id,
+                          uint16_t return_length, const uint8_t *packet, uint16_t length)
 {
-    Onion *onion = object;
+    int len = decrypt_data_symmetric(relay->secret_symmetric_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES,
+                                     SIZE_IPPORT + return_length + crypto_box_MACBYTES, data);
 
-    if (length > ONION_MAX_PACKET_SIZE)
-        return 1;
+    if (len != SIZE_IPPORT + return_length)
+        return -1;
 
-    if (length <= 1 + RETURN_3)
-        return 1;
+    if (ipport_unpack(send_to, data, len, 0) == -1)
+        return -1;
 
-    change_symmetric_key(onion);
+    uint16_t header_length = crypto_box_NONCEBYTES + SIZE_IPPORT + return_length + crypto_box_MACBYTES;
+    uint8_t *next = data + SIZE_IPPORT - 1;
+    next[0] = packet_id;
+    memcpy(next + 1 + return_length, packet + 1 + header_length, length - (1 + header_length));
+    return 1 + return_length + (length - (1 + header_length));
+}
 
-    uint8_t plain[SIZE_IPPORT + RETURN_2];
-    int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES,
-                                     SIZE_IPPORT + RETURN_2 + crypto_box_MACBYTES, plain);
+static int relay_recv_3(const Onion *onion, Onion_Relay *relay, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    if (length > ONION_MAX_PACKET_SIZE)
+        return 1;
 
-    if ((uint32_t)len != sizeof(plain))
+    if (length <= 1 + RETURN_3)
         return 1;
 
+    uint8_t data[ONION_MAX_PACKET_SIZE + SIZE_IPPORT];
     IP_Port send_to;
+    int data_len = forward_return(relay, data, &send_to, NET_PACKET_ONION_RECV_2, RETURN_2, packet, length);
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1)
+    if (data_len == -1)
         return 1;
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
-    data[0] = NET_PACKET_ONION_RECV_2;
-    memcpy(data + 1, plain + SIZE_IPPORT, RETURN_2);
-    memcpy(data + 1 + RETURN_2, packet + 1 + RETURN_3, length - (1 + RETURN_3));
-    uint16_t data_len = 1 + RETURN_2 + (length - (1 + RETURN_3));
-
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
+    if (relay_send(onion, relay, send_to, data + SIZE_IPPORT - 1, data_len) != data_len)
         return 1;
 
     return 0;
 }
 
-static int handle_recv_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+static int relay_recv_2(const Onion *onion, Onion_Relay *relay, IP_Port source, const uint8_t *packet, uint16_t length)
 {
-    Onion *onion = object;
-
     if (length > ONION_MAX_PACKET_SIZE)
         return 1;
 
     if (length <= 1 + RETURN_2)
         return 1;
 
-    change_symmetric_key(onion);
+    uint8_t data[ONION_MAX_PACKET_SIZE + SIZE_IPPORT];
+    IP_Port send_to;
+    int data_len = forward_return(relay, data, &send_to, NET_PACKET_ONION_RECV_1, RETURN_1, packet, length);
 
-    uint8_t plain[SIZE_IPPORT + RETURN_1];
-    int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES,
-                                     SIZE_IPPORT + RETURN_1 + crypto_box_MACBYTES, plain);
+    if (data_len == -1)
+        return 1;
 
-    if ((uint32_t)len != sizeof(plain))
+    if (relay_send(onion, relay, send_to, data + SIZE_IPPORT - 1, data_len) != data_len)
         return 1;
 
-    IP_Port send_to;
+    return 0;
+}
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1)
-        return 1;
+static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Onion *onion = object;
+    change_symmetric_key(onion);
+    return relay_send_1(onion, &onion->relay, source, packet, length);
+}
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
-    data[0] = NET_PACKET_ONION_RECV_1;
-    memcpy(data + 1, plain + SIZE_IPPORT, RETURN_1);
-    memcpy(data + 1 + RETURN_1, packet + 1 + RETURN_2, length - (1 + RETURN_2));
-    uint16_t data_len = 1 + RETURN_1 + (length - (1 + RETURN_2));
+static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Onion *onion = object;
+    change_symmetric_key(onion);
+    return relay_send_2(onion, &onion->relay, source, packet, length);
+}
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
-        return 1;
+static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Onion *onion = object;
+    change_symmetric_key(onion);
+    return relay_recv_3(onion, &onion->relay, source, packet, length);
+}
 
-    return 0;
+static int handle_recv_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Onion *onion = object;
+    change_symmetric_key(onion);
+    return relay_recv_2(onion, &onion->relay, source, packet, length);
 }
 
+/* Always handled on the main thread: the packet may have to be passed to recv_1_function. */
 static int handle_recv_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
 {
     Onion *onion = object;
@@ -551,7 +654,7 @@ static int handle_recv_1(void *object, IP_Port source, const uint8_t *packet, ui
     change_symmetric_key(onion);
 
     uint8_t plain[SIZE_IPPORT];
-    int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES,
+    int len = decrypt_data_symmetric(onion->relay.secret_symmetric_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES,
                                      SIZE_IPPORT + crypto_box_MACBYTES, plain);
 
     if ((uint32_t)len != SIZE_IPPORT)
@@ -567,9 +670,111 @@ static int handle_recv_1(void *object, IP_Port source, const uint8_t *packet, ui
     if (onion->recv_1_function && send_to.ip.family != AF_INET && send_to.ip.family != AF_INET6)
         return onion->recv_1_function(onion->callback_object, send_to, packet + (1 + RETURN_1), data_len);
 
-    if ((uint32_t)sendpacket(onion->net, send_to, packet + (1 + RETURN_1), data_len) != data_len)
+    if ((uint32_t)sendpacket_queued(onion->net, send_to, packet + (1 + RETURN_1), data_len) != data_len)
+        return 1;
+
+    return 0;
+}
+
+static int relay_packet(const Onion *onion, Onion_Relay *relay, IP_Port source, const uint8_t *packet,
+                        uint16_t length)
+{
+    switch (packet[0]) {
+        case NET_PACKET_ONION_SEND_INITIAL:
+            return relay_send_initial(onion, relay, source, packet, length);
+
+        case NET_PACKET_ONION_SEND_1:
+            return relay_send_1(onion, relay, source, packet, length);
+
+        case NET_PACKET_ONION_SEND_2:
+            return relay_send_2(onion, relay, source, packet, length);
+
+        case NET_PACKET_ONION_RECV_3:
+            return relay_recv_3(onion, relay, source, packet, length);
+
+        case NET_PACKET_ONION_RECV_2:
+            return relay_recv_2(onion, relay, source, packet, length);
+    }
+
+    return 1;
+}
+
+static void *onion_worker_thread(void *arg)
+{
+    Onion_Worker *worker = arg;
+    Onion_Relay *relay = &worker->relay;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    while (1) {
+        while (worker->first == worker->last && !worker->shutdown) {
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+        }
+
+        if (worker->shutdown)
+            break;
+
+        uint32_t start = worker->first;
+        uint32_t num = MIN(worker->last - worker->first, ONION_WORKER_BATCH_SIZE);
+        memcpy(relay->secret_symmetric_key, worker->secret_symmetric_key, crypto_box_KEYBYTES);
+        pthread_mutex_unlock(&worker->mutex);
+
+        /* The main thread only writes jobs past last. */
+        uint32_t i;
+
+        for (i = 0; i < num; ++i) {
+            Onion_Job *job = &worker->jobs[(start + i) % ONION_WORKER_QUEUE_SIZE];
+            relay_packet(worker->onion, relay, job->source, job->data, job->length);
+        }
+
+        sendpacket_batch(worker->onion->net, relay->send_queue, relay->send_queue_length);
+        relay->send_queue_length = 0;
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->first += num;
+    }
+
+    pthread_mutex_unlock(&worker->mutex);
+    return NULL;
+}
+
+/* Hand the packet to a worker thread. Packets with the same public key always go
+ * to the same worker so that their shared key is only computed by one thread.
+ */
+static int handle_dispatch(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Onion *onion = object;
+
+    if (length > ONION_MAX_PACKET_SIZE || length <= 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES)
+        return 1;
+
+    change_symmetric_key(onion);
+
+    Onion_Worker *worker;
+
+    if (packet[0] == NET_PACKET_ONION_RECV_3 || packet[0] == NET_PACKET_ONION_RECV_2) {
+        worker = &onion->workers[onion->next_worker % onion->num_workers];
+        ++onion->next_worker;
+    } else {
+        worker = &onion->workers[packet[1 + crypto_box_NONCEBYTES] % onion->num_workers];
+    }
+
+    pthread_mutex_lock(&worker->mutex);
+
+    if (worker->last - worker->first >= ONION_WORKER_QUEUE_SIZE) {
+        ++worker->num_dropped;
+        pthread_mutex_unlock(&worker->mutex);
         return 1;
+    }
+
+    Onion_Job *job = &worker->jobs[worker->last % ONION_WORKER_QUEUE_SIZE];
+    memcpy(job->data, packet, length);
+    job->length = length;
+    job->source = source;
+    ++worker->last;
 
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
     return 0;
 }
 
@@ -579,7 +784,113 @@ void set_callback_handle_recv_1(Onion *onion, int (*function)(void *, IP_Port, c
     onion->callback_object = object;
 }
 
-Onion *new_onion(DHT *dht)
+static void stop_workers(Onion *onion)
+{
+    uint32_t i;
+
+    for (i = 0; i < onion->num_workers; ++i) {
+        Onion_Worker *worker = &onion->workers[i];
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->shutdown = 1;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+        pthread_join(worker->thread, NULL);
+
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker->jobs);
+        free(worker->relay.send_queue);
+    }
+
+    free(onion->workers);
+    onion->workers = NULL;
+    onion->num_workers = 0;
+}
+
+static int start_worker(Onion *onion, Onion_Worker *worker)
+{
+    worker->onion = onion;
+    worker->jobs = calloc(ONION_WORKER_QUEUE_SIZE, sizeof(Onion_Job));
+    worker->relay.send_queue = malloc(NET_SEND_QUEUE_SIZE * sizeof(Queued_Packet));
+
+    if (worker->jobs == NULL || worker->relay.send_queue == NULL) {
+        free(worker->jobs);
+        free(worker->relay.send_queue);
+        return -1;
+    }
+
+    random_nonce(worker->relay.nonce);
+    memcpy(worker->secret_symmetric_key, onion->relay.secret_symmetric_key, crypto_box_KEYBYTES);
+
+    if (pthread_mutex_init(&worker->mutex, NULL) != 0) {
+        free(worker->jobs);
+        free(worker->relay.send_queue);
+        return -1;
+    }
+
+    if (pthread_cond_init(&worker->cond, NULL) != 0) {
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker->jobs);
+        free(worker->relay.send_queue);
+        return -1;
+    }
+
+    if (pthread_create(&worker->thread, NULL, onion_worker_thread, worker) != 0) {
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker->jobs);
+        free(worker->relay.send_queue);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Start num_workers threads that relay onion packets (all but NET_PACKET_ONION_RECV_1,
+ * which may have to be passed to the TCP server) instead of the thread running
+ * networking_poll().
+ *
+ * Threads don't survive fork(), call this after it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int onion_start_workers(Onion *onion, uint32_t num_workers)
+{
+    if (onion->num_workers != 0 || num_workers == 0 || num_workers > ONION_MAX_WORKERS)
+        return -1;
+
+    onion->workers = calloc(num_workers, sizeof(Onion_Worker));
+
+    if (onion->workers == NULL)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < num_workers; ++i) {
+        if (start_worker(onion, &onion->workers[i]) == -1) {
+            stop_workers(onion);
+            return -1;
+        }
+
+        ++onion->num_workers;
+    }
+
+    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_INITIAL, &handle_dispatch, onion);
+    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_1, &handle_dispatch, onion);
+    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_2, &handle_dispatch, onion);
+    networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_3, &handle_dispatch, onion);
+    networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, &handle_dispatch, onion);
+    return 0;
+}
+
+/* Create a new Onion, with num_workers relay threads (see onion_start_workers())
+ * if num_workers isn't 0.
+ *
+ * return NULL on failure.
+ */
+Onion *new_onion_ex(DHT *dht, uint32_t num_workers)
 {
     if (dht == NULL)
         return NULL;
@@ -591,7 +902,8 @@ Onion *new_onion(DHT *dht)
 
     onion->dht = dht;
     onion->net = dht->net;
-    new_symmetric_key(onion->secret_symmetric_key);
+    new_symmetric_key(onion->relay.secret_symmetric_key);
+    random_nonce(onion->relay.nonce);
     onion->timestamp = unix_time();
 
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_INITIAL, &handle_send_initial, onion);
@@ -602,14 +914,27 @@ Onion *new_onion(DHT *dht)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, &handle_recv_2, onion);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, &handle_recv_1, onion);
 
+    if (num_workers != 0 && onion_start_workers(onion, num_workers) == -1) {
+        kill_onion(onion);
+        return NULL;
+    }
+
     return onion;
 }
 
+Onion *new_onion(DHT *dht)
+{
+    return new_onion_ex(dht, 0);
+}
+
 void kill_onion(Onion *onion)
 {
     if (onion == NULL)
         return;
 
+    if (onion->dht->precompute_pool)
+        precompute_pool_cancel(onion->dht->precompute_pool, onion);
+
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_INITIAL, NULL, NULL);
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_1, NULL, NULL);
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_2, NULL, NULL);
@@ -618,5 +943,6 @@ void kill_onion(Onion *onion)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, NULL, NULL);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, NULL, NULL);
 
+    stop_workers(onion);
     free(onion);
 }
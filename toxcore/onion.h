@@ -24,20 +24,7 @@
 #define ONION_H
 
 #include "DHT.h"
-
-typedef struct {
-    DHT     *dht;
-    Networking_Core *net;
-    uint8_t secret_symmetric_key[crypto_box_KEYBYTES];
-    uint64_t timestamp;
-
-    Shared_Keys shared_keys_1;
-    Shared_Keys shared_keys_2;
-    Shared_Keys shared_keys_3;
-
-    int (*recv_1_function)(void *, IP_Port, const uint8_t *, uint16_t);
-    void *callback_object;
-} Onion;
+#include <pthread.h>
 
 #define ONION_MAX_PACKET_SIZE 1400
 
@@ -53,6 +40,71 @@ typedef struct {
 #define ONION_MAX_DATA_SIZE (ONION_MAX_PACKET_SIZE - (ONION_SEND_1 + 1))
 #define ONION_RESPONSE_MAX_DATA_SIZE (ONION_MAX_PACKET_SIZE - (1 + ONION_RETURN_3))
 
+#define ONION_MAX_WORKERS 64
+
+/* Number of packets that can wait for each worker thread. */
+#define ONION_WORKER_QUEUE_SIZE 512
+
+/* Maximum number of packets a worker takes from its queue at once. */
+#define ONION_WORKER_BATCH_SIZE 32
+
+/* Everything a thread relaying onion packets changes, each one has its own. */
+typedef struct {
+    uint8_t secret_symmetric_key[crypto_box_KEYBYTES];
+    uint8_t nonce[crypto_box_NONCEBYTES]; /* last nonce used for a return path. */
+
+    Shared_Keys shared_keys_1;
+    Shared_Keys shared_keys_2;
+    Shared_Keys shared_keys_3;
+
+    /* Packets to send with sendpacket_batch(), NULL on the main thread which
+     * uses sendpacket_queued(). */
+    Queued_Packet *send_queue;
+    uint32_t send_queue_length;
+} Onion_Relay;
+
+typedef struct Onion_Worker Onion_Worker;
+
+typedef struct {
+    DHT     *dht;
+    Networking_Core *net;
+    uint64_t timestamp; /* when relay.secret_symmetric_key was made. */
+
+    Onion_Relay relay;
+
+    Onion_Worker *workers;
+    uint32_t num_workers;
+    uint32_t next_worker;
+
+    int (*recv_1_function)(void *, IP_Port, const uint8_t *, uint16_t);
+    void *callback_object;
+} Onion;
+
+typedef struct {
+    IP_Port source;
+    uint16_t length;
+    uint8_t data[ONION_MAX_PACKET_SIZE];
+} Onion_Job;
+
+struct Onion_Worker {
+    const Onion *onion;
+    Onion_Relay relay;
+
+    Onion_Job *jobs;
+    /* Both only ever increase, jobs are at (number % ONION_WORKER_QUEUE_SIZE). */
+    uint32_t first; /* oldest job not done yet. */
+    uint32_t last; /* next free job. */
+    uint64_t num_dropped; /* number of packets dropped because the queue was full. */
+
+    /* Latest key set by the main thread, copied to relay when jobs are taken. */
+    uint8_t secret_symmetric_key[crypto_box_KEYBYTES];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    _Bool shutdown;
+    pthread_t thread;
+};
+
 typedef struct {
     uint8_t shared_key1[crypto_box_BEFORENMBYTES];
     uint8_t shared_key2[crypto_box_BEFORENMBYTES];
@@ -154,6 +206,24 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
 void set_callback_handle_recv_1(Onion *onion, int (*function)(void *, IP_Port, const uint8_t *, uint16_t),
                                 void *object);
 
+/* Start num_workers threads that relay onion packets (all but NET_PACKET_ONION_RECV_1,
+ * which may have to be passed to the TCP server) instead of the thread running
+ * networking_poll().
+ *
+ * Threads don't survive fork(), call this after it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int onion_start_workers(Onion *onion, uint32_t num_workers);
+
+/* Create a new Onion, with num_workers relay threads (see onion_start_workers())
+ * if num_workers isn't 0.
+ *
+ * return NULL on failure.
+ */
+Onion *new_onion_ex(DHT *dht, uint32_t num_workers);
+
 Onion *new_onion(DHT *dht);
 
 void kill_onion(Onion *onion);
@@ -200,90 +200,212 @@ static void generate_ping_id(const Onion_Announce *onion_a, uint64_t time, const
     crypto_hash_sha256(ping_id, data, sizeof(data));
 }
 
-/* check if public key is in entries list
- *
- * return -1 if no
- * return position in list if yes
- */
-static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
+static uint32_t hash_public_key(const Onion_Announce *onion_a, const uint8_t *public_key)
 {
+    uint32_t hash = 2166136261u ^ onion_a->hash_key;
     unsigned int i;
 
-    for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-        if (!is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)
-                && memcmp(onion_a->entries[i].public_key, public_key, crypto_box_PUBLICKEYBYTES) == 0)
-            return i;
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        hash ^= public_key[i];
+        hash *= 16777619u;
     }
 
-    return -1;
+    return hash;
 }
 
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_entry(const void *a, const void *b)
+/* return position in hash_table of public_key or of the empty slot where it would go.
+ */
+static uint32_t hash_slot(const Onion_Announce *onion_a, const uint8_t *public_key)
 {
-    Onion_Announce_Entry entry1, entry2;
-    memcpy(&entry1, a, sizeof(Onion_Announce_Entry));
-    memcpy(&entry2, b, sizeof(Onion_Announce_Entry));
-    int t1 = is_timeout(entry1.time, ONION_ANNOUNCE_TIMEOUT);
-    int t2 = is_timeout(entry2.time, ONION_ANNOUNCE_TIMEOUT);
+    uint32_t mask = onion_a->hash_size - 1;
+    uint32_t slot = hash_public_key(onion_a, public_key) & mask;
 
-    if (t1 && t2)
-        return 0;
+    while (onion_a->hash_table[slot] != 0) {
+        if (id_equal(onion_a->entries[onion_a->hash_table[slot] - 1].public_key, public_key))
+            break;
 
-    if (t1)
-        return -1;
+        slot = (slot + 1) & mask;
+    }
 
-    if (t2)
-        return 1;
+    return slot;
+}
 
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+/* Remove the entry in slot, moving back the entries after it so that lookups
+ * never stop at a hole before reaching them.
+ */
+static void hash_remove(Onion_Announce *onion_a, uint32_t slot)
+{
+    uint32_t mask = onion_a->hash_size - 1;
+    uint32_t next = slot;
 
-    if (close == 1)
-        return 1;
+    while (1) {
+        next = (next + 1) & mask;
 
-    if (close == 2)
-        return -1;
+        if (onion_a->hash_table[next] == 0)
+            break;
 
-    return 0;
+        uint32_t home = hash_public_key(onion_a, onion_a->entries[onion_a->hash_table[next] - 1].public_key) & mask;
+
+        /* The entry can fill the hole if its home slot isn't between the hole and it. */
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            onion_a->hash_table[slot] = onion_a->hash_table[next];
+            slot = next;
+        }
+    }
+
+    onion_a->hash_table[slot] = 0;
 }
 
-/* add entry to entries list
- *
- * return -1 if failure
- * return position if added
+/* return 1 if entry a is farther from our public key than entry b.
+ * return 0 if not.
  */
-static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const uint8_t *public_key,
-                          const uint8_t *data_public_key, const uint8_t *ret)
+static int farther(const Onion_Announce *onion_a, uint32_t a, uint32_t b)
+{
+    return id_closest(onion_a->dht->self_public_key, onion_a->entries[a].public_key,
+                      onion_a->entries[b].public_key) == 2;
+}
+
+static void heap_set(Onion_Announce *onion_a, uint32_t pos, uint32_t index)
 {
+    onion_a->heap[pos] = index;
+    onion_a->entries[index].heap_index = pos;
+}
 
-    int pos = in_entries(onion_a, public_key);
+/* Restore the heap order after the key of the entry at heap position pos changed. */
+static void heap_fix(Onion_Announce *onion_a, uint32_t pos)
+{
+    uint32_t index = onion_a->heap[pos];
 
-    unsigned int i;
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
 
-    if (pos == -1) {
-        for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-            if (is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT))
-                pos = i;
-        }
+        if (!farther(onion_a, index, onion_a->heap[parent]))
+            break;
+
+        heap_set(onion_a, pos, onion_a->heap[parent]);
+        pos = parent;
+    }
+
+    while (1) {
+        uint32_t child = pos * 2 + 1;
+
+        if (child >= onion_a->num_entries)
+            break;
+
+        if (child + 1 < onion_a->num_entries && farther(onion_a, onion_a->heap[child + 1], onion_a->heap[child]))
+            ++child;
+
+        if (!farther(onion_a, onion_a->heap[child], index))
+            break;
+
+        heap_set(onion_a, pos, onion_a->heap[child]);
+        pos = child;
+    }
+
+    heap_set(onion_a, pos, index);
+}
+
+static void list_remove(Onion_Announce *onion_a, uint32_t index)
+{
+    Onion_Announce_Entry *entry = &onion_a->entries[index];
+
+    if (entry->older == ONION_ANNOUNCE_NO_ENTRY) {
+        onion_a->oldest = entry->newer;
+    } else {
+        onion_a->entries[entry->older].newer = entry->newer;
+    }
+
+    if (entry->newer == ONION_ANNOUNCE_NO_ENTRY) {
+        onion_a->newest = entry->older;
+    } else {
+        onion_a->entries[entry->newer].older = entry->older;
     }
+}
+
+static void list_add_newest(Onion_Announce *onion_a, uint32_t index)
+{
+    Onion_Announce_Entry *entry = &onion_a->entries[index];
+    entry->older = onion_a->newest;
+    entry->newer = ONION_ANNOUNCE_NO_ENTRY;
 
-    if (pos == -1) {
-        if (id_closest(onion_a->dht->self_public_key, public_key, onion_a->entries[0].public_key) == 1)
-            pos = 0;
+    if (onion_a->newest == ONION_ANNOUNCE_NO_ENTRY) {
+        onion_a->oldest = index;
+    } else {
+        onion_a->entries[onion_a->newest].newer = index;
     }
 
-    if (pos == -1)
+    onion_a->newest = index;
+}
+
+/* return -1 if public_key doesn't have an announce entry that hasn't timed out.
+ * return index of the entry in onion_a->entries if it does.
+ */
+int onion_announce_find_entry(const Onion_Announce *onion_a, const uint8_t *public_key)
+{
+    uint32_t slot = hash_slot(onion_a, public_key);
+
+    if (onion_a->hash_table[slot] == 0)
         return -1;
 
-    memcpy(onion_a->entries[pos].public_key, public_key, crypto_box_PUBLICKEYBYTES);
-    onion_a->entries[pos].ret_ip_port = ret_ip_port;
-    memcpy(onion_a->entries[pos].ret, ret, ONION_RETURN_3);
-    memcpy(onion_a->entries[pos].data_public_key, data_public_key, crypto_box_PUBLICKEYBYTES);
-    onion_a->entries[pos].time = unix_time();
+    uint32_t index = onion_a->hash_table[slot] - 1;
+
+    if (is_timeout(onion_a->entries[index].time, ONION_ANNOUNCE_TIMEOUT))
+        return -1;
+
+    return index;
+}
+
+/* Add or refresh the announce entry of public_key.
+ *
+ * If the store is full the entry replaces one that timed out or, if none did,
+ * the entry farthest from our public key if public_key is closer.
+ *
+ * return -1 if failure
+ * return index of the entry in onion_a->entries if added
+ */
+int onion_announce_add_entry(Onion_Announce *onion_a, IP_Port ret_ip_port, const uint8_t *public_key,
+                             const uint8_t *data_public_key, const uint8_t *ret)
+{
+    uint32_t slot = hash_slot(onion_a, public_key);
+    uint32_t index;
+
+    if (onion_a->hash_table[slot] != 0) {
+        /* Known, even if it timed out: refresh it in place. */
+        index = onion_a->hash_table[slot] - 1;
+        list_remove(onion_a, index);
+    } else {
+        if (onion_a->num_entries < onion_a->max_entries) {
+            index = onion_a->num_entries;
+            heap_set(onion_a, onion_a->num_entries, index);
+            ++onion_a->num_entries;
+        } else {
+            index = onion_a->oldest;
+
+            if (!is_timeout(onion_a->entries[index].time, ONION_ANNOUNCE_TIMEOUT)) {
+                index = onion_a->heap[0];
+
+                if (id_closest(onion_a->dht->self_public_key, public_key, onion_a->entries[index].public_key) != 1)
+                    return -1;
+            }
+
+            list_remove(onion_a, index);
+            hash_remove(onion_a, hash_slot(onion_a, onion_a->entries[index].public_key));
+            /* Removing may have moved the slot of public_key back. */
+            slot = hash_slot(onion_a, public_key);
+        }
 
-    memcpy(cmp_public_key, onion_a->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-    qsort(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, sizeof(Onion_Announce_Entry), cmp_entry);
-    return in_entries(onion_a, public_key);
+        memcpy(onion_a->entries[index].public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        onion_a->hash_table[slot] = index + 1;
+        heap_fix(onion_a, onion_a->entries[index].heap_index);
+    }
+
+    Onion_Announce_Entry *entry = &onion_a->entries[index];
+    entry->ret_ip_port = ret_ip_port;
+    memcpy(entry->ret, ret, ONION_RETURN_3);
+    memcpy(entry->data_public_key, data_public_key, crypto_box_PUBLICKEYBYTES);
+    entry->time = unix_time();
+    list_add_newest(onion_a, index);
+    return index;
 }
 
 static int handle_announce_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
@@ -317,10 +439,10 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
     uint8_t *data_public_key = plain + ONION_PING_ID_SIZE + crypto_box_PUBLICKEYBYTES;
 
     if (memcmp(ping_id1, plain, ONION_PING_ID_SIZE) == 0 || memcmp(ping_id2, plain, ONION_PING_ID_SIZE) == 0) {
-        index = add_to_entries(onion_a, source, packet_public_key, data_public_key,
-                               packet + (ANNOUNCE_REQUEST_SIZE_RECV - ONION_RETURN_3));
+        index = onion_announce_add_entry(onion_a, source, packet_public_key, data_public_key,
+                                         packet + (ANNOUNCE_REQUEST_SIZE_RECV - ONION_RETURN_3));
     } else {
-        index = in_entries(onion_a, plain + ONION_PING_ID_SIZE);
+        index = onion_announce_find_entry(onion_a, plain + ONION_PING_ID_SIZE);
     }
 
     /*Respond with a announce response packet*/
@@ -389,7 +511,7 @@ static int handle_data_request(void *object, IP_Port source, const uint8_t *pack
     if (length > ONION_MAX_PACKET_SIZE)
         return 1;
 
-    int index = in_entries(onion_a, packet + 1);
+    int index = onion_announce_find_entry(onion_a, packet + 1);
 
     if (index == -1)
         return 1;
@@ -405,9 +527,13 @@ static int handle_data_request(void *object, IP_Port source, const uint8_t *pack
     return 0;
 }
 
-Onion_Announce *new_onion_announce(DHT *dht)
+/* Create a new onion announce store for up to max_entries announced nodes.
+ *
+ * return NULL on failure.
+ */
+Onion_Announce *new_onion_announce_ex(DHT *dht, uint32_t max_entries)
 {
-    if (dht == NULL)
+    if (dht == NULL || max_entries == 0 || max_entries > (UINT32_MAX / 4))
         return NULL;
 
     Onion_Announce *onion_a = calloc(1, sizeof(Onion_Announce));
@@ -415,6 +541,28 @@ Onion_Announce *new_onion_announce(DHT *dht)
     if (onion_a == NULL)
         return NULL;
 
+    onion_a->hash_size = 1;
+
+    /* Keep the table at most half full so that probe sequences stay short. */
+    while (onion_a->hash_size < max_entries * 2)
+        onion_a->hash_size *= 2;
+
+    onion_a->entries = calloc(max_entries, sizeof(Onion_Announce_Entry));
+    onion_a->heap = calloc(max_entries, sizeof(uint32_t));
+    onion_a->hash_table = calloc(onion_a->hash_size, sizeof(uint32_t));
+
+    if (onion_a->entries == NULL || onion_a->heap == NULL || onion_a->hash_table == NULL) {
+        free(onion_a->entries);
+        free(onion_a->heap);
+        free(onion_a->hash_table);
+        free(onion_a);
+        return NULL;
+    }
+
+    onion_a->max_entries = max_entries;
+    onion_a->oldest = ONION_ANNOUNCE_NO_ENTRY;
+    onion_a->newest = ONION_ANNOUNCE_NO_ENTRY;
+    onion_a->hash_key = random_int();
     onion_a->dht = dht;
     onion_a->net = dht->net;
     new_symmetric_key(onion_a->secret_bytes);
@@ -425,6 +573,11 @@ Onion_Announce *new_onion_announce(DHT *dht)
     return onion_a;
 }
 
+Onion_Announce *new_onion_announce(DHT *dht)
+{
+    return new_onion_announce_ex(dht, ONION_ANNOUNCE_MAX_ENTRIES);
+}
+
 void kill_onion_announce(Onion_Announce *onion_a)
 {
     if (onion_a == NULL)
@@ -432,5 +585,8 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, NULL, NULL);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, NULL, NULL);
+    free(onion_a->entries);
+    free(onion_a->heap);
+    free(onion_a->hash_table);
     free(onion_a);
 }
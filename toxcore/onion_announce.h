@@ -45,18 +45,41 @@
 #define ONION_DATA_REQUEST_MIN_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES)
 #define MAX_DATA_REQUEST_SIZE (ONION_MAX_DATA_SIZE - ONION_DATA_REQUEST_MIN_SIZE)
 
+#define ONION_ANNOUNCE_NO_ENTRY UINT32_MAX
+
 typedef struct {
     uint8_t public_key[crypto_box_PUBLICKEYBYTES];
     IP_Port ret_ip_port;
     uint8_t ret[ONION_RETURN_3];
     uint8_t data_public_key[crypto_box_PUBLICKEYBYTES];
     uint64_t time;
+
+    uint32_t heap_index; /* position in the distance heap. */
+    uint32_t older, newer; /* neighbours in the list ordered by time. */
 } Onion_Announce_Entry;
 
+/* Entries are never moved or deleted: an entry that timed out is only dropped
+ * from lookups and is reused when room is needed.
+ *
+ * hash_table indexes them by public key, heap keeps the one farthest from our
+ * own key on top so that it can be evicted for a closer one and the time ordered
+ * list finds the oldest one (the first to time out).
+ */
 typedef struct {
     DHT     *dht;
     Networking_Core *net;
-    Onion_Announce_Entry entries[ONION_ANNOUNCE_MAX_ENTRIES];
+    Onion_Announce_Entry *entries;
+    uint32_t max_entries;
+    uint32_t num_entries; /* entries[0] to entries[num_entries - 1] are used. */
+
+    uint32_t *hash_table; /* index + 1 of the entries, 0 if empty. */
+    uint32_t hash_size; /* power of 2 bigger than max_entries. */
+    uint32_t hash_key;
+
+    uint32_t *heap; /* indexes of the entries, farthest from us on top. */
+
+    uint32_t oldest, newest; /* ends of the time ordered list. */
+
     /* This is crypto_box_KEYBYTES long just so we can use new_symmetric_key() to fill it */
     uint8_t secret_bytes[crypto_box_KEYBYTES];
 
@@ -131,6 +154,29 @@ int send_data_request(Networking_Core *net, const Onion_Path *path, IP_Port dest
                       const uint8_t *encrypt_public_key, const uint8_t *nonce, const uint8_t *data, uint16_t length);
 
 
+/* Add or refresh the announce entry of public_key.
+ *
+ * If the store is full the entry replaces one that timed out or, if none did,
+ * the entry farthest from our public key if public_key is closer.
+ *
+ * return -1 if failure
+ * return index of the entry in onion_a->entries if added
+ */
+int onion_announce_add_entry(Onion_Announce *onion_a, IP_Port ret_ip_port, const uint8_t *public_key,
+                             const uint8_t *data_public_key, const uint8_t *ret);
+
+/* return -1 if public_key doesn't have an announce entry that hasn't timed out.
+ * return index of the entry in onion_a->entries if it does.
+ */
+int onion_announce_find_entry(const Onion_Announce *onion_a, const uint8_t *public_key);
+
+/* Create a new onion announce store for up to max_entries announced nodes.
+ *
+ * return NULL on failure.
+ */
+Onion_Announce *new_onion_announce_ex(DHT *dht, uint32_t max_entries);
+
+/* Same as new_onion_announce_ex() with ONION_ANNOUNCE_MAX_ENTRIES entries. */
 Onion_Announce *new_onion_announce(DHT *dht);
 
 void kill_onion_announce(Onion_Announce *onion_a);
@@ -33,6 +33,9 @@
 #define ANNOUNCE_ARRAY_SIZE 256
 #define ANNOUNCE_TIMEOUT 10
 
+/* num, public key, ip_port, path_num and time sent stored for each announce request. */
+#define ANNOUNCE_SENDBACK_DATA_SIZE (sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES + sizeof(IP_Port) + sizeof(uint32_t) + sizeof(uint64_t))
+
 /* Add a node to the path_nodes bootstrap array.
  *
  * return -1 on failure
@@ -119,6 +122,22 @@ uint16_t onion_backup_nodes(const Onion_Client *onion_c, Node_format *nodes, uin
     return max_num;
 }
 
+/* return a random node out of the num_nodes nodes.
+ *
+ * Of two random nodes the one that answers faster and more reliably is picked, this
+ * makes paths favour good nodes while every node can still be picked.
+ */
+static Node_format random_path_node(const Onion_Client *onion_c, const Node_format *nodes, unsigned int num_nodes)
+{
+    const Node_format *node1 = &nodes[rand() % num_nodes];
+    const Node_format *node2 = &nodes[rand() % num_nodes];
+
+    if (DHT_node_cost(onion_c->dht, node2->public_key) < DHT_node_cost(onion_c->dht, node1->public_key))
+        return *node2;
+
+    return *node1;
+}
+
 /* Put up to max_num random nodes in nodes.
  *
  * return the number of nodes.
@@ -138,7 +157,7 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
             return 0;
 
         for (i = 0; i < max_num; ++i) {
-            nodes[i] = onion_c->path_nodes[rand() % num_nodes];
+            nodes[i] = random_path_node(onion_c, onion_c->path_nodes, num_nodes);
         }
     } else {
         int random_tcp = get_random_tcp_con_number(onion_c->c);
@@ -152,7 +171,7 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
             nodes[0].ip_port.ip.ip4.uint32 = random_tcp;
 
             for (i = 1; i < max_num; ++i) {
-                nodes[i] = onion_c->path_nodes[rand() % num_nodes];
+                nodes[i] = random_path_node(onion_c, onion_c->path_nodes, num_nodes);
             }
         } else {
             unsigned int num_nodes_bs = (onion_c->path_nodes_index_bs < MAX_PATH_NODES) ? onion_c->path_nodes_index_bs :
@@ -165,7 +184,7 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
             nodes[0].ip_port.ip.ip4.uint32 = random_tcp;
 
             for (i = 1; i < max_num; ++i) {
-                nodes[i] = onion_c->path_nodes_bs[rand() % num_nodes_bs];
+                nodes[i] = random_path_node(onion_c, onion_c->path_nodes_bs, num_nodes_bs);
             }
         }
     }
@@ -198,9 +217,129 @@ static int is_path_used(const Onion_Client_Paths *onion_paths, const Node_format
     return -1;
 }
 
+/* return the time in ms without response after which the path is replaced.
+ */
+static uint64_t path_response_timeout(const Onion_Client_Paths *onion_paths, uint32_t pathnum)
+{
+    uint64_t timeout = (uint64_t)onion_paths->path_rtt[pathnum] * 4;
+
+    if (timeout < ONION_PATH_MIN_RESPONSE_TIME)
+        return ONION_PATH_MIN_RESPONSE_TIME;
+
+    return MIN(timeout, ONION_PATH_TIMEOUT * 1000);
+}
+
+/* return 1 if the path should be replaced.
+ * return 0 if not.
+ */
+static int path_degraded(const Onion_Client_Paths *onion_paths, uint32_t pathnum)
+{
+    if (is_timeout(onion_paths->path_creation_time[pathnum], ONION_PATH_MAX_LIFETIME))
+        return 1;
+
+    /* Only worth it if the replacement is already built. */
+    if (onion_paths->path_success[pathnum] < ONION_PATH_MIN_SUCCESS && onion_paths->num_standby != 0)
+        return 1;
+
+    if (onion_paths->last_path_used_times[pathnum] < ONION_PATH_MAX_NO_RESPONSE_USES / 2)
+        return 0;
+
+    /* Once we know how long responses take, a path is dead as soon as they are
+     * a few round trips late. */
+    if (onion_paths->path_rtt[pathnum] != 0
+            && current_time_monotonic() - onion_paths->path_first_unanswered[pathnum] >= path_response_timeout(onion_paths,
+                    pathnum))
+        return 1;
+
+    if (onion_paths->last_path_used_times[pathnum] < ONION_PATH_MAX_NO_RESPONSE_USES)
+        return 0;
+
+    return onion_paths->last_path_success[pathnum] + ONION_PATH_TIMEOUT < onion_paths->last_path_used[pathnum];
+}
+
+/* Reset the state of the path that was just put in pathnum.
+ */
+static void reset_path(Onion_Client_Paths *onion_paths, uint32_t pathnum, uint64_t creation_time)
+{
+    onion_paths->last_path_success[pathnum] = unix_time() + ONION_PATH_FIRST_TIMEOUT - ONION_PATH_TIMEOUT;
+    onion_paths->path_creation_time[pathnum] = creation_time;
+    onion_paths->last_path_used_times[pathnum] = ONION_PATH_MAX_NO_RESPONSE_USES / 2;
+    onion_paths->path_success[pathnum] = ONION_PATH_SUCCESS_ONE / 2;
+    onion_paths->path_rtt[pathnum] = 0;
+    onion_paths->path_first_unanswered[pathnum] = current_time_monotonic();
+
+    uint32_t path_num = rand();
+    path_num /= NUMBER_ONION_PATHS;
+    path_num *= NUMBER_ONION_PATHS;
+    path_num += pathnum;
+
+    onion_paths->paths[pathnum].path_num = path_num;
+}
+
+/* Put a standby path in pathnum.
+ *
+ * return -1 if there was no suitable standby path.
+ * return 0 on success.
+ */
+static int use_standby_path(Onion_Client_Paths *onion_paths, uint32_t pathnum)
+{
+    while (onion_paths->num_standby != 0) {
+        --onion_paths->num_standby;
+        const Onion_Path *path = &onion_paths->standby[onion_paths->num_standby];
+        uint64_t creation_time = onion_paths->standby_creation_time[onion_paths->num_standby];
+        Node_format nodes[3];
+
+        if (is_timeout(creation_time, ONION_PATH_STANDBY_LIFETIME))
+            continue;
+
+        if (onion_path_to_nodes(nodes, 3, path) == -1 || is_path_used(onion_paths, nodes) != -1)
+            continue;
+
+        memcpy(&onion_paths->paths[pathnum], path, sizeof(Onion_Path));
+        reset_path(onion_paths, pathnum, creation_time);
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Drop the old standby paths and build a new one if there aren't enough.
+ */
+static void do_standby_paths(const Onion_Client *onion_c, Onion_Client_Paths *onion_paths)
+{
+    unsigned int i = 0;
+
+    while (i < onion_paths->num_standby) {
+        if (is_timeout(onion_paths->standby_creation_time[i], ONION_PATH_STANDBY_LIFETIME)) {
+            --onion_paths->num_standby;
+            onion_paths->standby[i] = onion_paths->standby[onion_paths->num_standby];
+            onion_paths->standby_creation_time[i] = onion_paths->standby_creation_time[onion_paths->num_standby];
+        } else {
+            ++i;
+        }
+    }
+
+    if (onion_paths->num_standby == ONION_PATH_STANDBY)
+        return;
+
+    Node_format nodes[3];
+
+    if (random_nodes_path_onion(onion_c, nodes, 3) != 3)
+        return;
+
+    if (create_onion_path(onion_c->dht, &onion_paths->standby[onion_paths->num_standby], nodes) == -1)
+        return;
+
+    onion_paths->standby_creation_time[onion_paths->num_standby] = unix_time();
+    ++onion_paths->num_standby;
+}
+
 /* Create a new path or use an old suitable one (if pathnum is valid)
  * or a random one from onion_paths.
  *
+ * A path that stops answering is replaced by a standby path, or a new one if
+ * there is none.
+ *
  * return -1 on failure
  * return 0 on success
  *
@@ -209,12 +348,18 @@ static int is_path_used(const Onion_Client_Paths *onion_paths, const Node_format
  */
 static int random_path(const Onion_Client *onion_c, Onion_Client_Paths *onion_paths, uint32_t pathnum, Onion_Path *path)
 {
-    if (pathnum >= NUMBER_ONION_PATHS)
+    if (pathnum >= NUMBER_ONION_PATHS) {
+        /* The better of two random paths, paths that weren't built yet get built. */
+        uint32_t other = rand() % NUMBER_ONION_PATHS;
         pathnum = rand() % NUMBER_ONION_PATHS;
 
-    if ((onion_paths->last_path_success[pathnum] + ONION_PATH_TIMEOUT < onion_paths->last_path_used[pathnum]
-            && onion_paths->last_path_used_times[pathnum] >= ONION_PATH_MAX_NO_RESPONSE_USES)
-            || is_timeout(onion_paths->path_creation_time[pathnum], ONION_PATH_MAX_LIFETIME)) {
+        if (!is_timeout(onion_paths->path_creation_time[pathnum], ONION_PATH_MAX_LIFETIME)
+                && !is_timeout(onion_paths->path_creation_time[other], ONION_PATH_MAX_LIFETIME)
+                && onion_paths->path_success[other] > onion_paths->path_success[pathnum])
+            pathnum = other;
+    }
+
+    if (path_degraded(onion_paths, pathnum) && use_standby_path(onion_paths, pathnum) == -1) {
         Node_format nodes[3];
 
         if (random_nodes_path_onion(onion_c, nodes, 3) != 3)
@@ -226,27 +371,61 @@ static int random_path(const Onion_Client *onion_c, Onion_Client_Paths *onion_pa
             if (create_onion_path(onion_c->dht, &onion_paths->paths[pathnum], nodes) == -1)
                 return -1;
 
-            onion_paths->last_path_success[pathnum] = unix_time() + ONION_PATH_FIRST_TIMEOUT - ONION_PATH_TIMEOUT;
-            onion_paths->path_creation_time[pathnum] = unix_time();
-            onion_paths->last_path_used_times[pathnum] = ONION_PATH_MAX_NO_RESPONSE_USES / 2;
-
-            uint32_t path_num = rand();
-            path_num /= NUMBER_ONION_PATHS;
-            path_num *= NUMBER_ONION_PATHS;
-            path_num += pathnum;
-
-            onion_paths->paths[pathnum].path_num = path_num;
+            reset_path(onion_paths, pathnum, unix_time());
         } else {
             pathnum = n;
         }
     }
 
+    if (onion_paths->last_path_used_times[pathnum] == 0)
+        onion_paths->path_first_unanswered[pathnum] = current_time_monotonic();
+
     ++onion_paths->last_path_used_times[pathnum];
     onion_paths->last_path_used[pathnum] = unix_time();
+    /* Counted as lost until the response comes back. */
+    onion_paths->path_success[pathnum] -= onion_paths->path_success[pathnum] / 8;
     memcpy(path, &onion_paths->paths[pathnum], sizeof(Onion_Path));
     return 0;
 }
 
+/* Update the success rate and round trip time of the path of a response to a
+ * request sent at sent_time (in ms).
+ */
+static void path_response(Onion_Client *onion_c, uint32_t num, uint32_t path_num, uint64_t sent_time)
+{
+    Onion_Client_Paths *onion_paths = (num == 0) ? &onion_c->onion_paths_self : &onion_c->onion_paths_friends;
+    uint32_t pathnum = path_num % NUMBER_ONION_PATHS;
+
+    if (onion_paths->paths[pathnum].path_num != path_num)
+        return;
+
+    uint64_t temp_time = current_time_monotonic();
+    uint32_t rtt = (temp_time > sent_time) ? temp_time - sent_time : 1;
+
+    if (onion_paths->path_rtt[pathnum] == 0) {
+        onion_paths->path_rtt[pathnum] = rtt;
+    } else {
+        onion_paths->path_rtt[pathnum] = ((uint64_t)onion_paths->path_rtt[pathnum] * 7 + rtt) / 8;
+    }
+
+    onion_paths->path_success[pathnum] = MIN(onion_paths->path_success[pathnum] + ONION_PATH_SUCCESS_ONE / 8,
+                                         ONION_PATH_SUCCESS_ONE);
+    onion_paths->last_path_success[pathnum] = unix_time();
+    onion_paths->last_path_used_times[pathnum] = 0;
+
+    /* Every node of the path gets the credit. */
+    Node_format nodes[3];
+
+    if (onion_path_to_nodes(nodes, 3, &onion_paths->paths[pathnum]) == 0) {
+        unsigned int i;
+
+        for (i = 0; i < 3; ++i) {
+            if (nodes[i].ip_port.ip.family == AF_INET || nodes[i].ip_port.ip.family == AF_INET6)
+                DHT_node_response(onion_c->dht, nodes[i].public_key, 0);
+        }
+    }
+}
+
 /* Set path timeouts, return the path number.
  *
  */
@@ -334,11 +513,14 @@ static int send_onion_packet_tcp_udp(const Onion_Client *onion_c, const Onion_Pa
 static int new_sendback(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
                         uint32_t path_num, uint64_t *sendback)
 {
-    uint8_t data[sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[ANNOUNCE_SENDBACK_DATA_SIZE];
+    uint64_t sent_time = current_time_monotonic();
     memcpy(data, &num, sizeof(uint32_t));
     memcpy(data + sizeof(uint32_t), public_key, crypto_box_PUBLICKEYBYTES);
     memcpy(data + sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES, &ip_port, sizeof(IP_Port));
     memcpy(data + sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES + sizeof(IP_Port), &path_num, sizeof(uint32_t));
+    memcpy(data + sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES + sizeof(IP_Port) + sizeof(uint32_t), &sent_time,
+           sizeof(uint64_t));
     *sendback = ping_array_add(&onion_c->announce_ping_array, data, sizeof(data));
 
     if (*sendback == 0)
@@ -353,16 +535,17 @@ static int new_sendback(Onion_Client *onion_c, uint32_t num, const uint8_t *publ
  * sendback is the sendback ONION_ANNOUNCE_SENDBACK_DATA_LENGTH big
  * ret_pubkey must be at least crypto_box_PUBLICKEYBYTES big
  * ret_ip_port must be at least 1 big
+ * the time the request was sent (in ms) is put in sent_time
  *
  * return ~0 on failure
  * return num (see new_sendback(...)) on success
  */
 static uint32_t check_sendback(Onion_Client *onion_c, const uint8_t *sendback, uint8_t *ret_pubkey,
-                               IP_Port *ret_ip_port, uint32_t *path_num)
+                               IP_Port *ret_ip_port, uint32_t *path_num, uint64_t *sent_time)
 {
     uint64_t sback;
     memcpy(&sback, sendback, sizeof(uint64_t));
-    uint8_t data[sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[ANNOUNCE_SENDBACK_DATA_SIZE];
 
     if (ping_array_check(data, sizeof(data), &onion_c->announce_ping_array, sback) != sizeof(data))
         return ~0;
@@ -370,6 +553,8 @@ static uint32_t check_sendback(Onion_Client *onion_c, const uint8_t *sendback, u
     memcpy(ret_pubkey, data + sizeof(uint32_t), crypto_box_PUBLICKEYBYTES);
     memcpy(ret_ip_port, data + sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES, sizeof(IP_Port));
     memcpy(path_num, data + sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES + sizeof(IP_Port), sizeof(uint32_t));
+    memcpy(sent_time, data + sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES + sizeof(IP_Port) + sizeof(uint32_t),
+           sizeof(uint64_t));
 
     uint32_t num;
     memcpy(&num, data, sizeof(uint32_t));
@@ -418,6 +603,18 @@ static int client_send_announce_request(Onion_Client *onion_c, uint32_t num, IP_
         return -1;
     }
 
+    /* Every node of the path gets the blame if no response comes back. */
+    Node_format nodes[3];
+
+    if (onion_path_to_nodes(nodes, 3, &path) == 0) {
+        unsigned int i;
+
+        for (i = 0; i < 3; ++i) {
+            if (nodes[i].ip_port.ip.family == AF_INET || nodes[i].ip_port.ip.family == AF_INET6)
+                DHT_node_request_sent(onion_c->dht, nodes[i].public_key);
+        }
+    }
+
     return send_onion_packet_tcp_udp(onion_c, &path, dest, request, len);
 }
 
@@ -601,7 +798,8 @@ static int handle_announce_response(void *object, IP_Port source, const uint8_t
     uint8_t public_key[crypto_box_PUBLICKEYBYTES];
     IP_Port ip_port;
     uint32_t path_num;
-    uint32_t num = check_sendback(onion_c, packet + 1, public_key, &ip_port, &path_num);
+    uint64_t sent_time;
+    uint32_t num = check_sendback(onion_c, packet + 1, public_key, &ip_port, &path_num, &sent_time);
 
     if (num > onion_c->num_friends)
         return 1;
@@ -626,6 +824,8 @@ static int handle_announce_response(void *object, IP_Port source, const uint8_t
     if ((uint32_t)len != sizeof(plain))
         return 1;
 
+    path_response(onion_c, num, path_num, sent_time);
+
     if (client_add_to_list(onion_c, num, public_key, ip_port, plain[0], plain + 1, path_num) == -1)
         return 1;
 
@@ -1016,6 +1216,8 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
     onion_c->friends_list[index].status = 1;
     memcpy(onion_c->friends_list[index].real_public_key, public_key, crypto_box_PUBLICKEYBYTES);
     crypto_box_keypair(onion_c->friends_list[index].temp_public_key, onion_c->friends_list[index].temp_secret_key);
+    /* New friends are looked up as often as recently seen ones. */
+    onion_c->friends_list[index].last_seen = unix_time();
     return index;
 }
 
@@ -1215,20 +1417,71 @@ static void populate_path_nodes_tcp(Onion_Client *onion_c)
 
 #define RUN_COUNT_FRIEND_ANNOUNCE_BEGINNING 17
 
-static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
+/* Put up to max_num nodes that store the announcements of the friend with the
+ * closest key to the one of friendnum in nodes.
+ * Announcements are stored on the nodes closest to the announced key, so these
+ * are a much better place to start looking than random nodes.
+ *
+ * return the number of nodes.
+ */
+static unsigned int neighbour_nodes(const Onion_Client *onion_c, uint16_t friendnum, Node_format *nodes,
+                                    unsigned int max_num)
+{
+    const uint8_t *public_key = onion_c->friends_list[friendnum].real_public_key;
+    const Onion_Friend *closest = NULL;
+    uint32_t i, j;
+
+    for (i = 0; i < onion_c->num_friends; ++i) {
+        const Onion_Friend *onion_friend = &onion_c->friends_list[i];
+
+        if (i == friendnum || onion_friend->status == 0)
+            continue;
+
+        if (closest && id_closest(public_key, closest->real_public_key, onion_friend->real_public_key) != 2)
+            continue;
+
+        for (j = 0; j < MAX_ONION_CLIENTS; ++j) {
+            if (!is_timeout(onion_friend->clients_list[j].timestamp, FRIEND_ONION_NODE_TIMEOUT)) {
+                closest = onion_friend;
+                break;
+            }
+        }
+    }
+
+    if (closest == NULL)
+        return 0;
+
+    unsigned int num = 0;
+
+    for (j = 0; j < MAX_ONION_CLIENTS && num < max_num; ++j) {
+        const Onion_Node *node = &closest->clients_list[j];
+
+        if (!is_timeout(node->timestamp, FRIEND_ONION_NODE_TIMEOUT)) {
+            memcpy(nodes[num].public_key, node->public_key, crypto_box_PUBLICKEYBYTES);
+            nodes[num].ip_port = node->ip_port;
+            ++num;
+        }
+    }
+
+    return num;
+}
+
+/* return the number of packets sent to look for the friend.
+ */
+static unsigned int do_friend(Onion_Client *onion_c, uint16_t friendnum)
 {
     if (friendnum >= onion_c->num_friends)
-        return;
+        return 0;
 
     if (onion_c->friends_list[friendnum].status == 0)
-        return;
+        return 0;
 
     unsigned int interval = ANNOUNCE_FRIEND;
 
     if (onion_c->friends_list[friendnum].run_count < RUN_COUNT_FRIEND_ANNOUNCE_BEGINNING)
         interval = ANNOUNCE_FRIEND_BEGINNING;
 
-    unsigned int i, count = 0;
+    unsigned int i, count = 0, sent = 0;
     Onion_Node *list_nodes = onion_c->friends_list[friendnum].clients_list;
 
     if (!onion_c->friends_list[friendnum].is_online) {
@@ -1247,6 +1500,7 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
             if (is_timeout(list_nodes[i].last_pinged, interval)) {
                 if (client_send_announce_request(onion_c, friendnum + 1, list_nodes[i].ip_port, list_nodes[i].public_key, 0, ~0) == 0) {
                     list_nodes[i].last_pinged = unix_time();
+                    ++sent;
                 }
             }
         }
@@ -1260,12 +1514,23 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
                 n = (MAX_ONION_CLIENTS / 2);
 
             if (num_nodes != 0) {
-                unsigned int j;
+                Node_format nodes[MAX_ONION_CLIENTS / 2];
+                unsigned int j, num_neighbour = 0;
+
+                if (count == 0)
+                    num_neighbour = neighbour_nodes(onion_c, friendnum, nodes, n);
 
                 for (j = 0; j < n; ++j) {
-                    unsigned int num = rand() % num_nodes;
-                    client_send_announce_request(onion_c, friendnum + 1, onion_c->path_nodes[num].ip_port,
-                                                 onion_c->path_nodes[num].public_key, 0, ~0);
+                    const Node_format *node;
+
+                    if (j < num_neighbour) {
+                        node = &nodes[j];
+                    } else {
+                        node = &onion_c->path_nodes[rand() % num_nodes];
+                    }
+
+                    if (client_send_announce_request(onion_c, friendnum + 1, node->ip_port, node->public_key, 0, ~0) == 0)
+                        ++sent;
                 }
 
                 ++onion_c->friends_list[friendnum].run_count;
@@ -1275,19 +1540,95 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
         }
 
         /* send packets to friend telling them our DHT public key. */
-        if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_onion_sent, ONION_DHTPK_SEND_INTERVAL))
-            if (send_dhtpk_announce(onion_c, friendnum, 0) >= 1)
+        if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_onion_sent, ONION_DHTPK_SEND_INTERVAL)) {
+            int num = send_dhtpk_announce(onion_c, friendnum, 0);
+
+            if (num >= 1) {
                 onion_c->friends_list[friendnum].last_dht_pk_onion_sent = unix_time();
+                sent += num;
+            }
+        }
+
+        if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_dht_sent, DHT_DHTPK_SEND_INTERVAL)) {
+            int num = send_dhtpk_announce(onion_c, friendnum, 1);
 
-        if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_dht_sent, DHT_DHTPK_SEND_INTERVAL))
-            if (send_dhtpk_announce(onion_c, friendnum, 1) >= 1)
+            if (num >= 1) {
                 onion_c->friends_list[friendnum].last_dht_pk_dht_sent = unix_time();
+                sent += num;
+            }
+        }
+    }
 
+    return sent;
+}
+
+/* return 1 if the friend was seen recently and should be looked up before the others.
+ * return 0 if not.
+ */
+static int friend_recently_seen(const Onion_Friend *onion_friend)
+{
+    return !is_timeout(onion_friend->last_seen, ONION_FRIEND_BACKOFF_START);
+}
+
+/* Set when the friend should be looked up next, every second for recently seen
+ * friends and then twice as long after each lookup.
+ */
+static void schedule_friend(Onion_Friend *onion_friend)
+{
+    if (friend_recently_seen(onion_friend)) {
+        onion_friend->lookup_interval = 1;
+    } else {
+        uint32_t interval = (onion_friend->lookup_interval == 0) ? 2 : onion_friend->lookup_interval * 2;
+        onion_friend->lookup_interval = MIN(interval, ONION_FRIEND_MAX_LOOKUP_INTERVAL);
     }
+
+    onion_friend->next_lookup = unix_time() + onion_friend->lookup_interval;
 }
 
+/* Look for the friends that are due, sending at most friend_lookup_budget packets.
+ * Recently seen friends go first, the others get what's left of the budget.
+ * The next round starts where this one ran out of budget so that every friend
+ * eventually gets its turn.
+ */
+static void do_friends(Onion_Client *onion_c)
+{
+    if (onion_c->num_friends == 0)
+        return;
+
+    uint64_t temp_time = unix_time();
+    uint32_t budget = onion_c->friend_lookup_budget;
+    uint16_t start = onion_c->next_friend % onion_c->num_friends;
+    unsigned int pass, i;
+
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < onion_c->num_friends; ++i) {
+            uint16_t friendnum = (start + i) % onion_c->num_friends;
+            Onion_Friend *onion_friend = &onion_c->friends_list[friendnum];
+
+            if (onion_friend->status == 0 || onion_friend->is_online)
+                continue;
+
+            if (friend_recently_seen(onion_friend) != (pass == 0))
+                continue;
+
+            /* A friend that was just seen again doesn't wait for the end of its backoff. */
+            if (onion_friend->next_lookup > temp_time && !(pass == 0 && onion_friend->lookup_interval > 1))
+                continue;
+
+            if (budget == 0) {
+                onion_c->next_friend = friendnum;
+                return;
+            }
+
+            unsigned int sent = do_friend(onion_c, friendnum);
+            budget = (sent < budget) ? budget - sent : 0;
+            schedule_friend(onion_friend);
+        }
+    }
+
+    onion_c->next_friend = start;
+}
 
-/* Function to call when onion data packet with contents beginning with byte is received. */
 void oniondata_registerhandler(Onion_Client *onion_c, uint8_t byte, oniondata_handler_callback cb, void *object)
 {
     onion_c->Onion_Data_Handlers[byte].function = cb;
@@ -1411,13 +1752,14 @@ unsigned int onion_connection_status(const Onion_Client *onion_c)
 
 void do_onion_client(Onion_Client *onion_c)
 {
-    unsigned int i;
-
     if (onion_c->last_run == unix_time())
         return;
 
     populate_path_nodes(onion_c);
 
+    do_standby_paths(onion_c, &onion_c->onion_paths_self);
+    do_standby_paths(onion_c, &onion_c->onion_paths_friends);
+
     do_announce(onion_c);
 
     if (onion_isconnected(onion_c)) {
@@ -1435,9 +1777,7 @@ void do_onion_client(Onion_Client *onion_c)
     }
 
     if (onion_connection_status(onion_c)) {
-        for (i = 0; i < onion_c->num_friends; ++i) {
-            do_friend(onion_c, i);
-        }
+        do_friends(onion_c);
     }
 
     onion_c->last_run = unix_time();
@@ -1453,7 +1793,8 @@ Onion_Client *new_onion_client(Net_Crypto *c)
     if (onion_c == NULL)
         return NULL;
 
-    if (ping_array_init(&onion_c->announce_ping_array, ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT) != 0) {
+    if (ping_array_init(&onion_c->announce_ping_array, ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT,
+                        ANNOUNCE_SENDBACK_DATA_SIZE) != 0) {
         free(onion_c);
         return NULL;
     }
@@ -1463,6 +1804,7 @@ Onion_Client *new_onion_client(Net_Crypto *c)
     onion_c->c = c;
     new_symmetric_key(onion_c->secret_symmetric_key);
     crypto_box_keypair(onion_c->temp_public_key, onion_c->temp_secret_key);
+    onion_c->friend_lookup_budget = ONION_FRIEND_LOOKUP_BUDGET;
     networking_registerhandler(onion_c->net, NET_PACKET_ANNOUNCE_RESPONSE, &handle_announce_response, onion_c);
     networking_registerhandler(onion_c->net, NET_PACKET_ONION_DATA_RESPONSE, &handle_data_response, onion_c);
     oniondata_registerhandler(onion_c, ONION_DATA_DHTPK, &handle_dhtpk_announce, onion_c);
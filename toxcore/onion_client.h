@@ -45,6 +45,19 @@
 #define ONION_PATH_MAX_LIFETIME 1200
 #define ONION_PATH_MAX_NO_RESPONSE_USES 4
 
+/* Number of prebuilt paths kept ready to replace a failing one. */
+#define ONION_PATH_STANDBY 2
+#define ONION_PATH_STANDBY_LIFETIME 60
+
+/* Share of answered requests in Onion_Client_Paths.path_success is out of this. */
+#define ONION_PATH_SUCCESS_ONE 1024
+
+/* A path with a lower path_success is replaced if a standby path is ready. */
+#define ONION_PATH_MIN_SUCCESS (ONION_PATH_SUCCESS_ONE / 4)
+
+/* Minimum time in ms without response before a path is replaced. */
+#define ONION_PATH_MIN_RESPONSE_TIME 1000
+
 #define MAX_STORED_PINGED_NODES 9
 #define MIN_NODE_PING_TIME 10
 
@@ -56,6 +69,15 @@
 #define ONION_OFFLINE_TIMEOUT (ONION_NODE_PING_INTERVAL * 1.25)
 
 /* Onion data packet ids. */
+/* Default maximum number of packets sent per second to look for friends. */
+#define ONION_FRIEND_LOOKUP_BUDGET 200
+
+/* Friends not seen for this many seconds are looked up less and less often. */
+#define ONION_FRIEND_BACKOFF_START (10 * 60)
+
+/* Maximum number of seconds between two lookups of a friend. */
+#define ONION_FRIEND_MAX_LOOKUP_INTERVAL (5 * 60)
+
 #define ONION_DATA_FRIEND_REQ CRYPTO_PACKET_FRIEND_REQ
 #define ONION_DATA_DHTPK CRYPTO_PACKET_DHTPK
 
@@ -80,6 +102,17 @@ typedef struct {
     uint64_t path_creation_time[NUMBER_ONION_PATHS];
     /* number of times used without success. */
     unsigned int last_path_used_times[NUMBER_ONION_PATHS];
+
+    /* smoothed share of requests that were answered, out of ONION_PATH_SUCCESS_ONE. */
+    uint16_t path_success[NUMBER_ONION_PATHS];
+    /* smoothed round trip time in ms, 0 if unknown. */
+    uint32_t path_rtt[NUMBER_ONION_PATHS];
+    /* time in ms of the first request sent since the last response. */
+    uint64_t path_first_unanswered[NUMBER_ONION_PATHS];
+
+    Onion_Path standby[ONION_PATH_STANDBY];
+    uint64_t standby_creation_time[ONION_PATH_STANDBY];
+    unsigned int num_standby;
 } Onion_Client_Paths;
 
 typedef struct {
@@ -106,6 +139,9 @@ typedef struct {
 
     uint64_t last_seen;
 
+    uint64_t next_lookup; /* do_onion_client() doesn't look for the friend before this time. */
+    uint32_t lookup_interval; /* seconds between lookups, doubles while the friend isn't seen. */
+
     Last_Pinged last_pinged[MAX_STORED_PINGED_NODES];
     uint8_t last_pinged_index;
 
@@ -158,6 +194,11 @@ typedef struct {
 
     uint64_t last_packet_recv;
 
+    /* Maximum number of packets sent per second to look for friends, recently
+     * seen friends go first. */
+    uint32_t friend_lookup_budget;
+    uint16_t next_friend; /* friend the next round of lookups starts with. */
+
     unsigned int onion_connected;
     _Bool UDP_connected;
 } Onion_Client;
@@ -56,7 +56,7 @@ struct PING {
 
 #define PING_PLAIN_SIZE (1 + sizeof(uint64_t))
 #define DHT_PING_SIZE (1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES + PING_PLAIN_SIZE + crypto_box_MACBYTES)
-#define PING_DATA_SIZE (CLIENT_ID_SIZE + sizeof(IP_Port))
+#define PING_DATA_SIZE (CLIENT_ID_SIZE + sizeof(IP_Port) + sizeof(uint64_t))
 
 int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *client_id)
 {
@@ -75,6 +75,8 @@ int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *client_id)
     uint8_t data[PING_DATA_SIZE];
     id_copy(data, client_id);
     memcpy(data + CLIENT_ID_SIZE, &ipp, sizeof(IP_Port));
+    uint64_t temp_time = current_time_monotonic();
+    memcpy(data + CLIENT_ID_SIZE + sizeof(IP_Port), &temp_time, sizeof(uint64_t));
     ping_id = ping_array_add(&ping->ping_array, data, sizeof(data));
 
     if (ping_id == 0)
@@ -97,6 +99,7 @@ int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *client_id)
     if (rc != PING_PLAIN_SIZE + crypto_box_MACBYTES)
         return 1;
 
+    DHT_node_request_sent(ping->dht, client_id);
     return sendpacket(ping->dht->net, ipp, pk, sizeof(pk));
 }
 
@@ -217,6 +220,10 @@ static int handle_ping_response(void *_dht, IP_Port source, const uint8_t *packe
         return 1;
 
     addto_lists(dht, source, packet + 1);
+
+    uint64_t sent_time;
+    memcpy(&sent_time, data + CLIENT_ID_SIZE + sizeof(IP_Port), sizeof(uint64_t));
+    DHT_node_response(dht, packet + 1, sent_time);
     return 0;
 }
 
@@ -324,7 +331,7 @@ PING *new_ping(DHT *dht)
     if (ping == NULL)
         return NULL;
 
-    if (ping_array_init(&ping->ping_array, PING_NUM_MAX, PING_TIMEOUT) != 0) {
+    if (ping_array_init(&ping->ping_array, PING_NUM_MAX, PING_TIMEOUT, PING_DATA_SIZE) != 0) {
         free(ping);
         return NULL;
     }
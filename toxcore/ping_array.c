@@ -30,63 +30,37 @@
 #include "crypto_core.h"
 #include "util.h"
 
-static void clear_entry(Ping_Array *array, uint32_t index)
-{
-    free(array->entries[index].data);
-    array->entries[index].data = NULL;
-    array->entries[index].length =
-        array->entries[index].time =
-            array->entries[index].ping_id = 0;
-}
-
-/* Clear timed out entries.
- */
-static void ping_array_clear_timedout(Ping_Array *array)
-{
-    while (array->last_deleted != array->last_added) {
-        uint32_t index = array->last_deleted % array->total_size;
-
-        if (!is_timeout(array->entries[index].time, array->timeout))
-            break;
-
-        clear_entry(array, index);
-        ++array->last_deleted;
-    }
-}
-
 /* Add a data with length to the Ping_Array list and return a ping_id.
  *
  * return ping_id on success.
- * return 0 on failure.
+ * return 0 on failure (length bigger than max_data_length).
  */
 uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length)
 {
-    ping_array_clear_timedout(array);
-    uint32_t index = array->last_added % array->total_size;
+    if (length > array->max_data_length)
+        return 0;
 
-    if (array->entries[index].data != NULL) {
-        array->last_deleted = array->last_added - array->total_size;
-        clear_entry(array, index);
-    }
+    uint32_t index = array->last_added & (array->total_size - 1);
+    Ping_Array_Entry *entry = &array->entries[index];
 
-    array->entries[index].data = malloc(length);
+    memcpy(array->data + (size_t)index * array->max_data_length, data, length);
+    entry->length = length;
+    entry->time = unix_time();
+    ++array->last_added;
 
-    if (array->entries[index].data == NULL)
-        return 0;
+    if (array->num_random_ids == 0) {
+        randombytes((uint8_t *)array->random_ids, sizeof(array->random_ids));
+        array->num_random_ids = PING_ARRAY_RANDOM_IDS;
+    }
 
-    memcpy(array->entries[index].data, data, length);
-    array->entries[index].length = length;
-    array->entries[index].time = unix_time();
-    ++array->last_added;
-    uint64_t ping_id = random_64b();
-    ping_id /= array->total_size;
-    ping_id *= array->total_size;
-    ping_id += index;
+    uint64_t ping_id = array->random_ids[--array->num_random_ids];
+    ping_id &= ~(uint64_t)(array->total_size - 1);
+    ping_id |= index;
 
     if (ping_id == 0)
         ping_id += array->total_size;
 
-    array->entries[index].ping_id = ping_id;
+    entry->ping_id = ping_id;
     return ping_id;
 }
 
@@ -103,36 +77,34 @@ int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t
     if (ping_id == 0)
         return -1;
 
-    uint32_t index = ping_id % array->total_size;
+    uint32_t index = ping_id & (array->total_size - 1);
+    Ping_Array_Entry *entry = &array->entries[index];
 
-    if (array->entries[index].ping_id != ping_id)
+    if (entry->ping_id != ping_id)
         return -1;
 
-    if (is_timeout(array->entries[index].time, array->timeout))
+    if (is_timeout(entry->time, array->timeout))
         return -1;
 
-    if (array->entries[index].length > length)
+    if (entry->length > length)
         return -1;
 
-    if (array->entries[index].data == NULL)
-        return -1;
-
-    memcpy(data, array->entries[index].data, array->entries[index].length);
-    uint32_t len = array->entries[index].length;
-    clear_entry(array, index);
-    return len;
+    memcpy(data, array->data + (size_t)index * array->max_data_length, entry->length);
+    entry->ping_id = 0;
+    return entry->length;
 }
 
 /* Initialize a Ping_Array.
- * size represents the total size of the array and should be a power of 2.
+ * size represents the total size of the array and must be a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
+ * max_data_length is the maximum length of the data of an entry.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
+int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout, uint32_t max_data_length)
 {
-    if (size == 0 || timeout == 0 || empty_array == NULL)
+    if (size == 0 || (size & (size - 1)) != 0 || timeout == 0 || max_data_length == 0 || empty_array == NULL)
         return -1;
 
     empty_array->entries = calloc(size, sizeof(Ping_Array_Entry));
@@ -140,8 +112,18 @@ int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
     if (empty_array->entries == NULL)
         return -1;
 
-    empty_array->last_deleted = empty_array->last_added = 0;
+    empty_array->data = malloc((size_t)size * max_data_length);
+
+    if (empty_array->data == NULL) {
+        free(empty_array->entries);
+        empty_array->entries = NULL;
+        return -1;
+    }
+
+    empty_array->last_added = 0;
+    empty_array->num_random_ids = 0;
     empty_array->total_size = size;
+    empty_array->max_data_length = max_data_length;
     empty_array->timeout = timeout;
     return 0;
 }
@@ -150,13 +132,8 @@ int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
  */
 void ping_array_free_all(Ping_Array *array)
 {
-    while (array->last_deleted != array->last_added) {
-        uint32_t index = array->last_deleted % array->total_size;
-        clear_entry(array, index);
-        ++array->last_deleted;
-    }
-
     free(array->entries);
     array->entries = NULL;
+    free(array->data);
+    array->data = NULL;
 }
-
@@ -25,28 +25,39 @@
 
 #include "network.h"
 
+/* Number of random ping_ids generated at once. */
+#define PING_ARRAY_RANDOM_IDS 32
+
 typedef struct {
-    void *data;
-    uint32_t length;
+    uint64_t ping_id; /* 0 if the entry is free. */
     uint64_t time;
-    uint64_t ping_id;
+    uint32_t length;
 } Ping_Array_Entry;
 
 
+/* Entries are written in a ring, entry number n is at n % total_size, and the
+ * data of each one is kept inline in a slab allocated once in ping_array_init().
+ * Nothing is ever swept, an entry is gone once it is checked, timed out or
+ * overwritten by the entry total_size numbers after it.
+ */
 typedef struct {
     Ping_Array_Entry *entries;
+    uint8_t *data; /* total_size slots of max_data_length bytes. */
 
-    uint32_t last_deleted; /* number representing the next entry to be deleted. */
-    uint32_t last_added; /* number representing the last entry to be added. */
+    uint32_t last_added; /* number representing the next entry to be added. */
     uint32_t total_size; /* The length of entries */
+    uint32_t max_data_length; /* The maximum length of the data of an entry. */
     uint32_t timeout; /* The timeout after which entries are cleared. */
+
+    uint64_t random_ids[PING_ARRAY_RANDOM_IDS];
+    uint32_t num_random_ids; /* number of unused random_ids. */
 } Ping_Array;
 
 
 /* Add a data with length to the Ping_Array list and return a ping_id.
  *
  * return ping_id on success.
- * return 0 on failure.
+ * return 0 on failure (length bigger than max_data_length).
  */
 uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length);
 
@@ -60,13 +71,14 @@ uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length)
 int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t ping_id);
 
 /* Initialize a Ping_Array.
- * size represents the total size of the array and should be a power of 2.
+ * size represents the total size of the array and must be a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
+ * max_data_length is the maximum length of the data of an entry.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout);
+int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout, uint32_t max_data_length);
 
 /* Free all the allocated memory in a Ping_Array.
  */
@@ -0,0 +1,252 @@
+/* precompute_pool.c
+ *
+ * Worker threads that compute shared keys (and other expensive handshake
+ * crypto) away from the main loop.
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "precompute_pool.h"
+#include "util.h"
+
+static void *precompute_worker(void *arg)
+{
+    Precompute_Pool *pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (1) {
+        while (pool->next_work == pool->last && !pool->shutdown) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+
+        if (pool->shutdown)
+            break;
+
+        uint32_t start = pool->next_work;
+        uint32_t num = MIN(pool->last - pool->next_work, PRECOMPUTE_BATCH_SIZE);
+        pool->next_work += num;
+        pthread_mutex_unlock(&pool->mutex);
+
+        /* The jobs between start and start + num now belong to this thread. */
+        uint32_t i;
+
+        for (i = 0; i < num; ++i) {
+            Precompute_Job *job = &pool->jobs[(start + i) % pool->size];
+            encrypt_precompute(job->public_key, job->secret_key, job->shared_key);
+            job->result = 0;
+
+            if (job->work)
+                job->work(job);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+
+        for (i = 0; i < num; ++i) {
+            pool->jobs[(start + i) % pool->size].status = PRECOMPUTE_JOB_DONE;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/* Create a new pool with num_threads workers and a queue of queue_size jobs.
+ *
+ * return NULL on failure.
+ */
+Precompute_Pool *new_precompute_pool(uint32_t num_threads, uint32_t queue_size)
+{
+    if (num_threads == 0 || num_threads > PRECOMPUTE_MAX_THREADS || queue_size == 0)
+        return NULL;
+
+    Precompute_Pool *pool = calloc(1, sizeof(Precompute_Pool));
+
+    if (pool == NULL)
+        return NULL;
+
+    pool->jobs = calloc(queue_size, sizeof(Precompute_Job));
+
+    if (pool->jobs == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->size = queue_size;
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool->jobs);
+        free(pool);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&pool->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->jobs);
+        free(pool);
+        return NULL;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < num_threads; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, precompute_worker, pool) != 0) {
+            kill_precompute_pool(pool);
+            return NULL;
+        }
+
+        ++pool->num_threads;
+    }
+
+    return pool;
+}
+
+/* Queue the computation of the shared key between public_key and secret_key.
+ *
+ * data of length is copied into the job, work (may be NULL) is run on the worker
+ * right after the shared key is computed and done is called by do_precompute_pool()
+ * on the thread running it.
+ *
+ * If the queue is full the job is dropped, this is how the pool sheds load.
+ *
+ * return 0 on success.
+ * return -1 on failure (queue full or data too big).
+ */
+int precompute_pool_add(Precompute_Pool *pool, const uint8_t *public_key, const uint8_t *secret_key,
+                        precompute_work_cb work, precompute_done_cb done, void *object, IP_Port source, uint32_t number,
+                        uint64_t id, const uint8_t *data, uint16_t length)
+{
+    if (length > PRECOMPUTE_MAX_DATA_SIZE || done == NULL)
+        return -1;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->last - pool->first >= pool->size) {
+        ++pool->num_dropped;
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+
+    Precompute_Job *job = &pool->jobs[pool->last % pool->size];
+    memcpy(job->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(job->secret_key, secret_key, crypto_box_SECRETKEYBYTES);
+    job->work = work;
+    job->done = done;
+    job->object = object;
+    job->source = source;
+    job->number = number;
+    job->id = id;
+    job->result = -1;
+    job->length = length;
+
+    if (length)
+        memcpy(job->data, data, length);
+
+    job->status = PRECOMPUTE_JOB_QUEUED;
+    ++pool->last;
+
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+/* Make sure done is never called for jobs of object.
+ * Call this before freeing object.
+ */
+void precompute_pool_cancel(Precompute_Pool *pool, const void *object)
+{
+    pthread_mutex_lock(&pool->mutex);
+    uint32_t i;
+
+    for (i = pool->first; i != pool->last; ++i) {
+        Precompute_Job *job = &pool->jobs[i % pool->size];
+
+        if (job->object == object)
+            job->done = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* return the number of jobs that are queued or being worked on.
+ */
+uint32_t precompute_pool_pending(Precompute_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    uint32_t num = pool->last - pool->first;
+    pthread_mutex_unlock(&pool->mutex);
+    return num;
+}
+
+/* Hand all finished jobs back by calling their done callbacks.
+ *
+ * Call this in the main loop.
+ */
+void do_precompute_pool(Precompute_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    while (pool->first != pool->last) {
+        Precompute_Job *job = &pool->jobs[pool->first % pool->size];
+
+        if (job->status != PRECOMPUTE_JOB_DONE)
+            break;
+
+        /* Workers never touch a finished job and add only writes past last,
+         * so the callback can run without holding the lock. */
+        precompute_done_cb done = job->done;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (done)
+            done(job->object, job);
+
+        pthread_mutex_lock(&pool->mutex);
+        job->status = PRECOMPUTE_JOB_FREE;
+        ++pool->first;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void kill_precompute_pool(Precompute_Pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    uint32_t i;
+
+    for (i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    memset(pool->jobs, 0, pool->size * sizeof(Precompute_Job));
+    free(pool->jobs);
+    free(pool);
+}
@@ -0,0 +1,139 @@
+/* precompute_pool.h
+ *
+ * Worker threads that compute shared keys (and other expensive handshake
+ * crypto) away from the main loop.
+ *
+ *  Copyright (C) 2015 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PRECOMPUTE_POOL_H
+#define PRECOMPUTE_POOL_H
+
+#include "crypto_core.h"
+#include <pthread.h>
+
+/* Maximum size of the data that can be attached to a job. */
+#define PRECOMPUTE_MAX_DATA_SIZE MAX_UDP_PACKET_SIZE
+
+/* Maximum number of jobs a worker takes from the queue at once. */
+#define PRECOMPUTE_BATCH_SIZE 16
+
+/* Default size of the job queue. */
+#define PRECOMPUTE_DEFAULT_QUEUE_SIZE 1024
+
+#define PRECOMPUTE_MAX_THREADS 64
+
+typedef struct Precompute_Job Precompute_Job;
+
+/* Called on a worker thread after the shared key was computed.
+ * It must only touch the job it is given.
+ */
+typedef void (*precompute_work_cb)(Precompute_Job *job);
+
+/* Called from do_precompute_pool() with the finished job. */
+typedef void (*precompute_done_cb)(void *object, Precompute_Job *job);
+
+enum {
+    PRECOMPUTE_JOB_FREE,
+    PRECOMPUTE_JOB_QUEUED,
+    PRECOMPUTE_JOB_DONE,
+};
+
+struct Precompute_Job {
+    uint8_t status;
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    /* Filled in by the worker. */
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+
+    precompute_work_cb work;
+    precompute_done_cb done;
+    void *object;
+
+    /* Values passed back to done untouched. */
+    IP_Port source;
+    uint32_t number;
+    uint64_t id;
+
+    /* Set by work, -1 means the job failed. */
+    int result;
+
+    uint16_t length;
+    uint8_t data[PRECOMPUTE_MAX_DATA_SIZE];
+};
+
+typedef struct {
+    Precompute_Job *jobs;
+    uint32_t size;
+
+    /* All three only ever increase, jobs are at (number % size). */
+    uint32_t first; /* oldest job not yet handed back to the main loop. */
+    uint32_t next_work; /* next job to be picked up by a worker. */
+    uint32_t last; /* next free job. */
+
+    uint64_t num_dropped; /* number of jobs refused because the queue was full. */
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    _Bool shutdown;
+
+    pthread_t threads[PRECOMPUTE_MAX_THREADS];
+    uint32_t num_threads;
+} Precompute_Pool;
+
+/* Create a new pool with num_threads workers and a queue of queue_size jobs.
+ *
+ * return NULL on failure.
+ */
+Precompute_Pool *new_precompute_pool(uint32_t num_threads, uint32_t queue_size);
+
+/* Queue the computation of the shared key between public_key and secret_key.
+ *
+ * data of length is copied into the job, work (may be NULL) is run on the worker
+ * right after the shared key is computed and done is called by do_precompute_pool()
+ * on the thread running it.
+ *
+ * If the queue is full the job is dropped, this is how the pool sheds load.
+ *
+ * return 0 on success.
+ * return -1 on failure (queue full or data too big).
+ */
+int precompute_pool_add(Precompute_Pool *pool, const uint8_t *public_key, const uint8_t *secret_key,
+                        precompute_work_cb work, precompute_done_cb done, void *object, IP_Port source, uint32_t number,
+                        uint64_t id, const uint8_t *data, uint16_t length);
+
+/* Make sure done is never called for jobs of object.
+ * Call this before freeing object.
+ */
+void precompute_pool_cancel(Precompute_Pool *pool, const void *object);
+
+/* return the number of jobs that are queued or being worked on.
+ */
+uint32_t precompute_pool_pending(Precompute_Pool *pool);
+
+/* Hand all finished jobs back by calling their done callbacks.
+ *
+ * Call this in the main loop.
+ */
+void do_precompute_pool(Precompute_Pool *pool);
+
+void kill_precompute_pool(Precompute_Pool *pool);
+
+#endif